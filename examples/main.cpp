@@ -132,6 +132,8 @@ void runFile(int ac, char** av, const std::string& path)
     DefineMathModule(&oVM);
     DefineModuleModule(&oVM);
     DefinePathModule(&oVM);
+    DefineSchedulerModule(&oVM);
+    DefineWorkerModule(&oVM);
 
     test_module.func("ret_void_no_param", &ret_void_no_param);
     test_module.func("ret_int_no_param", &ret_int_no_param);
@@ -6,6 +6,8 @@
 
 #define MAP_MAX_LOAD (0.75)
 
+class Object;
+
 // A union to let us reinterpret a double as raw bits and back.
 typedef union
 {
@@ -29,6 +31,8 @@ class MapTable
 {
 public:
 	MapTable();
+    // The object holding the table, whose write barrier Set() calls.
+    Object* m_pOwner;
     int m_iCount;
     int m_iCapacity;
 	std::vector<MapEntry> m_vEntries;
@@ -3,7 +3,8 @@
 #define FOX_PARSER_HPP_
 
 #include <stdint.h>
-#include "Lexer.h"
+#include <vector>
+#include "Token.h"
 #include "ParserHelper.h"
 #include "chunk.hpp"
 
@@ -21,12 +22,13 @@ typedef enum {
     TOKEN_LEFT_BRACKET, TOKEN_RIGHT_BRACKET,
     TOKEN_COMMA, TOKEN_DOT, TOKEN_MINUS, TOKEN_MINUS_MINUS, TOKEN_PLUS, TOKEN_PLUS_PLUS,
     TOKEN_SEMICOLON, TOKEN_SLASH, TOKEN_STAR,
+    TOKEN_AMPERSAND, TOKEN_PIPE, TOKEN_CARET, TOKEN_TILDE,
 
     // One or two character tokens.
     TOKEN_BANG, TOKEN_BANG_EQUAL,
     TOKEN_EQUAL, TOKEN_EQUAL_EQUAL, TOKEN_DOUBLE_DOT_EQUAL,
-    TOKEN_GREATER, TOKEN_GREATER_EQUAL,
-    TOKEN_LESS, TOKEN_LESS_EQUAL,
+    TOKEN_GREATER, TOKEN_GREATER_EQUAL, TOKEN_GREATER_GREATER,
+    TOKEN_LESS, TOKEN_LESS_EQUAL, TOKEN_LESS_LESS,
 
 	TOKEN_COLON, TOKEN_DOUBLE_COLON,
 
@@ -58,6 +60,10 @@ typedef enum {
     PREC_AND,
     PREC_EQUALITY,
     PREC_COMPARISON,
+    PREC_BIT_OR,
+    PREC_BIT_XOR,
+    PREC_BIT_AND,
+    PREC_SHIFT,
     PREC_TERM,
     PREC_FACTOR,
     PREC_UNARY,
@@ -91,6 +97,15 @@ typedef enum {
 class Parser;
 class Compiler;
 
+// A function whose compilation is deferred to its first call: the tokens of
+// its parameters and body, followed by a TOKEN_EOF. See Function().
+struct LazyFunction
+{
+    FunctionType type;
+    bool inClass;
+    std::vector<Token> tokens;
+};
+
 typedef void (*parse_fn)(Parser& parser, bool can_assign);
 
 struct ParseRule
@@ -124,7 +139,6 @@ public:
     void Consume(int oType, const char* message);
 	Chunk* GetCurrentChunk();
 	void SetCurrentChunk(Chunk& chunk);
-    void RemoveComment();
 
 	ObjectString* CopyString(const std::string& value);
 	ObjectString* TakeString(const std::string& value);
@@ -133,11 +147,20 @@ public:
 
 	void EmitByte(uint8_t byte);
 	void EmitBytes(uint8_t byte1, uint8_t byte2);
+	void Peephole();
+	void Fuse(int start, uint8_t instruction, int operandStart, int operandCount);
+	int MarkJumpTarget();
 	void EmitConstant(Value value);
 	void EmitReturn();
 	int EmitJump(uint8_t instruction);
+	int EmitConditionJump(bool* keepsCondition);
 	void PatchJump(int offset);
 	void EmitLoop(int loopStart);
+	void CutCode(int start, std::vector<uint8_t>& code, std::vector<int>& lines);
+	void PasteCode(const std::vector<uint8_t>& code, const std::vector<int>& lines);
+	void EmitInlineCache();
+	void EmitMethodCache();
+	void EmitVariable(uint8_t instruction, int arg);
 	uint8_t MakeConstant(Value value);
 
 	ObjectFunction* EndCompiler();
@@ -147,6 +170,7 @@ public:
     ParseRule *GetRule(int type);
 
 	uint8_t IdentifierConstant(const Token& name);
+	int ModuleVariable(const Token& name);
 
 	void BeginScope();
 	void EndScope();
@@ -164,9 +188,17 @@ public:
     int localCount;
     Upvalue upvalues[UINT8_COUNT];
     int scopeDepth;
+
+    // Peephole state: the offsets of the last three instructions, how many
+    // bytes of the last one are still to come, and the latest offset a jump
+    // lands on, which no superinstruction may span.
+    int instructions[3];
+    int pendingBytes;
+    int jumpTarget;
 };
 
 ObjectFunction* Compile(Parser& parser, const std::string &strText, Chunk* chunk);
+bool CompileLazy(Parser& parser, ObjectFunction* function);
 void Expression(Parser& parser);
 void ParsePrecedence(Parser& parser, Precedence preced);
 void Number(Parser& parser, bool can_assign = false);
@@ -193,7 +225,7 @@ void Lambda(Parser& parser, bool can_assign);
 void Block(Parser& parser);
 void Declaration(Parser& parser);
 void Synchronize(Parser& parser);
-uint8_t ParseVariable(Parser& parser, Token& name, const char *msg);
+int ParseVariable(Parser& parser, Token& name, const char *msg);
 void VarDeclaration(Parser& parser, Token name);
 // void VarDeclaration(Parser& parser);
 int NamedVariable(Parser& parser, Token name, bool can_assign, uint8_t* pGetOp = NULL, uint8_t* pSetOp = NULL);
@@ -208,6 +240,6 @@ int ResolveUpvalue(Parser& parser, Compiler *comp, Token& name);
 void ClassDeclaration(Parser& parser, Token& name);
 uint8_t ArgumentList(Parser& parser);
 void DeclareVariable(Parser& parser, Token name);
-void DefineVariable(Parser& parser, uint8_t global);
+void DefineVariable(Parser& parser, int global);
 
 #endif
\ No newline at end of file
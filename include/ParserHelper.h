@@ -10,10 +10,19 @@
 #define DIRECTORY_TEST_PARSERHELPER_H
 
 #include <string>
+#include <vector>
 
-class Lexer;
 class Token;
 
+// The token stream of a ParserHelper, saved while it replays other tokens.
+struct TokenReplay
+{
+    const std::vector<Token>* m_pTokens;
+    size_t m_iNext;
+    Token m_oCurrent;
+    Token m_oPrevious;
+};
+
 class ParserHelper
 {
 private:
@@ -27,7 +36,13 @@ private:
     };
 
 protected:
-    Lexer oLexer;
+    // The tokens of the source given to Init(), see ScanTokens().
+    std::vector<Token> m_vTokens;
+
+    // The tokens NextToken() reads: m_vTokens, or the ones given to
+    // BeginReplay().
+    const std::vector<Token>* m_pTokens = nullptr;
+    size_t m_iNext = 0;
 public:
 
     Token oPreviousToken;
@@ -35,10 +50,7 @@ public:
     bool panicMode;
 
     bool Init(const std::string& str);
-    void Define(const std::string& strId, const std::string& strValue, bool bAddInTrash = false);
-
-    Lexer& GetLexer();
-    const Lexer& GetLexer() const;
+    void DumpTokens() const;
 
     void NextToken();
 
@@ -47,6 +59,13 @@ public:
 
     void AdvanceToken(token_advance_mode mode);
 
+    // Makes NextToken() read [vTokens], which were read from the source
+    // before and end with a TOKEN_EOF, until EndReplay() restores the stream
+    // saved in [oSaved].
+    void BeginReplay(const std::vector<Token>& vTokens, TokenReplay& oSaved);
+    void EndReplay(const TokenReplay& oSaved);
+    bool IsReplaying() const;
+
 	bool IsToken(int iType, bool bAdvance = true);
     bool IsToken(const std::string& strValue, bool bAdvance = true);
     bool IsToken(const std::string& strType, const std::string& strValue, bool bAdvance = true);
@@ -3,7 +3,9 @@
 #ifndef FOX_TABLE_HPP_
 #define FOX_TABLE_HPP_
 
+class Object;
 class ObjectString;
+class GC;
 
 #define TABLE_MAX_LOAD (0.75)
 
@@ -26,6 +28,9 @@ class Table
 {
 public:
 	Table();
+    // The object holding the table, whose write barrier Set() calls. NULL
+    // for the tables of the VM.
+    Object* m_pOwner;
     int m_iCount;
     int m_iCapacity;
 	std::vector<Entry> m_vEntries;
@@ -35,11 +40,16 @@ public:
 	bool Set(ObjectString* key, Value value);
 	void AddAll(Table& from);
 	bool Get(ObjectString* key, Value& value);
+	int IndexOf(ObjectString* key);
 	bool Delete(ObjectString* key);
 	ObjectString* FindString(const char *chars, int length, uint32_t hash);
 	ObjectString* FindString(const std::string& string, uint32_t hash);
-	void MarkTable();
-	void RemoveWhite();
+	// Marks the keys and values of the table.
+	void MarkTable(GC& gc);
+	// Deletes the entries whose key wasn't reached by the collection of
+	// [gc], so a table of weak references, like the interned strings,
+	// doesn't keep them alive.
+	void RemoveWhite(GC& gc);
 	void Print();
 };
 
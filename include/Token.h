@@ -0,0 +1,46 @@
+#ifndef FOX_TOKEN_H_
+#define FOX_TOKEN_H_
+
+#include <cstddef>
+#include <string>
+
+// The type of a token. [m_id] is one of the TokenType values of Parser.h,
+// [m_name] is only set by the callers matching tokens by name.
+struct LexType
+{
+    int m_id = 0;
+    std::string m_name;
+
+    bool operator==(int iId) const { return m_id == iId; }
+    bool operator!=(int iId) const { return m_id != iId; }
+    bool operator==(const std::string& strName) const { return m_name == strName; }
+    bool operator!=(const std::string& strName) const { return m_name != strName; }
+};
+
+inline LexType StringID(int iId)
+{
+    LexType oType;
+    oType.m_id = iId;
+    return oType;
+}
+
+// A token produced by ScanTokens().
+class Token
+{
+public:
+    Token() = default;
+    Token(const std::string& strText, std::size_t iLength)
+        : m_strText(strText), m_iLength(iLength) {}
+    Token(const LexType& oType, const std::string& strText, std::size_t iLength)
+        : m_oType(oType), m_strText(strText), m_iLength(iLength) {}
+
+    const std::string& GetText() const { return m_strText; }
+
+    LexType m_oType;
+    std::string m_strText;
+    std::size_t m_iLength = 0;
+    // The line the token ends on.
+    int m_iLinesTraversed = 0;
+};
+
+#endif
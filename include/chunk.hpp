@@ -3,83 +3,177 @@
 
 #include <vector>
 #include <cstdint>
+#include <functional>
 #include "common.h"
 #include "value.hpp"
 
 typedef enum
 {
-    OP_CONST,
-    OP_NIL,
-    OP_TRUE,
-    OP_FALSE,
-    OP_POP,
-    OP_GET_LOCAL,
-    OP_SET_LOCAL,
-    OP_GET_GLOBAL,
-    OP_DEFINE_GLOBAL,
-    OP_SET_GLOBAL,
-    OP_GET_UPVALUE,
-    OP_SET_UPVALUE,
-    OP_GET_PROPERTY,
-    OP_SET_PROPERTY,
-    OP_GET_SUPER,
-    OP_EQUAL,
-    OP_GREATER,
-    OP_LESS,
-
-    OP_ADD,
-    OP_SUB,
-    OP_MUL,
-    OP_DIV,
-    OP_NOT,
-    OP_NEGATE,
-    OP_PRINT,
-    OP_JUMP,
-    OP_JUMP_IF_FALSE,
-    OP_LOOP,
-    OP_IMPORT,
-    OP_CALL,
-    OP_INVOKE,
-    OP_SUPER_INVOKE,
-    OP_CLOSURE,
-    OP_CLOSE_UPVALUE,
-    OP_RETURN,
-    OP_CLASS,
-    OP_INHERIT,
-    OP_METHOD,
-    OP_OPERATOR,
-
-    OP_SUBSCRIPT,
-    OP_SUBSCRIPT_ASSIGN,
-    OP_ARRAY,
-    OP_ADD_LIST,
-    OP_SLICE,
-    
-    OP_MAP,
-    OP_ADD_MAP,
-
-    OP_END_MODULE,
-    OP_END,
-
-    OP_IS,
-
-    // CODES for Repl Mode
-    OP_PRINT_REPL,
+    #define OPCODE(name) name,
+    #include "opcodes.h"
+    #undef OPCODE
 
     OP_TOTAL,
 } OpCode;
 
+class ObjectClass;
+class Table;
+
+// The number of receiver classes an inline cache remembers. A site that sees
+// more classes than this is megamorphic: it keeps the first ones and falls
+// back to a regular lookup for the others.
+#define INLINE_CACHE_SIZE 4
+
+// An inline cache for a single instruction that looks a name up on a class or
+// an instance. For each class seen at that site it remembers the slot in the
+// hash table where the name was found last time, so the next lookup can go
+// straight to it. The slot is only a guess: the caller must check that the
+// entry still holds the name before using it.
+struct InlineCache
+{
+    ObjectClass* m_vClasses[INLINE_CACHE_SIZE];
+    int m_vSlots[INLINE_CACHE_SIZE];
+    int m_iCount = 0;
+
+    // Returns the slot remembered for [pClass], or -1 if there is none.
+    int Find(ObjectClass* pClass) const
+    {
+        for (int i = 0; i < m_iCount; i++)
+        {
+            if (m_vClasses[i] == pClass)
+                return m_vSlots[i];
+        }
+        return -1;
+    }
+
+    void Update(ObjectClass* pClass, int iSlot)
+    {
+        for (int i = 0; i < m_iCount; i++)
+        {
+            if (m_vClasses[i] == pClass)
+            {
+                m_vSlots[i] = iSlot;
+                return;
+            }
+        }
+
+        if (m_iCount < INLINE_CACHE_SIZE)
+        {
+            m_vClasses[m_iCount] = pClass;
+            m_vSlots[m_iCount] = iSlot;
+            m_iCount++;
+        }
+    }
+};
+
+// An inline cache for a call site that invokes a method by name. For each
+// method table the receiver's method was looked up in (a class, a library or
+// one of the built-in types), it remembers the closure or native found there so
+// the next call doesn't hash the name at all. Unlike InlineCache, the method
+// itself is stored, so the entries are only trusted for the epoch they were
+// filled in: the VM bumps its method epoch whenever a method table changes.
+struct MethodCache
+{
+    const Table* m_vTables[INLINE_CACHE_SIZE];
+    Value m_vMethods[INLINE_CACHE_SIZE];
+    uint32_t m_uEpoch = 0;
+    int m_iCount = 0;
+
+    // Returns the method remembered for [pTable], or nullptr if there is none
+    // or the cache was filled before [uEpoch].
+    const Value* Find(const Table* pTable, uint32_t uEpoch) const
+    {
+        if (m_uEpoch != uEpoch)
+            return nullptr;
+
+        for (int i = 0; i < m_iCount; i++)
+        {
+            if (m_vTables[i] == pTable)
+                return &m_vMethods[i];
+        }
+        return nullptr;
+    }
+
+    void Update(const Table* pTable, Value oMethod, uint32_t uEpoch)
+    {
+        if (m_uEpoch != uEpoch)
+        {
+            m_uEpoch = uEpoch;
+            m_iCount = 0;
+        }
+
+        if (m_iCount < INLINE_CACHE_SIZE)
+        {
+            m_vTables[m_iCount] = pTable;
+            m_vMethods[m_iCount] = oMethod;
+            m_iCount++;
+        }
+    }
+};
+
 class Chunk
 {
 public:
     int m_iCount;
+    // The code of the chunk, if it has its own: the one being compiled, or a
+    // copy of the shared code, see OwnCode().
     std::vector<uint8_t> m_vCode;
+    // The code the VMs that load the same module from the code cache share.
+    // It is never written: the chunk gets its own copy before the interpreter
+    // quickens one of its instructions.
+    ref<const std::vector<uint8_t>> m_pSharedCode;
     ValueArray m_oConstants;
-    std::vector<int> m_vLines;
+    // The source line of each byte of the code. It never changes once the
+    // function is compiled, so it is shared like the code.
+    ref<std::vector<int>> m_pLines;
+    std::vector<InlineCache> m_vCaches;
+    std::vector<MethodCache> m_vMethodCaches;
 
     Chunk();
     void WriteChunk(uint8_t byte, int line);
+    void Truncate(int offset);
     int AddConstant(Value value);
+    int AddInlineCache();
+    int AddMethodCache();
+    int InstructionSize(int offset) const;
+
+    // Returns the number of stack slots a frame running the chunk uses at
+    // most, counting the [slots] it starts with (the closure and its
+    // arguments), or -1 if the code is malformed.
+    int MaxStack(int slots) const;
+
+    // The code the chunk runs: its own if it has some, the shared one
+    // otherwise.
+    const std::vector<uint8_t>& Code() const
+    {
+        return m_vCode.empty() && m_pSharedCode != nullptr ? *m_pSharedCode : m_vCode;
+    }
+
+    // The address of the first instruction, for a frame to start at.
+    uint8_t* Start() const { return const_cast<uint8_t*>(Code().data()); }
+
+    // Returns the offset of [pIp] in the code. A frame started before the
+    // chunk got its own code still runs the shared one.
+    int Offset(const uint8_t* pIp) const;
+
+    // Copies the shared code if the chunk doesn't have its own yet, and
+    // returns [pIp] moved to the same instruction of its own code.
+    uint8_t* OwnCode(uint8_t* pIp);
+
+    // Moves the code of the chunk to m_pSharedCode and returns it.
+    ref<const std::vector<uint8_t>> ShareCode();
 };
 
+// Returns the number of operand bytes that follow [instruction]. OP_CLOSURE
+// is also followed by two bytes per upvalue of its function, which only
+// Chunk::InstructionSize() knows about.
+int OperandSize(uint8_t instruction);
+
+// Returns the number of stack slots a frame running [code] uses at most,
+// counting the [slots] it starts with, or -1 if an instruction that can run is
+// unknown or cut short, jumps out of the code or pops more than the frame
+// holds. [instructionSize] returns the size of the instruction at an offset,
+// operands included, or -1 to reject it.
+int MaxStackDepth(const std::vector<uint8_t>& code, int slots, const std::function<int(int)>& instructionSize);
+
 #endif
\ No newline at end of file
@@ -0,0 +1,126 @@
+#ifndef FOX_CODECACHE_HPP_
+#define FOX_CODECACHE_HPP_
+
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "common.h"
+#include "value.hpp"
+
+class VM;
+class ObjectFunction;
+class ObjectModule;
+struct LazyFunction;
+
+// The maximum number of modules the code cache keeps. Once it is full, new
+// modules are still compiled but not cached anymore, so a host that compiles
+// endless one-off snippets (a REPL for instance) doesn't grow it forever.
+#define CODE_CACHE_MAX 256
+
+// The version of the .foxc format. It must change whenever the format, the
+// opcodes or the way the compiler uses them change, so that the files written
+// by an older build are compiled again instead of being run.
+#define FOXC_VERSION 6
+
+struct CachedFunction;
+
+// A constant of a cached function. Numbers are stored as they are, strings and
+// functions are created again in each VM that loads them: a VM interns its
+// strings and compares them by address, so it can't use the objects of
+// another.
+struct CachedConstant
+{
+    enum Kind { VALUE, STRING, FUNCTION };
+
+    Kind m_eKind;
+    Value m_oValue;
+    std::string m_strString;
+    ref<const CachedFunction> m_pFunction;
+};
+
+// A compiled function that doesn't belong to any VM. It is never modified
+// once it is in the cache, so any thread can load it without locking.
+struct CachedFunction
+{
+    bool m_bHasName;
+    std::string m_strName;
+    int m_iArity;
+    int m_iMinArity;
+    int m_iMaxArity;
+    int m_iUpvalueCount;
+    int m_iMaxSlots;
+    // The code and the lines are shared by every VM that loads the function.
+    // A VM only copies the code when it quickens it, see Chunk::OwnCode().
+    ref<const std::vector<uint8_t>> m_pCode;
+    ref<std::vector<int>> m_pLines;
+    std::vector<CachedConstant> m_vConstants;
+    size_t m_iCaches;
+    size_t m_iMethodCaches;
+    // The tokens of a function compiled with -lazy, which each VM compiles on
+    // its first call. Its code and constants are empty.
+    ref<const LazyFunction> m_pLazy;
+};
+
+// The body of a module and the top-level variables its compilation declared,
+// in the order of their slots.
+struct CachedModule
+{
+    ref<const CachedFunction> m_pFunction;
+    std::vector<std::string> m_vVariables;
+};
+
+// The process-wide cache of compiled modules, shared by every VM of every
+// thread. A module is only compiled the first time a VM loads it: the other
+// VMs build their functions straight from the cache.
+//
+// The compiled code refers to module variables by slot, so a module is only
+// reused in a module that declared the same variables in the same slots
+// before it was compiled. The key holds them along with the name and the
+// source of the module, and whether it was compiled with -lazy, since a lazy
+// compilation leaves the functions to compile at their first call.
+//
+// Imported modules are also cached on disk, in a .foxc file next to their
+// source, so that the next process doesn't compile them either.
+class CodeCache
+{
+public:
+    static CodeCache& Get();
+
+    // The compile mode, the name of [oModule] and its variables, in the
+    // order of their slots.
+    static std::string Layout(ObjectModule& oModule, bool bLazy);
+    static std::string Key(ObjectModule& oModule, bool bLazy, const std::string& strSource);
+
+    // Returns nullptr if nothing was cached for [strKey].
+    ref<const CachedModule> Find(const std::string& strKey);
+
+    // Snapshots [pFunction], the body of [oModule] that was just compiled.
+    // [iFirstVariable] is the number of variables the module had before the
+    // compilation. Returns nullptr if the function can't be cached.
+    static ref<const CachedModule> Save(ObjectModule& oModule, size_t iFirstVariable, ObjectFunction* pFunction);
+
+    void Add(const std::string& strKey, ref<const CachedModule> pCached);
+
+    // Reads the .foxc file at [strPath]. Returns nullptr if it can't be read,
+    // if it wasn't compiled from [strSource] in a module laid out as
+    // [strLayout], or if it was damaged since.
+    static ref<const CachedModule> Read(const std::string& strPath, const std::string& strLayout, const std::string& strSource);
+
+    // Writes [oCached] to the .foxc file at [strPath]. Failing to write it
+    // isn't an error: the module is simply compiled again next time.
+    static void Write(const std::string& strPath, const std::string& strLayout, const std::string& strSource, const CachedModule& oCached);
+
+    // Declares the variables of [oCached] in [pModule] and builds its body in
+    // [pVM].
+    static ObjectFunction* Load(VM* pVM, ObjectModule* pModule, const CachedModule& oCached);
+
+    void Clear();
+
+private:
+    std::mutex m_oMutex;
+    std::unordered_map<std::string, ref<const CachedModule>> m_vModules;
+};
+
+#endif
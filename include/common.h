@@ -12,6 +12,37 @@
 #include "Benchmark.hpp"
 
 inline bool IsRepl;
+
+// VM::run jumps from one handler to the next through a table of label
+// addresses, a GCC and Clang extension. Set to 0 to dispatch with a switch.
+#ifndef FOX_COMPUTED_GOTO
+    #if defined(__GNUC__) || defined(__clang__)
+        #define FOX_COMPUTED_GOTO 1
+    #else
+        #define FOX_COMPUTED_GOTO 0
+    #endif
+#endif
+
+// If true, a Value is a single 64-bit word that uses NaN-tagging to store
+// non-number values in the unused bits of a quiet NaN double. Otherwise it is
+// a tagged union, which is twice as big but easier to inspect in a debugger.
+// NaN-tagging needs pointers that fit in 48 bits, which is the case on the
+// 64-bit platforms we support.
+#ifndef FOX_NAN_TAGGING
+    #define FOX_NAN_TAGGING 1
+#endif
+
+// If true, functions that run often are compiled to x86-64 machine code by a
+// baseline JIT (see jit.hpp) and the interpreter is only the fallback. It
+// relies on the layout of NaN-tagged values and on mmap(), so it is off on
+// other targets. At runtime, -jit=off disables it to compare both.
+#ifndef FOX_JIT
+    #if FOX_NAN_TAGGING && defined(__x86_64__) && (defined(__linux__) || defined(__APPLE__))
+        #define FOX_JIT 1
+    #else
+        #define FOX_JIT 0
+    #endif
+#endif
 // inline bool DEBUG_TRACE_EXECUTION;
 // namespace helper
 // {
@@ -67,7 +67,7 @@ extern "C"
 		if (pModule != NULL)
 		{
         	Value oKlass;
-			if (pModule->m_vVariables.Get(Fox_AsString(Fox_NewString(pVM, strKlassName)), oKlass))
+			if (pModule->GetVariable(Fox_AsString(Fox_NewString(pVM, strKlassName)), oKlass))
 			{
 				return Fox_Object(pVM->gc.New<ObjectInstance>(pVM, Fox_AsClass(oKlass)));
 			}
@@ -82,7 +82,7 @@ extern "C"
 		if (pModule != NULL)
 		{
         	Value oKlass;
-			if (pModule->m_vVariables.Get(Fox_AsString(Fox_NewString(pVM, strKlassName)), oKlass))
+			if (pModule->GetVariable(Fox_AsString(Fox_NewString(pVM, strKlassName)), oKlass))
 			{
 				ObjectInstance* pInstance = pVM->gc.New<ObjectInstance>(pVM, Fox_AsClass(oKlass));
 				// ObjectInstance* pInstance = pVM->gc.New<ObjectInstance>(pVM, Fox_AsClass(oKlass), cStruct);
@@ -1,13 +1,37 @@
 #ifndef FOX_GC_HPP_
 #define FOX_GC_HPP_
 
-#include <set>
+#include <atomic>
+#include <cstdint>
+#include <cstddef>
+#include <functional>
+#include <new>
 #include <string>
 #include <utility>
 #include <vector>
 #include <unordered_map>
 
+#include "common.h"
+
 #define GC_HEAP_GROW_FACTOR 2
+// The least heap size a full collection is triggered at.
+#define GC_MIN_NEXT_GC (1024 * 1024)
+// How many bytes of young objects are allocated between two minor
+// collections.
+#define GC_NURSERY_SIZE (1024 * 1024)
+// The size of a block of the nursery, a power of two. Objects bigger than
+// GC_NURSERY_MAX_OBJECT are young too, but aren't bump-allocated.
+#define GC_NURSERY_BLOCK_SIZE (64 * 1024)
+#define GC_NURSERY_MAX_OBJECT 1024
+// How many empty blocks the nursery keeps for reuse.
+#define GC_NURSERY_FREE_BLOCKS 32
+// How many objects an allocation traces or sweeps while an incremental
+// collection is running. This bounds the pause of each allocation.
+#define GC_INCREMENTAL_WORK 128
+// The heap size from which full collections mark with several threads.
+#define GC_PARALLEL_HEAP (64 * 1024 * 1024)
+
+class GC;
 
 /**
  * The `Traceable` struct is used as a base class
@@ -16,40 +40,169 @@
 class Traceable
 {
 public:
-	bool mMarked;
+	// Atomic, as the threads of a parallel marking race to mark an object.
+	std::atomic<bool> mMarked;
+	// Set once the object survived a collection and was promoted to the old
+	// generation.
+	bool m_bOld;
+	// Set while the old object is in the remembered set of its GC.
+	bool m_bRemembered;
+	// Set if the object was bump-allocated in the nursery.
+	bool m_bInNursery;
+	// The size the object was allocated with.
+	std::uint32_t m_iSize;
+	// The next object in the list of all the objects of the GC.
+	Traceable* m_pNextObject;
+	// The GC the object belongs to.
+	GC* m_pGC;
 
 	Traceable();
 	virtual ~Traceable();
 	virtual void on_destroy();
 
-	// Mark the object and all its children as live
-  	void mark();
-
-	// Overridden by derived classes to call mark()
+	// Overridden by derived classes to call GC::Shade()
 	// on objects referenced by this object. The default
 	// implemention does nothing.
-	virtual void markChildren();
+	virtual void markChildren(GC& gc);
+
+	// Overridden by derived classes which call WriteBarrier() every time
+	// they store a reference. An old object without a write barrier stays
+	// in the remembered set, so minor collections always trace it.
+	virtual bool HasWriteBarrier() const;
+
+	// Must be called when storing a reference to [pTarget] in this object.
+	// An old object referencing a young one is remembered, so the next
+	// minor collection traces it. While an incremental collection marks, a
+	// marked object referencing a white one shades it (Dijkstra's barrier).
+	inline void WriteBarrier(Traceable* pTarget);
+};
+
+// Bump-allocates the young objects in blocks of GC_NURSERY_BLOCK_SIZE bytes.
+//
+// Objects are never moved, as natives hold raw pointers to them across
+// allocations: a survivor is promoted where it is, and a block is reused
+// once all the objects allocated in it are freed.
+class Nursery
+{
+public:
+	Nursery();
+	~Nursery();
+
+	// Returns [iSize] bytes, at most GC_NURSERY_MAX_OBJECT.
+	void* Allocate(size_t iSize);
+	// Gives back the memory of an object allocated by Allocate().
+	void Release(void* pMemory);
+
+private:
+	struct Block
+	{
+		// How many objects allocated in the block aren't freed yet.
+		size_t m_iLive;
+		Block* m_pNext;
+	};
+
+	Block* NewBlock();
+
+	Block* m_pCurrent;
+	char* m_pTop;
+	char* m_pEnd;
+	Block* m_pFree;
+	size_t m_iFreeCount;
+};
+
+enum GCPhase
+{
+	GC_PHASE_IDLE,
+	// An incremental collection is tracing the objects.
+	GC_PHASE_MARK,
+	// An incremental collection is sweeping the old objects, then freeing
+	// the dead ones.
+	GC_PHASE_SWEEP,
 };
 
 const std::uint32_t GC_OnMark = 10;
+// Emitted between the mark and the sweep, to drop the weak
+// references to the objects about to be freed.
+const std::uint32_t GC_OnSweep = 11;
 class GC
 {
-	typedef std::set<Traceable*> ObjectSet;
-	ObjectSet m_oRoots;
     std::unordered_map<std::uint32_t, std::vector<std::function<void()>>> m_vEvents;
-    std::vector<ObjectSet::iterator> m_vBeCollected;
 	/**
-	* Objects tracing information: allocation pointer to header.
+	* The objects of the GC, linked through their m_pNextObject: the young
+	* ones, allocated since the last collection, and the old ones, which
+	* survived one. A new object is pushed to the front of the young ones
+	* and a sweep walks each list once.
+	*/
+	Traceable* m_pYoung;
+	Traceable* m_pOld;
+	/**
+	* The old objects which may reference young ones: those whose write
+	* barrier fired since the last collection, and those without one.
+	* Minor collections trace them along with the roots.
 	*/
-	ObjectSet m_oHeap;
+	std::vector<Traceable*> m_vRemembered;
+	/**
+	* The gray objects: marked, but whose children aren't yet. The mark
+	* phase drains it in a loop instead of recursing, so a long chain of
+	* objects can't overflow the native stack.
+	*/
+	std::vector<Traceable*> m_vGray;
+	Nursery m_oNursery;
+	// How many bytes of young objects were allocated since the last
+	// collection.
+	size_t m_iYoungBytes;
+	// Set during a minor collection, which only frees young objects.
+	bool m_bMinor;
+
+	// Set to collect the whole heap in slices of GC_INCREMENTAL_WORK
+	// objects instead of all at once.
+	bool m_bIncremental;
+	GCPhase m_ePhase;
+	// Set while an allocation does a slice of the incremental collection,
+	// as a destructor may allocate too.
+	bool m_bStepping;
+	// The objects without a write barrier the incremental marking traced.
+	// The mutator may have changed them since, so they are traced again
+	// once the gray objects are drained.
+	std::vector<Traceable*> m_vRescan;
+	// The link to the next old object the incremental sweep looks at.
+	Traceable** m_ppSweep;
+	// The objects the incremental sweep found dead. They are freed once the
+	// sweep is done, as their destructors may look at each other.
+	Traceable* m_pDead;
+
+	// How many threads mark the full collections of heaps bigger than
+	// m_iParallelHeap bytes, with the pool of ParallelMarker.
+	size_t m_iMarkThreads;
+	size_t m_iParallelHeap;
+	// Set while the marker runs, for Shade() to use its mark stacks.
+	bool m_bParallel;
 
 	template <typename... T>
 	void print(const T &... t);
 	template <typename T>
 	void PrintVector(std::vector<T> const &input);
-	void Mark();
+	// Traces at most [iBudget] gray objects. Returns true once none is
+	// left.
+	bool Mark(size_t iBudget = SIZE_MAX);
+	void MarkParallel();
 	void Sweep();
-	void Prepare();
+	Traceable** SweepList(Traceable** ppList, Traceable*& pDead);
+	// Empties the remembered set before a sweep, but for the old objects
+	// without a write barrier a minor collection keeps.
+	void ForgetRemembered();
+	// Sweeps the young objects, adds the survivors in front of the old
+	// ones, and returns the link to the first of the old ones.
+	Traceable** SweepYoung(Traceable*& pDead);
+	void StartIncremental();
+	// Does a slice of the incremental collection.
+	void Step();
+	void FinishMark();
+	void Free(Traceable* p);
+	void* Allocate(size_t iSize);
+	// Accounts for the new object [p], collects if needed, then adds it to
+	// the young objects.
+	void Track(Traceable* p, size_t iSize);
 
 public:
 	int bytesAllocated;
@@ -59,11 +212,36 @@ public:
 	GC();
 	~GC();
 	void Dump(const char *label);
+	// A full collection, of both generations.
 	void Collect();
+	// A minor collection, which traces the roots and the remembered set and
+	// promotes the young objects still alive.
+	void CollectYoung();
 	void AddObject(Traceable* o);
+	// Unlinks [o] from the objects, which walks them.
 	void RemoveObject(Traceable* o);
-	void AddRoot(Traceable* obj);
-	void RemoveRoot(Traceable* obj);
+	// Marks the root [obj] and queues it to have its children traced.
+	// During a minor collection, an old root isn't marked but is traced.
+	// Returns false if [obj] already was marked.
+	bool AddRoot(Traceable* obj);
+	// Marks [obj], referenced by another object, and queues it to have its
+	// children traced. Old objects are left alone during a minor collection.
+	// Returns false if [obj] already was marked.
+	bool Shade(Traceable* obj);
+	// Returns true if [obj] wasn't reached by the running collection and is
+	// about to be freed.
+	bool IsWhite(Traceable* obj) const;
+	// Returns true while an incremental collection is tracing the objects.
+	bool IsMarking() const { return m_ePhase == GC_PHASE_MARK; }
+	void SetIncremental(bool bIncremental);
+	// Sets how many threads mark the full collections of big heaps. It
+	// defaults to the number of cores, and 1 marks on the collecting thread
+	// only.
+	void SetMarkThreads(size_t iThreads);
+	// Sets the heap size in bytes from which marking is parallel.
+	void SetParallelHeap(size_t iBytes);
+	// Adds the old object [obj] to the remembered set.
+	void Remember(Traceable* obj);
 	void ClearRoots();
 	
     
@@ -75,66 +253,32 @@ public:
 	T* New(Args&&... args);
 	template <class T>
     T* New();
-	template <class T>
-	T* NewArray(size_t count);
 };
 
+inline void Traceable::WriteBarrier(Traceable* pTarget)
+{
+	if (pTarget == nullptr)
+		return;
+	if (m_bOld && !m_bRemembered && !pTarget->m_bOld)
+		m_pGC->Remember(this);
+	if (mMarked.load(std::memory_order_relaxed) && !pTarget->mMarked.load(std::memory_order_relaxed) && m_pGC->IsMarking())
+		m_pGC->Shade(pTarget);
+}
+
 template <typename T, typename... Args>
 inline T* GC::New(Args&&... args)
 {
-	T* pObject = new T(std::forward<Args>(args)...);
-
-	bytesAllocated += sizeof(T);
-
-	if (bytesAllocated > nextGC)
-    {
-		ClearRoots();
-    	emit(GC_OnMark);
-    	Collect();
-    }
-	AddObject(pObject);
+	T* pObject = new (Allocate(sizeof(T))) T(std::forward<Args>(args)...);
+	Track(pObject, sizeof(T));
     return pObject;
 }
 
 template <class T>
 inline T* GC::New()
 {
-    T* pObject = new T();
-
-	bytesAllocated += sizeof(T);
-
-	if (bytesAllocated > nextGC)
-    {
-		ClearRoots();
-    	emit(GC_OnMark);
-    	Collect();
-    }
-	AddObject(pObject);
-    return pObject;
-}
-
-// template <class T> void Delete(Allocator& allocator, T& object)
-// {
-//     object.~T(); 
-//     allocator.Deallocate(&object);
-// }
-
-template <typename T>
-inline T* GC::NewArray(size_t count)
-{
-    T* pObject = new T[count];
-	for (int i = 0; i < count; i++)
-		AddObject(pObject[i]);
-
-	bytesAllocated += sizeof(T) * count;
-
-	if (bytesAllocated > nextGC)
-    {
-		ClearRoots();
-    	emit(GC_OnMark);
-    	Collect();
-    }
+    T* pObject = new (Allocate(sizeof(T))) T();
+	Track(pObject, sizeof(T));
     return pObject;
 }
 
-#endif
\ No newline at end of file
+#endif
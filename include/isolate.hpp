@@ -0,0 +1,99 @@
+#ifndef FOX_ISOLATE_HPP_
+#define FOX_ISOLATE_HPP_
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "common.h"
+#include "Parser.h"
+#include "value.hpp"
+#include "vm.hpp"
+
+// A value copied out of one VM so that another one, usually on another
+// thread, can rebuild it. VMs share no objects at all, so only plain data can
+// be sent: nil, booleans, numbers, strings, and arrays and maps of those.
+class Message
+{
+public:
+    Message();
+
+    // Deep copies [oValue]. Returns false with the reason in [strError] if it
+    // holds something that can't be sent.
+    bool Copy(Value oValue, std::string& strError);
+
+    // Builds the value again in [pVM].
+    Value ToValue(VM* pVM) const;
+
+private:
+    enum Kind { NIL, BOOL, INT, NUMBER, STRING, ARRAY, MAP };
+
+    bool Copy(Value oValue, std::string& strError, std::vector<Object*>& vPath);
+
+    Kind m_eKind;
+    union
+    {
+        bool m_bBool;
+        int m_iInt;
+        double m_fNumber;
+    };
+    std::string m_strString;
+    // The elements of an array, or the keys and values of a map one after
+    // the other.
+    std::vector<Message> m_vItems;
+};
+
+// A queue of messages that any thread can send to and receive from.
+class Channel
+{
+public:
+    void Send(Message&& oMessage);
+
+    // Blocks until a message arrives. Returns false once the channel is
+    // closed and has nothing left.
+    bool Receive(Message& oMessage);
+
+    // Wakes up the receivers, nothing can be sent anymore.
+    void Close();
+
+private:
+    std::mutex m_oMutex;
+    std::condition_variable m_oReady;
+    std::deque<Message> m_vMessages;
+    bool m_bClosed = false;
+};
+
+// A VM of its own running a script on its own thread. It shares nothing with
+// the VM that started it and talks to it through two channels: the inbox,
+// that the script reads with worker.receive(), and the outbox that it writes
+// with worker.send().
+class Isolate
+{
+public:
+    // [setup] is called on the new VM before it runs, to define the modules
+    // the script may import.
+    Isolate(const std::string& strPath, int argc, char** argv, std::function<void(VM&)> setup);
+
+    // Joins the thread if nobody did.
+    ~Isolate();
+
+    Channel& Inbox() { return m_oInbox; }
+    Channel& Outbox() { return m_oOutbox; }
+
+    // Closes the inbox, waits for the script to end and returns how it ended.
+    InterpretResult Join();
+
+private:
+    void Run(std::string strPath, int argc, char** argv, std::function<void(VM&)> setup);
+
+    Channel m_oInbox;
+    Channel m_oOutbox;
+    std::thread m_oThread;
+    InterpretResult m_eResult;
+};
+
+#endif
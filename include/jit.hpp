@@ -0,0 +1,112 @@
+#ifndef FOX_JIT_HPP_
+#define FOX_JIT_HPP_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <vector>
+
+#include "common.h"
+#include "value.hpp"
+
+class ObjectFunction;
+class VM;
+
+// Number of times the interpreter has to reach a function (calling it,
+// returning into it or taking one of its loop back edges) before it is
+// compiled to machine code.
+#define FOX_JIT_THRESHOLD 1000
+
+// How deep the machine code of a function may call into the machine code of
+// another before leaving the rest of the calls to the interpreter. Each level
+// takes 16 bytes of the native stack.
+#define FOX_JIT_MAX_DEPTH 1024
+
+// What JitCode::Enter() returns instead of an offset when the interpreter
+// can't simply go on in the function it entered.
+enum JitExit
+{
+    // The machine code was left in a function it called: the interpreter goes
+    // on with the frame on top of the current fiber, wherever it was left.
+    JIT_EXIT_FRAMES = -1,
+    // A call failed, and reported it.
+    JIT_EXIT_ERROR = -2
+};
+
+// What the compiled code works on. It doesn't have registers of its own: the
+// operands stay on the fiber's stack exactly where the interpreter keeps them,
+// so the interpreter can take over at any instruction boundary.
+//
+// A compiled function calls another one without leaving the machine code: the
+// runtime helper pushes the frame of the callee and points the state at it,
+// and the machine code of the callee runs on the same native stack and the
+// same state, which its return points back at the caller.
+struct JitState
+{
+    VM* m_pVM;
+    // How many of these calls are running.
+    int m_iDepth;
+    // The native stack pointer once the entry saved the registers, where any
+    // exit unwinds to whatever the depth.
+    void* m_pNativeStack;
+    Value* m_pStackTop;
+    Value* m_pSlots;
+    Value* m_pModuleVariables;
+    const uint8_t* m_pTarget;
+};
+
+// Runs compiled code from [m_pTarget] and returns the offset of the bytecode
+// instruction the interpreter must resume at, or a JitExit.
+typedef int (*JitEntry)(JitState* pState);
+
+// When the machine code was left at [iOffset] in a function it called, hands
+// the frame on top of the current fiber to the interpreter and returns
+// JIT_EXIT_FRAMES.
+int JitLeave(JitState* pState, int iOffset);
+
+// The machine code compiled for one ObjectFunction.
+//
+// Every bytecode instruction gets a native entry point. Calls, method
+// invocations and string concatenations go through the runtime helpers of the
+// interpreter, and a compiled callee runs and returns in machine code too. The
+// instructions the baseline compiler doesn't know (property accesses,
+// closures, ...), and the guards of the ones it does, simply leave the machine
+// code with the offset of the instruction. The interpreter runs it and enters
+// the machine code again at the next call, return or loop back edge.
+class JitCode
+{
+public:
+    JitCode(uint8_t* pCode, size_t uSize, std::vector<int32_t>&& vEntries);
+    ~JitCode();
+
+    int Enter(VM* pVM, int iOffset, Value* pSlots, Value* pModuleVariables, Value*& pStackTop) const
+    {
+        FOX_ASSERT(m_vEntries[iOffset] >= 0, "Not an instruction boundary.");
+        JitState oState;
+        oState.m_pVM = pVM;
+        oState.m_iDepth = 0;
+        oState.m_pStackTop = pStackTop;
+        oState.m_pSlots = pSlots;
+        oState.m_pModuleVariables = pModuleVariables;
+        oState.m_pTarget = Entry(iOffset);
+        int iExit = reinterpret_cast<JitEntry>(m_pCode)(&oState);
+        if (iExit >= 0 && oState.m_iDepth > 0)
+            iExit = JitLeave(&oState, iExit);
+        pStackTop = oState.m_pStackTop;
+        return iExit;
+    }
+
+    // The machine code of the instruction at [iOffset].
+    const uint8_t* Entry(int iOffset) const { return m_pCode + m_vEntries[iOffset]; }
+
+private:
+    uint8_t* m_pCode;
+    size_t m_uSize;
+    // Native offset of each bytecode instruction, -1 inside operands.
+    std::vector<int32_t> m_vEntries;
+};
+
+// Compiles [pFunction] to machine code, or returns nullptr if this platform
+// has no JIT or the code couldn't be mapped.
+JitCode* JitCompile(ObjectFunction* pFunction);
+
+#endif
@@ -8,6 +8,8 @@ void DefineMathModule(VM* oVM);
 void DefineModuleModule(VM* oVM);
 void DefineOSModule(VM* oVM);
 void DefinePathModule(VM* oVM);
+void DefineSchedulerModule(VM* oVM);
+void DefineWorkerModule(VM* oVM);
 
 
 void DefineCoreArray(VM* oVM);
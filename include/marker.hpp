@@ -0,0 +1,92 @@
+#ifndef FOX_MARKER_HPP_
+#define FOX_MARKER_HPP_
+
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "common.h"
+
+class GC;
+class Traceable;
+
+// How many gray objects a marking thread keeps to itself before it shares
+// half of them with the others.
+#define GC_MARK_SHARE 256
+
+// Marks the objects of a GC with a pool of helper threads, for the full
+// collections of big heaps.
+//
+// Every thread, the collecting one included, has its own mark stack. It
+// traces the objects from the private part, and moves some to the shared
+// part when it has plenty, so that an idle thread can steal half of them.
+// The mark bits are set with an atomic exchange, so an object is traced by
+// only one thread.
+//
+// There is one pool for the whole process, which marks for one GC at a
+// time: the VMs of several isolates share its helpers instead of each
+// starting as many as there are cores. The helpers are started when a
+// marking asks for more threads than the pool has, and wait for the next
+// marking in between.
+class ParallelMarker
+{
+public:
+    // Traces everything reachable from [vGray] with [iThreads] threads, the
+    // calling one included, and empties [vGray]. Returns once every thread
+    // is done, or false at once if the pool is marking for another GC.
+    static bool Mark(GC& oGC, std::vector<Traceable*>& vGray, size_t iThreads);
+
+    // Marks [pObject] and pushes it on the mark stack of the calling thread.
+    // Returns false if another thread marked it first.
+    static bool Shade(Traceable* pObject);
+
+private:
+    ParallelMarker();
+    ~ParallelMarker();
+
+    struct Worker
+    {
+        std::vector<Traceable*> m_vLocal;
+        std::mutex m_oLock;
+        std::vector<Traceable*> m_vShared;
+        // The size of m_vShared, read by the others without locking.
+        std::atomic<size_t> m_iShared;
+    };
+
+    static ParallelMarker& Get();
+
+    void MarkWith(GC& oGC, std::vector<Traceable*>& vGray, size_t iThreads);
+    void Grow(size_t iThreads);
+    void Run(size_t iWorker);
+    void Work(size_t iWorker);
+    void Share(Worker& oWorker);
+    bool Steal(size_t iWorker);
+    bool AnyShared() const;
+
+    // The worker of the calling thread while it marks.
+    static thread_local Worker* s_pWorker;
+
+    // Held by the GC the pool marks for.
+    std::mutex m_oBusy;
+    GC* m_pGC;
+    std::vector<scope<Worker>> m_vWorkers;
+    std::vector<std::thread> m_vThreads;
+    // How many workers the running marking uses, the first ones.
+    size_t m_iActive;
+
+    std::mutex m_oLock;
+    std::condition_variable m_oStart;
+    std::condition_variable m_oDone;
+    // Bumped by every marking, for the helpers to tell they must start.
+    size_t m_iGeneration;
+    // How many helpers are still marking.
+    size_t m_iRunning;
+    bool m_bQuit;
+
+    // How many threads ran out of objects to trace and to steal.
+    std::atomic<size_t> m_iIdle;
+};
+
+#endif
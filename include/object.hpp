@@ -20,6 +20,8 @@
 #include "gc.hpp"
 
 class VM;
+class JitCode;
+struct LazyFunction;
 template<typename T>
 class Klass;
 
@@ -157,11 +159,28 @@ public:
     }
 };
 
+// Marks [pObject] and queues it to have its children traced by [gc]. Does
+// nothing for NULL.
+void MarkObject(GC& gc, Object* pObject);
+
+// Marks the object [value] holds, if any.
+void MarkValue(GC& gc, Value value);
+
+// Must be called when storing [value] in [pOwner], see
+// Traceable::WriteBarrier().
+static inline void WriteBarrier(Object* pOwner, Value value)
+{
+    if ((pOwner->m_bOld || pOwner->mMarked.load(std::memory_order_relaxed)) && Fox_IsObject(value))
+        pOwner->WriteBarrier(Fox_AsObject(value));
+}
+
 class ObjectString : public Object
 {
 public:
     explicit ObjectString(const std::string& v) : string(v) {}
 
+    bool HasWriteBarrier() const override { return true; }
+
     uint32_t hash;
     std::string string;
 };
@@ -245,9 +264,37 @@ private:
     VM& m_oVM;
 
 public:
-    Table m_vVariables;
+    // Returns the slot of the variable [strName] in m_vVariables, or -1 if
+    // the module doesn't have one.
+    int FindVariable(ObjectString* strName);
+
+    // Returns the slot of [strName], adding an undefined variable for it if
+    // there is none yet. The compiler resolves every top-level name this way,
+    // even the ones that are only defined later on or by an import.
+    int DeclareVariable(ObjectString* strName);
+
+    // Looks a variable up by name. Returns false if it isn't defined.
+    bool GetVariable(ObjectString* strName, Value& oValue);
+
+    // Defines the variable [strName], or changes its value if it exists.
+    void SetVariable(ObjectString* strName, Value oValue);
+
+    // Defines every variable of [oOther] in this module.
+    void ImportVariables(ObjectModule& oOther);
+
+    // Maps the name of each top-level variable to its slot in m_vVariables.
+    // Compiled code refers to variables by slot, so this is only used by the
+    // compiler and for lookups by name from the host.
+    Table m_vVariableNames;
+
+    // The values of the top-level variables. Slots that were declared but not
+    // defined yet hold Fox_Undefined.
+    std::vector<Value> m_vVariables;
+
     // The name of the module.
     ObjectString* m_strName;
+
+    void markChildren(GC& gc) override;
 };
 
 class ObjectFunction : public Object
@@ -257,20 +304,35 @@ public:
     int iMinArity;
     int iMaxArity;
     int upValueCount;
+    // The stack slots a frame of the function uses at most, from the closure
+    // to its deepest temporary, see Chunk::MaxStack().
+    int maxSlots;
     Chunk chunk;
     ObjectString* name;
     ObjectModule* module;
+    // How many times the interpreter entered the function, see JIT_ENTER().
+    int hotness;
+    JitCode* jitCode;
+    // Set until the first call of a function compiled with -lazy, which
+    // compiles its chunk, see VM::CompileLazy().
+    ref<const LazyFunction> lazy;
 
 	explicit ObjectFunction()
 	{
 		arity = 0;
 		name = NULL;
 		upValueCount = 0;
+		maxSlots = 0;
 		type = OBJ_FUNCTION;
         module = NULL;
         iMinArity = 0;
         iMaxArity = 0;
+        hotness = 0;
+        jitCode = nullptr;
 	}
+	~ObjectFunction();
+
+    void markChildren(GC& gc) override;
 };
 
 class ObjectUpvalue : public Object
@@ -287,6 +349,9 @@ public:
         next = NULL;
         closed = Fox_Nil;
     }
+
+    void markChildren(GC& gc) override;
+    bool HasWriteBarrier() const override { return true; }
 };
 
 
@@ -306,6 +371,8 @@ public:
 		function = func;
 		type = OBJ_NATIVE;
 	}
+
+    bool HasWriteBarrier() const override { return true; }
 };
 
 class ObjectLib : public Object
@@ -321,6 +388,8 @@ public:
 		name = n;
 		methods = Table();
 	}
+
+    void markChildren(GC& gc) override;
 };
 
 class ObjectClosure : public Object
@@ -331,6 +400,21 @@ public:
     int upvalueCount;
 
     ObjectClosure(VM* oVM, ObjectFunction* func);
+
+    void markChildren(GC& gc) override;
+    bool HasWriteBarrier() const override { return true; }
+};
+
+// The operators a class can overload that the interpreter dispatches through
+// ObjectClass::operatorTable instead of looking their name up.
+enum OperatorSlot
+{
+    OPERATOR_ADD,
+    OPERATOR_SUB,
+    OPERATOR_MUL,
+    OPERATOR_DIV,
+
+    OPERATOR_COUNT,
 };
 
 class ObjectClass : public Object
@@ -340,6 +424,9 @@ public:
     ObjectString* name;
     Table methods;
     Table operators;
+    // The overloads of the operators in OperatorSlot, or nil for the ones the
+    // class doesn't define. Kept in sync with [operators].
+    Value operatorTable[OPERATOR_COUNT];
     Table getters;
     Table setters;
     Table fields;
@@ -354,6 +441,8 @@ public:
         derivedCount = 0;
 	}
 
+    void markChildren(GC& gc) override;
+
     bool operator==(const ObjectClass& other) const
     {
         ObjectClass* cl = (ObjectClass*) this;
@@ -381,12 +470,15 @@ public:
 	{
 		type = OBJ_INSTANCE;
 		klass = k;
+        fields.m_pOwner = this;
 		fields.AddAll(klass->fields);
         m_pVm = pVm;
         user_type = nullptr;
 	}
 
     void on_destroy() override;
+    void markChildren(GC& gc) override;
+    bool HasWriteBarrier() const override { return true; }
 
     bool operator==(const ObjectInstance& other) const
     {
@@ -520,6 +612,9 @@ public:
 		receiver = r;
 		method = m;
 	}
+
+    void markChildren(GC& gc) override;
+    bool HasWriteBarrier() const override { return true; }
 };
 
 struct ObjectAbstractType
@@ -547,6 +642,8 @@ public:
         data = d;
 	}
 
+    bool HasWriteBarrier() const override { return true; }
+
     bool operator==(const ObjectAbstract& other) const
     {
         return data == other.data && abstractType == other.abstractType;
@@ -568,6 +665,9 @@ public:
     {
         return m_vValues == other.m_vValues;
     }
+
+    void markChildren(GC& gc) override;
+    bool HasWriteBarrier() const override { return true; }
 };
 
 class ObjectMap : public Object
@@ -580,12 +680,17 @@ public:
 	{
 		type = OBJ_MAP;
         m_vValues = MapTable();
+        m_vValues.m_pOwner = this;
+        m_oMethods.m_pOwner = this;
 	}
 
     bool operator==(const ObjectMap& other) const
     {
         return m_vValues.m_vEntries == other.m_vValues.m_vEntries;
     }
+
+    void markChildren(GC& gc) override;
+    bool HasWriteBarrier() const override { return true; }
 };
 
 static inline bool is_obj_type(Value val, ObjType type)
@@ -594,13 +699,24 @@ static inline bool is_obj_type(Value val, ObjType type)
 }
 
 #define UINT8_COUNT (UINT8_MAX + 1)
-#define FRAMES_MAX 64
-#define STACK_MAX (FRAMES_MAX * UINT8_COUNT)
+// The deepest a fiber's call stack may get before "Stack overflow.". Fibers
+// start with a few frames and grow them on demand, so this only catches
+// runaway recursion.
+#define FRAMES_MAX 65536
+
+// How many stack slots a new fiber has room for. Every frame is pushed with
+// the room its function needs above its slots (see ObjectFunction::maxSlots),
+// growing the stack if it has to, so the instructions themselves never have to
+// check for it.
+#define FIBER_INITIAL_SLOTS UINT8_COUNT
+
+// How many call frames a new fiber has room for.
+#define FIBER_INITIAL_FRAMES 4
 
 struct CallFrame
 {
 	ObjectClosure* closure;
-	std::vector<uint8_t>::iterator ip;
+	uint8_t* ip;
 	Value* slots;
 };
 
@@ -610,7 +726,9 @@ public:
     explicit ObjectFiber(ObjectClosure* pClosure)
 	{
 		type = OBJ_FIBER;
-        m_pStackTop = m_vStack;
+        m_vStack.resize(FIBER_INITIAL_SLOTS);
+        m_vFrames.resize(FIBER_INITIAL_FRAMES);
+        m_pStackTop = m_vStack.data();
         m_iFrameCount = 0;
 
         m_vOpenUpvalues = nullptr;
@@ -623,32 +741,65 @@ public:
             // Initialize the first call frame.
             CallFrame *pFrame = &m_vFrames[m_iFrameCount++];
             pFrame->closure = pClosure;
-            pFrame->ip = pClosure->function->chunk.m_vCode.begin();
+            pFrame->ip = pClosure->function->chunk.Start();
 
-            // The first slot always holds the closure.
+            // The first slot always holds the closure. The argument, if any,
+            // is bound after it when the fiber is first called.
             *m_pStackTop = pClosure;
+            pFrame->slots = m_pStackTop;
             m_pStackTop++;
-            pFrame->slots = m_pStackTop - pClosure->function->arity - 1;
+            EnsureStack(pClosure->function->maxSlots);
         }
 	}
 
-    void SetSlot(int iArgCount)
+    // Makes sure the stack has room for at least [iNeeded] values, moving it
+    // if it has to grow. Pointers into the stack held outside the fiber must
+    // be fixed up by the caller.
+    void EnsureStack(size_t iNeeded)
+    {
+        if (iNeeded <= m_vStack.size())
+            return;
+
+        size_t iCapacity = m_vStack.size();
+        while (iCapacity < iNeeded)
+            iCapacity *= 2;
+
+        std::vector<Value> vStack(iCapacity);
+        Value* pOld = m_vStack.data();
+        std::copy(pOld, m_pStackTop, vStack.data());
+
+        // Frames and open upvalues point into the stack, move them along.
+        m_pStackTop = vStack.data() + (m_pStackTop - pOld);
+        for (int i = 0; i < m_iFrameCount; i++)
+            m_vFrames[i].slots = vStack.data() + (m_vFrames[i].slots - pOld);
+        for (ObjectUpvalue* pUpvalue = m_vOpenUpvalues; pUpvalue != nullptr; pUpvalue = pUpvalue->next)
+            pUpvalue->location = vStack.data() + (pUpvalue->location - pOld);
+
+        m_vStack.swap(vStack);
+    }
+
+    void markChildren(GC& gc) override;
+
+    // Returns a new frame on top of the others, growing the frames if they
+    // are all in use.
+    CallFrame* PushFrame()
     {
-        CallFrame *pFrame = &m_vFrames[m_iFrameCount];
-        pFrame->slots = m_pStackTop - iArgCount - 1;
+        if (m_iFrameCount == (int) m_vFrames.size())
+            m_vFrames.resize(m_vFrames.size() * 2);
+        return &m_vFrames[m_iFrameCount++];
     }
 
     // The stack of value slots. This is used for holding local variables and
     // temporaries while the fiber is executing. It is heap-allocated and grown
     // as needed.
-    Value m_vStack[STACK_MAX];
+    std::vector<Value> m_vStack;
     
     // A pointer to one past the top-most value on the stack.
     Value* m_pStackTop;
     
     // The stack of call frames. This is a dynamic array that grows as needed but
     // never shrinks.
-    CallFrame m_vFrames[FRAMES_MAX];
+    std::vector<CallFrame> m_vFrames;
     
     // The number of frames currently in use in [frames].
     int m_iFrameCount;
@@ -722,11 +873,11 @@ template <typename T,
     std::enable_if_t<!std::is_base_of<Object, T>::value, bool>>
 T Value::as()
 {
-    if (type != VAL_OBJ)
+    if (!Fox_IsObject(*this))
         throw std::runtime_error("Invalid Type");
     if (!is_obj_type(*this, OBJ_INSTANCE))
         throw std::runtime_error("Invalid Type");
-    ObjectInstance* user = static_cast<ObjectInstance*>(val.obj);
+    ObjectInstance* user = static_cast<ObjectInstance*>(GetObject());
     return *static_cast<T*>(user->user_type);
 }
 
@@ -734,9 +885,9 @@ template <typename T,
     std::enable_if_t<std::is_base_of<Object, T>::value, bool>>
 T* Value::as()
 {
-    if (type != VAL_OBJ)
+    if (!Fox_IsObject(*this))
         throw std::runtime_error("Invalid Type");
-    return static_cast<T*>(val.obj);
+    return static_cast<T*>(GetObject());
 }
 
 template<typename T>
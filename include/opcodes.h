@@ -0,0 +1,109 @@
+// The opcodes of the VM, one OPCODE(name) per line. Define OPCODE() before
+// including this file: it builds the OpCode enum and the dispatch table of
+// VM::run, in this order, so a new opcode is only added here. No include
+// guard, as it is included once per use.
+
+OPCODE(OP_CONST)
+OPCODE(OP_NIL)
+OPCODE(OP_TRUE)
+OPCODE(OP_FALSE)
+OPCODE(OP_POP)
+OPCODE(OP_GET_LOCAL)
+OPCODE(OP_SET_LOCAL)
+OPCODE(OP_GET_MODULE_VAR)
+OPCODE(OP_DEFINE_MODULE_VAR)
+OPCODE(OP_SET_MODULE_VAR)
+OPCODE(OP_GET_UPVALUE)
+OPCODE(OP_SET_UPVALUE)
+OPCODE(OP_GET_PROPERTY)
+OPCODE(OP_SET_PROPERTY)
+OPCODE(OP_GET_SUPER)
+OPCODE(OP_EQUAL)
+OPCODE(OP_GREATER)
+OPCODE(OP_LESS)
+
+OPCODE(OP_ADD)
+OPCODE(OP_SUB)
+OPCODE(OP_MUL)
+OPCODE(OP_DIV)
+OPCODE(OP_BIT_AND)
+OPCODE(OP_BIT_OR)
+OPCODE(OP_BIT_XOR)
+OPCODE(OP_BIT_NOT)
+OPCODE(OP_SHIFT_LEFT)
+OPCODE(OP_SHIFT_RIGHT)
+OPCODE(OP_NOT)
+OPCODE(OP_NEGATE)
+OPCODE(OP_PRINT)
+OPCODE(OP_JUMP)
+OPCODE(OP_JUMP_IF_FALSE)
+OPCODE(OP_LOOP)
+OPCODE(OP_IMPORT)
+OPCODE(OP_CALL)
+// An OP_CALL right before an OP_RETURN. A closure called this way reuses the
+// frame of the caller, anything else is called normally and the OP_RETURN
+// returns its result.
+OPCODE(OP_TAIL_CALL)
+OPCODE(OP_INVOKE)
+OPCODE(OP_SUPER_INVOKE)
+OPCODE(OP_CLOSURE)
+OPCODE(OP_CLOSE_UPVALUE)
+OPCODE(OP_RETURN)
+OPCODE(OP_CLASS)
+OPCODE(OP_INHERIT)
+OPCODE(OP_METHOD)
+OPCODE(OP_OPERATOR)
+
+OPCODE(OP_SUBSCRIPT)
+OPCODE(OP_SUBSCRIPT_ASSIGN)
+OPCODE(OP_ARRAY)
+OPCODE(OP_ADD_LIST)
+OPCODE(OP_SLICE)
+
+OPCODE(OP_MAP)
+OPCODE(OP_ADD_MAP)
+
+OPCODE(OP_END_MODULE)
+OPCODE(OP_END)
+
+OPCODE(OP_IS)
+
+// Specialized variants of the arithmetic and comparison instructions. The
+// compiler never emits them: the interpreter rewrites the generic instruction
+// in place once it has seen the operand types these expect (see QUICKEN()).
+OPCODE(OP_ADD_NUM)
+OPCODE(OP_ADD_STR)
+OPCODE(OP_SUB_NUM)
+OPCODE(OP_MUL_NUM)
+OPCODE(OP_LESS_NUM)
+OPCODE(OP_GREATER_NUM)
+
+// Superinstructions. The compiler fuses these sequences as it emits them (see
+// Parser::Peephole()); they were picked from the instruction pairs and triples
+// that -lp counts in the examples, tests and benchmarks.
+OPCODE(OP_GET_LOCAL_PROPERTY)   // GET_LOCAL, GET_PROPERTY
+OPCODE(OP_LESS_LOCAL_CONST)     // GET_LOCAL, CONST, LESS
+OPCODE(OP_ADD_LOCAL_CONST)      // GET_LOCAL, CONST, ADD
+OPCODE(OP_SUB_LOCAL_CONST)      // GET_LOCAL, CONST, SUB
+OPCODE(OP_STORE_LOCAL)          // SET_LOCAL, POP
+OPCODE(OP_STORE_MODULE_VAR)     // SET_MODULE_VAR, POP
+OPCODE(OP_RETURN_LOCAL)         // GET_LOCAL, RETURN
+
+// Loop control. The compare-and-branch instructions replace the comparison
+// ending the condition of a loop or an if and the OP_JUMP_IF_FALSE testing it
+// (see Parser::EmitConditionJump()). They pop their operands and leave no
+// condition behind for the branches to pop.
+OPCODE(OP_JUMP_IF_NOT_LESS)             // LESS, JUMP_IF_FALSE
+OPCODE(OP_JUMP_IF_NOT_GREATER)          // GREATER, JUMP_IF_FALSE
+OPCODE(OP_JUMP_IF_LESS)                 // LESS, NOT, JUMP_IF_FALSE
+OPCODE(OP_JUMP_IF_GREATER)              // GREATER, NOT, JUMP_IF_FALSE
+OPCODE(OP_JUMP_IF_NOT_LESS_LOCAL)       // GET_LOCAL, GET_LOCAL, LESS, JUMP_IF_FALSE
+OPCODE(OP_JUMP_IF_NOT_LESS_LOCAL_CONST) // LESS_LOCAL_CONST, JUMP_IF_FALSE
+// ++i, i++, i = i + 1, ... on a local. The OP_STORE_LOCAL they are fused with
+// stays in their operands so they can turn back into the two instructions
+// when the local isn't a number.
+OPCODE(OP_INC_LOCAL)                    // ADD_LOCAL_CONST, STORE_LOCAL
+OPCODE(OP_DEC_LOCAL)                    // SUB_LOCAL_CONST, STORE_LOCAL
+
+// CODES for Repl Mode
+OPCODE(OP_PRINT_REPL)
@@ -0,0 +1,22 @@
+#ifndef FOX_SCANNER_HPP_
+#define FOX_SCANNER_HPP_
+
+#include <string>
+#include <vector>
+
+class Token;
+
+// Splits [strSource] into the tokens of the parser, appended to [vTokens].
+//
+// The scanner is a hand-written DFA working directly on the source buffer:
+// a token is recognized by a switch on its first character and at most one
+// character of lookahead, and the keywords are told apart from identifiers
+// with a perfect hash. Unlike the regex lexer it replaces, it needs no setup,
+// so creating a Parser costs nothing.
+//
+// Whitespace, comments and '#' lines are skipped, and the escapes of strings
+// are resolved. The tokens end with a TOKEN_EOF. An invalid character or an
+// unterminated string gives a TOKEN_ERROR whose text is the error message.
+void ScanTokens(const std::string& strSource, std::vector<Token>& vTokens);
+
+#endif
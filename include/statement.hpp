@@ -7,8 +7,8 @@ void PrintStatement(Parser& parser);
 void ExpressionStatement(Parser& parser);
 void ForStatement(Parser& parser);
 void WhileStatement(Parser& parser);
-void for_loop(Parser& parser, int *exit_jump);
-void for_increment(Parser& parser, int *loop_start);
+void for_loop(Parser& parser, int *exit_jump, bool *keeps_condition);
+void for_increment(Parser& parser, std::vector<uint8_t> *code, std::vector<int> *lines);
 void ImportStatement(Parser& parser);
 void SwitchStatement(Parser& parser);
 void ReturnStatement(Parser& parser);
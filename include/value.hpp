@@ -5,6 +5,8 @@
 #include <vector>
 #include <string>
 #include <variant>
+#include <cstring>
+#include <iostream>
 #include "common.h"
 #include "NameUtils.hpp"
 
@@ -32,9 +34,12 @@ enum ValueType {
     VAL_BOOL,
     VAL_NIL,
     VAL_NUMBER,
-    // VAL_INT,
+    VAL_INT,
     VAL_USER,
     VAL_OBJ,
+    // Only used internally, for module variables that are used before they
+    // are defined. It's never visible to a script.
+    VAL_UNDEFINED,
     // VAL_STRING,
     // VAL_CLOSURE,
     // VAL_ARRAY,
@@ -51,6 +56,250 @@ enum ValueType {
     // VAL_UPVALUE,
 };
 
+#if FOX_NAN_TAGGING
+
+// An IEEE 754 double has 11 exponent bits and 52 mantissa bits. When all the
+// exponent bits are set, the value is a NaN, and as long as the highest
+// mantissa bit (the "quiet" bit) is also set, the hardware never produces it
+// by itself with anything in the remaining 51 bits. We use those bits to store
+// everything that isn't a number:
+//
+//   - Objects set the sign bit and keep their pointer in the low 48 bits.
+//   - Host userdata pointers set bit 48 instead of the sign bit.
+//   - 32-bit integers set bit 49 and keep their value in the low 32 bits.
+//   - nil, false, true and undefined are quiet NaNs with a small tag in the
+//     low bits.
+//
+// Any other bit pattern is a regular double.
+
+// A mask that selects the sign bit.
+#define FOX_SIGN_BIT ((uint64_t)1 << 63)
+
+// The bits that must be set to indicate a quiet NaN.
+#define FOX_QNAN ((uint64_t)0x7ffc000000000000)
+
+// Set on top of a quiet NaN to mark a host userdata pointer.
+#define FOX_USER_BIT ((uint64_t)1 << 48)
+
+// Set on top of a quiet NaN to mark a 32-bit integer.
+#define FOX_INT_BIT ((uint64_t)1 << 49)
+
+// Tag values for the different singleton values.
+#define FOX_TAG_NIL   1
+#define FOX_TAG_FALSE 2
+#define FOX_TAG_TRUE  3
+#define FOX_TAG_UNDEFINED 4
+
+#define FOX_NIL_BITS   (FOX_QNAN | FOX_TAG_NIL)
+#define FOX_FALSE_BITS (FOX_QNAN | FOX_TAG_FALSE)
+#define FOX_TRUE_BITS  (FOX_QNAN | FOX_TAG_TRUE)
+#define FOX_UNDEFINED_BITS (FOX_QNAN | FOX_TAG_UNDEFINED)
+
+class Value
+{
+public:
+    Value() : m_uBits(FOX_NIL_BITS)
+    {
+    }
+
+    template<typename T,
+        std::enable_if_t<!std::is_base_of<Object, std::remove_pointer_t<T>>::value, bool> = true>
+    Value(T te)
+    {
+        std::cerr << "Object" << std::endl;
+        m_uBits = FOX_QNAN | FOX_USER_BIT | (uint64_t)(uintptr_t)&te;
+    }
+
+    Value(const Value& other) : m_uBits(other.m_uBits)
+    {
+    }
+
+    Value(bool value) : m_uBits(value ? FOX_TRUE_BITS : FOX_FALSE_BITS)
+    {
+    }
+
+    Value(double value)
+    {
+        SetNumber(value);
+    }
+
+    Value(float value)
+    {
+        SetNumber(static_cast<double>(value));
+    }
+
+    Value(std::uint32_t value)
+    {
+        SetInteger(static_cast<int64_t>(value));
+    }
+
+    Value(std::size_t value)
+    {
+        if (value > static_cast<std::size_t>(INT32_MAX))
+            SetNumber(static_cast<double>(value));
+        else
+            SetInt(static_cast<int32_t>(value));
+    }
+
+    Value(int value)
+    {
+        SetInt(value);
+    }
+
+    Value(Object* value) : m_uBits(FOX_SIGN_BIT | FOX_QNAN | (uint64_t)(uintptr_t)value)
+    {
+    }
+
+    ~Value() = default;
+
+    uint64_t m_uBits;
+
+    ValueType GetType() const
+    {
+        if ((m_uBits & FOX_QNAN) != FOX_QNAN)   return VAL_NUMBER;
+        if (m_uBits & FOX_SIGN_BIT)             return VAL_OBJ;
+        if (m_uBits & FOX_INT_BIT)              return VAL_INT;
+        if (m_uBits & FOX_USER_BIT)             return VAL_USER;
+        if (m_uBits == FOX_NIL_BITS)            return VAL_NIL;
+        if (m_uBits == FOX_UNDEFINED_BITS)      return VAL_UNDEFINED;
+        return VAL_BOOL;
+    }
+
+    static Value Undefined()
+    {
+        Value oValue;
+        oValue.m_uBits = FOX_UNDEFINED_BITS;
+        return oValue;
+    }
+
+    double GetNumber() const
+    {
+        double number;
+        memcpy(&number, &m_uBits, sizeof(double));
+        return number;
+    }
+
+    int32_t GetInt() const
+    {
+        return static_cast<int32_t>(static_cast<uint32_t>(m_uBits));
+    }
+
+    Object* GetObject() const
+    {
+        return (Object*)(uintptr_t)(m_uBits & ~(FOX_SIGN_BIT | FOX_QNAN));
+    }
+
+    void SetNumber(double value)
+    {
+        memcpy(&m_uBits, &value, sizeof(double));
+    }
+
+    void SetInt(int32_t value)
+    {
+        m_uBits = FOX_QNAN | FOX_INT_BIT | static_cast<uint32_t>(value);
+    }
+
+    // Stores [value] as an integer if it fits in 32 bits, as a double
+    // otherwise.
+    void SetInteger(int64_t value)
+    {
+        if (value < INT32_MIN || value > INT32_MAX)
+            SetNumber(static_cast<double>(value));
+        else
+            SetInt(static_cast<int32_t>(value));
+    }
+
+    template <typename T,
+    std::enable_if_t<!std::is_base_of<Object, T>::value, bool> = true>
+    T as();
+
+    template <typename T,
+    std::enable_if_t<std::is_base_of<Object, T>::value, bool> = true>
+    T* as();
+
+    template<typename T>
+    bool is();
+
+    bool operator==(const Value& other) const;
+
+    Value& operator=(const Value& other)
+    {
+        m_uBits = other.m_uBits;
+        return *this;
+    }
+
+    Value& operator=(double value)
+    {
+        SetNumber(value);
+        return *this;
+    }
+
+    Value& operator=(bool value)
+    {
+        m_uBits = value ? FOX_TRUE_BITS : FOX_FALSE_BITS;
+        return *this;
+    }
+
+    Value& operator=(Object* value)
+    {
+        m_uBits = FOX_SIGN_BIT | FOX_QNAN | (uint64_t)(uintptr_t)value;
+        return *this;
+    }
+};
+
+static_assert(sizeof(Value) == sizeof(uint64_t), "A NaN-tagged Value must fit in 64 bits.");
+
+#define Fox_IsBool(val)         (((val).m_uBits | 1) == FOX_TRUE_BITS)
+#define Fox_IsNil(val)          ((val).m_uBits == FOX_NIL_BITS)
+#define Fox_IsUndefined(val)    ((val).m_uBits == FOX_UNDEFINED_BITS)
+#define Fox_IsDouble(val)       (((val).m_uBits & FOX_QNAN) != FOX_QNAN)
+#define Fox_IsInt(val)          (((val).m_uBits & (FOX_QNAN | FOX_SIGN_BIT | FOX_INT_BIT)) == (FOX_QNAN | FOX_INT_BIT))
+#define Fox_IsNumber(val)       (Fox_IsDouble(val) || Fox_IsInt(val))
+#define Fox_IsObject(val)       (((val).m_uBits & (FOX_QNAN | FOX_SIGN_BIT)) == (FOX_QNAN | FOX_SIGN_BIT))
+#define Fox_IsUserData(val)     (((val).m_uBits & (FOX_QNAN | FOX_SIGN_BIT | FOX_USER_BIT)) == (FOX_QNAN | FOX_USER_BIT))
+
+// The accessors are defined here rather than in value.cpp so the compiler can
+// inline them into the interpreter loop.
+template <>
+inline bool Value::as<bool>()
+{
+    if (!Fox_IsBool(*this))
+        throw std::runtime_error("Invalid Type");
+    return m_uBits == FOX_TRUE_BITS;
+}
+
+template <>
+inline double Value::as<double>()
+{
+    if (Fox_IsDouble(*this))
+        return GetNumber();
+    if (!Fox_IsInt(*this))
+        throw std::runtime_error("Invalid Type");
+    return static_cast<double>(GetInt());
+}
+
+template <>
+inline float Value::as<float>()
+{
+    if (Fox_IsInt(*this))
+        return static_cast<float>(GetInt());
+    if (!Fox_IsDouble(*this))
+        throw std::runtime_error("Invalid Type");
+    return static_cast<int>(GetNumber());
+}
+
+template <>
+inline int Value::as<int>()
+{
+    if (Fox_IsInt(*this))
+        return GetInt();
+    if (!Fox_IsDouble(*this))
+        throw std::runtime_error("Invalid Type");
+    return static_cast<int>(GetNumber());
+}
+
+#else
+
 class Value
 {
 public:
@@ -93,21 +342,20 @@ public:
     
     Value(std::uint32_t value)
     {
-        type = VAL_NUMBER;
-        val.number = static_cast<double>(value);
+        SetInteger(static_cast<int64_t>(value));
     }
 
     Value(std::size_t value)
     {
-        type = VAL_NUMBER;
-        val.number = static_cast<double>(value);
+        if (value > static_cast<std::size_t>(INT32_MAX))
+            SetNumber(static_cast<double>(value));
+        else
+            SetInt(static_cast<int32_t>(value));
     }
 
     Value(int value)
     {
-        type = VAL_NUMBER;
-        val.number = static_cast<double>(value);
-        // type = VAL_INT;
+        SetInt(value);
     }
 
     Value(Object* value)
@@ -119,11 +367,61 @@ public:
     ~Value() = default;
     
     ValueType type;
+
+    ValueType GetType() const
+    {
+        return type;
+    }
+
+    static Value Undefined()
+    {
+        Value oValue;
+        oValue.type = VAL_UNDEFINED;
+        return oValue;
+    }
+
+    double GetNumber() const
+    {
+        return val.number;
+    }
+
+    int32_t GetInt() const
+    {
+        return val.integer;
+    }
+
+    Object* GetObject() const
+    {
+        return val.obj;
+    }
+
+    void SetNumber(double value)
+    {
+        type = VAL_NUMBER;
+        val.number = value;
+    }
+
+    void SetInt(int32_t value)
+    {
+        type = VAL_INT;
+        val.integer = value;
+    }
+
+    // Stores [value] as an integer if it fits in 32 bits, as a double
+    // otherwise.
+    void SetInteger(int64_t value)
+    {
+        if (value < INT32_MIN || value > INT32_MAX)
+            SetNumber(static_cast<double>(value));
+        else
+            SetInt(static_cast<int32_t>(value));
+    }
+
     // foxely::Any userdata;
     union {
         bool boolean;
         double number;
-        int integer;
+        int32_t integer;
         Object* obj;
         void* userdata;
         // ObjectString* string;
@@ -229,6 +527,18 @@ float Value::as<float>();
 template <>
 int Value::as<int>();
 
+#define Fox_IsBool(val)    ((val).type == VAL_BOOL)
+#define Fox_IsNil(val)     ((val).type == VAL_NIL)
+#define Fox_IsUndefined(val) ((val).type == VAL_UNDEFINED)
+#define Fox_IsDouble(val)  ((val).type == VAL_NUMBER)
+#define Fox_IsInt(val)     ((val).type == VAL_INT)
+#define Fox_IsNumber(val)  (Fox_IsDouble(val) || Fox_IsInt(val))
+#define Fox_IsObject(val)     ((val).type == VAL_OBJ)
+
+#define Fox_IsUserData(val)     ((val).type == VAL_USER)
+
+#endif
+
 bool ValuesEqual(Value a, Value b);
 void PrintValue(Value value, VM* pVm = nullptr);
 std::string ValueToString(Value value, VM* pVm = nullptr);
@@ -249,25 +559,16 @@ public:
     void WriteValueArray(Value value);
 };
 
-#define Fox_IsBool(val)    ((val).type == VAL_BOOL)
-#define Fox_IsNil(val)     ((val).type == VAL_NIL)
-#define Fox_IsNumber(val)  ((val).type == VAL_NUMBER)
-// #define Fox_IsInt(val)     ((val).type == VAL_INT)
-#define Fox_IsObject(val)     ((val).type != VAL_BOOL &&    \
-                                (val).type != VAL_NIL &&    \
-                                (val).type != VAL_USER &&    \
-                                (val).type != VAL_NUMBER )
-
-#define Fox_IsUserData(val)     ((val).type == VAL_USER)
 #define Fox_AsObject(val)     ((val).as<Object>())
 #define Fox_AsBool(val)    ((val).as<bool>())
 #define Fox_AsNumber(val)  ((val).as<double>())
-// #define Fox_AsInt(val)  ((val).as<int>())
+#define Fox_AsInt(val)  ((val).as<int>())
 
 #define Fox_Bool(val)           (Value(val))
 #define Fox_Nil                 (Value())
+#define Fox_Undefined           (Value::Undefined())
 #define Fox_Number(val)         (Value(val))
-// #define Fox_Int(val)            (Value(val))
+#define Fox_Int(val)            (Value(static_cast<int>(val)))
 #define Fox_Object(object)      (Value(object))
 
-#endif
\ No newline at end of file
+#endif
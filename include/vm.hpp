@@ -6,6 +6,7 @@
 #include <time.h>
 #include <utility>
 #include <map>
+#include <unordered_map>
 #include <memory>
 
 #include "chunk.hpp"
@@ -16,6 +17,8 @@
 class Parser;
 class Callable;
 class Table;
+struct Scheduler;
+class Isolate;
 
 // A handle to a value, basically just a linked list of extra GC roots.
 class Handle : public Object
@@ -27,6 +30,8 @@ public:
 	}
 	
   	Value value;
+
+	void markChildren(GC& gc) override;
 };
 
 typedef enum
@@ -34,7 +39,10 @@ typedef enum
 	INTERPRET_OK,
 	INTERPRET_COMPILE_ERROR,
 	INTERPRET_RUNTIME_ERROR,
-	INTERPRET_ABORT
+	INTERPRET_ABORT,
+	// A native suspended the running fiber (see scheduler.cpp). run() returns
+	// it to its caller, and running the fiber again resumes it after the call.
+	INTERPRET_SUSPEND
 } InterpretResult;
 
 using NativeMethods = std::map<std::string, NativeFn>;
@@ -62,6 +70,8 @@ public:
     void Concatenate();
 	bool CallValue(Value callee, int argCount);
 	bool CallFunction(ObjectClosure* closure, int argCount);
+	bool CompileLazy(ObjectFunction* pFunction);
+	void EnsureStack(ObjectFiber* pFiber, size_t iNeeded);
 	
 	void DefineLib(const std::string &strModule, const std::string &name, NativeMethods &functions);
 	void DefineBuiltIn(Table& methods, NativeMethods &functions);
@@ -82,18 +92,20 @@ public:
 	void AddValueToRoot(Value value);
 	void AddObjectToRoot(Object* object);
 	void AddCompilerToRoots();
-	void AddArrayToRoot(ValueArray* array);
-	void BlackenObject(Object* object);
 
 	// Class
 	void DefineOperator(ObjectString* name);
 	void DefineMethod(ObjectString* name);
 	bool BindMethod(ObjectClass* klass, ObjectString* name);
-	bool Invoke(ObjectString* name, int argCount);
-	bool InvokeFromClass(ObjectClass* klass, ObjectString* name, int argCount);
+	bool Invoke(ObjectString* name, int argCount, MethodCache* cache = nullptr);
+	bool InvokeFromClass(ObjectClass* klass, ObjectString* name, int argCount, MethodCache* cache = nullptr);
+	bool FindMethod(Table& methods, ObjectString* name, MethodCache* cache, Value& method);
+	Entry* LookupCached(InlineCache& cache, ObjectClass* klass, Table& table, ObjectString* name);
 
 	ObjectModule* GetModule(Value name);
-	ObjectClosure* CompileInModule(Value name, const std::string& source, bool isExpression, bool printErrors);
+	// [cachePath] is the .foxc file the module is loaded from when it is up to
+	// date, and written to otherwise. Empty if the module isn't cached on disk.
+	ObjectClosure* CompileInModule(Value name, const std::string& source, bool isExpression, bool printErrors, const std::string& cachePath = "");
 	Value FindVariable(ObjectModule* module, const char* name);
 	void GetVariable(const char* module, const char* name, int slot);
 	Value ImportModule(Value name);
@@ -129,6 +141,16 @@ public:
 	bool IsLogToken() const;
 	bool IsLogGC() const;
 	bool IsLogTrace() const;
+	bool IsLogCache() const;
+	bool IsLogProfile() const;
+	bool IsLazyCompile() const;
+
+	// Flushes every method call cache. Must be called whenever a method table
+	// that may already be cached is changed.
+	void InvalidateMethodCaches();
+
+	// Hands [function] to the JIT once the interpreter found it hot.
+	void CompileHotFunction(ObjectFunction* function);
 
 	template<typename T, typename... Args>
 	T* new_value(Args&&... args)
@@ -158,6 +180,15 @@ public:
 
 	GC gc;
 
+	// The run queue, timers and file descriptors of the scheduler module, if
+	// DefineSchedulerModule() added it.
+	ref<Scheduler> m_pScheduler;
+
+	// The isolate this VM runs in, if another VM started it (see isolate.hpp).
+	Isolate* m_pIsolate;
+	// The isolates started from this VM. They are joined when it goes away.
+	std::vector<ref<Isolate>> m_vIsolates;
+
 	int argc;
 	char** argv;
 
@@ -168,6 +199,33 @@ private:
 	bool m_bLogToken;
 	bool m_bLogGC;
 	bool m_bLogTrace;
+	bool m_bLogCache;
+	bool m_bLogProfile;
+
+	// Cleared by -jit=off to only run the interpreter.
+	bool m_bJit;
+
+	// Set by -lazy to only compile the functions that don't capture anything
+	// when they are first called, see Function() in Parser.cpp.
+	bool m_bLazyCompile;
+
+	// Bumped by InvalidateMethodCaches(), see MethodCache.
+	uint32_t m_uMethodEpoch = 1;
+
+#ifdef DEBUG
+	// Inline cache statistics, printed after each Interpret() with -lc.
+	uint64_t m_uCacheHits = 0;
+	uint64_t m_uCacheMisses = 0;
+
+	// Instruction pair and triple counts, printed after each Interpret() with
+	// -lp. They are what the superinstructions were picked from.
+	uint64_t m_vPairCounts[OP_TOTAL][OP_TOTAL] = {};
+	std::unordered_map<uint32_t, uint64_t> m_vTripleCounts;
+	uint8_t m_uPreviousInstructions[2] = { OP_TOTAL, OP_TOTAL };
+
+	void CountInstruction(uint8_t instruction);
+	void PrintInstructionProfile();
+#endif
 };
 
 struct ExpandType
@@ -284,7 +342,7 @@ inline Klass<T>* ObjectModule::klass(const std::string& name)
 {
     m_oVM.Push(Fox_Object(m_oVM.m_oParser.CopyString(name)));
     m_oVM.Push(Fox_Object(m_oVM.new_value<Klass<T>>(m_oVM, Fox_AsString(m_oVM.PeekStart(0)), *this)));
-    m_vVariables.Set(Fox_AsString(m_oVM.PeekStart(0)), m_oVM.PeekStart(1));
+    SetVariable(Fox_AsString(m_oVM.PeekStart(0)), m_oVM.PeekStart(1));
     Klass<T>* pKlass = m_oVM.Pop().as<Klass<T>>();
     m_oVM.Pop();
     return pKlass;
@@ -299,6 +357,7 @@ void Klass<T>::define_method(const std::string& name, NativeFn func)
     m_oVM.Push(m_oVM.NewString(name));
     m_oVM.Push(Fox_Object(m_oVM.new_value<ObjectNative>(func)));
     methods.Set(Fox_AsString(m_oVM.PeekStart(0)), m_oVM.PeekStart(1));
+    m_oVM.InvalidateMethodCaches();
     m_oVM.Pop();
     m_oVM.Pop();
 }
@@ -391,6 +450,7 @@ void Klass<T>::ctor()
 	m_oVM.Push(m_oVM.NewString("init"));
 	m_oVM.Push(Fox_Object(m_oVM.new_value<ObjectNative>(constructor)));
 	methods.Set(Fox_AsString(m_oVM.PeekStart(1)), m_oVM.PeekStart(2));
+	m_oVM.InvalidateMethodCaches();
 	m_oVM.Pop();
 	m_oVM.Pop();
 }
@@ -409,6 +469,7 @@ void Klass<T>::dtor()
 	m_oVM.Push(m_oVM.NewString("destroy"));
 	m_oVM.Push(Fox_Object(m_oVM.new_value<ObjectNative>(destructor)));
 	methods.Set(Fox_AsString(m_oVM.PeekStart(1)), m_oVM.PeekStart(2));
+	m_oVM.InvalidateMethodCaches();
 	m_oVM.Pop();
 	m_oVM.Pop();
 }
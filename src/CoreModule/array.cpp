@@ -50,6 +50,7 @@ Value setNative(VM* pVM, int argCount, Value* args)
         int index = Fox_IsNumber(args[0]);
         ObjectArray* array = Fox_AsArray(args[-1]);
         array->m_vValues[index] = args[1];
+        WriteBarrier(array, args[1]);
     }
     else
         Fox_RuntimeError(pVM, "Expected index number");
@@ -62,6 +63,7 @@ Value pushNative(VM* pVM, int argCount, Value* args)
     Fox_FixArity(pVM, argCount, 1);
     ObjectArray* array = Fox_AsArray(args[-1]);
     array->m_vValues.push_back(args[0]);
+    WriteBarrier(array, args[0]);
     return Fox_Nil;
 }
 
@@ -8,6 +8,9 @@ Value initNative(VM* pVM, int argCount, Value* args)
 {
     Fox_FixArity(pVM, argCount, 1);
     Fox_PanicIfNot(pVM, Fox_IsClosure(args[0]), "Expected a function.");
+    // The fiber starts at the first instruction of the function.
+    if (!pVM->CompileLazy(Fox_AsClosure(args[0])->function))
+        return Fox_Nil;
 
     return Fox_Object(pVM->gc.New<ObjectFiber>(Fox_AsClosure(args[0])));
 }
@@ -58,13 +61,14 @@ Value callNative(VM* pVM, int argCount, Value* args)
         pVM->m_pCurrentFiber->m_pStackTop--;
 
     if (pFiber->m_iFrameCount == 1 &&
-        pFiber->m_vFrames[0].ip == pFiber->m_vFrames[0].closure->function->chunk.m_vCode.begin())
+        pFiber->m_vFrames[0].closure->function->chunk.Offset(pFiber->m_vFrames[0].ip) == 0)
     {
         // The fiber is being started for the first time. If its function takes a
-        // parameter, bind an argument to it.
+        // parameter, bind an argument to it: the slot after the closure receives
+        // the result of this call once the extra slot above it is popped.
         if (pFiber->m_vFrames[0].closure->function->arity == 1)
         {
-            pFiber->m_pStackTop++;
+            pFiber->m_pStackTop += 2;
             pVM->m_pCurrentFiber = pFiber;
             return hasValue ? args[0] : Fox_Nil;
         }
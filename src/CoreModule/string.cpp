@@ -51,10 +51,12 @@ void DefineCoreString(VM* pVM)
 
             std::string& strObject = Fox_AsString(args[-1])->string;
             std::string& strDelimiter = Fox_AsString(args[0])->string;
-            ObjectArray* pArray = Fox_AsArray(Fox_NewArray(pVM));
-
             Fox_PanicIfNot(pVM, !strDelimiter.empty(), "String delimiter can't be empty.");
 
+            // Every new string may collect, keep the array on the stack.
+            ObjectArray* pArray = Fox_AsArray(Fox_NewArray(pVM));
+            pVM->Push(Fox_Object(pArray));
+
 
             size_t          lIdx;
             size_t          l;
@@ -73,11 +75,15 @@ void DefineCoreString(VM* pVM)
                         break;
                 }
                 pArray->m_vValues.push_back(Fox_NewString(pVM, strObject.substr(l, lIdx - l).c_str()));
+                WriteBarrier(pArray, pArray->m_vValues.back());
                 l = lIdx + 1;
             }
             if (l < strObject.size())
+            {
                 pArray->m_vValues.push_back(Fox_NewString(pVM, strObject.substr(l, strObject.size() - l).c_str()));
-            return Fox_Object(pArray);
+                WriteBarrier(pArray, pArray->m_vValues.back());
+            }
+            return pVM->Pop();
         }),
 
         std::make_pair<std::string, NativeFn>("replace", [](VM* pVM, int argc, Value* args)
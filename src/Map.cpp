@@ -57,8 +57,10 @@ static uint32_t hashObject(Object* pObject)
         // cannot use them as map keys.
         case OBJ_CLOSURE:
         {
+            // The code of a function compiled with -lazy only appears at its
+            // first call, so it can't be part of the hash.
             ObjectClosure* pClosure = (ObjectClosure *) pObject;
-            return hashNumber(pClosure->function->arity) ^ hashNumber(pClosure->function->chunk.m_vCode.size());
+            return hashBits((uint64_t) (uintptr_t) pClosure->function);
         }
 
         case OBJ_STRING:
@@ -76,11 +78,13 @@ static uint32_t hashValue(Value value)
 {
   // TODO: We'll probably want to randomize this at some point.
 
-    switch (value.type)
+    switch (value.GetType())
     {
         case VAL_BOOL:      return (Fox_AsBool(value) ? 1 : 0);
         case VAL_NIL:       return 1;
-        // case VAL_INT:       return hashInt(Fox_AsInt(value));
+        // Integers hash like the equivalent double so that 1 and 1.0 are
+        // the same key.
+        case VAL_INT:       return hashNumber(Fox_AsNumber(value));
         case VAL_NUMBER:    return hashNumber(Fox_AsNumber(value));
         case VAL_OBJ:       return hashObject(Fox_AsObject(value));
         default:            return -1;
@@ -91,6 +95,7 @@ static uint32_t hashValue(Value value)
 
 MapTable::MapTable()
 {
+    m_pOwner = NULL;
     m_iCount = 0;
     m_iCapacity = 0;
 
@@ -178,6 +183,10 @@ bool MapTable::Set(Value oKey, Value value)
 
     entry.m_oKey = oKey;
     entry.m_oValue = value;
+    if (m_pOwner != NULL) {
+        WriteBarrier(m_pOwner, oKey);
+        WriteBarrier(m_pOwner, value);
+    }
     return is_new_key;
 }
 
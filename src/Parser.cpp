@@ -2,7 +2,7 @@
 #include <cstdint>
 #include <cstring>
 #include <algorithm>
-#include "Lexer.h"
+#include <atomic>
 #include "Token.h"
 #include "Parser.h"
 #include "object.hpp"
@@ -25,8 +25,12 @@ Compiler::Compiler(Parser& parser, FunctionType eType, const std::string& name)
     enclosing = parser.currentCompiler;
     localCount = 0;
     scopeDepth = 0;
+    instructions[0] = instructions[1] = instructions[2] = -1;
+    pendingBytes = 0;
+    jumpTarget = 0;
     type = eType;
     function = parser.m_pVm->gc.New<ObjectFunction>();
+    function->module = parser.m_pVm->currentModule;
     parser.currentCompiler = this;
 
     if (eType != TYPE_SCRIPT) {
@@ -50,65 +54,6 @@ Parser::Parser(VM* pVm)
 	currentCompiler = NULL;
 	currentClass = NULL;
 
-    oLexer.Define(TOKEN_NEW_LINE,"\n", true);
-    oLexer.Define(TOKEN_WS,"[ \t\r\b]+", true);
-    oLexer.Define(TOKEN_NUMBER,"([0-9]+)|([0-9]+.[0-9]+)");
-    // oLexer.Define(TOKEN_INT,"[0-9]+");
-    oLexer.DefineArea(TOKEN_STRING,'"', '"');
-	oLexer.Define(TOKEN_PLUS, "\\+");
-    oLexer.Define(TOKEN_PLUS_PLUS, "\\+\\+");
-	oLexer.Define(TOKEN_MINUS, "-");
-    oLexer.Define(TOKEN_MINUS_MINUS, "--");
-    oLexer.Define(TOKEN_DOUBLE_COLON,"::");
-    oLexer.Define(TOKEN_COLON,":");
-    oLexer.Define(TOKEN_LEFT_PAREN,"\\(");
-    oLexer.Define(TOKEN_RIGHT_PAREN,"\\)");
-    oLexer.Define(TOKEN_LEFT_BRACE,"\\{");
-    oLexer.Define(TOKEN_RIGHT_BRACE,"\\}");
-    oLexer.Define(TOKEN_LEFT_BRACKET,"\\[");
-    oLexer.Define(TOKEN_RIGHT_BRACKET,"\\]");
-	oLexer.Define(TOKEN_DOT, "\\.");
-    oLexer.Define(TOKEN_SEMICOLON,";");
-    oLexer.Define(TOKEN_SLASH,"/");
-    oLexer.Define(TOKEN_COMMA,",");
-    oLexer.Define(TOKEN_STAR,"\\*");
-    oLexer.Define(TOKEN_GREATER,">");
-    oLexer.Define(TOKEN_GREATER_EQUAL,">=");
-    oLexer.Define(TOKEN_LESS, "<");
-    oLexer.Define(TOKEN_LESS_EQUAL, "<=");
-    oLexer.Define(TOKEN_NIL, "nil");
-    oLexer.Define(TOKEN_OR, "\\|\\|");
-    oLexer.Define(TOKEN_AND, "&&");
-    oLexer.Define(TOKEN_PRINT, "print");
-    oLexer.Define(TOKEN_SUPER, "super");
-    oLexer.Define(TOKEN_THIS, "this");
-    oLexer.Define(TOKEN_TRUE, "true");
-    oLexer.Define(TOKEN_FALSE, "false");
-    oLexer.Define(TOKEN_FOR, "for");
-    oLexer.Define(TOKEN_FUN, "func");
-    oLexer.Define(TOKEN_IF, "if");
-    oLexer.Define(TOKEN_IMPORT, "import");
-    oLexer.Define(TOKEN_RETURN, "return");
-    oLexer.Define(TOKEN_VAR, "var");
-    oLexer.Define(TOKEN_DOUBLE_DOT_EQUAL, ":=");
-    oLexer.Define(TOKEN_WHILE, "while");
-    oLexer.Define(TOKEN_SWITCH, "switch");
-    oLexer.Define(TOKEN_BANG, "!");
-    oLexer.Define(TOKEN_BANG_EQUAL, "!=");
-    oLexer.Define(TOKEN_CLASS, "class");
-    oLexer.Define(TOKEN_ELSE, "else");
-    oLexer.Define(TOKEN_IS, "is");
-    oLexer.Define(TOKEN_EQUAL, "=");
-    oLexer.Define(TOKEN_EQUAL_EQUAL, "==");
-    oLexer.Define(TOKEN_SHEBANG,"#[^\n\r]*", true);
-    oLexer.Define(TOKEN_IDENTIFIER,"[A-Za-z_]+[0-9]*");
-    oLexer.Define("Token Operator", "operator");
-
-    oLexer.Define(TOKEN_SINGLE_COMMENT,"//[^\n\r]*", true);
-    oLexer.Define("Token_Start_MultiComment","/\\*");
-    oLexer.Define("Token_End_MultiComment","\\*/");
-    oLexer.Define(TOKEN_EOF,"\\0");
-
     for (int i = 0; i < TOKEN_MAX; i++)
     {
         rules[i].prefix = NULL;
@@ -131,6 +76,12 @@ Parser::Parser(VM* pVm)
     rules[TOKEN_SEMICOLON] = { NULL, NULL, PREC_NONE };
     rules[TOKEN_SLASH] = { NULL, Binary, PREC_FACTOR };
     rules[TOKEN_STAR] = { NULL, Binary, PREC_FACTOR };
+    rules[TOKEN_AMPERSAND] = { NULL, Binary, PREC_BIT_AND };
+    rules[TOKEN_PIPE] = { NULL, Binary, PREC_BIT_OR };
+    rules[TOKEN_CARET] = { NULL, Binary, PREC_BIT_XOR };
+    rules[TOKEN_TILDE] = { Unary, NULL, PREC_NONE };
+    rules[TOKEN_GREATER_GREATER] = { NULL, Binary, PREC_SHIFT };
+    rules[TOKEN_LESS_LESS] = { NULL, Binary, PREC_SHIFT };
     rules[TOKEN_BANG] = { Unary, NULL, PREC_NONE };
     rules[TOKEN_BANG_EQUAL] = { NULL, Binary, PREC_EQUALITY };
     rules[TOKEN_EQUAL] = { NULL, NULL, PREC_NONE };
@@ -170,7 +121,7 @@ Parser::Parser(VM* pVm)
 
 bool Parser::IsEnd()
 {
-	return GetLexer().oTokenIterator == GetLexer().oTokenList.end();
+	return CurrentToken().m_oType == TOKEN_EOF;
 }
 
 void Parser::Advance()
@@ -185,28 +136,10 @@ void Parser::MarkInitialized()
     currentCompiler->locals[currentCompiler->localCount - 1].depth = currentCompiler->scopeDepth;
 }
 
-void Parser::RemoveComment()
-{
-    int iOpenComment = 0;
-    Lexer& oLex = GetLexer();
-    oLex.oTokenList.erase(std::remove_if(oLex.oTokenList.begin(), oLex.oTokenList.end(), [&iOpenComment](const Token& oToken)
-    {
-        bool bSuccess = iOpenComment == 1;
-        if (oToken.GetText() == "/*" && iOpenComment == 0) {
-            iOpenComment++;
-            bSuccess = true;
-        }
-        else if (oToken.GetText() == "*/" && iOpenComment == 1)
-            iOpenComment--;
-        return bSuccess;
-    }), oLex.oTokenList.end());
-}
-
 ObjectFunction* Compile(Parser& parser, const std::string& strText, Chunk* chunk)
 {
     if (!parser.Init(strText))
         return NULL;
-    parser.RemoveComment();
 
 	Compiler compiler(parser, TYPE_SCRIPT, "");
 	parser.compilingChunk = chunk;
@@ -215,7 +148,7 @@ ObjectFunction* Compile(Parser& parser, const std::string& strText, Chunk* chunk
 
 #if DEBUG
 	if (parser.m_pVm->IsLogToken())
-        helper::Dump(parser.GetLexer());
+        parser.DumpTokens();
  #endif
 
 	while (!parser.IsEnd()) {
@@ -238,7 +171,28 @@ void Parser::Consume(int oType, const char* message)
 
 void Parser::EmitByte(uint8_t byte)
 {
-    GetCurrentChunk()->WriteChunk(byte, PreviousToken().m_iLinesTraversed);
+	Compiler* compiler = currentCompiler;
+	Chunk* chunk = GetCurrentChunk();
+	int offset = chunk->m_vCode.size();
+
+	if (compiler->pendingBytes == 0)
+	{
+		// This byte is the opcode of a new instruction.
+		compiler->instructions[0] = compiler->instructions[1];
+		compiler->instructions[1] = compiler->instructions[2];
+		compiler->instructions[2] = offset;
+		compiler->pendingBytes = 1 + OperandSize(byte);
+	}
+	else if (offset == compiler->instructions[2] + 1 && chunk->m_vCode[offset - 1] == OP_CLOSURE)
+	{
+		// The upvalues of a closure follow its function.
+		Value function = chunk->m_oConstants.m_vValues[byte];
+		compiler->pendingBytes += 2 * Fox_AsFunction(function)->upValueCount;
+	}
+
+	chunk->WriteChunk(byte, PreviousToken().m_iLinesTraversed);
+	if (--compiler->pendingBytes == 0)
+		Peephole();
 }
 
 void Parser::EmitBytes(uint8_t byte1, uint8_t byte2)
@@ -247,6 +201,123 @@ void Parser::EmitBytes(uint8_t byte1, uint8_t byte2)
 	EmitByte(byte2);
 }
 
+/**
+ * @brief Appelée à chaque instruction complète, remplace les dernières
+ * instructions émises par une superinstruction quand elles forment une des
+ * séquences listées dans opcodes.h. Une séquence qui contient la cible d'un
+ * saut (voir MarkJumpTarget) n'est jamais fusionnée.
+ */
+void Parser::Peephole()
+{
+	Compiler* compiler = currentCompiler;
+	std::vector<uint8_t>& code = GetCurrentChunk()->m_vCode;
+	int first = compiler->instructions[0];
+	int previous = compiler->instructions[1];
+	int last = compiler->instructions[2];
+
+	if (previous < 0 || previous < compiler->jumpTarget)
+		return;
+
+	switch (code[last])
+	{
+		case OP_POP:
+			if (code[previous] == OP_SET_LOCAL)
+				Fuse(previous, OP_STORE_LOCAL, previous + 1, 1);
+			else if (code[previous] == OP_SET_MODULE_VAR)
+				Fuse(previous, OP_STORE_MODULE_VAR, previous + 1, 2);
+			// i++ as a statement: the old value it pushes is popped right away.
+			else if ((code[previous] == OP_INC_LOCAL || code[previous] == OP_DEC_LOCAL) &&
+					 first >= 0 && first >= compiler->jumpTarget && code[first] == OP_GET_LOCAL)
+				Fuse(first, code[previous], previous + 1, 4);
+			break;
+
+		case OP_STORE_LOCAL:
+			// The store stays in place, as the operands of the new instruction.
+			if ((code[previous] == OP_ADD_LOCAL_CONST || code[previous] == OP_SUB_LOCAL_CONST) &&
+				code[previous + 1] == code[last + 1])
+			{
+				code[previous] = code[previous] == OP_ADD_LOCAL_CONST ? OP_INC_LOCAL : OP_DEC_LOCAL;
+				compiler->instructions[2] = previous;
+				compiler->instructions[1] = first;
+				compiler->instructions[0] = -1;
+			}
+			break;
+
+		case OP_RETURN:
+			if (code[previous] == OP_GET_LOCAL)
+				Fuse(previous, OP_RETURN_LOCAL, previous + 1, 1);
+			// return f(...): the call is in tail position.
+			else if (code[previous] == OP_CALL)
+				code[previous] = OP_TAIL_CALL;
+			break;
+
+		case OP_GET_PROPERTY:
+			// The property name and cache stay where they are.
+			if (code[previous] == OP_GET_LOCAL)
+				Fuse(previous, OP_GET_LOCAL_PROPERTY, previous + 1, 4);
+			break;
+
+		case OP_LESS:
+		case OP_ADD:
+		case OP_SUB:
+		{
+			if (first < 0 || first < compiler->jumpTarget ||
+				code[first] != OP_GET_LOCAL || code[previous] != OP_CONST)
+				break;
+
+			// Their fallback for other operands assumes a number constant.
+			Value constant = GetCurrentChunk()->m_oConstants.m_vValues[code[previous + 1]];
+			if (code[last] == OP_LESS)
+				Fuse(first, OP_LESS_LOCAL_CONST, first + 1, 2);
+			else if (Fox_IsNumber(constant))
+				Fuse(first, code[last] == OP_ADD ? OP_ADD_LOCAL_CONST : OP_SUB_LOCAL_CONST, first + 1, 2);
+			break;
+		}
+	}
+}
+
+/**
+ * @brief Remplace le code à partir de start par instruction, suivie des
+ * opérandes des instructions d'origine sauf leurs opcodes
+ */
+void Parser::Fuse(int start, uint8_t instruction, int operandStart, int operandCount)
+{
+	Compiler* compiler = currentCompiler;
+	Chunk* chunk = GetCurrentChunk();
+	std::vector<uint8_t> operands;
+	int line = (*chunk->m_pLines)[start];
+
+	for (int i = operandStart; operands.size() < (size_t) operandCount; i++)
+	{
+		// Skip the opcode of the next instruction of the sequence.
+		if (i == compiler->instructions[1] || i == compiler->instructions[2])
+			continue;
+		operands.push_back(chunk->m_vCode[i]);
+	}
+
+	chunk->Truncate(start);
+	chunk->WriteChunk(instruction, line);
+	for (uint8_t operand : operands)
+		chunk->WriteChunk(operand, line);
+
+	compiler->instructions[1] = start == compiler->instructions[1] ? compiler->instructions[0] : -1;
+	compiler->instructions[0] = -1;
+	compiler->instructions[2] = start;
+
+	// The new instruction may start another sequence.
+	Peephole();
+}
+
+/**
+ * @brief Renvoie l'offset de la prochaine instruction, qui est la cible d'un
+ * saut en arrière : elle ne pourra pas être fusionnée avec les précédentes
+ */
+int Parser::MarkJumpTarget()
+{
+	currentCompiler->jumpTarget = GetCurrentChunk()->m_vCode.size();
+	return currentCompiler->jumpTarget;
+}
+
 void Parser::EmitConstant(Value value)
 {
   	EmitBytes(OP_CONST, MakeConstant(value));
@@ -272,6 +343,80 @@ int Parser::EmitJump(uint8_t instruction)
 	return GetCurrentChunk()->m_vCode.size() - 2;
 }
 
+/**
+ * @brief Émet le saut pris quand la condition qui vient d'être compilée est
+ * fausse. Si elle se termine par une comparaison, la comparaison et le saut
+ * sont fusionnés : la condition ne reste alors pas sur la pile et
+ * keepsCondition passe à false, sinon chaque branche doit la retirer
+ * @return l'offset du saut, à passer à PatchJump
+ */
+int Parser::EmitConditionJump(bool* keepsCondition)
+{
+	Compiler* compiler = currentCompiler;
+	std::vector<uint8_t>& code = GetCurrentChunk()->m_vCode;
+	int first = compiler->instructions[0];
+	int previous = compiler->instructions[1];
+	int last = compiler->instructions[2];
+	int start = last;
+	uint8_t instruction = OP_JUMP_IF_FALSE;
+	std::vector<uint8_t> operands;
+
+	if (last >= 0 && last >= compiler->jumpTarget)
+	{
+		switch (code[last])
+		{
+			case OP_LESS:
+				// i < n, on two locals.
+				if (first >= 0 && first >= compiler->jumpTarget &&
+					code[first] == OP_GET_LOCAL && code[previous] == OP_GET_LOCAL)
+				{
+					instruction = OP_JUMP_IF_NOT_LESS_LOCAL;
+					operands = { code[first + 1], code[previous + 1] };
+					start = first;
+				}
+				else
+					instruction = OP_JUMP_IF_NOT_LESS;
+				break;
+
+			case OP_GREATER:
+				instruction = OP_JUMP_IF_NOT_GREATER;
+				break;
+
+			case OP_LESS_LOCAL_CONST:
+				instruction = OP_JUMP_IF_NOT_LESS_LOCAL_CONST;
+				operands = { code[last + 1], code[last + 2] };
+				break;
+
+			case OP_NOT:
+				// >= and <= compile to LESS or GREATER, then NOT.
+				if (previous < 0 || previous < compiler->jumpTarget)
+					break;
+				if (code[previous] == OP_LESS)
+					instruction = OP_JUMP_IF_LESS;
+				else if (code[previous] == OP_GREATER)
+					instruction = OP_JUMP_IF_GREATER;
+				else
+					break;
+				start = previous;
+				break;
+		}
+	}
+
+	*keepsCondition = instruction == OP_JUMP_IF_FALSE;
+	if (*keepsCondition)
+		return EmitJump(OP_JUMP_IF_FALSE);
+
+	GetCurrentChunk()->Truncate(start);
+	compiler->instructions[0] = compiler->instructions[1] = compiler->instructions[2] = -1;
+
+	EmitByte(instruction);
+	for (uint8_t operand : operands)
+		EmitByte(operand);
+	EmitByte(0xff);
+	EmitByte(0xff);
+	return code.size() - 2;
+}
+
 void Parser::PatchJump(int offset)
 {
 	// -2 to adjust for the bytecode for the jump offset itself.
@@ -281,6 +426,7 @@ void Parser::PatchJump(int offset)
 	if (jump > UINT16_MAX) {
 		Error("Too much code to jump over.");
 	}
+	currentCompiler->jumpTarget = GetCurrentChunk()->m_vCode.size();
 
 	GetCurrentChunk()->m_vCode[offset] = (jump >> 8) & 0xff;
 	GetCurrentChunk()->m_vCode[offset + 1] = jump & 0xff;
@@ -299,6 +445,76 @@ void Parser::EmitLoop(int loopStart)
 	EmitByte(offset & 0xff);
 }
 
+/**
+ * @brief Retire le code émis depuis start et le place dans code et lines,
+ * pour le réémettre plus loin avec PasteCode. Les sauts qu'il contient sont
+ * relatifs, il ne doit simplement pas y en avoir qui sortent du code retiré
+ */
+void Parser::CutCode(int start, std::vector<uint8_t>& code, std::vector<int>& lines)
+{
+	Chunk* chunk = GetCurrentChunk();
+
+	code.assign(chunk->m_vCode.begin() + start, chunk->m_vCode.end());
+	lines.assign(chunk->m_pLines->begin() + start, chunk->m_pLines->end());
+	chunk->Truncate(start);
+	currentCompiler->instructions[0] = currentCompiler->instructions[1] = currentCompiler->instructions[2] = -1;
+}
+
+void Parser::PasteCode(const std::vector<uint8_t>& code, const std::vector<int>& lines)
+{
+	Chunk* chunk = GetCurrentChunk();
+
+	for (size_t i = 0; i < code.size(); i++)
+		chunk->WriteChunk(code[i], lines[i]);
+	// Nothing before the pasted code may be fused with what follows it.
+	currentCompiler->instructions[0] = currentCompiler->instructions[1] = currentCompiler->instructions[2] = -1;
+	currentCompiler->jumpTarget = chunk->m_vCode.size();
+}
+
+/**
+ * @brief Réserve un cache pour l'instruction qui vient d'être émise et écrit
+ * son index sur 2 bytes
+ */
+void Parser::EmitInlineCache()
+{
+	int cache = GetCurrentChunk()->AddInlineCache();
+
+	if (cache > UINT16_MAX)
+		Error("Too many property accesses in one chunk.");
+
+	EmitByte((cache >> 8) & 0xff);
+	EmitByte(cache & 0xff);
+}
+
+/**
+ * @brief Réserve un cache pour l'appel de méthode qui vient d'être émis et
+ * écrit son index sur 2 bytes
+ */
+void Parser::EmitMethodCache()
+{
+	int cache = GetCurrentChunk()->AddMethodCache();
+
+	if (cache > UINT16_MAX)
+		Error("Too many method calls in one chunk.");
+
+	EmitByte((cache >> 8) & 0xff);
+	EmitByte(cache & 0xff);
+}
+
+/**
+ * @brief Émet une instruction qui accède à une variable. L'index d'une
+ * variable de module est écrit sur 2 bytes, celui d'une locale ou d'une
+ * upvalue sur 1 byte
+ */
+void Parser::EmitVariable(uint8_t instruction, int arg)
+{
+	EmitByte(instruction);
+	if (instruction == OP_GET_MODULE_VAR || instruction == OP_SET_MODULE_VAR ||
+		instruction == OP_DEFINE_MODULE_VAR)
+		EmitByte((arg >> 8) & 0xff);
+	EmitByte(arg & 0xff);
+}
+
 uint8_t Parser::MakeConstant(Value value)
 {
 	m_pVm->Push(value);
@@ -316,6 +532,10 @@ ObjectFunction* Parser::EndCompiler()
 {
 	EmitReturn();
     ObjectFunction* func = currentCompiler->function;
+    // The closure and its parameters come first.
+    func->maxSlots = GetCurrentChunk()->MaxStack(1 + func->arity);
+    if (func->maxSlots < 0 && !hadError)
+        Error("Cannot work out the stack depth of the function.");
     #ifdef DEBUG_PRINT_CODE
     if (!hadError) {
         disassemble_chunk(GetCurrentChunk(), func->name != NULL ? func->name->string : "<script>");
@@ -372,16 +592,24 @@ void ParsePrecedence(Parser& parser, Precedence preced)
 
 void Number(Parser& parser, bool can_assign)
 {
-	double value = strtod(parser.PreviousToken().GetText().c_str(), NULL);
+    std::string strText = parser.PreviousToken().GetText();
+
+    // Les littéraux sans partie décimale sont des entiers, sauf s'ils ne
+    // tiennent pas sur 32 bits.
+    if (strText.find('.') == std::string::npos)
+    {
+        long long value = strtoll(strText.c_str(), NULL, 10);
+        if (value >= INT32_MIN && value <= INT32_MAX)
+        {
+            parser.EmitConstant(Fox_Int(value));
+            return;
+        }
+    }
+
+	double value = strtod(strText.c_str(), NULL);
 	parser.EmitConstant(Fox_Number(value));
 }
 
-// void IntNumber(Parser& parser, bool can_assign)
-// {
-// 	int value = std::stoi(parser.PreviousToken().GetText().c_str(), NULL);
-// 	parser.EmitConstant(Fox_Number(value));
-// }
-
 void Grouping(Parser& parser, bool can_assign)
 {
   	Expression(parser);
@@ -399,6 +627,9 @@ void Unary(Parser& parser, bool can_assign)
         case TOKEN_MINUS:
             parser.EmitByte(OP_NEGATE);
             break;
+        case TOKEN_TILDE:
+            parser.EmitByte(OP_BIT_NOT);
+            break;
         default:
             return;
     }
@@ -437,7 +668,7 @@ void Increment(Parser& parser, bool can_assign)
     // Si '++'/'--' est avant la variable alors SET la variable avec le bon SET qu'on a récupérer juste avant
     if (isBefore)
     {
-		parser.EmitBytes(set_op, (uint8_t) arg);
+		parser.EmitVariable(set_op, arg);
     }
 }
 
@@ -478,6 +709,21 @@ void Binary(Parser& parser, bool can_assign)
         case TOKEN_SLASH:
             parser.EmitByte(OP_DIV);
         break;
+        case TOKEN_AMPERSAND:
+            parser.EmitByte(OP_BIT_AND);
+            break;
+        case TOKEN_PIPE:
+            parser.EmitByte(OP_BIT_OR);
+            break;
+        case TOKEN_CARET:
+            parser.EmitByte(OP_BIT_XOR);
+            break;
+        case TOKEN_LESS_LESS:
+            parser.EmitByte(OP_SHIFT_LEFT);
+            break;
+        case TOKEN_GREATER_GREATER:
+            parser.EmitByte(OP_SHIFT_RIGHT);
+            break;
         case TOKEN_IS:
             parser.EmitByte(OP_IS);
             break;
@@ -533,12 +779,15 @@ void Dot(Parser& parser, bool can_assign)
     if (can_assign && parser.Match(TOKEN_EQUAL)) {
         Expression(parser);
         parser.EmitBytes(OP_SET_PROPERTY, name);
+        parser.EmitInlineCache();
     } else if (parser.Match(TOKEN_LEFT_PAREN)) {
         uint8_t arg_count = ArgumentList(parser);
         parser.EmitBytes(OP_INVOKE, name);
         parser.EmitByte(arg_count);
+        parser.EmitMethodCache();
     } else {
         parser.EmitBytes(OP_GET_PROPERTY, name);
+        parser.EmitInlineCache();
     }
 }
 
@@ -560,13 +809,16 @@ void RuleThis(Parser& parser, bool can_assign)
             uint8_t arg_count = ArgumentList(parser);
             parser.EmitBytes(OP_INVOKE, name);
             parser.EmitByte(arg_count);
+            parser.EmitMethodCache();
         } else if (parser.Match(TOKEN_EQUAL)) {
             Expression(parser);
             parser.EmitBytes(OP_SET_PROPERTY, name);
+            parser.EmitInlineCache();
         }
         else
         {
             parser.EmitBytes(OP_GET_PROPERTY, name);
+            parser.EmitInlineCache();
         }
     }
 }
@@ -587,6 +839,7 @@ void RuleSuper(Parser& parser, bool can_assign)
         NamedVariable(parser, Token("super", 5), false);
         parser.EmitBytes(OP_SUPER_INVOKE, name);
         parser.EmitByte(arg_count);
+        parser.EmitMethodCache();
     } else {
         NamedVariable(parser, Token("super", 5), false);
         parser.EmitBytes(OP_GET_SUPER, name);
@@ -611,11 +864,12 @@ void Variable(Parser& parser, bool can_assign)
 
 void Lambda(Parser& parser, bool can_assign)
 {
-    static std::size_t lId = 0;
-    Token name = Token(StringID(TOKEN_IDENTIFIER), "|_@mBd@" + std::to_string(lId), 7 + std::to_string(lId).size());
+    // Shared by the VMs of every thread, see isolate.hpp.
+    static std::atomic<std::size_t> lId(0);
+    std::size_t id = lId++;
+    Token name = Token(StringID(TOKEN_IDENTIFIER), "|_@mBd@" + std::to_string(id), 7 + std::to_string(id).size());
 	FuncDeclaration(parser, name);
     NamedVariable(parser, name, can_assign);
-    lId++;
 }
 
 void String(Parser& parser, bool can_assign)
@@ -653,6 +907,8 @@ void List(Parser& parser, bool canAssign)
     if (!parser.IsToken(TOKEN_RIGHT_BRACKET, false))
     {
         do {
+            if (args == 255)
+                parser.Error("Cannot have more than 255 elements in a list.");
             args++;
             Expression(parser);
 
@@ -672,6 +928,8 @@ void Map(Parser& parser, bool canAssign)
     if (!parser.IsToken(TOKEN_RIGHT_BRACE, false))
     {
         do {
+            if (args == 255)
+                parser.Error("Cannot have more than 255 entries in a map.");
             args++;
             Expression(parser);
             parser.Consume(TOKEN_COLON, "Expected ':'");
@@ -783,24 +1041,24 @@ int NamedVariable(Parser& parser, Token name, bool can_assign, uint8_t* pGetOp,
 	    get_op = OP_GET_UPVALUE;
 	    set_op = OP_SET_UPVALUE;
 	} else {
-		arg = parser.IdentifierConstant(name);
-		get_op = OP_GET_GLOBAL;
-		set_op = OP_SET_GLOBAL;
+		arg = parser.ModuleVariable(name);
+		get_op = OP_GET_MODULE_VAR;
+		set_op = OP_SET_MODULE_VAR;
 	}
 
     if (can_assign && parser.Match(TOKEN_EQUAL)) {
 		Expression(parser);
-		parser.EmitBytes(set_op, (uint8_t) arg);
+		parser.EmitVariable(set_op, arg);
 	}
     else if (can_assign && (parser.PeekTokenIsType(TOKEN_PLUS_PLUS) ||
                             parser.PeekTokenIsType(TOKEN_MINUS_MINUS))) {
-		parser.EmitBytes(get_op, (uint8_t) arg);
-		parser.EmitBytes(get_op, (uint8_t) arg);
+		parser.EmitVariable(get_op, arg);
+		parser.EmitVariable(get_op, arg);
 		Expression(parser);
-		parser.EmitBytes(set_op, (uint8_t) arg);
+		parser.EmitVariable(set_op, arg);
 		parser.EmitByte(OP_POP);
 	} else
-		parser.EmitBytes(get_op, (uint8_t) arg);
+		parser.EmitVariable(get_op, arg);
     
     if (pGetOp)
         *pGetOp = get_op;
@@ -826,24 +1084,23 @@ void DeclareVariable(Parser& parser, Token name)
     AddLocal(parser, name);
 }
 
-uint8_t ParseVariable(Parser& parser, Token& name, const char *msg)
+int ParseVariable(Parser& parser, Token& name, const char *msg)
 {
 	DeclareVariable(parser, name);
 
   	if (parser.currentCompiler->scopeDepth > 0)
 		return 0;
 
-	uint8_t name_id = parser.IdentifierConstant(name);
-    return name_id;
+    return parser.ModuleVariable(name);
 }
 
-void DefineVariable(Parser& parser, uint8_t global)
+void DefineVariable(Parser& parser, int global)
 {
     if (parser.currentCompiler->scopeDepth > 0) {
         parser.MarkInitialized();
         return;
     }
-    parser.EmitBytes(OP_DEFINE_GLOBAL, global);
+    parser.EmitVariable(OP_DEFINE_MODULE_VAR, global);
 }
 
 /*
@@ -853,7 +1110,7 @@ void DefineVariable(Parser& parser, uint8_t global)
 */
 void VarDeclaration(Parser& parser, Token name)
 {
-    uint8_t global = ParseVariable(parser, name, "Expect variable name.");
+    int global = ParseVariable(parser, name, "Expect variable name.");
 
     // if (parser.Match(TOKEN_EQUAL)) {
         Expression(parser);
@@ -877,22 +1134,95 @@ void VarDeclaration(Parser& parser, Token name)
 */
 void FuncDeclaration(Parser& parser, Token name)
 {
-	uint8_t global = ParseVariable(parser, name, "Expect function name.");
+	int global = ParseVariable(parser, name, "Expect function name.");
 	parser.MarkInitialized();
 	Function(parser, TYPE_FUNCTION, name);
 	DefineVariable(parser, global);
 }
 
+static bool SkipFunction(Parser& parser, LazyFunction& lazy, int& arity, int& minArity);
+static void CompileFunction(Parser& parser, FunctionType type, const Token& name);
+static void FunctionBody(Parser& parser);
+
 /*
  * @brief Cette fonction permet d'initializer une fonction
  * @param parser c'est la ref vers le parser
  * @param type c'est le type de fonction (voir l'enum FunctionType)
  * @param name c'est le nom de la fonction
  * @return true si les deux sont égaux sinon false dans le cas contraire
+ * @note Avec -lazy, une fonction qui ne capture aucune variable n'est
+ * compilée qu'à son premier appel (voir SkipFunction et CompileLazy)
 */
 void Function(Parser& parser, FunctionType type, const Token& name)
+{
+	// The name of a method is the previous token, which skipping or replaying
+	// the body changes.
+	const Token oName = name;
+	if (parser.m_pVm->IsLazyCompile())
+	{
+		ref<LazyFunction> lazy = new_ref<LazyFunction>();
+		lazy->type = type;
+		lazy->inClass = parser.currentClass != NULL;
+		int arity = 0;
+		int minArity = 0;
+		if (SkipFunction(parser, *lazy, arity, minArity))
+		{
+			ObjectFunction* function = parser.m_pVm->gc.New<ObjectFunction>();
+			function->module = parser.m_pVm->currentModule;
+			function->arity = arity;
+			function->iMinArity = minArity;
+			function->iMaxArity = arity;
+			function->lazy = lazy;
+			parser.m_pVm->Push(Fox_Object(function));
+			function->name = parser.CopyString(oName.GetText());
+			parser.m_pVm->Pop();
+			parser.EmitBytes(OP_CLOSURE, parser.MakeConstant(Fox_Object(function)));
+			return;
+		}
+
+		// It refers to variables of the enclosing functions, which it has to
+		// capture now: compile it from the tokens it was skipped with.
+		if (!lazy->tokens.empty())
+		{
+			TokenReplay saved;
+			parser.BeginReplay(lazy->tokens, saved);
+			CompileFunction(parser, type, oName);
+			parser.EndReplay(saved);
+			return;
+		}
+	}
+	CompileFunction(parser, type, oName);
+}
+
+/*
+ * @brief Cette fonction compile la liste des paramètres et le corps d'une
+ * fonction, et émet la closure qui la crée
+ * @param parser c'est la ref vers le parser
+ * @param type c'est le type de fonction (voir l'enum FunctionType)
+ * @param name c'est le nom de la fonction
+*/
+static void CompileFunction(Parser& parser, FunctionType type, const Token& name)
 {
 	Compiler compiler(parser, type, name.GetText());
+	FunctionBody(parser);
+
+	// Create the function object.
+	ObjectFunction* function = parser.EndCompiler();
+	parser.EmitBytes(OP_CLOSURE, parser.MakeConstant(Fox_Object(function)));
+	for (int i = 0; i < function->upValueCount; i++)
+	{
+	    parser.EmitByte(compiler.upvalues[i].isLocal ? 1 : 0);
+	    parser.EmitByte(compiler.upvalues[i].index);
+	}
+}
+
+/*
+ * @brief Cette fonction compile la liste des paramètres et le corps de la
+ * fonction du compiler en cours
+ * @param parser c'est la ref vers le parser
+*/
+static void FunctionBody(Parser& parser)
+{
 	parser.BeginScope();
 
 	// Compile the parameter list.
@@ -907,7 +1237,7 @@ void Function(Parser& parser, FunctionType type, const Token& name)
 				parser.ErrorAtCurrent("Cannot have more than 255 parameters.");
 			parser.Consume(TOKEN_IDENTIFIER, "Expect parameter name.");
 			Token& name = (Token&) parser.PreviousToken();
-			uint8_t paramConstant = ParseVariable(parser, name, "Expect parameter name.");
+			int paramConstant = ParseVariable(parser, name, "Expect parameter name.");
 
             if (parser.Match(TOKEN_EQUAL))
             {
@@ -922,15 +1252,153 @@ void Function(Parser& parser, FunctionType type, const Token& name)
 	// The body.
 	parser.Consume(TOKEN_LEFT_BRACE, "Expect '{' before function body.");
 	Block(parser);
+}
 
-	// Create the function object.
-	ObjectFunction* function = parser.EndCompiler();
-	parser.EmitBytes(OP_CLOSURE, parser.MakeConstant(Fox_Object(function)));
-	for (int i = 0; i < function->upValueCount; i++)
+/*
+ * @brief Cette fonction renvoie true si [name] est une variable locale d'une
+ * des fonctions en cours de compilation, que la fonction qui la référence
+ * devrait capturer
+ * @param parser c'est la ref vers le parser
+ * @param name c'est le nom de la variable
+*/
+static bool IsEnclosingLocal(Parser& parser, Token name)
+{
+	for (Compiler* compiler = parser.currentCompiler; compiler != NULL; compiler = compiler->enclosing)
 	{
-	    parser.EmitByte(compiler.upvalues[i].isLocal ? 1 : 0);
-	    parser.EmitByte(compiler.upvalues[i].index);
+		for (int i = 0; i < compiler->localCount; i++)
+		{
+			if (IdentifiersEqual(name, compiler->locals[i].name))
+				return true;
+		}
+	}
+	return false;
+}
+
+/*
+ * @brief Cette fonction saute la liste des paramètres et le corps de la
+ * fonction sur laquelle est le parser, en copiant leurs tokens dans
+ * [lazy.tokens], pour qu'elle soit compilée à son premier appel
+ * @param parser c'est la ref vers le parser
+ * @param lazy reçoit les tokens de la fonction
+ * @param[out] arity reçoit le nombre de paramètres
+ * @param[out] minArity reçoit le nombre de paramètres sans valeur par défaut
+ * @return false si la fonction ne peut pas être compilée plus tard, parce
+ * qu'elle capture une variable locale, 'this' ou 'super', ou qu'elle est mal
+ * formée. Les tokens déjà sautés sont alors dans [lazy.tokens].
+ * @note La recherche des variables capturées est prudente : un identifiant
+ * qui a le nom d'une variable locale suffit, même s'il désigne autre chose.
+*/
+static bool SkipFunction(Parser& parser, LazyFunction& lazy, int& arity, int& minArity)
+{
+	if (!parser.PeekTokenIsType(TOKEN_LEFT_PAREN))
+		return false;
+
+	bool deferrable = true;
+	int depth = 0;
+	int groups = 0;
+	int previous = TOKEN_EOF;
+	while (groups < 2)
+	{
+		Token token = parser.CurrentToken();
+		int type = token.m_oType.m_id;
+		if (type == TOKEN_EOF)
+			break;
+		lazy.tokens.push_back(token);
+
+		switch (type)
+		{
+			case TOKEN_LEFT_PAREN:
+			case TOKEN_LEFT_BRACE:
+			case TOKEN_LEFT_BRACKET:
+				depth++;
+				break;
+			case TOKEN_RIGHT_PAREN:
+			case TOKEN_RIGHT_BRACE:
+			case TOKEN_RIGHT_BRACKET:
+				// The parameter list, then the body.
+				if (--depth <= 0)
+				{
+					depth = 0;
+					groups++;
+				}
+				break;
+			case TOKEN_SUPER:
+				deferrable = false;
+				break;
+			case TOKEN_THIS:
+				// Only a method has its own 'this'.
+				if (lazy.type == TYPE_FUNCTION)
+					deferrable = false;
+				break;
+			case TOKEN_IDENTIFIER:
+				if (groups == 0 && depth == 1 && (previous == TOKEN_LEFT_PAREN || previous == TOKEN_COMMA))
+				{
+					arity++;
+					minArity++;
+				}
+				if (previous != TOKEN_DOT && IsEnclosingLocal(parser, token))
+					deferrable = false;
+				break;
+			case TOKEN_EQUAL:
+				// A default value.
+				if (groups == 0 && depth == 1 && previous == TOKEN_IDENTIFIER)
+					minArity--;
+				break;
+		}
+		previous = type;
+		parser.Advance();
 	}
+
+	Token end(StringID(TOKEN_EOF), "", 0);
+	end.m_iLinesTraversed = parser.PreviousToken().m_iLinesTraversed;
+	lazy.tokens.push_back(end);
+	return deferrable && groups == 2 && arity <= 255;
+}
+
+/*
+ * @brief Cette fonction compile une fonction dont la compilation a été
+ * repoussée à son premier appel (voir Function), à partir de ses tokens
+ * @param parser c'est la ref vers le parser
+ * @param function c'est la fonction, qui reçoit le code compilé
+ * @return false si la fonction ne compile pas
+*/
+bool CompileLazy(Parser& parser, ObjectFunction* function)
+{
+	const LazyFunction& lazy = *function->lazy;
+
+	// A function is only called at runtime, so nothing is being compiled:
+	// the function is compiled on its own, with no enclosing function.
+	Compiler* enclosing = parser.currentCompiler;
+	ClassCompiler* enclosingClass = parser.currentClass;
+	parser.currentCompiler = NULL;
+	Token className;
+	ClassCompiler classCompiler(className);
+	classCompiler.enclosing = NULL;
+	classCompiler.hasSuperclass = false;
+	parser.currentClass = lazy.inClass ? &classCompiler : NULL;
+	parser.hadError = false;
+	parser.panicMode = false;
+
+	TokenReplay saved;
+	parser.BeginReplay(lazy.tokens, saved);
+	Compiler compiler(parser, lazy.type, function->name->string);
+	FunctionBody(parser);
+	ObjectFunction* compiled = parser.EndCompiler();
+	parser.EndReplay(saved);
+
+	parser.currentCompiler = enclosing;
+	parser.currentClass = enclosingClass;
+	if (parser.hadError)
+		return false;
+
+	// The closures that were already created refer to [function].
+	std::swap(function->chunk, compiled->chunk);
+	function->arity = compiled->arity;
+	function->iMinArity = compiled->iMinArity;
+	function->iMaxArity = compiled->iMaxArity;
+	function->maxSlots = compiled->maxSlots;
+	function->lazy = nullptr;
+	return true;
 }
 
 void Procedure(Parser& parser)
@@ -1159,6 +1627,21 @@ uint8_t Parser::IdentifierConstant(const Token& name)
   	return MakeConstant(Fox_Object(CopyString(name.GetText())));
 }
 
+/**
+ * @brief Cette fonction renvoie l'index de la variable de module [name],
+ * en la déclarant si le module ne la connait pas encore
+ * @param name le nom de la variable
+ * @return l'index de la variable dans le module en cours de compilation
+ */
+int Parser::ModuleVariable(const Token& name)
+{
+	int slot = m_pVm->currentModule->DeclareVariable(CopyString(name.GetText()));
+
+	if (slot > UINT16_MAX)
+		Error("Too many variables in one module.");
+	return slot;
+}
+
 /*
  * @brief Cette fonction permet de comparer le nom de deux Identifiers
  * @param a le Token qui sera comparé
@@ -1224,10 +1707,10 @@ void Method(Parser& parser)
 void ClassDeclaration(Parser& parser, Token& name)
 {
 	uint8_t nameConstant = parser.IdentifierConstant(name);
-	DeclareVariable(parser, name);
+	int global = ParseVariable(parser, name, "Expect class name.");
 
 	parser.EmitBytes(OP_CLASS, nameConstant);
-	DefineVariable(parser, nameConstant);
+	DefineVariable(parser, global);
 
 	ClassCompiler classCompiler(name);
 	classCompiler.enclosing = parser.currentClass;
@@ -5,48 +5,68 @@
 ** Created by besseausamuel
 */
 
-#include "Lexer.h"
 #include "Token.h"
 #include "ParserHelper.h"
+#include "scanner.hpp"
+#include <cstdio>
 #include <cstring>
 
 bool ParserHelper::Init(const std::string& str)
 {
-    if (!oLexer.Process(str))
-        return false;
-
-    oLexer.Begin();
+    m_vTokens.clear();
+    ScanTokens(str, m_vTokens);
+    m_pTokens = &m_vTokens;
+    m_iNext = 0;
     NextToken();
 
     return true;
 }
 
-void ParserHelper::Define(const std::string& strId, const std::string& strValue, bool bAddInTrash)
+void ParserHelper::DumpTokens() const
 {
-    oLexer.Define(strId, strValue, bAddInTrash);
-}
-
-Lexer& ParserHelper::GetLexer()
-{
-    return oLexer;
-}
-
-const Lexer& ParserHelper::GetLexer() const
-{
-    return oLexer;
+    for (const Token& oToken : m_vTokens)
+        printf("%4d %2d '%s'\n", oToken.m_iLinesTraversed, oToken.m_oType.m_id, oToken.GetText().c_str());
 }
 
 void ParserHelper::NextToken()
 {
 	oPreviousToken = CurrentToken();
     for (;;) {
-		oCurrentToken = oLexer.NextToken();
+        // The last token is a TOKEN_EOF, which is read again and again.
+		oCurrentToken = (*m_pTokens)[m_iNext];
+        if (m_iNext + 1 < m_pTokens->size())
+            m_iNext++;
         if (oCurrentToken.m_oType != 84)
             break;
         ErrorAtCurrent(CurrentToken().GetText().c_str());
     }
 }
 
+void ParserHelper::BeginReplay(const std::vector<Token>& vTokens, TokenReplay& oSaved)
+{
+    oSaved.m_pTokens = m_pTokens;
+    oSaved.m_iNext = m_iNext;
+    oSaved.m_oCurrent = oCurrentToken;
+    oSaved.m_oPrevious = oPreviousToken;
+
+    m_pTokens = &vTokens;
+    m_iNext = 0;
+    NextToken();
+}
+
+void ParserHelper::EndReplay(const TokenReplay& oSaved)
+{
+    m_pTokens = oSaved.m_pTokens;
+    m_iNext = oSaved.m_iNext;
+    oCurrentToken = oSaved.m_oCurrent;
+    oPreviousToken = oSaved.m_oPrevious;
+}
+
+bool ParserHelper::IsReplaying() const
+{
+    return m_pTokens != &m_vTokens;
+}
+
 const Token& ParserHelper::PreviousToken() const
 {
     return oPreviousToken;
@@ -59,8 +79,7 @@ const Token& ParserHelper::CurrentToken() const
 
 void ParserHelper::AdvanceToken(const token_advance_mode mode)
 {
-	std::string errorType = std::string("ERROR");
-    if (CurrentToken().m_oType == errorType)
+    if (CurrentToken().m_oType == 84)
     {
         ErrorAtCurrent(CurrentToken().GetText().c_str());
         return;
@@ -94,7 +113,7 @@ bool ParserHelper::IsToken(int iType, bool bAdvance)
 
 bool ParserHelper::IsToken(const std::string& strValue, bool bAdvance)
 {
-    if (oLexer.TokenMatch(oCurrentToken, strValue))
+    if (oCurrentToken.GetText() == strValue)
     {
         if (bAdvance)
         	NextToken();
@@ -106,7 +125,7 @@ bool ParserHelper::IsToken(const std::string& strValue, bool bAdvance)
 
 bool ParserHelper::IsToken(const std::string& strType, const std::string& strValue, bool bAdvance)
 {
-    if (oCurrentToken.m_oType == strType && oLexer.TokenMatch(oCurrentToken, strValue))
+    if (oCurrentToken.m_oType == strType && oCurrentToken.GetText() == strValue)
     {
         if (bAdvance)
         	NextToken();
@@ -117,7 +136,7 @@ bool ParserHelper::IsToken(const std::string& strType, const std::string& strVal
 
 bool ParserHelper::IsToken(const std::string& strType, const char* strValue, bool bAdvance)
 {
-    if (oCurrentToken.m_oType == strType && oLexer.TokenMatch(oCurrentToken, strValue))
+    if (oCurrentToken.m_oType == strType && oCurrentToken.GetText() == strValue)
     {
         if (bAdvance)
         	NextToken();
@@ -128,7 +147,7 @@ bool ParserHelper::IsToken(const std::string& strType, const char* strValue, boo
 
 bool ParserHelper::IsToken(int iType, const std::string& strValue, bool bAdvance)
 {
-    if (oCurrentToken.m_oType == iType && oLexer.TokenMatch(oCurrentToken, strValue))
+    if (oCurrentToken.m_oType == iType && oCurrentToken.GetText() == strValue)
     {
         if (bAdvance)
         	NextToken();
@@ -139,7 +158,7 @@ bool ParserHelper::IsToken(int iType, const std::string& strValue, bool bAdvance
 
 bool ParserHelper::IsToken(int iType, const char* strValue, bool bAdvance)
 {
-    if (oCurrentToken.m_oType == iType && oLexer.TokenMatch(oCurrentToken, strValue))
+    if (oCurrentToken.m_oType == iType && oCurrentToken.GetText() == strValue)
     {
         if (bAdvance)
         	NextToken();
@@ -162,7 +181,7 @@ bool ParserHelper::IsTokenThenAssign(const std::string& strType, Token& oToken,
 
 bool ParserHelper::IsTokenThenAssign(const std::string& strType, const char* strValue, Token& oToken, bool bAdvance)
 {
-    if (oCurrentToken.m_oType == strType && oLexer.TokenMatch(oCurrentToken, strValue))
+    if (oCurrentToken.m_oType == strType && oCurrentToken.GetText() == strValue)
     {
         oToken = oCurrentToken;
         if (bAdvance)
@@ -188,7 +207,7 @@ bool ParserHelper::IsTokenThenAssign(const std::string& strType, Container<Token
 template <typename Allocator, template <typename, typename> class Container>
 bool ParserHelper::IsTokenThenAssign(const std::string& strType, const char* strValue, Container<Token&, Allocator>& oTokenList, bool bAdvance)
 {
-    if (oCurrentToken.m_oType == strType && oLexer.TokenMatch(oCurrentToken, strValue))
+    if (oCurrentToken.m_oType == strType && oCurrentToken.GetText() == strValue)
     {
         oTokenList.push_back(oCurrentToken.GetText());
         if (bAdvance)
@@ -213,7 +232,7 @@ bool ParserHelper::IsTokenThenAssign(int iType, Token& oToken, bool bAdvance)
 
 bool ParserHelper::IsTokenThenAssign(int iType, const char* strValue, Token& oToken, bool bAdvance)
 {
-    if (oCurrentToken.m_oType == iType && oLexer.TokenMatch(oCurrentToken, strValue))
+    if (oCurrentToken.m_oType == iType && oCurrentToken.GetText() == strValue)
     {
         oToken = oCurrentToken;
         if (bAdvance)
@@ -239,7 +258,7 @@ bool ParserHelper::IsTokenThenAssign(int iType, Container<Token&, Allocator>& oT
 template <typename Allocator, template <typename, typename> class Container>
 bool ParserHelper::IsTokenThenAssign(int iType, const char* strValue, Container<Token&, Allocator>& oTokenList, bool bAdvance)
 {
-    if (oCurrentToken.m_oType == iType && oLexer.TokenMatch(oCurrentToken, strValue))
+    if (oCurrentToken.m_oType == iType && oCurrentToken.GetText() == strValue)
     {
         oTokenList.push_back(oCurrentToken.GetText());
         if (bAdvance)
@@ -261,12 +280,12 @@ bool ParserHelper::PeekTokenIsType(int iType)
 
 bool ParserHelper::PeekNextTokenIsType(int iType)
 {
-    return (oLexer.PeekNextToken().m_oType == iType);
+    return ((*m_pTokens)[m_iNext].m_oType == iType);
 }
 
 bool ParserHelper::PeekTokenIs(const std::string& s)
 {
-    return (oLexer.TokenMatch(CurrentToken(), s));
+    return (CurrentToken().GetText() == s);
 }
 
 void ParserHelper::ErrorAtCurrent(const char* message)
@@ -286,8 +305,7 @@ void ParserHelper::ErrorAt(const Token& token, const char* message)
     panicMode = true;
     fprintf(stderr, "[line %d] Error", token.m_iLinesTraversed);
 
-	std::string errorType = std::string("ERROR");
-    if (token.m_oType != errorType) {
+    if (token.m_oType != 84) {
         fprintf(stderr, " at '%s'", token.m_strText.c_str());
     }
 
@@ -47,17 +47,20 @@ void ReturnStatement(Parser& parser)
 
 void IfStatement(Parser& parser)
 {
+    bool keeps_condition;
     parser.Consume(TOKEN_LEFT_PAREN, "Expect '(' after 'if'.");
     Expression(parser);
     parser.Consume(TOKEN_RIGHT_PAREN, "Expect ')' after condition.");
 
-    int then_jump = parser.EmitJump(OP_JUMP_IF_FALSE);
-    parser.EmitByte(OP_POP);
+    int then_jump = parser.EmitConditionJump(&keeps_condition);
+    if (keeps_condition)
+        parser.EmitByte(OP_POP);
     Statement(parser);
 
     int else_jump = parser.EmitJump(OP_JUMP);
     parser.PatchJump(then_jump);
-    parser.EmitByte(OP_POP);
+    if (keeps_condition)
+        parser.EmitByte(OP_POP);
 
     if (parser.Match(TOKEN_ELSE))
         Statement(parser);
@@ -73,6 +76,7 @@ void ImportStatement(Parser& parser)
 
     parser.Consume(TOKEN_SEMICOLON, "Expect ';' after import.");
     parser.EmitBytes(OP_IMPORT, import_constant);
+    parser.EmitByte(OP_POP);
 }
 
 void PrintStatement(Parser& parser)
@@ -107,39 +111,43 @@ void ExpressionStatement(Parser& parser)
 
 void WhileStatement(Parser& parser)
 {
-    int loop_start = parser.GetCurrentChunk()->m_iCount;
+    bool keeps_condition;
+    int loop_start = parser.MarkJumpTarget();
     parser.Consume(TOKEN_LEFT_PAREN, "Expect '(' after 'while'.");
     Expression(parser);
     parser.Consume(TOKEN_RIGHT_PAREN, "Expect ')' after condition.");
 
-    int exit_jump = parser.EmitJump(OP_JUMP_IF_FALSE);
-    parser.EmitByte(OP_POP);
+    int exit_jump = parser.EmitConditionJump(&keeps_condition);
+    if (keeps_condition)
+        parser.EmitByte(OP_POP);
     Statement(parser);
     parser.EmitLoop(loop_start);
     parser.PatchJump(exit_jump);
-    parser.EmitByte(OP_POP);
+    if (keeps_condition)
+        parser.EmitByte(OP_POP);
 }
 
-void for_loop(Parser& parser, int *exit_jump)
+void for_loop(Parser& parser, int *exit_jump, bool *keeps_condition)
 {
     Expression(parser);
     parser.Consume(TOKEN_SEMICOLON, "Expect ';' after loop condition.");
 
-    *exit_jump = parser.EmitJump(OP_JUMP_IF_FALSE);
-    parser.EmitByte(OP_POP);
+    *exit_jump = parser.EmitConditionJump(keeps_condition);
+    if (*keeps_condition)
+        parser.EmitByte(OP_POP);
 }
 
-void for_increment(Parser& parser, int *loop_start)
+// The increment is compiled before the body but runs after it, so its code is
+// cut out here and pasted back once the body is compiled. That saves the jumps
+// around it on every iteration.
+void for_increment(Parser& parser, std::vector<uint8_t> *code, std::vector<int> *lines)
 {
-    int body_jump = parser.EmitJump(OP_JUMP);
-    int increment_start = parser.GetCurrentChunk()->m_vCode.size();
+    int increment_start = parser.MarkJumpTarget();
 
     Expression(parser);
     parser.EmitByte(OP_POP);
     parser.Consume(TOKEN_RIGHT_PAREN, "Expect ')' after for clauses.");
-    parser.EmitLoop(*loop_start);
-    *loop_start = increment_start;
-    parser.PatchJump(body_jump);
+    parser.CutCode(increment_start, *code, *lines);
 }
 
 void ForStatement(Parser& parser)
@@ -152,25 +160,30 @@ void ForStatement(Parser& parser)
     } else {
         ExpressionStatement(parser);
     }
-    int loop_start = parser.GetCurrentChunk()->m_vCode.size();
+    int loop_start = parser.MarkJumpTarget();
 	int exit_jump = -1;
+    bool keeps_condition = false;
+    std::vector<uint8_t> increment;
+    std::vector<int> increment_lines;
 
     if (!parser.Match(TOKEN_SEMICOLON))
-        for_loop(parser, &exit_jump);
+        for_loop(parser, &exit_jump, &keeps_condition);
     if (!parser.Match(TOKEN_RIGHT_PAREN))
-        for_increment(parser, &loop_start);
+        for_increment(parser, &increment, &increment_lines);
     Statement(parser);
+    parser.PasteCode(increment, increment_lines);
     parser.EmitLoop(loop_start);
     if (exit_jump != -1) {
         parser.PatchJump(exit_jump);
-        parser.EmitByte(OP_POP);
+        if (keeps_condition)
+            parser.EmitByte(OP_POP);
     }
     parser.EndScope();
 }
 
 void SwitchStatement(Parser& parser)
 {
-    int loop_start = parser.GetCurrentChunk()->m_iCount;
+    int loop_start = parser.MarkJumpTarget();
     parser.Consume(TOKEN_LEFT_PAREN, "Expect '(' after 'switch'.");
     Expression(parser);
     parser.Consume(TOKEN_RIGHT_PAREN, "Expect ')' after condition.");
@@ -15,6 +15,7 @@
 
 Table::Table()
 {
+    m_pOwner = NULL;
     m_iCount = 0;
     m_iCapacity = 3;
 
@@ -86,6 +87,10 @@ bool Table::Set(ObjectString* key, Value value)
 
     entry.m_pKey = key;
     entry.m_oValue = value;
+    if (m_pOwner != NULL) {
+        m_pOwner->WriteBarrier(key);
+        WriteBarrier(m_pOwner, value);
+    }
     return is_new_key;
 }
 
@@ -123,6 +128,19 @@ bool Table::Get(ObjectString* key, Value& value)
     return true;
 }
 
+// Returns the index of [key]'s entry in m_vEntries, or -1 if the table doesn't
+// contain it. The index is only a hint once the table is modified.
+int Table::IndexOf(ObjectString* key)
+{
+    if (m_iCount == 0)
+        return -1;
+
+    Entry& entry = FindEntry(key);
+    if (entry.m_pKey == NULL)
+        return -1;
+    return &entry - m_vEntries.data();
+}
+
 bool Table::Delete(ObjectString* key)
 {
     if (m_iCount == 0)
@@ -174,23 +192,24 @@ ObjectString* Table::FindString(const std::string& string, uint32_t hash)
     }
 }
 
-void Table::MarkTable()
+void Table::MarkTable(GC& gc)
 {
-    // for (int i = 0; i <= m_iCapacity; i++)
-	// {
-    //     Entry& entry = m_vEntries[i];
-    //     MarkObject(entry.m_pKey);
-    //     MarkValue(entry.m_oValue);
-    // }
+    for (int i = 0; i <= m_iCapacity; i++)
+	{
+        Entry& entry = m_vEntries[i];
+        MarkObject(gc, entry.m_pKey);
+        MarkValue(gc, entry.m_oValue);
+    }
 }
 
-void Table::RemoveWhite()
+void Table::RemoveWhite(GC& gc)
 {
-    // for (int i = 0; i <= m_iCapacity; i++)
-	// {
-    //     Entry& entry = m_vEntries[i];
-    //     if (entry.m_pKey != NULL && !entry.m_pKey->mMarked) {
-    //         Delete(entry.m_pKey);
-    //     }
-    // }
+    for (int i = 0; i <= m_iCapacity; i++)
+	{
+        Entry& entry = m_vEntries[i];
+        if (entry.m_pKey != NULL && gc.IsWhite(entry.m_pKey)) {
+            entry.m_pKey = NULL;
+            entry.m_oValue = Fox_Bool(true);
+        }
+    }
 }
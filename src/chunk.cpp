@@ -1,10 +1,12 @@
 #include <cstdint>
+#include <functional>
 #include "chunk.hpp"
+#include "object.hpp"
 
 /**
  * Constructeur pour Chunk
  */
-Chunk::Chunk() : m_vCode(), m_vLines()
+Chunk::Chunk() : m_vCode(), m_pLines(new_ref<std::vector<int>>())
 {
 	m_iCount = 0;
 }
@@ -23,7 +25,57 @@ void Chunk::WriteChunk(uint8_t byte, int line)
 
 	m_iCount++;
     m_vCode.push_back(byte);
-    m_vLines.push_back(line);
+    m_pLines->push_back(line);
+}
+
+/**
+ * @brief Supprime le code à partir de offset, pour que le compilateur puisse
+ * remplacer les dernières instructions par une superinstruction
+ */
+void Chunk::Truncate(int offset)
+{
+	m_vCode.resize(offset);
+	m_pLines->resize(offset);
+	m_iCount = offset;
+}
+
+/**
+ * @brief Renvoie la position de pIp dans le code, qu'il pointe dans le code
+ * partagé ou dans la copie du chunk
+ */
+int Chunk::Offset(const uint8_t* pIp) const
+{
+	if (m_pSharedCode != nullptr && pIp >= m_pSharedCode->data() && pIp <= m_pSharedCode->data() + m_pSharedCode->size())
+		return (int) (pIp - m_pSharedCode->data());
+	return (int) (pIp - m_vCode.data());
+}
+
+/**
+ * @brief Copie le code partagé avant que l'interpréteur ne modifie une
+ * instruction, et renvoie [pIp] déplacé dans la copie
+ */
+uint8_t* Chunk::OwnCode(uint8_t* pIp)
+{
+	if (m_pSharedCode == nullptr)
+		return pIp;
+	int offset = Offset(pIp);
+	if (m_vCode.empty())
+		m_vCode = *m_pSharedCode;
+	return m_vCode.data() + offset;
+}
+
+/**
+ * @brief Déplace le code du chunk dans m_pSharedCode pour que le cache de code
+ * le partage avec les autres VM
+ */
+ref<const std::vector<uint8_t>> Chunk::ShareCode()
+{
+	if (m_pSharedCode == nullptr)
+	{
+		m_pSharedCode = new_ref<const std::vector<uint8_t>>(std::move(m_vCode));
+		m_vCode.clear();
+	}
+	return m_pSharedCode;
 }
 
 int Chunk::AddConstant(Value value)
@@ -31,3 +83,300 @@ int Chunk::AddConstant(Value value)
     m_oConstants.WriteValueArray(value);
     return m_oConstants.m_vValues.size() - 1;
 }
+
+/**
+ * @brief Réserve un cache pour une instruction et renvoie son index
+ */
+int Chunk::AddInlineCache()
+{
+    m_vCaches.emplace_back();
+    return m_vCaches.size() - 1;
+}
+
+/**
+ * @brief Réserve un cache pour un appel de méthode et renvoie son index
+ */
+int Chunk::AddMethodCache()
+{
+    m_vMethodCaches.emplace_back();
+    return m_vMethodCaches.size() - 1;
+}
+
+/**
+ * @brief Renvoie la taille de l'instruction à offset, opérandes comprises
+ */
+int Chunk::InstructionSize(int offset) const
+{
+	const std::vector<uint8_t>& code = Code();
+	int size = 1 + OperandSize(code[offset]);
+
+	if (code[offset] == OP_CLOSURE)
+	{
+		Value function = m_oConstants.m_vValues[code[offset + 1]];
+		size += 2 * Fox_AsFunction(function)->upValueCount;
+	}
+	return size;
+}
+
+int OperandSize(uint8_t instruction)
+{
+	switch (instruction)
+	{
+		case OP_CONST:
+		case OP_GET_LOCAL:
+		case OP_SET_LOCAL:
+		case OP_GET_UPVALUE:
+		case OP_SET_UPVALUE:
+		case OP_GET_SUPER:
+		case OP_CALL:
+		case OP_TAIL_CALL:
+		case OP_CLASS:
+		case OP_METHOD:
+		case OP_OPERATOR:
+		case OP_IMPORT:
+		case OP_PRINT:
+		case OP_ADD_LIST:
+		case OP_ADD_MAP:
+		case OP_CLOSURE:
+		case OP_STORE_LOCAL:
+		case OP_RETURN_LOCAL:
+			return 1;
+
+		case OP_GET_MODULE_VAR:
+		case OP_DEFINE_MODULE_VAR:
+		case OP_SET_MODULE_VAR:
+		case OP_STORE_MODULE_VAR:
+		case OP_JUMP:
+		case OP_JUMP_IF_FALSE:
+		case OP_LOOP:
+		case OP_LESS_LOCAL_CONST:
+		case OP_ADD_LOCAL_CONST:
+		case OP_SUB_LOCAL_CONST:
+		case OP_JUMP_IF_NOT_LESS:
+		case OP_JUMP_IF_NOT_GREATER:
+		case OP_JUMP_IF_LESS:
+		case OP_JUMP_IF_GREATER:
+			return 2;
+
+		case OP_GET_PROPERTY:
+		case OP_SET_PROPERTY:
+			return 3;
+
+		case OP_INVOKE:
+		case OP_SUPER_INVOKE:
+		case OP_GET_LOCAL_PROPERTY:
+		case OP_JUMP_IF_NOT_LESS_LOCAL:
+		case OP_JUMP_IF_NOT_LESS_LOCAL_CONST:
+		case OP_INC_LOCAL:
+		case OP_DEC_LOCAL:
+			return 4;
+
+		default:
+			return 0;
+	}
+}
+
+/**
+ * @brief Renvoie combien de valeurs l'instruction à offset laisse sur la pile
+ * en plus de celles qu'elle prend, et dans [peak] combien elle en empile
+ * au plus pendant qu'elle s'exécute (le JIT empile les deux opérandes des
+ * superinstructions sur les locales avant de les comparer ou de les ajouter)
+ */
+static int StackEffect(const std::vector<uint8_t>& code, int offset, int& peak)
+{
+	peak = 0;
+	switch (code[offset])
+	{
+		case OP_CONST:
+		case OP_NIL:
+		case OP_TRUE:
+		case OP_FALSE:
+		case OP_GET_LOCAL:
+		case OP_GET_MODULE_VAR:
+		case OP_GET_UPVALUE:
+		case OP_IMPORT:
+		case OP_CLOSURE:
+		case OP_CLASS:
+		case OP_ARRAY:
+		case OP_MAP:
+			return 1;
+
+		case OP_GET_LOCAL_PROPERTY:
+			peak = 1;
+			return 1;
+
+		case OP_LESS_LOCAL_CONST:
+		case OP_ADD_LOCAL_CONST:
+		case OP_SUB_LOCAL_CONST:
+			peak = 2;
+			return 1;
+
+		case OP_JUMP_IF_NOT_LESS_LOCAL:
+		case OP_JUMP_IF_NOT_LESS_LOCAL_CONST:
+		case OP_INC_LOCAL:
+		case OP_DEC_LOCAL:
+			peak = 2;
+			return 0;
+
+		case OP_RETURN_LOCAL:
+			peak = 1;
+			return 0;
+
+		case OP_SLICE:
+			peak = 1;
+			return -2;
+
+		case OP_SET_LOCAL:
+		case OP_SET_MODULE_VAR:
+		case OP_SET_UPVALUE:
+		case OP_GET_PROPERTY:
+		case OP_BIT_NOT:
+		case OP_NOT:
+		case OP_NEGATE:
+		case OP_JUMP:
+		case OP_JUMP_IF_FALSE:
+		case OP_LOOP:
+		case OP_RETURN:
+		case OP_END_MODULE:
+		case OP_END:
+		case OP_PRINT_REPL:
+			return 0;
+
+		case OP_JUMP_IF_NOT_LESS:
+		case OP_JUMP_IF_NOT_GREATER:
+		case OP_JUMP_IF_LESS:
+		case OP_JUMP_IF_GREATER:
+			return -2;
+
+		// OP_SUBSCRIPT_ASSIGN pops its three operands for an array or a map
+		// but only two for a string, count the one that keeps the most.
+		case OP_SUBSCRIPT_ASSIGN:
+			return -2;
+
+		case OP_CALL:
+		case OP_TAIL_CALL:
+		case OP_PRINT:
+		case OP_ADD_LIST:
+			return -code[offset + 1];
+
+		case OP_ADD_MAP:
+			return -2 * code[offset + 1];
+
+		case OP_INVOKE:
+			return -code[offset + 2];
+
+		case OP_SUPER_INVOKE:
+			return -code[offset + 2] - 1;
+
+		default:
+			return -1;
+	}
+}
+
+/**
+ * @brief Renvoie le nombre de cases de pile dont une frame a besoin pour
+ * exécuter le chunk, en partant de [slots] valeurs (la closure et ses
+ * arguments), ou -1 si le code est mal formé
+ */
+int Chunk::MaxStack(int slots) const
+{
+	const std::vector<uint8_t>& code = Code();
+	return MaxStackDepth(code, slots, [this, &code](int offset) {
+		if (code[offset] == OP_CLOSURE &&
+			(code[offset + 1] >= m_oConstants.m_vValues.size() || !Fox_IsFunction(m_oConstants.m_vValues[code[offset + 1]])))
+			return -1;
+		return InstructionSize(offset);
+	});
+}
+
+/**
+ * @brief Suit toutes les instructions de code qui peuvent s'exécuter pour
+ * trouver la profondeur de pile maximale, voir Chunk::MaxStack()
+ */
+int MaxStackDepth(const std::vector<uint8_t>& code, int slots, const std::function<int(int)>& instructionSize)
+{
+	int size = (int) code.size();
+	// The depth of the stack before each instruction, -1 until it is reached.
+	std::vector<int> depths(size, -1);
+	std::vector<int> pending;
+	int max = slots;
+
+	auto reach = [&](int offset, int depth) {
+		if (offset < 0 || offset >= size || depth < 0 || depth > slots + size)
+			return false;
+		if (depths[offset] < depth)
+		{
+			depths[offset] = depth;
+			pending.push_back(offset);
+		}
+		return true;
+	};
+
+	if (size == 0 || !reach(0, slots))
+		return -1;
+
+	while (!pending.empty())
+	{
+		int offset = pending.back();
+		pending.pop_back();
+
+		// The fixed operands are there before [instructionSize] reads them.
+		uint8_t instruction = code[offset];
+		if (instruction >= OP_TOTAL || offset + 1 + OperandSize(instruction) > size)
+			return -1;
+
+		int length = instructionSize(offset);
+		if (length < 1 + OperandSize(instruction) || offset + length > size)
+			return -1;
+		int next = offset + length;
+
+		int peak;
+		int depth = depths[offset];
+		int after = depth + StackEffect(code, offset, peak);
+		if (depth + peak > max)
+			max = depth + peak;
+		if (after > max)
+			max = after;
+
+		int jump = -1;
+		switch (instruction)
+		{
+			case OP_JUMP:
+			case OP_JUMP_IF_FALSE:
+			case OP_JUMP_IF_NOT_LESS:
+			case OP_JUMP_IF_NOT_GREATER:
+			case OP_JUMP_IF_LESS:
+			case OP_JUMP_IF_GREATER:
+				jump = next + ((code[offset + 1] << 8) | code[offset + 2]);
+				break;
+
+			case OP_JUMP_IF_NOT_LESS_LOCAL:
+			case OP_JUMP_IF_NOT_LESS_LOCAL_CONST:
+				jump = next + ((code[offset + 3] << 8) | code[offset + 4]);
+				break;
+
+			case OP_LOOP:
+				jump = next - ((code[offset + 1] << 8) | code[offset + 2]);
+				break;
+		}
+
+		if (jump != -1 && !reach(jump, after))
+			return -1;
+
+		switch (instruction)
+		{
+			case OP_JUMP:
+			case OP_LOOP:
+			case OP_RETURN:
+			case OP_RETURN_LOCAL:
+			case OP_END:
+				break;
+
+			default:
+				if (!reach(next, after))
+					return -1;
+				break;
+		}
+	}
+	return max;
+}
@@ -0,0 +1,625 @@
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <sstream>
+
+#include "codecache.hpp"
+#include "object.hpp"
+#include "Parser.h"
+#include "vm.hpp"
+
+CodeCache& CodeCache::Get()
+{
+    static CodeCache instance;
+    return instance;
+}
+
+std::string CodeCache::Layout(ObjectModule& oModule, bool bLazy)
+{
+    std::vector<ObjectString*> vNames(oModule.m_vVariables.size(), nullptr);
+    for (Entry& oEntry : oModule.m_vVariableNames.m_vEntries)
+    {
+        if (oEntry.m_pKey != nullptr)
+            vNames[Fox_AsInt(oEntry.m_oValue)] = oEntry.m_pKey;
+    }
+
+    std::string strKey = bLazy ? "lazy" : "eager";
+    strKey += '\0';
+    strKey += oModule.m_strName->string;
+    strKey += '\0';
+    for (ObjectString* pName : vNames)
+    {
+        if (pName != nullptr)
+            strKey += pName->string;
+        strKey += '\0';
+    }
+    return strKey;
+}
+
+std::string CodeCache::Key(ObjectModule& oModule, bool bLazy, const std::string& strSource)
+{
+    std::string strKey = Layout(oModule, bLazy);
+    strKey += '\0';
+    strKey += strSource;
+    return strKey;
+}
+
+ref<const CachedModule> CodeCache::Find(const std::string& strKey)
+{
+    std::lock_guard<std::mutex> oLock(m_oMutex);
+    auto it = m_vModules.find(strKey);
+    if (it == m_vModules.end())
+        return nullptr;
+    return it->second;
+}
+
+// Returns nullptr if [pFunction] holds a constant that can't be cached.
+static ref<CachedFunction> SaveFunction(ObjectFunction* pFunction)
+{
+    ref<CachedFunction> pCached = new_ref<CachedFunction>();
+    pCached->m_bHasName = pFunction->name != nullptr;
+    if (pCached->m_bHasName)
+        pCached->m_strName = pFunction->name->string;
+    pCached->m_iArity = pFunction->arity;
+    pCached->m_iMinArity = pFunction->iMinArity;
+    pCached->m_iMaxArity = pFunction->iMaxArity;
+    pCached->m_iUpvalueCount = pFunction->upValueCount;
+    pCached->m_iMaxSlots = pFunction->maxSlots;
+    // The compiling VM runs the shared code too.
+    pCached->m_pCode = pFunction->chunk.ShareCode();
+    pCached->m_pLines = pFunction->chunk.m_pLines;
+    pCached->m_iCaches = pFunction->chunk.m_vCaches.size();
+    pCached->m_iMethodCaches = pFunction->chunk.m_vMethodCaches.size();
+    pCached->m_pLazy = pFunction->lazy;
+
+    for (Value oConstant : pFunction->chunk.m_oConstants.m_vValues)
+    {
+        CachedConstant oCachedConstant;
+        oCachedConstant.m_eKind = CachedConstant::VALUE;
+        oCachedConstant.m_oValue = oConstant;
+        if (Fox_IsString(oConstant))
+        {
+            oCachedConstant.m_eKind = CachedConstant::STRING;
+            oCachedConstant.m_strString = Fox_AsString(oConstant)->string;
+        }
+        else if (Fox_IsFunction(oConstant))
+        {
+            oCachedConstant.m_eKind = CachedConstant::FUNCTION;
+            oCachedConstant.m_pFunction = SaveFunction(Fox_AsFunction(oConstant));
+            if (oCachedConstant.m_pFunction == nullptr)
+                return nullptr;
+        }
+        else if (Fox_IsObject(oConstant))
+            return nullptr;
+        pCached->m_vConstants.push_back(oCachedConstant);
+    }
+    return pCached;
+}
+
+ref<const CachedModule> CodeCache::Save(ObjectModule& oModule, size_t iFirstVariable, ObjectFunction* pFunction)
+{
+    ref<CachedModule> pCached = new_ref<CachedModule>();
+    pCached->m_pFunction = SaveFunction(pFunction);
+    if (pCached->m_pFunction == nullptr)
+        return nullptr;
+
+    pCached->m_vVariables.resize(oModule.m_vVariables.size() - iFirstVariable);
+    for (Entry& oEntry : oModule.m_vVariableNames.m_vEntries)
+    {
+        if (oEntry.m_pKey != nullptr && (size_t) Fox_AsInt(oEntry.m_oValue) >= iFirstVariable)
+            pCached->m_vVariables[Fox_AsInt(oEntry.m_oValue) - iFirstVariable] = oEntry.m_pKey->string;
+    }
+    return pCached;
+}
+
+void CodeCache::Add(const std::string& strKey, ref<const CachedModule> pCached)
+{
+    std::lock_guard<std::mutex> oLock(m_oMutex);
+    if (m_vModules.size() < CODE_CACHE_MAX)
+        m_vModules.emplace(strKey, pCached);
+}
+
+static ObjectFunction* LoadFunction(VM* pVM, ObjectModule* pModule, const CachedFunction& oCached)
+{
+    ObjectFunction* pFunction = pVM->gc.New<ObjectFunction>();
+    pFunction->module = pModule;
+    pFunction->arity = oCached.m_iArity;
+    pFunction->iMinArity = oCached.m_iMinArity;
+    pFunction->iMaxArity = oCached.m_iMaxArity;
+    pFunction->upValueCount = oCached.m_iUpvalueCount;
+    pFunction->maxSlots = oCached.m_iMaxSlots;
+    pFunction->chunk.m_pSharedCode = oCached.m_pCode;
+    pFunction->chunk.m_iCount = oCached.m_pCode->size();
+    pFunction->chunk.m_pLines = oCached.m_pLines;
+    pFunction->chunk.m_vCaches.resize(oCached.m_iCaches);
+    pFunction->chunk.m_vMethodCaches.resize(oCached.m_iMethodCaches);
+    pFunction->lazy = oCached.m_pLazy;
+
+    // The strings and the inner functions may trigger a collection.
+    pVM->Push(Fox_Object(pFunction));
+    if (oCached.m_bHasName)
+        pFunction->name = Fox_AsString(pVM->NewString(oCached.m_strName));
+
+    for (const CachedConstant& oConstant : oCached.m_vConstants)
+    {
+        Value oValue = oConstant.m_oValue;
+        if (oConstant.m_eKind == CachedConstant::STRING)
+            oValue = pVM->NewString(oConstant.m_strString);
+        else if (oConstant.m_eKind == CachedConstant::FUNCTION)
+            oValue = Fox_Object(LoadFunction(pVM, pModule, *oConstant.m_pFunction));
+        pFunction->chunk.AddConstant(oValue);
+    }
+    pVM->Pop();
+    return pFunction;
+}
+
+ObjectFunction* CodeCache::Load(VM* pVM, ObjectModule* pModule, const CachedModule& oCached)
+{
+    // The key guarantees the module has the same slots as the one the code
+    // was compiled in, so these get the slots the code expects.
+    for (const std::string& strName : oCached.m_vVariables)
+        pModule->DeclareVariable(Fox_AsString(pVM->NewString(strName)));
+
+    return LoadFunction(pVM, pModule, *oCached.m_pFunction);
+}
+
+/* --------- .foxc files ---------------------------------------------- */
+
+// A .foxc file starts with a header that tells whether it can be used:
+//
+//   "FOXC", FOXC_VERSION, OP_TOTAL, the hash and the size of the source, the
+//   compile mode and the layout of the module it was compiled in, and the
+//   hash of the rest of the file
+//
+// followed by the variables the module declares and its body. Functions are
+// written depth-first: the nested functions are in the constants of their
+// enclosing function, and the upvalue descriptors of a closure are the
+// operands of its OP_CLOSURE. A function compiled with -lazy has no code and
+// no constants but the tokens it is compiled from. Numbers are written in the byte order of the
+// machine, as the file is a cache and never leaves it.
+
+static const char FOXC_MAGIC[4] = { 'F', 'O', 'X', 'C' };
+
+enum FoxcValue : uint8_t { FOXC_NIL, FOXC_UNDEFINED, FOXC_BOOL, FOXC_DOUBLE, FOXC_INT };
+
+// The 64-bit FNV-1a hash of the [iSize] bytes at [pData]. The 32-bit one of
+// hashString() is too likely to collide across edits of a large module.
+static uint64_t Hash(const char* pData, size_t iSize)
+{
+    uint64_t uHash = 14695981039346656037ull;
+    for (size_t i = 0; i < iSize; i++)
+    {
+        uHash ^= (uint8_t) pData[i];
+        uHash *= 1099511628211ull;
+    }
+    return uHash;
+}
+
+class FoxcWriter
+{
+public:
+    std::string m_strData;
+
+    template <typename T>
+    void Write(T value)
+    {
+        m_strData.append((const char*) &value, sizeof(T));
+    }
+
+    void WriteString(const std::string& str)
+    {
+        Write<uint32_t>(str.size());
+        m_strData += str;
+    }
+
+    void WriteFunction(const CachedFunction& oFunction)
+    {
+        Write<uint8_t>(oFunction.m_bHasName);
+        WriteString(oFunction.m_strName);
+        Write<int32_t>(oFunction.m_iArity);
+        Write<int32_t>(oFunction.m_iMinArity);
+        Write<int32_t>(oFunction.m_iMaxArity);
+        Write<int32_t>(oFunction.m_iUpvalueCount);
+        Write<int32_t>(oFunction.m_iMaxSlots);
+
+        Write<uint32_t>(oFunction.m_pCode->size());
+        m_strData.append((const char*) oFunction.m_pCode->data(), oFunction.m_pCode->size());
+        for (int iLine : *oFunction.m_pLines)
+            Write<int32_t>(iLine);
+
+        Write<uint32_t>(oFunction.m_iCaches);
+        Write<uint32_t>(oFunction.m_iMethodCaches);
+
+        Write<uint8_t>(oFunction.m_pLazy != nullptr);
+        if (oFunction.m_pLazy != nullptr)
+        {
+            Write<uint8_t>(oFunction.m_pLazy->type);
+            Write<uint8_t>(oFunction.m_pLazy->inClass);
+            Write<uint32_t>(oFunction.m_pLazy->tokens.size());
+            for (const Token& oToken : oFunction.m_pLazy->tokens)
+            {
+                Write<int32_t>(oToken.m_oType.m_id);
+                Write<int32_t>(oToken.m_iLinesTraversed);
+                WriteString(oToken.GetText());
+            }
+        }
+
+        Write<uint32_t>(oFunction.m_vConstants.size());
+        for (const CachedConstant& oConstant : oFunction.m_vConstants)
+        {
+            Write<uint8_t>(oConstant.m_eKind);
+            if (oConstant.m_eKind == CachedConstant::STRING)
+                WriteString(oConstant.m_strString);
+            else if (oConstant.m_eKind == CachedConstant::FUNCTION)
+                WriteFunction(*oConstant.m_pFunction);
+            else
+                WriteValue(oConstant.m_oValue);
+        }
+    }
+
+    void WriteValue(Value oValue)
+    {
+        if (Fox_IsNil(oValue))
+            Write<uint8_t>(FOXC_NIL);
+        else if (Fox_IsUndefined(oValue))
+            Write<uint8_t>(FOXC_UNDEFINED);
+        else if (Fox_IsBool(oValue))
+        {
+            Write<uint8_t>(FOXC_BOOL);
+            Write<uint8_t>(Fox_AsBool(oValue));
+        }
+        else if (Fox_IsInt(oValue))
+        {
+            Write<uint8_t>(FOXC_INT);
+            Write<int32_t>(Fox_AsInt(oValue));
+        }
+        else
+        {
+            Write<uint8_t>(FOXC_DOUBLE);
+            Write<double>(Fox_AsNumber(oValue));
+        }
+    }
+};
+
+// Every read checks the size of the data, so a truncated or corrupted file
+// makes the reader fail instead of reading past its end. The checksum of the
+// header catches most corruptions, but the interpreter trusts the code it
+// runs, so each function is also checked the way the compiler would have
+// written it, see CheckFunction().
+class FoxcReader
+{
+public:
+    const std::string& m_strData;
+    size_t m_iOffset;
+    bool m_bFailed;
+    // The number of variables of the module once it is loaded.
+    size_t m_iVariables;
+
+    explicit FoxcReader(const std::string& strData) : m_strData(strData), m_iOffset(0), m_bFailed(false), m_iVariables(0) {}
+
+    bool Has(size_t iSize)
+    {
+        if (m_bFailed || m_strData.size() - m_iOffset < iSize)
+            m_bFailed = true;
+        return !m_bFailed;
+    }
+
+    template <typename T>
+    T Read()
+    {
+        T value = T();
+        if (Has(sizeof(T)))
+        {
+            memcpy(&value, m_strData.data() + m_iOffset, sizeof(T));
+            m_iOffset += sizeof(T);
+        }
+        return value;
+    }
+
+    std::string ReadString()
+    {
+        uint32_t iSize = Read<uint32_t>();
+        if (!Has(iSize))
+            return std::string();
+        std::string str = m_strData.substr(m_iOffset, iSize);
+        m_iOffset += iSize;
+        return str;
+    }
+
+    ref<const CachedFunction> ReadFunction()
+    {
+        ref<CachedFunction> pFunction = new_ref<CachedFunction>();
+        pFunction->m_bHasName = Read<uint8_t>() != 0;
+        pFunction->m_strName = ReadString();
+        pFunction->m_iArity = Read<int32_t>();
+        pFunction->m_iMinArity = Read<int32_t>();
+        pFunction->m_iMaxArity = Read<int32_t>();
+        pFunction->m_iUpvalueCount = Read<int32_t>();
+        pFunction->m_iMaxSlots = Read<int32_t>();
+
+        uint32_t iCodeSize = Read<uint32_t>();
+        if (!Has(iCodeSize + (size_t) iCodeSize * sizeof(int32_t)))
+            return nullptr;
+        pFunction->m_pCode = new_ref<const std::vector<uint8_t>>(m_strData.begin() + m_iOffset, m_strData.begin() + m_iOffset + iCodeSize);
+        m_iOffset += iCodeSize;
+        pFunction->m_pLines = new_ref<std::vector<int>>(iCodeSize);
+        for (int& iLine : *pFunction->m_pLines)
+            iLine = Read<int32_t>();
+
+        pFunction->m_iCaches = Read<uint32_t>();
+        pFunction->m_iMethodCaches = Read<uint32_t>();
+
+        if (Read<uint8_t>() != 0)
+        {
+            ref<LazyFunction> pLazy = new_ref<LazyFunction>();
+            pLazy->type = (FunctionType) Read<uint8_t>();
+            pLazy->inClass = Read<uint8_t>() != 0;
+            uint32_t iTokens = Read<uint32_t>();
+            for (uint32_t i = 0; i < iTokens && !m_bFailed; i++)
+            {
+                int iType = Read<int32_t>();
+                int iLine = Read<int32_t>();
+                std::string strText = ReadString();
+                Token oToken(StringID(iType), strText, strText.size());
+                oToken.m_iLinesTraversed = iLine;
+                pLazy->tokens.push_back(oToken);
+            }
+            // The parser expects a TOKEN_EOF at the end.
+            if (pLazy->tokens.empty() || pLazy->tokens.back().m_oType.m_id != TOKEN_EOF)
+                m_bFailed = true;
+            pFunction->m_pLazy = pLazy;
+        }
+
+        uint32_t iConstants = Read<uint32_t>();
+        for (uint32_t i = 0; i < iConstants && !m_bFailed; i++)
+        {
+            CachedConstant oConstant;
+            oConstant.m_eKind = (CachedConstant::Kind) Read<uint8_t>();
+            if (oConstant.m_eKind == CachedConstant::STRING)
+                oConstant.m_strString = ReadString();
+            else if (oConstant.m_eKind == CachedConstant::FUNCTION)
+                oConstant.m_pFunction = ReadFunction();
+            else if (oConstant.m_eKind == CachedConstant::VALUE)
+                oConstant.m_oValue = ReadValue();
+            else
+                m_bFailed = true;
+            pFunction->m_vConstants.push_back(oConstant);
+        }
+
+        if (!m_bFailed && !CheckFunction(*pFunction))
+            m_bFailed = true;
+        if (m_bFailed)
+            return nullptr;
+        return pFunction;
+    }
+
+    // Returns true if the operands of the code of [oFunction] are in range:
+    // its constants, caches, locals, upvalues and the variables of the module.
+    // Its jumps must stay in the code and its stack must need the room the
+    // function reserves, see MaxStackDepth().
+    bool CheckFunction(const CachedFunction& oFunction)
+    {
+        if (oFunction.m_iArity < 0 || oFunction.m_iArity > UINT8_MAX ||
+            oFunction.m_iMinArity < 0 || oFunction.m_iMinArity > oFunction.m_iArity ||
+            oFunction.m_iMaxArity != oFunction.m_iArity ||
+            oFunction.m_iUpvalueCount < 0 || oFunction.m_iUpvalueCount > UINT8_MAX + 1)
+            return false;
+
+        const std::vector<uint8_t>& vCode = *oFunction.m_pCode;
+        if (oFunction.m_pLazy != nullptr)
+        {
+            return vCode.empty() && oFunction.m_vConstants.empty() && oFunction.m_iMaxSlots == 0 &&
+                oFunction.m_iCaches == 0 && oFunction.m_iMethodCaches == 0;
+        }
+        // Each cache belongs to an instruction.
+        if (oFunction.m_iCaches > vCode.size() || oFunction.m_iMethodCaches > vCode.size())
+            return false;
+
+        const std::vector<CachedConstant>& vConstants = oFunction.m_vConstants;
+        auto isString = [&](uint8_t uConstant) {
+            return uConstant < vConstants.size() && vConstants[uConstant].m_eKind == CachedConstant::STRING;
+        };
+        auto isNumber = [&](uint8_t uConstant) {
+            return uConstant < vConstants.size() && vConstants[uConstant].m_eKind == CachedConstant::VALUE &&
+                Fox_IsNumber(vConstants[uConstant].m_oValue);
+        };
+        auto isLocal = [&](uint8_t uSlot) { return uSlot < oFunction.m_iMaxSlots; };
+        auto readShort = [](const uint8_t* pOperands) { return (size_t) ((pOperands[0] << 8) | pOperands[1]); };
+
+        auto instructionSize = [&](int iOffset) {
+            const uint8_t* pOperands = &vCode[iOffset + 1];
+            int iSize = 1 + OperandSize(vCode[iOffset]);
+            bool bValid = true;
+            switch (vCode[iOffset])
+            {
+                case OP_CONST:
+                    bValid = pOperands[0] < vConstants.size();
+                    break;
+
+                case OP_GET_LOCAL:
+                case OP_SET_LOCAL:
+                case OP_STORE_LOCAL:
+                case OP_RETURN_LOCAL:
+                    bValid = isLocal(pOperands[0]);
+                    break;
+
+                case OP_GET_UPVALUE:
+                case OP_SET_UPVALUE:
+                    bValid = pOperands[0] < oFunction.m_iUpvalueCount;
+                    break;
+
+                case OP_GET_MODULE_VAR:
+                case OP_DEFINE_MODULE_VAR:
+                case OP_SET_MODULE_VAR:
+                case OP_STORE_MODULE_VAR:
+                    bValid = readShort(pOperands) < m_iVariables;
+                    break;
+
+                case OP_GET_SUPER:
+                case OP_CLASS:
+                case OP_METHOD:
+                case OP_OPERATOR:
+                case OP_IMPORT:
+                    bValid = isString(pOperands[0]);
+                    break;
+
+                case OP_GET_PROPERTY:
+                case OP_SET_PROPERTY:
+                    bValid = isString(pOperands[0]) && readShort(pOperands + 1) < oFunction.m_iCaches;
+                    break;
+
+                case OP_GET_LOCAL_PROPERTY:
+                    bValid = isLocal(pOperands[0]) && isString(pOperands[1]) && readShort(pOperands + 2) < oFunction.m_iCaches;
+                    break;
+
+                case OP_INVOKE:
+                case OP_SUPER_INVOKE:
+                    bValid = isString(pOperands[0]) && readShort(pOperands + 2) < oFunction.m_iMethodCaches;
+                    break;
+
+                case OP_LESS_LOCAL_CONST:
+                case OP_JUMP_IF_NOT_LESS_LOCAL_CONST:
+                    bValid = isLocal(pOperands[0]) && pOperands[1] < vConstants.size();
+                    break;
+
+                case OP_ADD_LOCAL_CONST:
+                case OP_SUB_LOCAL_CONST:
+                    bValid = isLocal(pOperands[0]) && isNumber(pOperands[1]);
+                    break;
+
+                case OP_JUMP_IF_NOT_LESS_LOCAL:
+                    bValid = isLocal(pOperands[0]) && isLocal(pOperands[1]);
+                    break;
+
+                case OP_INC_LOCAL:
+                case OP_DEC_LOCAL:
+                    bValid = isLocal(pOperands[0]) && isNumber(pOperands[1]) &&
+                        pOperands[2] == OP_STORE_LOCAL && isLocal(pOperands[3]);
+                    break;
+
+                case OP_CLOSURE:
+                {
+                    if (pOperands[0] >= vConstants.size() || vConstants[pOperands[0]].m_eKind != CachedConstant::FUNCTION)
+                        return -1;
+                    // Each upvalue captures a local of this function or one of
+                    // its upvalues.
+                    int iUpvalues = vConstants[pOperands[0]].m_pFunction->m_iUpvalueCount;
+                    iSize += 2 * iUpvalues;
+                    if (iOffset + iSize > (int) vCode.size())
+                        return -1;
+                    for (int i = 0; i < iUpvalues && bValid; i++)
+                    {
+                        uint8_t uIndex = pOperands[2 + 2 * i];
+                        bValid = pOperands[1 + 2 * i] ? isLocal(uIndex) : uIndex < oFunction.m_iUpvalueCount;
+                    }
+                    break;
+                }
+            }
+            return bValid ? iSize : -1;
+        };
+
+        return MaxStackDepth(vCode, 1 + oFunction.m_iArity, instructionSize) == oFunction.m_iMaxSlots;
+    }
+
+    Value ReadValue()
+    {
+        switch (Read<uint8_t>())
+        {
+            case FOXC_NIL: return Fox_Nil;
+            case FOXC_UNDEFINED: return Fox_Undefined;
+            case FOXC_BOOL: return Fox_Bool(Read<uint8_t>() != 0);
+            case FOXC_INT: return Fox_Int(Read<int32_t>());
+            case FOXC_DOUBLE: return Fox_Number(Read<double>());
+        }
+        m_bFailed = true;
+        return Fox_Nil;
+    }
+};
+
+ref<const CachedModule> CodeCache::Read(const std::string& strPath, const std::string& strLayout, const std::string& strSource)
+{
+    std::ifstream oFile(strPath, std::ios::binary);
+    if (!oFile.is_open())
+        return nullptr;
+
+    std::stringstream strStream;
+    strStream << oFile.rdbuf();
+    std::string strData = strStream.str();
+    FoxcReader oReader(strData);
+
+    if (!oReader.Has(sizeof(FOXC_MAGIC)) || memcmp(strData.data(), FOXC_MAGIC, sizeof(FOXC_MAGIC)) != 0)
+        return nullptr;
+    oReader.m_iOffset += sizeof(FOXC_MAGIC);
+
+    // A file written by another build, for another source or for a module
+    // laid out differently is stale: the module is compiled again.
+    if (oReader.Read<uint32_t>() != FOXC_VERSION || oReader.Read<uint32_t>() != OP_TOTAL)
+        return nullptr;
+    if (oReader.Read<uint64_t>() != Hash(strSource.data(), strSource.size()) || oReader.Read<uint64_t>() != strSource.size())
+        return nullptr;
+    if (oReader.ReadString() != strLayout || oReader.m_bFailed)
+        return nullptr;
+
+    // A file damaged after it was written is compiled again too.
+    uint64_t uChecksum = oReader.Read<uint64_t>();
+    if (oReader.m_bFailed || uChecksum != Hash(strData.data() + oReader.m_iOffset, strData.size() - oReader.m_iOffset))
+        return nullptr;
+
+    ref<CachedModule> pCached = new_ref<CachedModule>();
+    uint32_t iVariables = oReader.Read<uint32_t>();
+    for (uint32_t i = 0; i < iVariables && !oReader.m_bFailed; i++)
+        pCached->m_vVariables.push_back(oReader.ReadString());
+
+    // The layout names the variables the module already had, each followed
+    // by a '\0', after the compile mode and the name of the module.
+    oReader.m_iVariables = std::count(strLayout.begin(), strLayout.end(), '\0') - 2 + iVariables;
+
+    pCached->m_pFunction = oReader.ReadFunction();
+    if (pCached->m_pFunction == nullptr || oReader.m_bFailed)
+        return nullptr;
+    return pCached;
+}
+
+void CodeCache::Write(const std::string& strPath, const std::string& strLayout, const std::string& strSource, const CachedModule& oCached)
+{
+    FoxcWriter oWriter;
+    oWriter.m_strData.append(FOXC_MAGIC, sizeof(FOXC_MAGIC));
+    oWriter.Write<uint32_t>(FOXC_VERSION);
+    oWriter.Write<uint32_t>(OP_TOTAL);
+    oWriter.Write<uint64_t>(Hash(strSource.data(), strSource.size()));
+    oWriter.Write<uint64_t>(strSource.size());
+    oWriter.WriteString(strLayout);
+
+    FoxcWriter oBody;
+    oBody.Write<uint32_t>(oCached.m_vVariables.size());
+    for (const std::string& strName : oCached.m_vVariables)
+        oBody.WriteString(strName);
+    oBody.WriteFunction(*oCached.m_pFunction);
+    oWriter.Write<uint64_t>(Hash(oBody.m_strData.data(), oBody.m_strData.size()));
+    oWriter.m_strData += oBody.m_strData;
+
+    // Write to a temporary file first, so that another process never reads
+    // a half-written one.
+    std::string strTemporary = strPath + ".tmp";
+    {
+        std::ofstream oFile(strTemporary, std::ios::binary | std::ios::trunc);
+        if (!oFile.is_open())
+            return;
+        oFile.write(oWriter.m_strData.data(), oWriter.m_strData.size());
+        if (!oFile)
+        {
+            oFile.close();
+            std::remove(strTemporary.c_str());
+            return;
+        }
+    }
+    if (std::rename(strTemporary.c_str(), strPath.c_str()) != 0)
+        std::remove(strTemporary.c_str());
+}
+
+void CodeCache::Clear()
+{
+    std::lock_guard<std::mutex> oLock(m_oMutex);
+    m_vModules.clear();
+}
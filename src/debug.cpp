@@ -5,27 +5,36 @@
 #include "object.hpp"
 
 static int invokeInstruction(const char *name, Chunk& chunk, int offset) {
-    uint8_t constant = chunk.m_vCode[offset + 1];
-    uint8_t argCount = chunk.m_vCode[offset + 2];
+    uint8_t constant = chunk.Code()[offset + 1];
+    uint8_t argCount = chunk.Code()[offset + 2];
+    uint16_t cache = (uint16_t)(chunk.Code()[offset + 3] << 8);
+    cache |= chunk.Code()[offset + 4];
     printf("%-16s (%d args) %4d '", name, argCount, constant);
    	PrintValue(chunk.m_oConstants.m_vValues[constant]);
-    printf("'\n");
-    return offset + 3;
+    printf("' (cache %d)\n", cache);
+    return offset + 5;
 }
 
 static int jumpInstruction(const char *name, int sign, Chunk& chunk, int offset) {
-    uint16_t jump = (uint16_t)(chunk.m_vCode[offset + 1] << 8);
-    jump |= chunk.m_vCode[offset + 2];
+    uint16_t jump = (uint16_t)(chunk.Code()[offset + 1] << 8);
+    jump |= chunk.Code()[offset + 2];
     printf("%-16s %4d -> %d\n", name, offset, offset + 3 + sign * jump);
     return offset + 3;
 }
 
 static int byteInstruction(const char *name, Chunk& chunk, int offset) {
-    uint8_t slot = chunk.m_vCode[offset + 1];
+    uint8_t slot = chunk.Code()[offset + 1];
     printf("%-16s %4d\n", name, slot);
     return offset + 2;
 }
 
+static int shortInstruction(const char *name, Chunk& chunk, int offset) {
+    uint16_t slot = (uint16_t)(chunk.Code()[offset + 1] << 8);
+    slot |= chunk.Code()[offset + 2];
+    printf("%-16s %4d\n", name, slot);
+    return offset + 3;
+}
+
 // Print a Simple (1 byte) Instruction like 'OP_RETURN'
 static int simpleInstruction(const char* name, int offset)
 {
@@ -36,32 +45,101 @@ static int simpleInstruction(const char* name, int offset)
 // Print a Constant Instruction (2 bytes)
 static int constantInstruction(const char* name, Chunk& chunk, int offset)
 {
-	uint8_t constant = chunk.m_vCode[offset + 1];
+	uint8_t constant = chunk.Code()[offset + 1];
 	printf("%-16s %4d '", name, constant);
 	PrintValue(chunk.m_oConstants.m_vValues[constant]);
 	printf("'\n");
 	return offset + 2;
 }
 
+// Print an instruction with a constant and an inline cache index (4 bytes)
+static int cachedInstruction(const char* name, Chunk& chunk, int offset)
+{
+	uint8_t constant = chunk.Code()[offset + 1];
+	uint16_t cache = (uint16_t)(chunk.Code()[offset + 2] << 8);
+	cache |= chunk.Code()[offset + 3];
+	printf("%-16s %4d '", name, constant);
+	PrintValue(chunk.m_oConstants.m_vValues[constant]);
+	printf("' (cache %d)\n", cache);
+	return offset + 4;
+}
+
+// Print a superinstruction on a local slot and a constant (3 bytes, or 5 for
+// OP_INC_LOCAL and OP_DEC_LOCAL which keep their OP_STORE_LOCAL)
+static int localConstantInstruction(const char* name, Chunk& chunk, int offset)
+{
+	uint8_t slot = chunk.Code()[offset + 1];
+	uint8_t constant = chunk.Code()[offset + 2];
+	printf("%-16s %4d %4d '", name, slot, constant);
+	PrintValue(chunk.m_oConstants.m_vValues[constant]);
+	printf("'\n");
+	return offset + chunk.InstructionSize(offset);
+}
+
+// Print OP_JUMP_IF_NOT_LESS_LOCAL_CONST, a local slot and a constant then a jump (5 bytes)
+static int localConstantJumpInstruction(const char* name, Chunk& chunk, int offset)
+{
+	uint8_t slot = chunk.Code()[offset + 1];
+	uint8_t constant = chunk.Code()[offset + 2];
+	uint16_t jump = (uint16_t)(chunk.Code()[offset + 3] << 8);
+	jump |= chunk.Code()[offset + 4];
+	printf("%-16s %4d %4d '", name, slot, constant);
+	PrintValue(chunk.m_oConstants.m_vValues[constant]);
+	printf("' -> %d\n", offset + 5 + jump);
+	return offset + 5;
+}
+
+// Print OP_GET_LOCAL_PROPERTY, a local slot then a property access (5 bytes)
+static int localCachedInstruction(const char* name, Chunk& chunk, int offset)
+{
+	uint8_t slot = chunk.Code()[offset + 1];
+	uint8_t constant = chunk.Code()[offset + 2];
+	uint16_t cache = (uint16_t)(chunk.Code()[offset + 3] << 8);
+	cache |= chunk.Code()[offset + 4];
+	printf("%-16s %4d %4d '", name, slot, constant);
+	PrintValue(chunk.m_oConstants.m_vValues[constant]);
+	printf("' (cache %d)\n", cache);
+	return offset + 5;
+}
+
+// Print OP_JUMP_IF_NOT_LESS_LOCAL, two local slots then a jump (5 bytes)
+static int localsJumpInstruction(const char* name, Chunk& chunk, int offset)
+{
+	uint16_t jump = (uint16_t)(chunk.Code()[offset + 3] << 8);
+	jump |= chunk.Code()[offset + 4];
+	printf("%-16s %4d %4d -> %d\n", name, chunk.Code()[offset + 1], chunk.Code()[offset + 2], offset + 5 + jump);
+	return offset + 5;
+}
+
 void disassembleChunk(Chunk& chunk, const char* name)
 {
     printf("== %s ==\n", name);
 
-    for (int offset = 0; offset < chunk.m_vCode.size();) {
+    for (int offset = 0; offset < chunk.Code().size();) {
         offset = disassembleInstruction(chunk, offset);
     }
 }
 
+const char* opcodeName(uint8_t instruction)
+{
+	static const char* names[] = {
+		#define OPCODE(name) #name,
+		#include "opcodes.h"
+		#undef OPCODE
+	};
+	return instruction < OP_TOTAL ? names[instruction] : "OP_UNKNOWN";
+}
+
 int disassembleInstruction(Chunk& chunk, int offset)
 {
     printf("%04d ", offset);
 
-    if (offset > 0 && chunk.m_vLines[offset] == chunk.m_vLines[offset - 1])
+    if (offset > 0 && (*chunk.m_pLines)[offset] == (*chunk.m_pLines)[offset - 1])
         printf("   | ");
     else
-        printf("%4d ", chunk.m_vLines[offset]);
+        printf("%4d ", (*chunk.m_pLines)[offset]);
 
-    uint8_t instruction = chunk.m_vCode[offset];
+    uint8_t instruction = chunk.Code()[offset];
     switch (instruction)
 	{
 		case OP_CONST:
@@ -97,12 +175,12 @@ int disassembleInstruction(Chunk& chunk, int offset)
 		case OP_SET_LOCAL:
 			return byteInstruction("OP_SET_LOCAL", chunk, offset);
 
-		case OP_GET_GLOBAL:
-			return constantInstruction("OP_GET_GLOBAL", chunk, offset);
-		case OP_DEFINE_GLOBAL:
-			return constantInstruction("OP_DEFINE_GLOBAL", chunk, offset);
-		case OP_SET_GLOBAL:
-			return constantInstruction("OP_SET_GLOBAL", chunk, offset);
+		case OP_GET_MODULE_VAR:
+			return shortInstruction("OP_GET_MODULE_VAR", chunk, offset);
+		case OP_DEFINE_MODULE_VAR:
+			return shortInstruction("OP_DEFINE_MODULE_VAR", chunk, offset);
+		case OP_SET_MODULE_VAR:
+			return shortInstruction("OP_SET_MODULE_VAR", chunk, offset);
 
 		case OP_GET_UPVALUE:
 			return byteInstruction("OP_GET_UPVALUE", chunk, offset);
@@ -110,9 +188,9 @@ int disassembleInstruction(Chunk& chunk, int offset)
 			return byteInstruction("OP_SET_UPVALUE", chunk, offset);
 
 		case OP_GET_PROPERTY:
-			return constantInstruction("OP_GET_PROPERTY", chunk, offset);
+			return cachedInstruction("OP_GET_PROPERTY", chunk, offset);
 		case OP_SET_PROPERTY:
-			return constantInstruction("OP_SET_PROPERTY", chunk, offset);
+			return cachedInstruction("OP_SET_PROPERTY", chunk, offset);
 
 		case OP_GET_SUPER:
 			return constantInstruction("OP_GET_SUPER", chunk, offset);
@@ -132,6 +210,18 @@ int disassembleInstruction(Chunk& chunk, int offset)
 			return simpleInstruction("OP_MUL", offset);
 		case OP_DIV:
 			return simpleInstruction("OP_DIV", offset);
+		case OP_BIT_AND:
+			return simpleInstruction("OP_BIT_AND", offset);
+		case OP_BIT_OR:
+			return simpleInstruction("OP_BIT_OR", offset);
+		case OP_BIT_XOR:
+			return simpleInstruction("OP_BIT_XOR", offset);
+		case OP_BIT_NOT:
+			return simpleInstruction("OP_BIT_NOT", offset);
+		case OP_SHIFT_LEFT:
+			return simpleInstruction("OP_SHIFT_LEFT", offset);
+		case OP_SHIFT_RIGHT:
+			return simpleInstruction("OP_SHIFT_RIGHT", offset);
 		case OP_NOT:
 			return simpleInstruction("OP_NOT", offset);
 		case OP_NEGATE:
@@ -150,6 +240,8 @@ int disassembleInstruction(Chunk& chunk, int offset)
 			return jumpInstruction("OP_LOOP", -1, chunk, offset);
 		case OP_CALL:
 			return byteInstruction("OP_CALL", chunk, offset);
+		case OP_TAIL_CALL:
+			return byteInstruction("OP_TAIL_CALL", chunk, offset);
 		case OP_INVOKE:
 			return invokeInstruction("OP_INVOKE", chunk, offset);
 		case OP_SUPER_INVOKE:
@@ -157,15 +249,15 @@ int disassembleInstruction(Chunk& chunk, int offset)
 		case OP_CLOSURE:
         {
 			offset++;
-			uint8_t constant = chunk.m_vCode[offset++];
+			uint8_t constant = chunk.Code()[offset++];
 			printf("%-16s %4d ", "OP_CLOSURE", constant);
 			PrintValue(chunk.m_oConstants.m_vValues[constant]);
 			printf("\n");
 			ObjectFunction* function = Fox_AsFunction(chunk.m_oConstants.m_vValues[constant]);
 			for (int j = 0; j < function->upValueCount; j++)
             {
-				int is_local = chunk.m_vCode[offset++];
-				int index = chunk.m_vCode[offset++];
+				int is_local = chunk.Code()[offset++];
+				int index = chunk.Code()[offset++];
 				printf("%04d      |                     %s %d\n",
 					offset - 2, is_local ? "local" : "upvalue", index);
 			}
@@ -189,6 +281,48 @@ int disassembleInstruction(Chunk& chunk, int offset)
 			return simpleInstruction("OP_END_MODULE", offset);
 		case OP_END:
 			return simpleInstruction("OP_END", offset);
+		case OP_ADD_NUM:
+			return simpleInstruction("OP_ADD_NUM", offset);
+		case OP_ADD_STR:
+			return simpleInstruction("OP_ADD_STR", offset);
+		case OP_SUB_NUM:
+			return simpleInstruction("OP_SUB_NUM", offset);
+		case OP_MUL_NUM:
+			return simpleInstruction("OP_MUL_NUM", offset);
+		case OP_LESS_NUM:
+			return simpleInstruction("OP_LESS_NUM", offset);
+		case OP_GREATER_NUM:
+			return simpleInstruction("OP_GREATER_NUM", offset);
+		case OP_GET_LOCAL_PROPERTY:
+			return localCachedInstruction("OP_GET_LOCAL_PROPERTY", chunk, offset);
+		case OP_LESS_LOCAL_CONST:
+			return localConstantInstruction("OP_LESS_LOCAL_CONST", chunk, offset);
+		case OP_ADD_LOCAL_CONST:
+			return localConstantInstruction("OP_ADD_LOCAL_CONST", chunk, offset);
+		case OP_SUB_LOCAL_CONST:
+			return localConstantInstruction("OP_SUB_LOCAL_CONST", chunk, offset);
+		case OP_STORE_LOCAL:
+			return byteInstruction("OP_STORE_LOCAL", chunk, offset);
+		case OP_STORE_MODULE_VAR:
+			return shortInstruction("OP_STORE_MODULE_VAR", chunk, offset);
+		case OP_RETURN_LOCAL:
+			return byteInstruction("OP_RETURN_LOCAL", chunk, offset);
+		case OP_JUMP_IF_NOT_LESS:
+			return jumpInstruction("OP_JUMP_IF_NOT_LESS", 1, chunk, offset);
+		case OP_JUMP_IF_NOT_GREATER:
+			return jumpInstruction("OP_JUMP_IF_NOT_GREATER", 1, chunk, offset);
+		case OP_JUMP_IF_LESS:
+			return jumpInstruction("OP_JUMP_IF_LESS", 1, chunk, offset);
+		case OP_JUMP_IF_GREATER:
+			return jumpInstruction("OP_JUMP_IF_GREATER", 1, chunk, offset);
+		case OP_JUMP_IF_NOT_LESS_LOCAL:
+			return localsJumpInstruction("OP_JUMP_IF_NOT_LESS_LOCAL", chunk, offset);
+		case OP_JUMP_IF_NOT_LESS_LOCAL_CONST:
+			return localConstantJumpInstruction("OP_JUMP_IF_NOT_LESS_LOCAL_CONST", chunk, offset);
+		case OP_INC_LOCAL:
+			return localConstantInstruction("OP_INC_LOCAL", chunk, offset);
+		case OP_DEC_LOCAL:
+			return localConstantInstruction("OP_DEC_LOCAL", chunk, offset);
 		default:
 			printf("Unknown opcode %d\n", instruction);
 			return offset + 1;
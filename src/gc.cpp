@@ -1,47 +1,169 @@
 #include <iostream>
 #include <memory>
 #include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
 #include <setjmp.h>
 #include "Parser.h"
 #include "vm.hpp"
 #include "gc.hpp"
+#include "marker.hpp"
 
 Traceable::Traceable()
 {
-	mMarked = false;
+	mMarked.store(false, std::memory_order_relaxed);
+	m_bOld = false;
+	m_bRemembered = false;
+	m_bInNursery = false;
+	m_iSize = 0;
+	m_pNextObject = nullptr;
+	m_pGC = nullptr;
 }
 
 Traceable::~Traceable() { }
 
 
-void Traceable::mark()
+void Traceable::markChildren(GC&) { }
+
+bool Traceable::HasWriteBarrier() const
+{
+	return false;
+}
+
+void Traceable::on_destroy()
+{
+}
+
+// The objects of a block start after its header, aligned like operator new.
+static const size_t NURSERY_ALIGN = alignof(std::max_align_t);
+static const size_t NURSERY_HEADER = NURSERY_ALIGN < 16 ? 16 : NURSERY_ALIGN;
+
+Nursery::Nursery()
+{
+	m_pCurrent = nullptr;
+	m_pTop = nullptr;
+	m_pEnd = nullptr;
+	m_pFree = nullptr;
+	m_iFreeCount = 0;
+}
+
+/**
+ * The GC frees all its objects before its nursery, so only the empty
+ * blocks are left.
+ */
+Nursery::~Nursery()
+{
+	std::free(m_pCurrent);
+	while (m_pFree != nullptr)
+	{
+		Block* pBlock = m_pFree;
+		m_pFree = pBlock->m_pNext;
+		std::free(pBlock);
+	}
+}
+
+Nursery::Block* Nursery::NewBlock()
 {
-	if (!mMarked)
+	static_assert(sizeof(Block) <= NURSERY_HEADER, "The objects must start after the header.");
+	Block* pBlock = m_pFree;
+	if (pBlock != nullptr)
+	{
+		m_pFree = pBlock->m_pNext;
+		m_iFreeCount--;
+	}
+	else
 	{
-		mMarked = true;
-		markChildren();
+		pBlock = (Block*) aligned_alloc(GC_NURSERY_BLOCK_SIZE, GC_NURSERY_BLOCK_SIZE);
+		if (pBlock == nullptr)
+			throw std::bad_alloc();
 	}
+	pBlock->m_iLive = 0;
+	pBlock->m_pNext = nullptr;
+	return pBlock;
 }
 
-void Traceable::markChildren() { }
+void* Nursery::Allocate(size_t iSize)
+{
+	iSize = (iSize + NURSERY_ALIGN - 1) & ~(NURSERY_ALIGN - 1);
+	if (m_pCurrent == nullptr || m_pTop + iSize > m_pEnd)
+	{
+		// The objects left in the old block keep it until they are freed.
+		Block* pOld = m_pCurrent;
+		m_pCurrent = NewBlock();
+		m_pTop = (char*) m_pCurrent + NURSERY_HEADER;
+		m_pEnd = (char*) m_pCurrent + GC_NURSERY_BLOCK_SIZE;
+		if (pOld != nullptr && pOld->m_iLive == 0)
+			Release(pOld);
+	}
+
+	void* pMemory = m_pTop;
+	m_pTop += iSize;
+	m_pCurrent->m_iLive++;
+	return pMemory;
+}
 
-void Traceable::on_destroy()
+void Nursery::Release(void* pMemory)
 {
+	Block* pBlock = (Block*) ((uintptr_t) pMemory & ~(uintptr_t) (GC_NURSERY_BLOCK_SIZE - 1));
+	if (pMemory != pBlock && --pBlock->m_iLive > 0)
+		return;
+
+	if (pBlock == m_pCurrent)
+	{
+		// Nothing is left in the current block, bump from its start again.
+		m_pTop = (char*) m_pCurrent + NURSERY_HEADER;
+	}
+	else if (m_iFreeCount < GC_NURSERY_FREE_BLOCKS)
+	{
+		pBlock->m_pNext = m_pFree;
+		m_pFree = pBlock;
+		m_iFreeCount++;
+	}
+	else
+		std::free(pBlock);
 }
 
 GC::GC()
 {
 	bytesAllocated = 0;
-	nextGC = 1024 * 1024;
+	nextGC = GC_MIN_NEXT_GC;
+	m_pYoung = nullptr;
+	m_pOld = nullptr;
+	m_iYoungBytes = 0;
+	m_bMinor = false;
+	m_bIncremental = false;
+	m_ePhase = GC_PHASE_IDLE;
+	m_bStepping = false;
+	m_ppSweep = nullptr;
+	m_pDead = nullptr;
+	m_iMarkThreads = std::thread::hardware_concurrency();
+	m_iParallelHeap = GC_PARALLEL_HEAP;
+	m_bParallel = false;
 }
 
 /**
- * Initializes address of the main frame.
+ * Frees every object, even in the middle of an incremental collection.
  */
 GC::~GC()
 {
-	m_oRoots.clear();
-	Collect();
+	// The destructors of the dead objects of the incremental sweep already
+	// ran.
+	Traceable* vLists[] = { m_pYoung, m_pOld, m_pDead };
+	for (Traceable* pList : { m_pYoung, m_pOld })
+	{
+		for (Traceable* p = pList; p != nullptr; p = p->m_pNextObject)
+			p->on_destroy();
+	}
+	for (Traceable* pList : vLists)
+	{
+		while (pList != nullptr)
+		{
+			Traceable* p = pList;
+			pList = p->m_pNextObject;
+			Free(p);
+		}
+	}
 }
 
 void GC::Dump(const char *label)
@@ -51,9 +173,13 @@ void GC::Dump(const char *label)
 
 	print("\n{");
 
-	for (const auto &it : m_oHeap)
+	for (Traceable* p = m_pYoung; p != nullptr; p = p->m_pNextObject)
+	{
+		print(p, ": {.marked = ", p->mMarked.load(), "}, ");
+	}
+	for (Traceable* p = m_pOld; p != nullptr; p = p->m_pNextObject)
 	{
-		print(it, ": {.marked = ", it->mMarked, "}, ");
+		print(p, ": {.marked = ", p->mMarked.load(), ", .old = 1}, ");
 	}
 
 	print("}\n");
@@ -80,12 +206,19 @@ void GC::PrintVector(std::vector<T> const &input)
 /**
  * Mark phase.
  */
-void GC::Mark()
+bool GC::Mark(size_t iBudget)
 {
-	for (ObjectSet::iterator it = m_oRoots.begin(); it != m_oRoots.end(); ++it)
+	while (!m_vGray.empty())
 	{
-    	(*it)->mark();
+		if (iBudget-- == 0)
+			return false;
+		Traceable* p = m_vGray.back();
+		m_vGray.pop_back();
+		p->markChildren(*this);
+		if (m_ePhase == GC_PHASE_MARK && !p->HasWriteBarrier())
+			m_vRescan.push_back(p);
 	}
+	return true;
 }
 
 std::uint32_t GC::add_callback(std::uint32_t id, std::function<void()> cb)
@@ -109,55 +242,210 @@ void GC::emit(std::uint32_t id)
     }
 }
 
-void GC::Prepare()
+/**
+ * Unlinks the white objects of [ppList] onto [pDead], and whitens and
+ * promotes the others. Returns the link at the end of the list.
+ */
+Traceable** GC::SweepList(Traceable** ppList, Traceable*& pDead)
 {
-	m_vBeCollected.clear();
-	for (ObjectSet::iterator it = m_oHeap.begin(); it != m_oHeap.end(); ++it)
+	Traceable** ppLink = ppList;
+	while (*ppLink != nullptr)
 	{
-		Traceable* p = *it;
-		// total++;
-		if (p && p->mMarked) {
-			p->mMarked = false;
-			// ++live;
+		Traceable* p = *ppLink;
+		if (p->mMarked.load(std::memory_order_relaxed)) {
+			p->mMarked.store(false, std::memory_order_relaxed);
+			p->m_bOld = true;
+			if (!p->HasWriteBarrier())
+				Remember(p);
+			ppLink = &p->m_pNextObject;
 		}
 		else {
-			p->on_destroy();
-			m_vBeCollected.push_back(it);
+			*ppLink = p->m_pNextObject;
+			p->m_pNextObject = pDead;
+			pDead = p;
 		}
 	}
+	return ppLink;
 }
 
 /**
- * Sweep phase.
+ * Sweep phase: a single walk of the young objects, and of the old ones
+ * in a full collection. The young survivors are promoted.
  */
 void GC::Sweep()
 {
-	// unsigned int live = 0;
-	// unsigned int dead = 0;
-	// unsigned int total = 0;
-	// std::vector<ObjectSet::iterator> erase;
-	// for (ObjectSet::iterator it = m_oHeap.begin(); it != m_oHeap.end(); ++it)
-	// {
-	// 	Traceable* p = *it;
-	// 	total++;
-	// 	if (p && p->mMarked) {
-	// 		p->mMarked = false;
-	// 		++live;
-	// 	}
-	// 	else {
-	// 		erase.push_back(it);
-	// 	}
-	// }
-	// dead = erase.size();
-	for (auto it : m_vBeCollected) {
-		Traceable* p = *it;
-		m_oHeap.erase(*it);
-		delete p;
-	}
-	// if (verbose) {
-	// 	cout << "GC: " << live << " objects live after sweep" << endl;
-	// 	cout << "GC: " << dead << " objects dead after sweep" << endl;
-  	// }
+	ForgetRemembered();
+
+	Traceable* pDead = nullptr;
+	if (!m_bMinor)
+		SweepList(&m_pOld, pDead);
+	SweepYoung(pDead);
+
+	// Every destructor runs before any object is freed, as they may still
+	// look at each other.
+	for (Traceable* p = pDead; p != nullptr; p = p->m_pNextObject)
+		p->on_destroy();
+	while (pDead != nullptr)
+	{
+		Traceable* p = pDead;
+		pDead = p->m_pNextObject;
+		Free(p);
+	}
+}
+
+void GC::ForgetRemembered()
+{
+	// Every young survivor is promoted, so once the sweep is done only the
+	// old objects without a write barrier may reference young ones. A minor
+	// collection doesn't walk the old objects, so keeps them remembered.
+	size_t iKept = 0;
+	for (Traceable* p : m_vRemembered)
+	{
+		if (m_bMinor && !p->HasWriteBarrier())
+			m_vRemembered[iKept++] = p;
+		else
+			p->m_bRemembered = false;
+	}
+	m_vRemembered.resize(iKept);
+}
+
+Traceable** GC::SweepYoung(Traceable*& pDead)
+{
+	Traceable** ppEnd = SweepList(&m_pYoung, pDead);
+	Traceable** ppFirstOld = ppEnd == &m_pYoung ? &m_pOld : ppEnd;
+	*ppEnd = m_pOld;
+	m_pOld = m_pYoung;
+	m_pYoung = nullptr;
+	m_iYoungBytes = 0;
+	return ppFirstOld;
+}
+
+void GC::Free(Traceable* p)
+{
+	bytesAllocated -= p->m_iSize;
+	bool bInNursery = p->m_bInNursery;
+	p->~Traceable();
+	if (bInNursery)
+		m_oNursery.Release(p);
+	else
+		::operator delete(p);
+}
+
+void* GC::Allocate(size_t iSize)
+{
+	if (iSize <= GC_NURSERY_MAX_OBJECT)
+		return m_oNursery.Allocate(iSize);
+	return ::operator new(iSize);
+}
+
+void GC::Track(Traceable* p, size_t iSize)
+{
+	p->m_iSize = iSize;
+	p->m_bInNursery = iSize <= GC_NURSERY_MAX_OBJECT;
+	bytesAllocated += iSize;
+	m_iYoungBytes += iSize;
+
+	if (m_ePhase != GC_PHASE_IDLE)
+	{
+		// The young objects wait for the incremental collection to finish.
+		if (!m_bStepping)
+			Step();
+	}
+	else if (bytesAllocated > nextGC)
+    {
+		if (m_bIncremental)
+			StartIncremental();
+		else
+		{
+			ClearRoots();
+    		emit(GC_OnMark);
+    		Collect();
+		}
+    }
+	else if (m_iYoungBytes > GC_NURSERY_SIZE)
+		CollectYoung();
+	AddObject(p);
+}
+
+void GC::StartIncremental()
+{
+	m_ePhase = GC_PHASE_MARK;
+	ClearRoots();
+	emit(GC_OnMark);
+}
+
+void GC::Step()
+{
+	m_bStepping = true;
+	if (m_ePhase == GC_PHASE_MARK)
+	{
+		if (Mark(GC_INCREMENTAL_WORK))
+			FinishMark();
+		m_bStepping = false;
+		return;
+	}
+
+	for (size_t iWork = 0; iWork < GC_INCREMENTAL_WORK; iWork++)
+	{
+		Traceable* p = *m_ppSweep;
+		if (p != nullptr)
+		{
+			if (p->mMarked.load(std::memory_order_relaxed)) {
+				p->mMarked.store(false, std::memory_order_relaxed);
+				if (!p->HasWriteBarrier())
+					Remember(p);
+				m_ppSweep = &p->m_pNextObject;
+			}
+			else {
+				*m_ppSweep = p->m_pNextObject;
+				p->on_destroy();
+				p->m_pNextObject = m_pDead;
+				m_pDead = p;
+			}
+		}
+		else if (m_pDead != nullptr)
+		{
+			p = m_pDead;
+			m_pDead = p->m_pNextObject;
+			Free(p);
+		}
+		else
+		{
+			m_ePhase = GC_PHASE_IDLE;
+			m_ppSweep = nullptr;
+			nextGC = std::max(bytesAllocated * GC_HEAP_GROW_FACTOR, GC_MIN_NEXT_GC);
+			break;
+		}
+	}
+	m_bStepping = false;
+}
+
+/**
+ * The end of the incremental marking, done at once: the roots and the
+ * objects without a write barrier are traced again, then the young objects
+ * are swept and the old ones are left to the next slices.
+ */
+void GC::FinishMark()
+{
+	emit(GC_OnMark);
+	for (Traceable* p : m_vRescan)
+		m_vGray.push_back(p);
+	m_vRescan.clear();
+	m_ePhase = GC_PHASE_SWEEP;
+	Mark();
+	emit(GC_OnSweep);
+
+	ForgetRemembered();
+	Traceable* pDead = nullptr;
+	m_ppSweep = SweepYoung(pDead);
+	while (pDead != nullptr)
+	{
+		Traceable* p = pDead;
+		pDead = p->m_pNextObject;
+		p->on_destroy();
+		p->m_pNextObject = m_pDead;
+		m_pDead = p;
+	}
 }
 
 /**
@@ -165,15 +453,18 @@ void GC::Sweep()
  */
 void GC::Collect()
 {
-	Mark();
+	if (m_iMarkThreads > 1 && (size_t) bytesAllocated > m_iParallelHeap)
+		MarkParallel();
+	else
+		Mark();
 
 // #ifdef DEBUG
 	// if (m_pVm->IsLogGC())
 		// Dump("After mark:");
 // #endif
-	Prepare();
+	emit(GC_OnSweep);
 	Sweep();
-	nextGC = bytesAllocated * GC_HEAP_GROW_FACTOR;
+	nextGC = std::max(bytesAllocated * GC_HEAP_GROW_FACTOR, GC_MIN_NEXT_GC);
 
 // #ifdef DEBUG
 // 	if (m_pVm->IsLogGC())
@@ -181,27 +472,113 @@ void GC::Collect()
 // #endif
 }
 
+/**
+ * Minor GC: the old objects are assumed alive, and those which may
+ * reference young ones are traced along with the roots.
+ */
+void GC::CollectYoung()
+{
+	m_bMinor = true;
+	ClearRoots();
+	emit(GC_OnMark);
+	for (Traceable* p : m_vRemembered)
+		m_vGray.push_back(p);
+	Mark();
+	emit(GC_OnSweep);
+	Sweep();
+	m_bMinor = false;
+}
+
+void GC::MarkParallel()
+{
+	m_bParallel = true;
+	bool bMarked = ParallelMarker::Mark(*this, m_vGray, m_iMarkThreads);
+	m_bParallel = false;
+	// The pool is marking for the GC of another isolate.
+	if (!bMarked)
+		Mark();
+}
+
+void GC::SetIncremental(bool bIncremental)
+{
+	m_bIncremental = bIncremental;
+}
+
+void GC::SetMarkThreads(size_t iThreads)
+{
+	m_iMarkThreads = iThreads;
+}
+
+void GC::SetParallelHeap(size_t iBytes)
+{
+	m_iParallelHeap = iBytes;
+}
+
 void GC::AddObject(Traceable* o)
 {
-  	m_oHeap.insert(o);
+	o->m_pGC = this;
+	o->m_pNextObject = m_pYoung;
+	m_pYoung = o;
 }
 
 void GC::RemoveObject(Traceable* o)
 {
-	m_oHeap.erase(o);
+	if (o->m_bRemembered)
+	{
+		m_vRemembered.erase(std::find(m_vRemembered.begin(), m_vRemembered.end(), o));
+		o->m_bRemembered = false;
+	}
+
+	Traceable** ppList = o->m_bOld ? &m_pOld : &m_pYoung;
+	for (Traceable** ppLink = ppList; *ppLink != nullptr; ppLink = &(*ppLink)->m_pNextObject)
+	{
+		if (*ppLink == o)
+		{
+			// The incremental sweep must not be left on the unlinked object.
+			if (m_ppSweep == &o->m_pNextObject)
+				m_ppSweep = ppLink;
+			*ppLink = o->m_pNextObject;
+			o->m_pNextObject = nullptr;
+			return;
+		}
+	}
 }
 
-void GC::AddRoot(Traceable* root)
+bool GC::AddRoot(Traceable* root)
 {
-	m_oRoots.insert(root);
+	if (m_bMinor && root->m_bOld)
+	{
+		m_vGray.push_back(root);
+		return true;
+	}
+	return Shade(root);
 }
 
-void GC::RemoveRoot(Traceable* root)
+bool GC::Shade(Traceable* obj)
 {
-	m_oRoots.erase(root);
+	if (m_bMinor && obj->m_bOld)
+		return false;
+	if (m_bParallel)
+		return ParallelMarker::Shade(obj);
+	if (obj->mMarked.load(std::memory_order_relaxed))
+		return false;
+	obj->mMarked.store(true, std::memory_order_relaxed);
+	m_vGray.push_back(obj);
+	return true;
+}
+
+bool GC::IsWhite(Traceable* obj) const
+{
+	return !obj->mMarked.load(std::memory_order_relaxed) && !(m_bMinor && obj->m_bOld);
+}
+
+void GC::Remember(Traceable* obj)
+{
+	obj->m_bRemembered = true;
+	m_vRemembered.push_back(obj);
 }
 
 void GC::ClearRoots()
 {
-	m_oRoots.clear();
-}
\ No newline at end of file
+	m_vGray.clear();
+}
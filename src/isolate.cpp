@@ -0,0 +1,206 @@
+#include <algorithm>
+#include <fstream>
+#include <streambuf>
+
+#include "isolate.hpp"
+#include "object.hpp"
+
+/* --------- Message ------------------------------------------------- */
+
+Message::Message()
+{
+    m_eKind = NIL;
+    m_fNumber = 0;
+}
+
+bool Message::Copy(Value oValue, std::string& strError)
+{
+    std::vector<Object*> vPath;
+    return Copy(oValue, strError, vPath);
+}
+
+bool Message::Copy(Value oValue, std::string& strError, std::vector<Object*>& vPath)
+{
+    if (Fox_IsNil(oValue))
+        m_eKind = NIL;
+    else if (Fox_IsBool(oValue))
+    {
+        m_eKind = BOOL;
+        m_bBool = Fox_AsBool(oValue);
+    }
+    else if (Fox_IsInt(oValue))
+    {
+        m_eKind = INT;
+        m_iInt = Fox_AsInt(oValue);
+    }
+    else if (Fox_IsDouble(oValue))
+    {
+        m_eKind = NUMBER;
+        m_fNumber = Fox_AsNumber(oValue);
+    }
+    else if (Fox_IsString(oValue))
+    {
+        m_eKind = STRING;
+        m_strString = Fox_AsString(oValue)->string;
+    }
+    else if (Fox_IsArray(oValue) || Fox_IsMap(oValue))
+    {
+        // The copy would never end.
+        Object* pObject = Fox_AsObject(oValue);
+        if (std::find(vPath.begin(), vPath.end(), pObject) != vPath.end())
+        {
+            strError = "Cannot send a value that contains itself.";
+            return false;
+        }
+        vPath.push_back(pObject);
+
+        std::vector<Value> vValues;
+        if (Fox_IsArray(oValue))
+        {
+            m_eKind = ARRAY;
+            vValues = Fox_AsArray(oValue)->m_vValues;
+        }
+        else
+        {
+            m_eKind = MAP;
+            for (auto& oEntry : Fox_AsMap(oValue)->m_vValues.m_vEntries)
+            {
+                if (Fox_IsNil(oEntry.m_oKey))
+                    continue;
+                vValues.push_back(oEntry.m_oKey);
+                vValues.push_back(oEntry.m_oValue);
+            }
+        }
+
+        m_vItems.resize(vValues.size());
+        for (size_t i = 0; i < vValues.size(); i++)
+        {
+            if (!m_vItems[i].Copy(vValues[i], strError, vPath))
+                return false;
+        }
+        vPath.pop_back();
+    }
+    else
+    {
+        strError = "Only nil, booleans, numbers, strings, arrays and maps can be sent to another VM.";
+        return false;
+    }
+    return true;
+}
+
+Value Message::ToValue(VM* pVM) const
+{
+    switch (m_eKind)
+    {
+    case NIL:    return Fox_Nil;
+    case BOOL:   return Fox_Bool(m_bBool);
+    case INT:    return Fox_Int(m_iInt);
+    case NUMBER: return Fox_Number(m_fNumber);
+    case STRING: return pVM->NewString(m_strString);
+    case ARRAY:
+    {
+        // The collector may run while the elements are built, so the array
+        // stays on the stack until it is complete.
+        ObjectArray* pArray = pVM->gc.New<ObjectArray>();
+        pVM->Push(Fox_Object(pArray));
+        for (const Message& oItem : m_vItems)
+        {
+            Value oItemValue = oItem.ToValue(pVM);
+            pArray->m_vValues.push_back(oItemValue);
+            WriteBarrier(pArray, oItemValue);
+        }
+        return pVM->Pop();
+    }
+    case MAP:
+    {
+        ObjectMap* pMap = pVM->gc.New<ObjectMap>();
+        pVM->Push(Fox_Object(pMap));
+        for (size_t i = 0; i + 1 < m_vItems.size(); i += 2)
+        {
+            pVM->Push(m_vItems[i].ToValue(pVM));
+            Value oItemValue = m_vItems[i + 1].ToValue(pVM);
+            pMap->m_vValues.Set(pVM->Pop(), oItemValue);
+        }
+        return pVM->Pop();
+    }
+    }
+    return Fox_Nil;
+}
+
+/* --------- Channel ------------------------------------------------- */
+
+void Channel::Send(Message&& oMessage)
+{
+    {
+        std::lock_guard<std::mutex> oLock(m_oMutex);
+        if (m_bClosed)
+            return;
+        m_vMessages.push_back(std::move(oMessage));
+    }
+    m_oReady.notify_one();
+}
+
+bool Channel::Receive(Message& oMessage)
+{
+    std::unique_lock<std::mutex> oLock(m_oMutex);
+    m_oReady.wait(oLock, [this] { return !m_vMessages.empty() || m_bClosed; });
+    if (m_vMessages.empty())
+        return false;
+    oMessage = std::move(m_vMessages.front());
+    m_vMessages.pop_front();
+    return true;
+}
+
+void Channel::Close()
+{
+    {
+        std::lock_guard<std::mutex> oLock(m_oMutex);
+        m_bClosed = true;
+    }
+    m_oReady.notify_all();
+}
+
+/* --------- Isolate ------------------------------------------------- */
+
+Isolate::Isolate(const std::string& strPath, int argc, char** argv, std::function<void(VM&)> setup)
+{
+    m_eResult = INTERPRET_OK;
+    m_oThread = std::thread(&Isolate::Run, this, strPath, argc, argv, setup);
+}
+
+Isolate::~Isolate()
+{
+    if (m_oThread.joinable())
+        Join();
+}
+
+InterpretResult Isolate::Join()
+{
+    // A script still waiting for messages gets nil and can end.
+    m_oInbox.Close();
+    if (m_oThread.joinable())
+        m_oThread.join();
+    return m_eResult;
+}
+
+void Isolate::Run(std::string strPath, int argc, char** argv, std::function<void(VM&)> setup)
+{
+    std::ifstream oFile(strPath);
+    if (!oFile.is_open())
+    {
+        fprintf(stderr, "Cannot open the worker script '%s'.\n", strPath.c_str());
+        m_eResult = INTERPRET_COMPILE_ERROR;
+        m_oOutbox.Close();
+        return;
+    }
+    std::string strSource((std::istreambuf_iterator<char>(oFile)), std::istreambuf_iterator<char>());
+
+    VM oVM(argc, argv);
+    oVM.m_pIsolate = this;
+    if (setup)
+        setup(oVM);
+    m_eResult = oVM.Interpret("main", strSource);
+
+    // The VM that started us gets nil once it has read everything.
+    m_oOutbox.Close();
+}
@@ -0,0 +1,914 @@
+#include <string.h>
+#include "jit.hpp"
+#include "object.hpp"
+#include "Parser.h"
+#include "vm.hpp"
+
+#if FOX_JIT
+
+#include <sys/mman.h>
+#include <unistd.h>
+
+static_assert(sizeof(Value) == 8, "The JIT expects NaN-tagged values.");
+
+// The x86-64 registers, numbered the way instructions encode them.
+enum Register
+{
+    RAX, RCX, RDX, RBX, RSP, RBP, RSI, RDI,
+    R8, R9, R10, R11, R12, R13, R14, R15
+};
+
+enum Condition
+{
+    CC_O  = 0x0,
+    CC_E  = 0x4,
+    CC_NE = 0x5,
+    CC_L  = 0xc,
+    CC_G  = 0xf
+};
+
+// The compiled code keeps the JitState and the interpreter's stack registers
+// in callee-saved registers, so the runtime helpers don't clobber them.
+static const int STATE = RBX;
+static const int STACK_TOP = R12;
+static const int SLOTS = R13;
+static const int MODULE_VARIABLES = R15;
+
+// The upper half of an integer value, see FOX_INT_BIT.
+static const uint32_t INT_TAG = (uint32_t)((FOX_QNAN | FOX_INT_BIT) >> 32);
+
+// Just enough of an x86-64 assembler for the baseline compiler. Jumps always
+// use 32-bit displacements so they can be patched once the target is known.
+class JitAssembler
+{
+public:
+    std::vector<uint8_t> m_vCode;
+
+    size_t Size() const { return m_vCode.size(); }
+
+    void Byte(uint8_t uByte) { m_vCode.push_back(uByte); }
+
+    void Dword(uint32_t uValue)
+    {
+        for (int i = 0; i < 4; i++)
+            Byte((uint8_t)(uValue >> (8 * i)));
+    }
+
+    void Qword(uint64_t uValue)
+    {
+        for (int i = 0; i < 8; i++)
+            Byte((uint8_t)(uValue >> (8 * i)));
+    }
+
+    void Rex(bool bWide, int iReg, int iRm)
+    {
+        uint8_t uRex = 0x40 | (bWide << 3) | ((iReg >> 3) << 2) | (iRm >> 3);
+        if (uRex != 0x40)
+            Byte(uRex);
+    }
+
+    // A ModRM byte for two registers.
+    void Direct(int iReg, int iRm) { Byte(0xc0 | ((iReg & 7) << 3) | (iRm & 7)); }
+
+    // A ModRM byte for [base + disp32].
+    void Memory(int iReg, int iBase, int32_t iDisp)
+    {
+        Byte(0x80 | ((iReg & 7) << 3) | (iBase & 7));
+        if ((iBase & 7) == RSP)
+            Byte(0x24);
+        Dword((uint32_t)iDisp);
+    }
+
+    void Push(int iReg) { Rex(false, 0, iReg); Byte(0x50 | (iReg & 7)); }
+    void Pop(int iReg)  { Rex(false, 0, iReg); Byte(0x58 | (iReg & 7)); }
+    void Ret()          { Byte(0xc3); }
+
+    // mov dst, [base + disp]
+    void Load(int iDst, int iBase, int32_t iDisp)
+    {
+        Rex(true, iDst, iBase);
+        Byte(0x8b);
+        Memory(iDst, iBase, iDisp);
+    }
+
+    // mov [base + disp], src
+    void Store(int iBase, int32_t iDisp, int iSrc)
+    {
+        Rex(true, iSrc, iBase);
+        Byte(0x89);
+        Memory(iSrc, iBase, iDisp);
+    }
+
+    void MovImm(int iDst, uint64_t uValue)
+    {
+        Rex(true, 0, iDst);
+        Byte(0xb8 | (iDst & 7));
+        Qword(uValue);
+    }
+
+    void MovImm32(int iDst, uint32_t uValue)
+    {
+        Rex(false, 0, iDst);
+        Byte(0xb8 | (iDst & 7));
+        Dword(uValue);
+    }
+
+    void Mov(int iDst, int iSrc) { Rex(true, iSrc, iDst); Byte(0x89); Direct(iSrc, iDst); }
+
+    // add reg, imm8 (64 bits)
+    void AddImm(int iReg, int8_t iValue)
+    {
+        Rex(true, 0, iReg);
+        Byte(0x83);
+        Direct(0, iReg);
+        Byte((uint8_t)iValue);
+    }
+
+    void Or(int iDst, int iSrc)   { Rex(true, iSrc, iDst); Byte(0x09); Direct(iSrc, iDst); }
+    void Cmp(int iDst, int iSrc)  { Rex(true, iSrc, iDst); Byte(0x39); Direct(iSrc, iDst); }
+
+    // 32-bit arithmetic on the payload of integer values. Writing the lower
+    // half of a register clears the upper one.
+    void Add32(int iDst, int iSrc)  { Rex(false, iSrc, iDst); Byte(0x01); Direct(iSrc, iDst); }
+    void Sub32(int iDst, int iSrc)  { Rex(false, iSrc, iDst); Byte(0x29); Direct(iSrc, iDst); }
+    void Cmp32(int iDst, int iSrc)  { Rex(false, iSrc, iDst); Byte(0x39); Direct(iSrc, iDst); }
+    void Imul32(int iDst, int iSrc) { Rex(false, iDst, iSrc); Byte(0x0f); Byte(0xaf); Direct(iDst, iSrc); }
+
+    void Cmp32Imm(int iReg, uint32_t uValue)
+    {
+        Rex(false, 0, iReg);
+        Byte(0x81);
+        Direct(7, iReg);
+        Dword(uValue);
+    }
+
+    void Shr(int iReg, uint8_t uCount)
+    {
+        Rex(true, 0, iReg);
+        Byte(0xc1);
+        Direct(5, iReg);
+        Byte(uCount);
+    }
+
+    // setcc on AL, CL, DL or BL.
+    void Set(Condition eCondition, int iReg)
+    {
+        Byte(0x0f);
+        Byte(0x90 | eCondition);
+        Direct(0, iReg);
+    }
+
+    // Turns the flag in AL into a bool value in RAX.
+    void BoolFromAl()
+    {
+        Byte(0x0f); Byte(0xb6); Direct(RAX, RAX);       // movzx eax, al
+        Byte(0x83); Direct(1, RAX); Byte(FOX_TAG_FALSE); // or eax, 2
+        MovImm(RDX, FOX_QNAN);
+        Or(RAX, RDX);
+    }
+
+    void TestAl()  { Byte(0x84); Direct(RAX, RAX); }
+    void TestEax() { Byte(0x85); Direct(RAX, RAX); }
+
+    void Call(int iReg) { Rex(false, 0, iReg); Byte(0xff); Direct(2, iReg); }
+
+    // call [base + disp]
+    void CallMemory(int iBase, int32_t iDisp)
+    {
+        Rex(false, 0, iBase);
+        Byte(0xff);
+        Memory(2, iBase, iDisp);
+    }
+
+    // cmp dword [base + disp], imm8
+    void Cmp32Memory(int iBase, int32_t iDisp, int8_t iValue)
+    {
+        Rex(false, 0, iBase);
+        Byte(0x83);
+        Memory(7, iBase, iDisp);
+        Byte((uint8_t)iValue);
+    }
+
+    // jmp [base + disp]
+    void JumpMemory(int iBase, int32_t iDisp)
+    {
+        Rex(false, 0, iBase);
+        Byte(0xff);
+        Memory(4, iBase, iDisp);
+    }
+
+    // Emits a jump and returns the position of its displacement.
+    size_t Jump()
+    {
+        Byte(0xe9);
+        Dword(0);
+        return Size() - 4;
+    }
+
+    size_t Jump(Condition eCondition)
+    {
+        Byte(0x0f);
+        Byte(0x80 | eCondition);
+        Dword(0);
+        return Size() - 4;
+    }
+
+    void Patch(size_t uJump, size_t uTarget)
+    {
+        uint32_t uDisp = (uint32_t)((int64_t)uTarget - (int64_t)(uJump + 4));
+        memcpy(&m_vCode[uJump], &uDisp, 4);
+    }
+
+    void JumpTo(size_t uTarget) { Patch(Jump(), uTarget); }
+};
+
+// The runtime helpers the compiled code calls when the operands of an
+// instruction aren't two integers. They return false, leaving the stack
+// untouched, when the interpreter must run the instruction instead: an
+// overloaded operator or an error. The compiled code stores the top of its
+// stack in the JitState before calling them, so the ones that allocate hand it
+// to the fiber first for the GC to see every value. None of them may throw,
+// there is no unwind information for the machine code.
+
+static bool JitArithmetic(JitState* pState, int iInstruction)
+{
+    Value& a = pState->m_pStackTop[-2];
+    Value& b = pState->m_pStackTop[-1];
+
+    if (iInstruction != OP_DIV && Fox_IsInt(a) && Fox_IsInt(b))
+    {
+        int64_t x = a.GetInt();
+        int64_t y = b.GetInt();
+        a.SetInteger(iInstruction == OP_ADD ? x + y : iInstruction == OP_SUB ? x - y : x * y);
+        return true;
+    }
+
+    if (iInstruction == OP_ADD && Fox_IsString(a) && Fox_IsString(b))
+    {
+        // Leaves the result in place of [a], like the arithmetic.
+        VM* pVM = pState->m_pVM;
+        pVM->m_pCurrentFiber->m_pStackTop = pState->m_pStackTop;
+        pVM->Concatenate();
+        return true;
+    }
+
+    if (!Fox_IsNumber(a) || !Fox_IsNumber(b))
+        return false;
+
+    double x = Fox_AsNumber(a);
+    double y = Fox_AsNumber(b);
+    switch (iInstruction)
+    {
+        case OP_ADD: a = Fox_Number(x + y); break;
+        case OP_SUB: a = Fox_Number(x - y); break;
+        case OP_MUL: a = Fox_Number(x * y); break;
+        default:     a = Fox_Number(x / y); break;
+    }
+    return true;
+}
+
+static bool JitCompare(JitState* pState, int iInstruction)
+{
+    Value& a = pState->m_pStackTop[-2];
+    Value& b = pState->m_pStackTop[-1];
+
+    if (!Fox_IsNumber(a) || !Fox_IsNumber(b))
+        return false;
+
+    double x = Fox_AsNumber(a);
+    double y = Fox_AsNumber(b);
+    a = Fox_Bool(iInstruction == OP_LESS ? x < y : x > y);
+    return true;
+}
+
+static bool JitEqual(JitState* pState, int)
+{
+    pState->m_pStackTop[-2] = Fox_Bool(ValuesEqual(pState->m_pStackTop[-2], pState->m_pStackTop[-1]));
+    return true;
+}
+
+static bool JitNegate(JitState* pState, int)
+{
+    Value& a = pState->m_pStackTop[-1];
+
+    if (Fox_IsInt(a) && a.GetInt() != INT32_MIN)
+        a.SetInt(-a.GetInt());
+    else if (Fox_IsNumber(a))
+        a = Fox_Number(-Fox_AsNumber(a));
+    else
+        return false;
+    return true;
+}
+
+// Points the state at the frame on top of [pFiber], for the machine code to
+// go on with it. The calls may have moved the stack, and declared module
+// variables.
+static void JitLoadFrame(JitState* pState, ObjectFiber* pFiber)
+{
+    CallFrame& oFrame = pFiber->m_vFrames[pFiber->m_iFrameCount - 1];
+    ObjectModule* pModule = oFrame.closure->function->module;
+    pState->m_pStackTop = pFiber->m_pStackTop;
+    pState->m_pSlots = oFrame.slots;
+    pState->m_pModuleVariables = pModule != nullptr ? pModule->m_vVariables.data() : nullptr;
+}
+
+// Points the state at the compiled function whose frame is on top of
+// [pFiber], for the machine code of its caller to call it.
+static int JitEnterCallee(JitState* pState, ObjectFiber* pFiber, ObjectFunction* pFunction)
+{
+    JitLoadFrame(pState, pFiber);
+    const CallFrame& oCallee = pFiber->m_vFrames[pFiber->m_iFrameCount - 1];
+    pState->m_pTarget = pFunction->jitCode->Entry(pFunction->chunk.Offset(oCallee.ip));
+    pState->m_iDepth++;
+    return 1;
+}
+
+// Once VM::CallValue() or VM::Invoke() has made the call of the frame at
+// [iCaller], tells the machine code how to go on: 0 once a native has left
+// its result on the stack, 1 once the frame of a compiled function has been
+// pushed, or JIT_EXIT_FRAMES to leave the rest to the interpreter.
+static int JitFinishCall(JitState* pState, ObjectFiber* pFiber, int iCaller)
+{
+    VM* pVM = pState->m_pVM;
+    if (pVM->m_pCurrentFiber != pFiber || pVM->result == INTERPRET_RUNTIME_ERROR ||
+        pVM->result == INTERPRET_ABORT || pVM->result == INTERPRET_SUSPEND)
+        return JIT_EXIT_FRAMES;
+
+    if (pFiber->m_iFrameCount == iCaller + 1)
+    {
+        JitLoadFrame(pState, pFiber);
+        return 0;
+    }
+    if (pFiber->m_iFrameCount != iCaller + 2)
+        return JIT_EXIT_FRAMES;
+
+    ObjectFunction* pFunction = pFiber->m_vFrames[iCaller + 1].closure->function;
+    if (pFunction->jitCode == nullptr && ++pFunction->hotness == FOX_JIT_THRESHOLD)
+        pVM->CompileHotFunction(pFunction);
+    if (pFunction->jitCode == nullptr || pState->m_iDepth == FOX_JIT_MAX_DEPTH)
+        return JIT_EXIT_FRAMES;
+    return JitEnterCallee(pState, pFiber, pFunction);
+}
+
+// OP_CALL at [iOffset], with [iNext] the instruction after it.
+static int JitCall(JitState* pState, int iOffset, int iNext)
+{
+    VM* pVM = pState->m_pVM;
+    ObjectFiber* pFiber = pVM->m_pCurrentFiber;
+    int iCaller = pFiber->m_iFrameCount - 1;
+    CallFrame& oFrame = pFiber->m_vFrames[iCaller];
+    uint8_t* pCode = oFrame.closure->function->chunk.Start();
+    int iArgCount = pCode[iOffset + 1];
+
+    oFrame.ip = pCode + iNext;
+    pFiber->m_pStackTop = pState->m_pStackTop;
+    Value oCallee = pFiber->m_pStackTop[-1 - iArgCount];
+
+    // A compiled closure called with the right number of arguments gets its
+    // frame here, the way VM::CallFunction() would push it.
+    if (Fox_IsClosure(oCallee))
+    {
+        ObjectClosure* pClosure = Fox_AsClosure(oCallee);
+        ObjectFunction* pFunction = pClosure->function;
+        Value* pSlots = pFiber->m_pStackTop - iArgCount - 1;
+        if (pFunction->jitCode != nullptr && iArgCount >= pFunction->iMinArity &&
+            iArgCount <= pFunction->iMaxArity && pFiber->m_iFrameCount < FRAMES_MAX &&
+            pState->m_iDepth < FOX_JIT_MAX_DEPTH &&
+            pSlots + pFunction->maxSlots <= pFiber->m_vStack.data() + pFiber->m_vStack.size())
+        {
+            CallFrame* pFrame = pFiber->PushFrame();
+            pFrame->closure = pClosure;
+            pFrame->ip = pFunction->chunk.Start();
+            pFrame->slots = pSlots;
+            return JitEnterCallee(pState, pFiber, pFunction);
+        }
+    }
+
+    if (!pVM->CallValue(oCallee, iArgCount))
+        return JIT_EXIT_ERROR;
+    return JitFinishCall(pState, pFiber, iCaller);
+}
+
+// OP_INVOKE at [iOffset], with [iNext] the instruction after it.
+static int JitInvoke(JitState* pState, int iOffset, int iNext)
+{
+    VM* pVM = pState->m_pVM;
+    ObjectFiber* pFiber = pVM->m_pCurrentFiber;
+    int iCaller = pFiber->m_iFrameCount - 1;
+    CallFrame& oFrame = pFiber->m_vFrames[iCaller];
+    Chunk& oChunk = oFrame.closure->function->chunk;
+    const std::vector<uint8_t>& vCode = oChunk.Code();
+    ObjectString* pMethod = Fox_AsString(oChunk.m_oConstants.m_vValues[vCode[iOffset + 1]]);
+    int iArgCount = vCode[iOffset + 2];
+    MethodCache& oCache = oChunk.m_vMethodCaches[(vCode[iOffset + 3] << 8) | vCode[iOffset + 4]];
+
+    oFrame.ip = oChunk.Start() + iNext;
+    pFiber->m_pStackTop = pState->m_pStackTop;
+    if (!pVM->Invoke(pMethod, iArgCount, &oCache))
+        return JIT_EXIT_ERROR;
+    return JitFinishCall(pState, pFiber, iCaller);
+}
+
+// Returns from a function the machine code called, with the value of the
+// local [iLocal], or the one on top of the stack when it is -1, the way
+// OP_RETURN does when the caller is in the same fiber. The state points back
+// at the caller afterwards.
+static void JitReturn(JitState* pState, int iLocal)
+{
+    VM* pVM = pState->m_pVM;
+    ObjectFiber* pFiber = pVM->m_pCurrentFiber;
+    Value* pSlots = pState->m_pSlots;
+    Value oResult = iLocal < 0 ? pState->m_pStackTop[-1] : pSlots[iLocal];
+
+    if (pFiber->m_vOpenUpvalues != nullptr && pFiber->m_vOpenUpvalues->location >= pSlots)
+        pVM->CloseUpvalues(pSlots);
+    pFiber->m_iFrameCount--;
+    *pSlots = oResult;
+    pFiber->m_pStackTop = pSlots + 1;
+    pState->m_iDepth--;
+    JitLoadFrame(pState, pFiber);
+}
+
+int JitLeave(JitState* pState, int iOffset)
+{
+    ObjectFiber* pFiber = pState->m_pVM->m_pCurrentFiber;
+    CallFrame& oFrame = pFiber->m_vFrames[pFiber->m_iFrameCount - 1];
+    oFrame.ip = oFrame.closure->function->chunk.Start() + iOffset;
+    pFiber->m_pStackTop = pState->m_pStackTop;
+    return JIT_EXIT_FRAMES;
+}
+
+typedef bool (*JitHelper)(JitState* pState, int iInstruction);
+typedef int (*JitCallHelper)(JitState* pState, int iOffset, int iNext);
+
+// Where the code for one instruction continues when its fast path doesn't
+// apply: call [m_pHelper], or leave the machine code when it is null.
+struct JitSlowPath
+{
+    std::vector<size_t> m_vJumps;
+    int m_iOffset;
+    // The instruction to go on with after the helper, or -1 to go back to
+    // [m_uResume] in the code of the same instruction.
+    int m_iNext;
+    JitHelper m_pHelper;
+    int m_iInstruction;
+    int m_iPop;
+    // Values a superinstruction pushed, dropped again before leaving.
+    int m_iDrop;
+    size_t m_uResume;
+};
+
+// Copies [oCode] to freshly mapped pages and makes them executable.
+static uint8_t* MapCode(const std::vector<uint8_t>& vCode, size_t& uSize)
+{
+    size_t uPage = (size_t)sysconf(_SC_PAGESIZE);
+    uSize = (vCode.size() + uPage - 1) / uPage * uPage;
+
+    void* pCode = mmap(nullptr, uSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (pCode == MAP_FAILED)
+        return nullptr;
+
+    memcpy(pCode, vCode.data(), vCode.size());
+    if (mprotect(pCode, uSize, PROT_READ | PROT_EXEC) != 0)
+    {
+        munmap(pCode, uSize);
+        return nullptr;
+    }
+    return (uint8_t*)pCode;
+}
+
+JitCode::JitCode(uint8_t* pCode, size_t uSize, std::vector<int32_t>&& vEntries)
+    : m_pCode(pCode), m_uSize(uSize), m_vEntries(std::move(vEntries))
+{
+}
+
+JitCode::~JitCode()
+{
+    munmap(m_pCode, m_uSize);
+}
+
+JitCode* JitCompile(ObjectFunction* pFunction)
+{
+    const Chunk& oChunk = pFunction->chunk;
+    const std::vector<uint8_t>& vCode = oChunk.Code();
+    int iSize = (int)vCode.size();
+
+    JitAssembler a;
+    std::vector<int32_t> vEntries(iSize, -1);
+    // Jumps to the entry of a bytecode instruction, patched at the end.
+    std::vector<std::pair<size_t, int>> vJumps;
+    std::vector<JitSlowPath> vSlowPaths;
+
+    auto loadState = [&]() {
+        a.Load(STACK_TOP, STATE, offsetof(JitState, m_pStackTop));
+        a.Load(SLOTS, STATE, offsetof(JitState, m_pSlots));
+        a.Load(MODULE_VARIABLES, STATE, offsetof(JitState, m_pModuleVariables));
+    };
+
+    // Save the callee-saved registers (keeping the stack aligned for the
+    // helper calls), load the state and go to the requested instruction.
+    a.Push(RBX);
+    a.Push(R12);
+    a.Push(R13);
+    a.Push(R15);
+    a.AddImm(RSP, -8);
+    a.Mov(STATE, RDI);
+    a.Store(STATE, offsetof(JitState, m_pNativeStack), RSP);
+    loadState();
+    a.JumpMemory(STATE, offsetof(JitState, m_pTarget));
+
+    // Every exit gets here with the offset to resume at in EAX, and drops the
+    // native frames of the functions the machine code called.
+    size_t uExit = a.Size();
+    a.Store(STATE, offsetof(JitState, m_pStackTop), STACK_TOP);
+    a.Load(RSP, STATE, offsetof(JitState, m_pNativeStack));
+    a.AddImm(RSP, 8);
+    a.Pop(R15);
+    a.Pop(R13);
+    a.Pop(R12);
+    a.Pop(RBX);
+    a.Ret();
+
+    auto exitAt = [&](int iOffset) {
+        a.MovImm32(RAX, (uint32_t)iOffset);
+        a.JumpTo(uExit);
+    };
+
+    auto push = [&](int iReg) {
+        a.Store(STACK_TOP, 0, iReg);
+        a.AddImm(STACK_TOP, 8);
+    };
+
+    // Jumps to the slow path unless the value in [iReg] is an integer.
+    auto guardInt = [&](int iReg, JitSlowPath& oSlow) {
+        a.Mov(RDX, iReg);
+        a.Shr(RDX, 32);
+        a.Cmp32Imm(RDX, INT_TAG);
+        oSlow.m_vJumps.push_back(a.Jump(CC_NE));
+    };
+
+    // Calls [pHelper] in place, for the instructions without a fast path.
+    auto callHelper = [&](JitHelper pHelper, int iInstruction, int iOffset, int iPop, int iDrop) {
+        a.Store(STATE, offsetof(JitState, m_pStackTop), STACK_TOP);
+        a.Mov(RDI, STATE);
+        a.MovImm32(RSI, (uint32_t)iInstruction);
+        a.MovImm(RAX, (uint64_t)(uintptr_t)pHelper);
+        a.Call(RAX);
+        a.TestAl();
+        size_t uContinue = a.Jump(CC_NE);
+        if (iDrop > 0)
+            a.AddImm(STACK_TOP, (int8_t)(-8 * iDrop));
+        exitAt(iOffset);
+        a.Patch(uContinue, a.Size());
+        if (iPop > 0)
+            a.AddImm(STACK_TOP, (int8_t)(-8 * iPop));
+    };
+
+    // Makes the call at [iOffset] through [pHelper], and goes on at the next
+    // instruction once the callee has returned, unless it left the machine
+    // code. A compiled callee is called right here, with the state pointing
+    // at it (16 bytes of native stack, keeping it aligned). The registers
+    // that point into the stack are reloaded, since it may have moved.
+    auto call = [&](JitCallHelper pHelper, int iOffset, int iNext) {
+        a.Store(STATE, offsetof(JitState, m_pStackTop), STACK_TOP);
+        a.Mov(RDI, STATE);
+        a.MovImm32(RSI, (uint32_t)iOffset);
+        a.MovImm32(RDX, (uint32_t)iNext);
+        a.MovImm(RAX, (uint64_t)(uintptr_t)pHelper);
+        a.Call(RAX);
+        a.TestEax();
+        a.Patch(a.Jump(CC_L), uExit);
+        size_t uReturned = a.Jump(CC_E);
+        loadState();
+        a.AddImm(RSP, -8);
+        a.CallMemory(STATE, offsetof(JitState, m_pTarget));
+        a.AddImm(RSP, 8);
+        a.Patch(uReturned, a.Size());
+        loadState();
+    };
+
+    // The return of a function the machine code called goes back to the
+    // machine code of its caller, the others leave it for the interpreter.
+    auto ret = [&](int iOffset, int iLocal) {
+        a.Cmp32Memory(STATE, offsetof(JitState, m_iDepth), 0);
+        size_t uCalled = a.Jump(CC_NE);
+        exitAt(iOffset);
+        a.Patch(uCalled, a.Size());
+        a.Store(STATE, offsetof(JitState, m_pStackTop), STACK_TOP);
+        a.Mov(RDI, STATE);
+        a.MovImm32(RSI, (uint32_t)iLocal);
+        a.MovImm(RAX, (uint64_t)(uintptr_t)JitReturn);
+        a.Call(RAX);
+        a.Ret();
+    };
+
+    // The arithmetic and comparison instructions: two integers are handled
+    // inline, anything else by a helper. [iDrop] is the number of operands a
+    // superinstruction pushed itself, to take back if the helper gives up.
+    auto binary = [&](int iInstruction, int iOffset, int iNext, int iDrop) {
+        bool bCompare = iInstruction == OP_LESS || iInstruction == OP_GREATER;
+        JitSlowPath oSlow = { {}, iOffset, iNext, bCompare ? JitCompare : JitArithmetic, iInstruction, 1, iDrop, 0 };
+
+        a.Load(RAX, STACK_TOP, -16);
+        a.Load(RCX, STACK_TOP, -8);
+        guardInt(RAX, oSlow);
+        guardInt(RCX, oSlow);
+
+        if (bCompare)
+        {
+            a.Cmp32(RAX, RCX);
+            a.Set(iInstruction == OP_LESS ? CC_L : CC_G, RAX);
+            a.BoolFromAl();
+        }
+        else
+        {
+            if (iInstruction == OP_ADD)
+                a.Add32(RAX, RCX);
+            else if (iInstruction == OP_SUB)
+                a.Sub32(RAX, RCX);
+            else
+                a.Imul32(RAX, RCX);
+            // On overflow the helper redoes it on 64 bits.
+            oSlow.m_vJumps.push_back(a.Jump(CC_O));
+            a.MovImm(RDX, FOX_QNAN | FOX_INT_BIT);
+            a.Or(RAX, RDX);
+        }
+        a.Store(STACK_TOP, -16, RAX);
+        a.AddImm(STACK_TOP, -8);
+        oSlow.m_uResume = a.Size();
+        vSlowPaths.push_back(oSlow);
+    };
+
+    // The compare-and-branch instructions: the comparison is done by binary()
+    // and the bool it leaves is popped and tested.
+    auto compareAndJump = [&](int iInstruction, int iOffset, int iDrop, bool bWhen, int iTarget) {
+        binary(iInstruction, iOffset, -1, iDrop);
+        a.Load(RAX, STACK_TOP, -8);
+        a.AddImm(STACK_TOP, -8);
+        a.MovImm(RDX, FOX_TRUE_BITS);
+        a.Cmp(RAX, RDX);
+        vJumps.push_back({ a.Jump(bWhen ? CC_E : CC_NE), iTarget });
+    };
+
+    int iNext;
+    for (int iOffset = 0; iOffset < iSize; iOffset = iNext)
+    {
+        vEntries[iOffset] = (int32_t)a.Size();
+        uint8_t uInstruction = vCode[iOffset];
+        iNext = iOffset + oChunk.InstructionSize(iOffset);
+        auto readShort = [&]() {
+            return (uint16_t)((vCode[iOffset + 1] << 8) | vCode[iOffset + 2]);
+        };
+
+        switch (uInstruction)
+        {
+            case OP_CONST:
+                a.MovImm(RAX, oChunk.m_oConstants.m_vValues[vCode[iOffset + 1]].m_uBits);
+                push(RAX);
+                break;
+
+            case OP_NIL:   a.MovImm(RAX, FOX_NIL_BITS);   push(RAX); break;
+            case OP_TRUE:  a.MovImm(RAX, FOX_TRUE_BITS);  push(RAX); break;
+            case OP_FALSE: a.MovImm(RAX, FOX_FALSE_BITS); push(RAX); break;
+
+            case OP_POP:
+                a.AddImm(STACK_TOP, -8);
+                break;
+
+            case OP_GET_LOCAL:
+                a.Load(RAX, SLOTS, 8 * vCode[iOffset + 1]);
+                push(RAX);
+                break;
+
+            case OP_SET_LOCAL:
+                a.Load(RAX, STACK_TOP, -8);
+                a.Store(SLOTS, 8 * vCode[iOffset + 1], RAX);
+                break;
+
+            case OP_GET_MODULE_VAR:
+            case OP_SET_MODULE_VAR:
+            case OP_STORE_MODULE_VAR:
+            {
+                // The interpreter reports the undefined variables.
+                int32_t iSlot = 8 * readShort();
+                a.Load(RAX, MODULE_VARIABLES, iSlot);
+                a.MovImm(RDX, FOX_UNDEFINED_BITS);
+                a.Cmp(RAX, RDX);
+                vSlowPaths.push_back({ { a.Jump(CC_E) }, iOffset, iNext, nullptr, 0, 0, 0, 0 });
+                if (uInstruction == OP_GET_MODULE_VAR)
+                    push(RAX);
+                else
+                {
+                    a.Load(RAX, STACK_TOP, -8);
+                    a.Store(MODULE_VARIABLES, iSlot, RAX);
+                    if (uInstruction == OP_STORE_MODULE_VAR)
+                        a.AddImm(STACK_TOP, -8);
+                }
+                break;
+            }
+
+            case OP_DEFINE_MODULE_VAR:
+                a.Load(RAX, STACK_TOP, -8);
+                a.Store(MODULE_VARIABLES, 8 * readShort(), RAX);
+                a.AddImm(STACK_TOP, -8);
+                break;
+
+            case OP_ADD:
+            case OP_ADD_NUM:
+            case OP_ADD_STR:
+                binary(OP_ADD, iOffset, iNext, 0);
+                break;
+
+            case OP_SUB:
+            case OP_SUB_NUM:
+                binary(OP_SUB, iOffset, iNext, 0);
+                break;
+
+            case OP_MUL:
+            case OP_MUL_NUM:
+                binary(OP_MUL, iOffset, iNext, 0);
+                break;
+
+            case OP_LESS:
+            case OP_LESS_NUM:
+                binary(OP_LESS, iOffset, iNext, 0);
+                break;
+
+            case OP_GREATER:
+            case OP_GREATER_NUM:
+                binary(OP_GREATER, iOffset, iNext, 0);
+                break;
+
+            case OP_INC_LOCAL:
+            case OP_DEC_LOCAL:
+                // Compiled as the two instructions they overlay, the
+                // OP_STORE_LOCAL gets its own entry.
+                iNext = iOffset + 3;
+                // Fall through.
+            case OP_LESS_LOCAL_CONST:
+            case OP_ADD_LOCAL_CONST:
+            case OP_SUB_LOCAL_CONST:
+                a.Load(RAX, SLOTS, 8 * vCode[iOffset + 1]);
+                push(RAX);
+                a.MovImm(RAX, oChunk.m_oConstants.m_vValues[vCode[iOffset + 2]].m_uBits);
+                push(RAX);
+                binary(uInstruction == OP_LESS_LOCAL_CONST ? OP_LESS :
+                    uInstruction == OP_ADD_LOCAL_CONST || uInstruction == OP_INC_LOCAL ? OP_ADD : OP_SUB,
+                    iOffset, iNext, 2);
+                break;
+
+            case OP_STORE_LOCAL:
+                a.Load(RAX, STACK_TOP, -8);
+                a.Store(SLOTS, 8 * vCode[iOffset + 1], RAX);
+                a.AddImm(STACK_TOP, -8);
+                break;
+
+            case OP_DIV:
+                callHelper(JitArithmetic, OP_DIV, iOffset, 1, 0);
+                break;
+
+            case OP_EQUAL:
+                callHelper(JitEqual, OP_EQUAL, iOffset, 1, 0);
+                break;
+
+            case OP_NEGATE:
+                callHelper(JitNegate, OP_NEGATE, iOffset, 0, 0);
+                break;
+
+            case OP_NOT:
+                a.Load(RCX, STACK_TOP, -8);
+                a.MovImm(RDX, FOX_NIL_BITS);
+                a.Cmp(RCX, RDX);
+                a.Set(CC_E, RAX);
+                a.MovImm(RDX, FOX_FALSE_BITS);
+                a.Cmp(RCX, RDX);
+                a.Set(CC_E, RCX);
+                a.Byte(0x08); a.Direct(RCX, RAX);               // or al, cl
+                a.BoolFromAl();
+                a.Store(STACK_TOP, -8, RAX);
+                break;
+
+            case OP_JUMP:
+                vJumps.push_back({ a.Jump(), iNext + readShort() });
+                break;
+
+            case OP_JUMP_IF_FALSE:
+            {
+                int iTarget = iNext + readShort();
+                a.Load(RAX, STACK_TOP, -8);
+                a.MovImm(RDX, FOX_FALSE_BITS);
+                a.Cmp(RAX, RDX);
+                vJumps.push_back({ a.Jump(CC_E), iTarget });
+                a.MovImm(RDX, FOX_NIL_BITS);
+                a.Cmp(RAX, RDX);
+                vJumps.push_back({ a.Jump(CC_E), iTarget });
+                break;
+            }
+
+            case OP_LOOP:
+                vJumps.push_back({ a.Jump(), iNext - readShort() });
+                break;
+
+            case OP_JUMP_IF_NOT_LESS:
+                compareAndJump(OP_LESS, iOffset, 0, false, iNext + readShort());
+                break;
+
+            case OP_JUMP_IF_NOT_GREATER:
+                compareAndJump(OP_GREATER, iOffset, 0, false, iNext + readShort());
+                break;
+
+            case OP_JUMP_IF_LESS:
+                compareAndJump(OP_LESS, iOffset, 0, true, iNext + readShort());
+                break;
+
+            case OP_JUMP_IF_GREATER:
+                compareAndJump(OP_GREATER, iOffset, 0, true, iNext + readShort());
+                break;
+
+            case OP_JUMP_IF_NOT_LESS_LOCAL:
+            case OP_JUMP_IF_NOT_LESS_LOCAL_CONST:
+                a.Load(RAX, SLOTS, 8 * vCode[iOffset + 1]);
+                push(RAX);
+                if (uInstruction == OP_JUMP_IF_NOT_LESS_LOCAL)
+                    a.Load(RAX, SLOTS, 8 * vCode[iOffset + 2]);
+                else
+                    a.MovImm(RAX, oChunk.m_oConstants.m_vValues[vCode[iOffset + 2]].m_uBits);
+                push(RAX);
+                compareAndJump(OP_LESS, iOffset, 2, false,
+                    iNext + ((vCode[iOffset + 3] << 8) | vCode[iOffset + 4]));
+                break;
+
+            case OP_CALL:
+                call(JitCall, iOffset, iNext);
+                break;
+
+            case OP_INVOKE:
+                call(JitInvoke, iOffset, iNext);
+                break;
+
+            case OP_RETURN:
+                ret(iOffset, -1);
+                break;
+
+            case OP_RETURN_LOCAL:
+                ret(iOffset, vCode[iOffset + 1]);
+                break;
+
+            default:
+                exitAt(iOffset);
+                break;
+        }
+    }
+
+    for (const JitSlowPath& oSlow : vSlowPaths)
+    {
+        for (size_t uJump : oSlow.m_vJumps)
+            a.Patch(uJump, a.Size());
+        if (oSlow.m_pHelper == nullptr)
+        {
+            exitAt(oSlow.m_iOffset);
+            continue;
+        }
+        callHelper(oSlow.m_pHelper, oSlow.m_iInstruction, oSlow.m_iOffset, oSlow.m_iPop, oSlow.m_iDrop);
+        if (oSlow.m_iNext < 0)
+            a.JumpTo(oSlow.m_uResume);
+        else
+            vJumps.push_back({ a.Jump(), oSlow.m_iNext });
+    }
+
+    for (const auto& oJump : vJumps)
+    {
+        if (oJump.second < 0 || oJump.second >= iSize || vEntries[oJump.second] < 0)
+            return nullptr;
+        a.Patch(oJump.first, (size_t)vEntries[oJump.second]);
+    }
+
+    size_t uMappedSize;
+    uint8_t* pCode = MapCode(a.m_vCode, uMappedSize);
+    if (pCode == nullptr)
+        return nullptr;
+    return new JitCode(pCode, uMappedSize, std::move(vEntries));
+}
+
+#else
+
+JitCode::JitCode(uint8_t* pCode, size_t uSize, std::vector<int32_t>&& vEntries)
+    : m_pCode(pCode), m_uSize(uSize), m_vEntries(std::move(vEntries))
+{
+}
+
+JitCode::~JitCode()
+{
+}
+
+JitCode* JitCompile(ObjectFunction* pFunction)
+{
+    return nullptr;
+}
+
+int JitLeave(JitState* pState, int iOffset)
+{
+    return JIT_EXIT_FRAMES;
+}
+
+#endif
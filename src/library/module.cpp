@@ -25,7 +25,7 @@ Value importNative(VM* oVM, int argCount, Value* args)
     {
         // The module has already been loaded. Remember it so we can import
         // variables from it if needed.
-        oVM->currentModule->m_vVariables.AddAll(Fox_AsModule(oVM->Pop())->m_vVariables);
+        oVM->currentModule->ImportVariables(*Fox_AsModule(oVM->Pop()));
         // currentModule = Fox_AsModule(Pop());
     }
     return Fox_Nil;
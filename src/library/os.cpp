@@ -55,15 +55,18 @@ Value exitNative(VM* oVM, int argCount, Value* args)
 Value argsNative(VM* oVM, int argCount, Value* args)
 {
     Fox_FixArity(oVM, argCount, 0);
+    // The array stays on the stack while the strings are allocated.
     Value oArray = Fox_NewArray(oVM);
     ObjectArray* pArray = Fox_AsArray(oArray);
-    std::vector<Value> vValues;
+    oVM->Push(oArray);
 
     for (int i = 1; i < oVM->argc; i++)
-        vValues.push_back(Fox_NewString(oVM, oVM->argv[i]));
-
-    pArray->m_vValues = vValues;
-    return oArray;
+    {
+        Value oString = Fox_NewString(oVM, oVM->argv[i]);
+        pArray->m_vValues.push_back(oString);
+        WriteBarrier(pArray, oString);
+    }
+    return oVM->Pop();
 }
 
 
@@ -0,0 +1,515 @@
+#include <algorithm>
+#include <deque>
+#include <functional>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <math.h>
+#include <poll.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#ifdef __linux__
+    #include <sys/epoll.h>
+#endif
+
+#include "library/library.h"
+#include "foxely.h"
+
+// The scheduler runs fibers spawned with scheduler.spawn() one after the other
+// on the thread of the VM. A fiber runs until it finishes or calls one of the
+// natives below that have to wait (yield, sleep, wait, read, write). Those
+// don't block: they suspend the fiber with INTERPRET_SUSPEND, which makes the
+// interpreter return to scheduler.run(), and the fiber is resumed by running
+// it again once its timer expired or its file descriptor is ready.
+
+// A fiber that can run, and the value the call that suspended it returns.
+// Fibers that never ran have no such call.
+struct Task
+{
+    ObjectFiber* pFiber;
+    Value oValue;
+    bool bResume;
+};
+
+struct SleepTimer
+{
+    double fWhen;
+    // Breaks ties so timers with the same deadline expire in order.
+    uint64_t uOrder;
+    ObjectFiber* pFiber;
+
+    bool operator>(const SleepTimer& oOther) const
+    {
+        return fWhen > oOther.fWhen || (fWhen == oOther.fWhen && uOrder > oOther.uOrder);
+    }
+};
+
+// A fiber waiting for a file descriptor. If [bIo] is set, the scheduler does
+// the read or write the fiber asked for once the descriptor is ready.
+struct IoWait
+{
+    ObjectFiber* pFiber = nullptr;
+    bool bIo = false;
+    // The bytes left to write, or the most to read in [uSize].
+    std::string strData;
+    size_t uSize = 0;
+    size_t uWritten = 0;
+};
+
+struct FdWait
+{
+    IoWait oRead;
+    IoWait oWrite;
+    bool bRegistered = false;
+};
+
+struct Scheduler
+{
+    std::deque<Task> vReady;
+    // A min-heap on the deadline.
+    std::vector<SleepTimer> vTimers;
+    uint64_t uTimers = 0;
+    std::unordered_map<int, FdWait> vWaiting;
+    int iPoll = -1;
+
+    // The fiber inside scheduler.run(), null when it isn't running.
+    ObjectFiber* pHost = nullptr;
+
+    ~Scheduler()
+    {
+        if (iPoll != -1)
+            close(iPoll);
+    }
+};
+
+static double Now()
+{
+    struct timespec oTime;
+    clock_gettime(CLOCK_MONOTONIC, &oTime);
+    return oTime.tv_sec * 1000.0 + oTime.tv_nsec / 1000000.0;
+}
+
+// Makes the interpreter return to scheduler.run() once the native calling this
+// returns. The fiber must already be queued somewhere to be resumed.
+static Value Suspend(VM* pVM)
+{
+    pVM->result = INTERPRET_SUSPEND;
+    return Fox_Nil;
+}
+
+// Only the fibers run by scheduler.run() can be suspended: anything else has
+// no loop to return to.
+static bool CanSuspend(VM* pVM)
+{
+    Scheduler& oScheduler = *pVM->m_pScheduler;
+    return oScheduler.pHost != nullptr && pVM->m_pCurrentFiber != oScheduler.pHost;
+}
+
+// Updates what the poller watches [iFd] for after its waiters changed.
+// Returns false if the descriptor can't be polled, like a regular file which
+// is always ready.
+static bool Watch(Scheduler& oScheduler, int iFd)
+{
+    FdWait& oWait = oScheduler.vWaiting[iFd];
+#ifdef __linux__
+    struct epoll_event oEvent;
+    oEvent.events = (oWait.oRead.pFiber ? (uint32_t) EPOLLIN : 0) | (oWait.oWrite.pFiber ? (uint32_t) EPOLLOUT : 0);
+    oEvent.data.fd = iFd;
+    if (oEvent.events == 0)
+    {
+        if (oWait.bRegistered)
+            epoll_ctl(oScheduler.iPoll, EPOLL_CTL_DEL, iFd, nullptr);
+        oScheduler.vWaiting.erase(iFd);
+        return true;
+    }
+    if (epoll_ctl(oScheduler.iPoll, oWait.bRegistered ? EPOLL_CTL_MOD : EPOLL_CTL_ADD, iFd, &oEvent) != 0)
+        return false;
+    oWait.bRegistered = true;
+#else
+    // poll() is handed the whole set every time, see WaitForEvents().
+    if (!oWait.oRead.pFiber && !oWait.oWrite.pFiber)
+        oScheduler.vWaiting.erase(iFd);
+#endif
+    return true;
+}
+
+// Waits at most [iTimeout] milliseconds, or forever if it is -1, for [iFd].
+static void PollOne(int iFd, bool bRead, int iTimeout)
+{
+    struct pollfd oPoll = { iFd, (short) (bRead ? POLLIN : POLLOUT), 0 };
+    while (poll(&oPoll, 1, iTimeout) < 0 && errno == EINTR)
+        ;
+}
+
+// Does the read or write of [oWait] on [iFd] without blocking. Returns false
+// if it has to wait for the descriptor, otherwise [oResult] is the string read
+// (nil at the end of the file) or how many bytes were written.
+static bool DoIo(VM* pVM, int iFd, IoWait& oWait, bool bRead, Value& oResult)
+{
+    int iFlags = fcntl(iFd, F_GETFL);
+    bool bBlocking = iFlags != -1 && !(iFlags & O_NONBLOCK);
+    if (bBlocking)
+    {
+        struct pollfd oPoll = { iFd, (short) (bRead ? POLLIN : POLLOUT), 0 };
+        if (poll(&oPoll, 1, 0) == 0)
+            return false;
+    }
+
+    if (bRead)
+    {
+        std::string strBuffer(oWait.uSize, '\0');
+        ssize_t iRead = read(iFd, &strBuffer[0], strBuffer.size());
+        if (iRead < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+            return false;
+        oResult = iRead > 0 ? pVM->NewString(strBuffer.substr(0, iRead)) : Fox_Nil;
+        return true;
+    }
+
+    // A blocking descriptor that is ready only takes PIPE_BUF bytes for sure.
+    size_t uLeft = oWait.strData.size() - oWait.uWritten;
+    ssize_t iWritten = write(iFd, oWait.strData.data() + oWait.uWritten,
+        bBlocking ? std::min(uLeft, (size_t) PIPE_BUF) : uLeft);
+    if (iWritten < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+        return false;
+    if (iWritten > 0)
+        oWait.uWritten += iWritten;
+    if (iWritten >= 0 && oWait.uWritten < oWait.strData.size())
+        return false;
+    oResult = Fox_Int(oWait.uWritten);
+    return true;
+}
+
+// Suspends the current fiber until [iFd] is ready, then does the I/O of
+// [oIo] if it has any. Outside of the scheduler, blocks until it is done.
+static Value WaitFor(VM* pVM, int iFd, bool bRead, IoWait oIo)
+{
+    Scheduler& oScheduler = *pVM->m_pScheduler;
+    Value oResult = Fox_Nil;
+    if (!CanSuspend(pVM))
+    {
+        while (oIo.bIo && !DoIo(pVM, iFd, oIo, bRead, oResult))
+            PollOne(iFd, bRead, -1);
+        if (!oIo.bIo)
+            PollOne(iFd, bRead, -1);
+        return oResult;
+    }
+
+    if (oIo.bIo && DoIo(pVM, iFd, oIo, bRead, oResult))
+        return oResult;
+
+    IoWait& oWait = bRead ? oScheduler.vWaiting[iFd].oRead : oScheduler.vWaiting[iFd].oWrite;
+    if (oWait.pFiber != nullptr)
+    {
+        Fox_RuntimeError(pVM, "Another fiber already waits to %s fd %d.", bRead ? "read" : "write", iFd);
+        return Fox_Nil;
+    }
+    oWait = oIo;
+    oWait.pFiber = pVM->m_pCurrentFiber;
+    if (Watch(oScheduler, iFd))
+        return Suspend(pVM);
+
+    // Regular files can't be polled, but they never make us wait either.
+    oWait = IoWait();
+    Watch(oScheduler, iFd);
+    while (oIo.bIo && !DoIo(pVM, iFd, oIo, bRead, oResult))
+        PollOne(iFd, bRead, -1);
+    return oResult;
+}
+
+// Queues the fiber waiting in [oWait] with the result of its I/O, unless the
+// descriptor turned out not to be ready after all.
+static void Complete(VM* pVM, Scheduler& oScheduler, int iFd, IoWait& oWait, bool bRead)
+{
+    Value oResult = Fox_Nil;
+    if (oWait.bIo && !DoIo(pVM, iFd, oWait, bRead, oResult))
+        return;
+    oScheduler.vReady.push_back({ oWait.pFiber, oResult, true });
+    oWait = IoWait();
+}
+
+// Blocks until a descriptor is ready or [iTimeout] milliseconds passed, and
+// queues the fibers waiting for the ready ones.
+static void WaitForEvents(VM* pVM, Scheduler& oScheduler, int iTimeout)
+{
+    std::vector<int> vReadable;
+    std::vector<int> vWritable;
+#ifdef __linux__
+    struct epoll_event vEvents[64];
+    int iCount = epoll_wait(oScheduler.iPoll, vEvents, 64, iTimeout);
+    for (int i = 0; i < iCount; i++)
+    {
+        // Errors and hang-ups wake everyone up, the I/O then reports them.
+        uint32_t uEvents = vEvents[i].events;
+        if (uEvents & (EPOLLIN | EPOLLERR | EPOLLHUP))
+            vReadable.push_back(vEvents[i].data.fd);
+        if (uEvents & (EPOLLOUT | EPOLLERR | EPOLLHUP))
+            vWritable.push_back(vEvents[i].data.fd);
+    }
+#else
+    std::vector<struct pollfd> vPolls;
+    for (auto& oEntry : oScheduler.vWaiting)
+    {
+        short iEvents = (oEntry.second.oRead.pFiber ? POLLIN : 0) | (oEntry.second.oWrite.pFiber ? POLLOUT : 0);
+        vPolls.push_back({ oEntry.first, iEvents, 0 });
+    }
+    if (poll(vPolls.data(), vPolls.size(), iTimeout) > 0)
+    {
+        for (struct pollfd& oPoll : vPolls)
+        {
+            if (oPoll.revents & (POLLIN | POLLERR | POLLHUP | POLLNVAL))
+                vReadable.push_back(oPoll.fd);
+            if (oPoll.revents & (POLLOUT | POLLERR | POLLHUP | POLLNVAL))
+                vWritable.push_back(oPoll.fd);
+        }
+    }
+#endif
+
+    for (int iFd : vReadable)
+    {
+        auto it = oScheduler.vWaiting.find(iFd);
+        if (it != oScheduler.vWaiting.end() && it->second.oRead.pFiber != nullptr)
+            Complete(pVM, oScheduler, iFd, it->second.oRead, true);
+    }
+    for (int iFd : vWritable)
+    {
+        auto it = oScheduler.vWaiting.find(iFd);
+        if (it != oScheduler.vWaiting.end() && it->second.oWrite.pFiber != nullptr)
+            Complete(pVM, oScheduler, iFd, it->second.oWrite, false);
+    }
+    for (int iFd : vReadable)
+        if (oScheduler.vWaiting.count(iFd))
+            Watch(oScheduler, iFd);
+    for (int iFd : vWritable)
+        if (oScheduler.vWaiting.count(iFd))
+            Watch(oScheduler, iFd);
+}
+
+// Runs [oTask] until it finishes or suspends itself again.
+static void Resume(VM* pVM, Scheduler& oScheduler, const Task& oTask)
+{
+    ObjectFiber* pFiber = oTask.pFiber;
+    if (oTask.bResume)
+        pFiber->m_pStackTop[-1] = oTask.oValue;
+
+    InterpretResult eResult = pVM->run(pFiber);
+    pVM->m_pCurrentFiber = oScheduler.pHost;
+
+    // An error in any fiber stops the whole script, as it would without the
+    // scheduler. The error has already been reported by then.
+    pVM->result = eResult == INTERPRET_SUSPEND ? INTERPRET_OK : eResult;
+}
+
+static Value spawnNative(VM* pVM, int argCount, Value* args)
+{
+    Fox_PanicIfNot(pVM, argCount == 1 || argCount == 2, "Expected [1-2] arguments but got %d.", argCount);
+    Fox_PanicIfNot(pVM, Fox_IsClosure(args[0]), "Expected a function.");
+
+    ObjectClosure* pClosure = Fox_AsClosure(args[0]);
+    Fox_PanicIfNot(pVM, pClosure->function->arity == argCount - 1,
+        "Expected %d arguments but got %d.", pClosure->function->arity, argCount - 1);
+    if (!pVM->CompileLazy(pClosure->function))
+        return Fox_Nil;
+
+    ObjectFiber* pFiber = pVM->gc.New<ObjectFiber>(pClosure);
+    // Binds the argument right after the closure.
+    if (argCount == 2)
+        *pFiber->m_pStackTop++ = args[1];
+
+    pVM->m_pScheduler->vReady.push_back({ pFiber, Fox_Nil, false });
+    return Fox_Object(pFiber);
+}
+
+static Value yieldNative(VM* pVM, int argCount, Value*)
+{
+    Fox_FixArity(pVM, argCount, 0);
+    if (!CanSuspend(pVM))
+        return Fox_Nil;
+
+    pVM->m_pScheduler->vReady.push_back({ pVM->m_pCurrentFiber, Fox_Nil, true });
+    return Suspend(pVM);
+}
+
+static Value sleepNative(VM* pVM, int argCount, Value* args)
+{
+    Fox_FixArity(pVM, argCount, 1);
+    Fox_PanicIfNot(pVM, Fox_IsNumber(args[0]), "Expected a number of milliseconds.");
+    double fDelay = Fox_AsNumber(args[0]);
+
+    if (!CanSuspend(pVM))
+    {
+        struct timespec oDelay = { (time_t) (fDelay / 1000), (long) (fmod(fDelay, 1000) * 1000000) };
+        if (fDelay > 0)
+            nanosleep(&oDelay, nullptr);
+        return Fox_Nil;
+    }
+
+    Scheduler& oScheduler = *pVM->m_pScheduler;
+    oScheduler.vTimers.push_back({ Now() + fDelay, oScheduler.uTimers++, pVM->m_pCurrentFiber });
+    std::push_heap(oScheduler.vTimers.begin(), oScheduler.vTimers.end(), std::greater<SleepTimer>());
+    return Suspend(pVM);
+}
+
+static Value waitNative(VM* pVM, int argCount, Value* args)
+{
+    Fox_FixArity(pVM, argCount, 2);
+    Fox_PanicIfNot(pVM, Fox_IsNumber(args[0]), "Expected a file descriptor.");
+    Fox_PanicIfNot(pVM, Fox_IsString(args[1]), "Expected \"r\" or \"w\".");
+
+    std::string strMode = Fox_AsString(args[1])->string;
+    Fox_PanicIfNot(pVM, strMode == "r" || strMode == "w", "Expected \"r\" or \"w\".");
+    return WaitFor(pVM, (int) Fox_AsNumber(args[0]), strMode == "r", IoWait());
+}
+
+static Value readNative(VM* pVM, int argCount, Value* args)
+{
+    Fox_PanicIfNot(pVM, argCount == 1 || argCount == 2, "Expected [1-2] arguments but got %d.", argCount);
+    Fox_PanicIfNot(pVM, Fox_IsNumber(args[0]), "Expected a file descriptor.");
+
+    IoWait oIo;
+    oIo.bIo = true;
+    oIo.uSize = 4096;
+    if (argCount == 2)
+    {
+        Fox_PanicIfNot(pVM, Fox_IsNumber(args[1]) && Fox_AsNumber(args[1]) >= 1, "Expected a positive size.");
+        oIo.uSize = (size_t) Fox_AsNumber(args[1]);
+    }
+    return WaitFor(pVM, (int) Fox_AsNumber(args[0]), true, oIo);
+}
+
+static Value writeNative(VM* pVM, int argCount, Value* args)
+{
+    Fox_FixArity(pVM, argCount, 2);
+    Fox_PanicIfNot(pVM, Fox_IsNumber(args[0]), "Expected a file descriptor.");
+    Fox_PanicIfNot(pVM, Fox_IsString(args[1]), "Expected string value in write function");
+
+    IoWait oIo;
+    oIo.bIo = true;
+    oIo.strData = Fox_AsString(args[1])->string;
+    return WaitFor(pVM, (int) Fox_AsNumber(args[0]), false, oIo);
+}
+
+static Value pipeNative(VM* pVM, int argCount, Value*)
+{
+    Fox_FixArity(pVM, argCount, 0);
+    int vFds[2];
+    if (pipe(vFds) != 0)
+    {
+        Fox_RuntimeError(pVM, "Cannot create a pipe: %s.", strerror(errno));
+        return Fox_Nil;
+    }
+    fcntl(vFds[0], F_SETFL, fcntl(vFds[0], F_GETFL) | O_NONBLOCK);
+    fcntl(vFds[1], F_SETFL, fcntl(vFds[1], F_GETFL) | O_NONBLOCK);
+
+    Value oArray = Fox_NewArray(pVM);
+    Fox_AsArray(oArray)->m_vValues = { Fox_Int(vFds[0]), Fox_Int(vFds[1]) };
+    return oArray;
+}
+
+static Value closeNative(VM* pVM, int argCount, Value* args)
+{
+    Fox_FixArity(pVM, argCount, 1);
+    Fox_PanicIfNot(pVM, Fox_IsNumber(args[0]), "Expected a file descriptor.");
+    int iFd = (int) Fox_AsNumber(args[0]);
+
+    // Whoever waits for it gets the end of the file, or what was written.
+    Scheduler& oScheduler = *pVM->m_pScheduler;
+    auto it = oScheduler.vWaiting.find(iFd);
+    if (it != oScheduler.vWaiting.end())
+    {
+        if (it->second.oRead.pFiber != nullptr)
+            oScheduler.vReady.push_back({ it->second.oRead.pFiber, Fox_Nil, true });
+        if (it->second.oWrite.pFiber != nullptr)
+            oScheduler.vReady.push_back({ it->second.oWrite.pFiber, Fox_Int(it->second.oWrite.uWritten), true });
+        it->second.oRead = IoWait();
+        it->second.oWrite = IoWait();
+        Watch(oScheduler, iFd);
+    }
+    close(iFd);
+    return Fox_Nil;
+}
+
+static Value runNative(VM* pVM, int argCount, Value*)
+{
+    Fox_FixArity(pVM, argCount, 0);
+    Scheduler& oScheduler = *pVM->m_pScheduler;
+    Fox_PanicIfNot(pVM, oScheduler.pHost == nullptr, "The scheduler is already running.");
+
+    oScheduler.pHost = pVM->m_pCurrentFiber;
+    while (pVM->result == INTERPRET_OK)
+    {
+        double fNow = Now();
+        while (!oScheduler.vTimers.empty() && oScheduler.vTimers.front().fWhen <= fNow)
+        {
+            std::pop_heap(oScheduler.vTimers.begin(), oScheduler.vTimers.end(), std::greater<SleepTimer>());
+            oScheduler.vReady.push_back({ oScheduler.vTimers.back().pFiber, Fox_Nil, true });
+            oScheduler.vTimers.pop_back();
+        }
+
+        if (!oScheduler.vReady.empty())
+        {
+            Task oTask = oScheduler.vReady.front();
+            oScheduler.vReady.pop_front();
+            Resume(pVM, oScheduler, oTask);
+            continue;
+        }
+
+        // Everything is done once no fiber is left to wake up.
+        if (oScheduler.vTimers.empty() && oScheduler.vWaiting.empty())
+            break;
+
+        int iTimeout = -1;
+        if (!oScheduler.vTimers.empty())
+            iTimeout = (int) ceil(std::max(0.0, oScheduler.vTimers.front().fWhen - fNow));
+        WaitForEvents(pVM, oScheduler, iTimeout);
+    }
+    oScheduler.pHost = nullptr;
+    return Fox_Nil;
+}
+
+// The fibers of the scheduler are only referenced from here while they wait.
+static void AddSchedulerToRoots(VM* pVM)
+{
+    Scheduler& oScheduler = *pVM->m_pScheduler;
+    pVM->AddObjectToRoot(oScheduler.pHost);
+    for (Task& oTask : oScheduler.vReady)
+    {
+        pVM->AddObjectToRoot(oTask.pFiber);
+        pVM->AddValueToRoot(oTask.oValue);
+    }
+    for (SleepTimer& oTimer : oScheduler.vTimers)
+        pVM->AddObjectToRoot(oTimer.pFiber);
+    for (auto& oEntry : oScheduler.vWaiting)
+    {
+        pVM->AddObjectToRoot(oEntry.second.oRead.pFiber);
+        pVM->AddObjectToRoot(oEntry.second.oWrite.pFiber);
+    }
+}
+
+void DefineSchedulerModule(VM* pVM)
+{
+    NativeMethods methods =
+	{
+		std::make_pair<std::string, NativeFn>("spawn", spawnNative),
+		std::make_pair<std::string, NativeFn>("yield", yieldNative),
+		std::make_pair<std::string, NativeFn>("sleep", sleepNative),
+		std::make_pair<std::string, NativeFn>("wait", waitNative),
+		std::make_pair<std::string, NativeFn>("read", readNative),
+		std::make_pair<std::string, NativeFn>("write", writeNative),
+		std::make_pair<std::string, NativeFn>("pipe", pipeNative),
+		std::make_pair<std::string, NativeFn>("close", closeNative),
+		std::make_pair<std::string, NativeFn>("run", runNative),
+	};
+
+    pVM->m_pScheduler = new_ref<Scheduler>();
+#ifdef __linux__
+    pVM->m_pScheduler->iPoll = epoll_create1(EPOLL_CLOEXEC);
+#endif
+    pVM->gc.add_callback(GC_OnMark, std::bind(AddSchedulerToRoots, pVM));
+
+    pVM->DefineModule("scheduler");
+    pVM->DefineLib("scheduler", "scheduler", methods);
+}
@@ -0,0 +1,123 @@
+#include <algorithm>
+#include <string>
+#include <thread>
+
+#include "library/library.h"
+#include "foxely.h"
+#include "isolate.hpp"
+
+// worker.spawn() starts a script in a VM of its own on another thread. The two
+// VMs only exchange copies of plain values: worker.send(w, value) and
+// worker.receive(w) talk to the worker [w], while the worker itself calls
+// worker.receive() and worker.send(value) to talk back.
+
+ObjectAbstractType foxely_worker_type =
+{
+    "worker/Worker"
+};
+
+// The modules a worker script may import.
+static void DefineWorkerModules(VM& oVM)
+{
+    DefineIOModule(&oVM);
+    DefineOSModule(&oVM);
+    DefineMathModule(&oVM);
+    DefineModuleModule(&oVM);
+    DefinePathModule(&oVM);
+    DefineSchedulerModule(&oVM);
+    DefineWorkerModule(&oVM);
+}
+
+static Isolate* GetWorker(Value oValue)
+{
+    if (!Fox_IsAbstract(oValue) || Fox_AsAbstract(oValue)->abstractType != &foxely_worker_type)
+        return nullptr;
+    return (Isolate *) Fox_AsAbstract(oValue)->data;
+}
+
+static Value spawnNative(VM* pVM, int argCount, Value* args)
+{
+    Fox_FixArity(pVM, argCount, 1);
+    Fox_PanicIfNot(pVM, Fox_IsString(args[0]), "Expected the path of a script.");
+
+    ref<Isolate> pIsolate = new_ref<Isolate>(Fox_AsCString(args[0]), pVM->argc, pVM->argv, DefineWorkerModules);
+    pVM->m_vIsolates.push_back(pIsolate);
+    return Fox_Abstract(pVM, pIsolate.get(), &foxely_worker_type);
+}
+
+static Value sendNative(VM* pVM, int argCount, Value* args)
+{
+    Fox_PanicIfNot(pVM, argCount == 1 || argCount == 2, "Expected [1-2] arguments but got %d.", argCount);
+
+    Channel* pChannel = nullptr;
+    if (argCount == 2)
+    {
+        Isolate* pWorker = GetWorker(args[0]);
+        Fox_PanicIfNot(pVM, pWorker != nullptr, "Expected a worker.");
+        pChannel = &pWorker->Inbox();
+    }
+    else
+    {
+        Fox_PanicIfNot(pVM, pVM->m_pIsolate != nullptr, "Only a worker can send to the VM that started it.");
+        pChannel = &pVM->m_pIsolate->Outbox();
+    }
+
+    Message oMessage;
+    std::string strError;
+    Fox_PanicIfNot(pVM, oMessage.Copy(args[argCount - 1], strError), "%s", strError.c_str());
+    pChannel->Send(std::move(oMessage));
+    return Fox_Nil;
+}
+
+static Value receiveNative(VM* pVM, int argCount, Value* args)
+{
+    Fox_PanicIfNot(pVM, argCount == 0 || argCount == 1, "Expected [0-1] arguments but got %d.", argCount);
+
+    Channel* pChannel = nullptr;
+    if (argCount == 1)
+    {
+        Isolate* pWorker = GetWorker(args[0]);
+        Fox_PanicIfNot(pVM, pWorker != nullptr, "Expected a worker.");
+        pChannel = &pWorker->Outbox();
+    }
+    else
+    {
+        Fox_PanicIfNot(pVM, pVM->m_pIsolate != nullptr, "Only a worker can receive from the VM that started it.");
+        pChannel = &pVM->m_pIsolate->Inbox();
+    }
+
+    // nil once the other side is done and everything was read.
+    Message oMessage;
+    if (!pChannel->Receive(oMessage))
+        return Fox_Nil;
+    return oMessage.ToValue(pVM);
+}
+
+static Value joinNative(VM* pVM, int argCount, Value* args)
+{
+    Fox_FixArity(pVM, argCount, 1);
+    Isolate* pWorker = GetWorker(args[0]);
+    Fox_PanicIfNot(pVM, pWorker != nullptr, "Expected a worker.");
+    return Fox_Bool(pWorker->Join() == INTERPRET_OK);
+}
+
+static Value coresNative(VM* pVM, int argCount, Value*)
+{
+    Fox_FixArity(pVM, argCount, 0);
+    return Fox_Int(std::max(1u, std::thread::hardware_concurrency()));
+}
+
+void DefineWorkerModule(VM* pVM)
+{
+    NativeMethods methods =
+	{
+		std::make_pair<std::string, NativeFn>("spawn", spawnNative),
+		std::make_pair<std::string, NativeFn>("send", sendNative),
+		std::make_pair<std::string, NativeFn>("receive", receiveNative),
+		std::make_pair<std::string, NativeFn>("join", joinNative),
+		std::make_pair<std::string, NativeFn>("cores", coresNative),
+	};
+
+    pVM->DefineModule("worker");
+    pVM->DefineLib("worker", "worker", methods);
+}
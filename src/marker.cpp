@@ -0,0 +1,200 @@
+#include "marker.hpp"
+#include "gc.hpp"
+
+thread_local ParallelMarker::Worker* ParallelMarker::s_pWorker = nullptr;
+
+ParallelMarker::ParallelMarker()
+{
+    m_pGC = nullptr;
+    m_iActive = 0;
+    m_iGeneration = 0;
+    m_iRunning = 0;
+    m_bQuit = false;
+    m_iIdle = 0;
+}
+
+ParallelMarker::~ParallelMarker()
+{
+    {
+        std::lock_guard<std::mutex> oLock(m_oLock);
+        m_bQuit = true;
+    }
+    m_oStart.notify_all();
+    for (std::thread& oThread : m_vThreads)
+        oThread.join();
+}
+
+ParallelMarker& ParallelMarker::Get()
+{
+    static ParallelMarker oPool;
+    return oPool;
+}
+
+bool ParallelMarker::Mark(GC& oGC, std::vector<Traceable*>& vGray, size_t iThreads)
+{
+    ParallelMarker& oPool = Get();
+    // Another VM marking with the pool has the threads, so this one marks
+    // on its own thread rather than start more.
+    std::unique_lock<std::mutex> oBusy(oPool.m_oBusy, std::try_to_lock);
+    if (!oBusy.owns_lock())
+        return false;
+    oPool.MarkWith(oGC, vGray, iThreads);
+    return true;
+}
+
+void ParallelMarker::MarkWith(GC& oGC, std::vector<Traceable*>& vGray, size_t iThreads)
+{
+    Grow(iThreads);
+    m_pGC = &oGC;
+
+    // The helpers are all waiting, so the roots are dealt out without
+    // locking.
+    for (size_t i = 0; i < vGray.size(); i++)
+        m_vWorkers[i % iThreads]->m_vShared.push_back(vGray[i]);
+    for (size_t i = 0; i < iThreads; i++)
+        m_vWorkers[i]->m_iShared = m_vWorkers[i]->m_vShared.size();
+    vGray.clear();
+    m_iIdle = 0;
+
+    {
+        std::lock_guard<std::mutex> oLock(m_oLock);
+        m_iActive = iThreads;
+        m_iRunning = iThreads - 1;
+        m_iGeneration++;
+    }
+    m_oStart.notify_all();
+
+    Work(0);
+
+    std::unique_lock<std::mutex> oLock(m_oLock);
+    m_oDone.wait(oLock, [this] { return m_iRunning == 0; });
+    m_pGC = nullptr;
+}
+
+void ParallelMarker::Grow(size_t iThreads)
+{
+    // The collecting thread is the first worker.
+    while (m_vWorkers.size() < iThreads)
+    {
+        m_vWorkers.push_back(new_scope<Worker>());
+        m_vWorkers.back()->m_iShared = 0;
+        if (m_vWorkers.size() > 1)
+            m_vThreads.push_back(std::thread(&ParallelMarker::Run, this, m_vWorkers.size() - 1));
+    }
+}
+
+bool ParallelMarker::Shade(Traceable* pObject)
+{
+    if (pObject->mMarked.load(std::memory_order_relaxed) || pObject->mMarked.exchange(true, std::memory_order_relaxed))
+        return false;
+    s_pWorker->m_vLocal.push_back(pObject);
+    return true;
+}
+
+void ParallelMarker::Run(size_t iWorker)
+{
+    size_t iGeneration = 0;
+    for (;;)
+    {
+        {
+            std::unique_lock<std::mutex> oLock(m_oLock);
+            m_oStart.wait(oLock, [&] { return m_bQuit || m_iGeneration != iGeneration; });
+            if (m_bQuit)
+                return;
+            iGeneration = m_iGeneration;
+            // This marking needs fewer threads than the pool has.
+            if (iWorker >= m_iActive)
+                continue;
+        }
+
+        Work(iWorker);
+
+        std::lock_guard<std::mutex> oLock(m_oLock);
+        if (--m_iRunning == 0)
+            m_oDone.notify_one();
+    }
+}
+
+void ParallelMarker::Work(size_t iWorker)
+{
+    Worker& oWorker = *m_vWorkers[iWorker];
+    s_pWorker = &oWorker;
+    for (;;)
+    {
+        while (!oWorker.m_vLocal.empty())
+        {
+            Traceable* pObject = oWorker.m_vLocal.back();
+            oWorker.m_vLocal.pop_back();
+            pObject->markChildren(*m_pGC);
+
+            if (oWorker.m_vLocal.size() > GC_MARK_SHARE && oWorker.m_iShared.load(std::memory_order_relaxed) == 0)
+                Share(oWorker);
+        }
+
+        if (Steal(iWorker))
+            continue;
+
+        // Nothing left here. The marking is over once every thread is in the
+        // same case, as only a busy thread can make more work.
+        m_iIdle++;
+        for (;;)
+        {
+            if (m_iIdle == m_iActive)
+            {
+                s_pWorker = nullptr;
+                return;
+            }
+            if (AnyShared())
+            {
+                m_iIdle--;
+                break;
+            }
+            std::this_thread::yield();
+        }
+    }
+}
+
+void ParallelMarker::Share(Worker& oWorker)
+{
+    // The oldest objects are likely the roots of the biggest subgraphs.
+    size_t iHalf = oWorker.m_vLocal.size() / 2;
+    std::lock_guard<std::mutex> oLock(oWorker.m_oLock);
+    oWorker.m_vShared.insert(oWorker.m_vShared.end(), oWorker.m_vLocal.begin(), oWorker.m_vLocal.begin() + iHalf);
+    oWorker.m_iShared = oWorker.m_vShared.size();
+    oWorker.m_vLocal.erase(oWorker.m_vLocal.begin(), oWorker.m_vLocal.begin() + iHalf);
+}
+
+bool ParallelMarker::Steal(size_t iWorker)
+{
+    Worker& oWorker = *m_vWorkers[iWorker];
+    size_t iWorkers = m_iActive;
+
+    // Take back all of our own shared objects first, then half of another's.
+    for (size_t i = 0; i < iWorkers; i++)
+    {
+        Worker& oVictim = *m_vWorkers[(iWorker + i) % iWorkers];
+        if (oVictim.m_iShared.load(std::memory_order_relaxed) == 0)
+            continue;
+
+        std::lock_guard<std::mutex> oLock(oVictim.m_oLock);
+        size_t iCount = oVictim.m_vShared.size();
+        if (iCount == 0)
+            continue;
+        size_t iTake = i == 0 ? iCount : (iCount + 1) / 2;
+        oWorker.m_vLocal.insert(oWorker.m_vLocal.end(), oVictim.m_vShared.end() - iTake, oVictim.m_vShared.end());
+        oVictim.m_vShared.resize(iCount - iTake);
+        oVictim.m_iShared = iCount - iTake;
+        return true;
+    }
+    return false;
+}
+
+bool ParallelMarker::AnyShared() const
+{
+    for (size_t i = 0; i < m_iActive; i++)
+    {
+        if (m_vWorkers[i]->m_iShared != 0)
+            return true;
+    }
+    return false;
+}
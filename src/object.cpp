@@ -2,13 +2,18 @@
 #include "Parser.h"
 #include "vm.hpp"
 #include "gc.hpp"
+#include "jit.hpp"
+
+ObjectFunction::~ObjectFunction()
+{
+    delete jitCode;
+}
 
 ObjectClosure::ObjectClosure(VM* oVM, ObjectFunction* func)
 {
     type = OBJ_CLOSURE;
     function = func;
     upvalueCount = func->upValueCount;
-    func->module = oVM->currentModule;
     upValues = std::vector<ObjectUpvalue*>(func->upValueCount);
     for (int i = 0; i < func->upValueCount; i++) {
         upValues[i] = nullptr;
@@ -28,17 +33,167 @@ void ObjectInstance::on_destroy()
 
 /* --------- Module Impl---------------------------------------------- */
 
+int ObjectModule::FindVariable(ObjectString* strName)
+{
+    Value oSlot;
+    if (!m_vVariableNames.Get(strName, oSlot))
+        return -1;
+    return Fox_AsInt(oSlot);
+}
+
+int ObjectModule::DeclareVariable(ObjectString* strName)
+{
+    int iSlot = FindVariable(strName);
+    if (iSlot != -1)
+        return iSlot;
+
+    iSlot = m_vVariables.size();
+    m_vVariables.push_back(Fox_Undefined);
+    m_vVariableNames.Set(strName, Fox_Int(iSlot));
+    return iSlot;
+}
+
+bool ObjectModule::GetVariable(ObjectString* strName, Value& oValue)
+{
+    int iSlot = FindVariable(strName);
+    if (iSlot == -1 || Fox_IsUndefined(m_vVariables[iSlot]))
+        return false;
+
+    oValue = m_vVariables[iSlot];
+    return true;
+}
+
+void ObjectModule::SetVariable(ObjectString* strName, Value oValue)
+{
+    m_vVariables[DeclareVariable(strName)] = oValue;
+}
+
+void ObjectModule::ImportVariables(ObjectModule& oOther)
+{
+    for (Entry& oEntry : oOther.m_vVariableNames.m_vEntries)
+    {
+        if (oEntry.m_pKey == nullptr)
+            continue;
+
+        Value oValue = oOther.m_vVariables[Fox_AsInt(oEntry.m_oValue)];
+        if (!Fox_IsUndefined(oValue))
+            SetVariable(oEntry.m_pKey, oValue);
+    }
+}
+
 void ObjectModule::define_func(const std::string& name, NativeFn func)
 {
     m_oVM.Push(m_oVM.NewString(name));
     m_oVM.Push(Fox_Object(m_oVM.new_value<ObjectNative>(func)));
-    m_vVariables.Set(Fox_AsString(m_oVM.PeekStart(0)), m_oVM.PeekStart(1));
+    SetVariable(Fox_AsString(m_oVM.PeekStart(0)), m_oVM.PeekStart(1));
     m_oVM.Pop();
     m_oVM.Pop();
 }
 
 /* ------------------------------------------------------------------- */
 
+/* --------- GC Impl---------------------------------------------- */
+
+void MarkObject(GC& gc, Object* pObject)
+{
+    if (pObject != nullptr)
+        gc.Shade(pObject);
+}
+
+void MarkValue(GC& gc, Value value)
+{
+    if (Fox_IsObject(value))
+        gc.Shade(Fox_AsObject(value));
+}
+
+void ObjectModule::markChildren(GC& gc)
+{
+    MarkObject(gc, m_strName);
+    m_vVariableNames.MarkTable(gc);
+    for (Value& oValue : m_vVariables)
+        MarkValue(gc, oValue);
+}
+
+void ObjectFunction::markChildren(GC& gc)
+{
+    MarkObject(gc, name);
+    for (Value& oValue : chunk.m_oConstants.m_vValues)
+        MarkValue(gc, oValue);
+}
+
+void ObjectUpvalue::markChildren(GC& gc)
+{
+    MarkValue(gc, closed);
+}
+
+void ObjectLib::markChildren(GC& gc)
+{
+    MarkObject(gc, name);
+    methods.MarkTable(gc);
+}
+
+void ObjectClosure::markChildren(GC& gc)
+{
+    MarkObject(gc, function);
+    for (int i = 0; i < upvalueCount; i++)
+        MarkObject(gc, upValues[i]);
+}
+
+void ObjectClass::markChildren(GC& gc)
+{
+    MarkObject(gc, superClass);
+    MarkObject(gc, name);
+    methods.MarkTable(gc);
+    operators.MarkTable(gc);
+    getters.MarkTable(gc);
+    setters.MarkTable(gc);
+    fields.MarkTable(gc);
+    for (int i = 0; i < OPERATOR_COUNT; i++)
+        MarkValue(gc, operatorTable[i]);
+}
+
+void ObjectInstance::markChildren(GC& gc)
+{
+    MarkObject(gc, klass);
+    fields.MarkTable(gc);
+}
+
+void ObjectBoundMethod::markChildren(GC& gc)
+{
+    MarkValue(gc, receiver);
+    MarkObject(gc, method);
+}
+
+void ObjectArray::markChildren(GC& gc)
+{
+    for (Value& oValue : m_vValues)
+        MarkValue(gc, oValue);
+}
+
+void ObjectMap::markChildren(GC& gc)
+{
+    for (auto& oEntry : m_vValues.m_vEntries)
+    {
+        MarkValue(gc, oEntry.m_oKey);
+        MarkValue(gc, oEntry.m_oValue);
+    }
+    m_oMethods.MarkTable(gc);
+}
+
+void ObjectFiber::markChildren(GC& gc)
+{
+    for (Value* pSlot = m_vStack.data(); pSlot < m_pStackTop; pSlot++)
+        MarkValue(gc, *pSlot);
+    for (int i = 0; i < m_iFrameCount; i++)
+        MarkObject(gc, m_vFrames[i].closure);
+    for (ObjectUpvalue* pUpvalue = m_vOpenUpvalues; pUpvalue != nullptr; pUpvalue = pUpvalue->next)
+        MarkObject(gc, pUpvalue);
+    MarkObject(gc, m_pCaller);
+    MarkValue(gc, m_oError);
+}
+
+/* ------------------------------------------------------------------- */
+
 /* --------- Utils Impl---------------------------------------------- */
 
 template <>
@@ -0,0 +1,316 @@
+#include <cstring>
+#include "Token.h"
+#include "Parser.h"
+#include "scanner.hpp"
+
+struct Keyword
+{
+    const char* m_strText;
+    int m_iType;
+};
+
+static const Keyword s_vKeywords[] =
+{
+    { "class", TOKEN_CLASS }, { "else", TOKEN_ELSE }, { "false", TOKEN_FALSE },
+    { "for", TOKEN_FOR }, { "func", TOKEN_FUN }, { "if", TOKEN_IF },
+    { "import", TOKEN_IMPORT }, { "is", TOKEN_IS }, { "nil", TOKEN_NIL },
+    { "print", TOKEN_PRINT }, { "return", TOKEN_RETURN }, { "super", TOKEN_SUPER },
+    { "switch", TOKEN_SWITCH }, { "this", TOKEN_THIS }, { "true", TOKEN_TRUE },
+    { "var", TOKEN_VAR }, { "while", TOKEN_WHILE },
+};
+
+// The size of the keyword table, a power of two.
+#define KEYWORD_SLOTS 64
+
+// A perfect hash of the keywords above: none of them share a slot. An
+// identifier is a keyword only if it is the one in its slot.
+static inline int HashKeyword(const char* pStart, size_t iLength)
+{
+    return (iLength + (uint8_t) pStart[0] + 7 * (uint8_t) pStart[iLength - 1]) & (KEYWORD_SLOTS - 1);
+}
+
+struct KeywordTable
+{
+    Keyword m_vSlots[KEYWORD_SLOTS];
+
+    KeywordTable()
+    {
+        for (Keyword& oSlot : m_vSlots)
+            oSlot = { nullptr, TOKEN_IDENTIFIER };
+        for (const Keyword& oKeyword : s_vKeywords)
+        {
+            int iSlot = HashKeyword(oKeyword.m_strText, strlen(oKeyword.m_strText));
+            FOX_ASSERT(m_vSlots[iSlot].m_strText == nullptr, "Keywords must not collide.");
+            m_vSlots[iSlot] = oKeyword;
+        }
+    }
+};
+
+static int IdentifierType(const char* pStart, size_t iLength)
+{
+    static const KeywordTable oTable;
+    const Keyword& oSlot = oTable.m_vSlots[HashKeyword(pStart, iLength)];
+    if (oSlot.m_strText != nullptr && strncmp(oSlot.m_strText, pStart, iLength) == 0 && oSlot.m_strText[iLength] == '\0')
+        return oSlot.m_iType;
+    return TOKEN_IDENTIFIER;
+}
+
+static inline bool IsAlpha(char c)
+{
+    return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || c == '_';
+}
+
+static inline bool IsDigit(char c)
+{
+    return c >= '0' && c <= '9';
+}
+
+class Scanner
+{
+public:
+    Scanner(const std::string& strSource, std::vector<Token>& vTokens)
+        : m_pCurrent(strSource.c_str()), m_pEnd(strSource.c_str() + strSource.size()),
+          m_pStart(m_pCurrent), m_iLine(1), m_vTokens(vTokens)
+    {
+    }
+
+    void Run()
+    {
+        for (;;)
+        {
+            SkipWhitespace();
+            m_pStart = m_pCurrent;
+            if (m_pCurrent == m_pEnd)
+            {
+                Add(TOKEN_EOF, std::string());
+                return;
+            }
+
+            char c = *m_pCurrent++;
+            if (IsAlpha(c))
+                Identifier();
+            else if (IsDigit(c))
+                Number();
+            else
+                Punctuation(c);
+        }
+    }
+
+private:
+    const char* m_pCurrent;
+    const char* m_pEnd;
+    const char* m_pStart;
+    int m_iLine;
+    std::vector<Token>& m_vTokens;
+
+    char Peek(int iOffset = 0) const
+    {
+        return m_pCurrent + iOffset < m_pEnd ? m_pCurrent[iOffset] : '\0';
+    }
+
+    bool Match(char c)
+    {
+        if (Peek() != c)
+            return false;
+        m_pCurrent++;
+        return true;
+    }
+
+    void Add(int iType, const std::string& strText)
+    {
+        Token oToken(StringID(iType), strText, strText.size());
+        oToken.m_iLinesTraversed = m_iLine;
+        m_vTokens.push_back(oToken);
+    }
+
+    void Add(int iType)
+    {
+        Add(iType, std::string(m_pStart, m_pCurrent));
+    }
+
+    void SkipWhitespace()
+    {
+        while (m_pCurrent < m_pEnd)
+        {
+            switch (*m_pCurrent)
+            {
+                case '\n':
+                    m_iLine++;
+                    // fallthrough
+                case ' ':
+                case '\t':
+                case '\r':
+                case '\b':
+                    m_pCurrent++;
+                    break;
+
+                case '#':
+                    SkipLine();
+                    break;
+
+                case '/':
+                    if (Peek(1) == '/')
+                        SkipLine();
+                    else if (Peek(1) == '*')
+                        SkipBlockComment();
+                    else
+                        return;
+                    break;
+
+                default:
+                    return;
+            }
+        }
+    }
+
+    void SkipLine()
+    {
+        while (m_pCurrent < m_pEnd && *m_pCurrent != '\n')
+            m_pCurrent++;
+    }
+
+    // An unterminated comment runs to the end of the source.
+    void SkipBlockComment()
+    {
+        m_pCurrent += 2;
+        while (m_pCurrent < m_pEnd && !(m_pCurrent[0] == '*' && Peek(1) == '/'))
+        {
+            if (*m_pCurrent == '\n')
+                m_iLine++;
+            m_pCurrent++;
+        }
+        m_pCurrent = m_pCurrent < m_pEnd ? m_pCurrent + 2 : m_pEnd;
+    }
+
+    void Identifier()
+    {
+        while (IsAlpha(Peek()) || IsDigit(Peek()))
+            m_pCurrent++;
+        Add(IdentifierType(m_pStart, m_pCurrent - m_pStart));
+    }
+
+    void Number()
+    {
+        while (IsDigit(Peek()))
+            m_pCurrent++;
+
+        if (Peek() == '.' && IsDigit(Peek(1)))
+        {
+            m_pCurrent++;
+            while (IsDigit(Peek()))
+                m_pCurrent++;
+        }
+        Add(TOKEN_NUMBER);
+    }
+
+    // The text of the token is the content of the string, without its quotes
+    // and with its escapes resolved.
+    void String()
+    {
+        int iLine = m_iLine;
+        std::string strText;
+        while (m_pCurrent < m_pEnd && *m_pCurrent != '"')
+        {
+            char c = *m_pCurrent++;
+            if (c == '\n')
+                m_iLine++;
+            else if (c == '\\' && m_pCurrent < m_pEnd)
+            {
+                switch (*m_pCurrent++)
+                {
+                    case 'n': c = '\n'; break;
+                    case 't': c = '\t'; break;
+                    case 'r': c = '\r'; break;
+                    case 'b': c = '\b'; break;
+                    case 'a': c = '\a'; break;
+                    case 'e': c = '\033'; break;
+                    case '0': case '1': case '2': case '3':
+                    case '4': case '5': case '6': case '7':
+                    {
+                        // An octal escape has up to three digits, as "\033".
+                        int iCode = m_pCurrent[-1] - '0';
+                        for (int i = 0; i < 2 && m_pCurrent < m_pEnd && *m_pCurrent >= '0' && *m_pCurrent <= '7'; i++)
+                            iCode = iCode * 8 + (*m_pCurrent++ - '0');
+                        c = (char) iCode;
+                        break;
+                    }
+                    case '"': c = '"'; break;
+                    case '\\': c = '\\'; break;
+                    default:
+                        // Unknown escapes are kept as they are.
+                        m_pCurrent--;
+                        break;
+                }
+            }
+            strText += c;
+        }
+
+        if (m_pCurrent == m_pEnd)
+        {
+            Add(TOKEN_ERROR, "Unterminated string.");
+            return;
+        }
+        m_pCurrent++;
+
+        // A string spanning several lines is on the line it starts on.
+        int iEndLine = m_iLine;
+        m_iLine = iLine;
+        Add(TOKEN_STRING, strText);
+        m_iLine = iEndLine;
+    }
+
+    void Punctuation(char c)
+    {
+        switch (c)
+        {
+            case '(': Add(TOKEN_LEFT_PAREN); return;
+            case ')': Add(TOKEN_RIGHT_PAREN); return;
+            case '{': Add(TOKEN_LEFT_BRACE); return;
+            case '}': Add(TOKEN_RIGHT_BRACE); return;
+            case '[': Add(TOKEN_LEFT_BRACKET); return;
+            case ']': Add(TOKEN_RIGHT_BRACKET); return;
+            case ',': Add(TOKEN_COMMA); return;
+            case '.': Add(TOKEN_DOT); return;
+            case ';': Add(TOKEN_SEMICOLON); return;
+            case '/': Add(TOKEN_SLASH); return;
+            case '*': Add(TOKEN_STAR); return;
+            case '^': Add(TOKEN_CARET); return;
+            case '~': Add(TOKEN_TILDE); return;
+            case '+': Add(Match('+') ? TOKEN_PLUS_PLUS : TOKEN_PLUS); return;
+            case '-': Add(Match('-') ? TOKEN_MINUS_MINUS : TOKEN_MINUS); return;
+            case '&': Add(Match('&') ? TOKEN_AND : TOKEN_AMPERSAND); return;
+            case '|': Add(Match('|') ? TOKEN_OR : TOKEN_PIPE); return;
+            case '!': Add(Match('=') ? TOKEN_BANG_EQUAL : TOKEN_BANG); return;
+            case '=': Add(Match('=') ? TOKEN_EQUAL_EQUAL : TOKEN_EQUAL); return;
+            case '"': String(); return;
+
+            case ':':
+                if (Match(':'))
+                    Add(TOKEN_DOUBLE_COLON);
+                else
+                    Add(Match('=') ? TOKEN_DOUBLE_DOT_EQUAL : TOKEN_COLON);
+                return;
+
+            case '<':
+                if (Match('<'))
+                    Add(TOKEN_LESS_LESS);
+                else
+                    Add(Match('=') ? TOKEN_LESS_EQUAL : TOKEN_LESS);
+                return;
+
+            case '>':
+                if (Match('>'))
+                    Add(TOKEN_GREATER_GREATER);
+                else
+                    Add(Match('=') ? TOKEN_GREATER_EQUAL : TOKEN_GREATER);
+                return;
+        }
+        Add(TOKEN_ERROR, "Unexpected character.");
+    }
+};
+
+void ScanTokens(const std::string& strSource, std::vector<Token>& vTokens)
+{
+    Scanner oScanner(strSource, vTokens);
+    oScanner.Run();
+}
@@ -46,12 +46,21 @@ bool CompareObject(Value a, Value b)
 // for object values, and value equality for unboxed values.
 bool ValuesSame(Value a, Value b)
 {
+    // An integer and a double holding the same number are the same value.
+    if (Fox_IsNumber(a) && Fox_IsNumber(b))
+    {
+        if (Fox_IsInt(a) && Fox_IsInt(b)) return a.GetInt() == b.GetInt();
+        return Fox_AsNumber(a) == Fox_AsNumber(b);
+    }
+
+#if FOX_NAN_TAGGING
+    return a.m_uBits == b.m_uBits;
+#else
     if (a.type != b.type)     return false;
     if (a.type == VAL_NIL)    return true;
-    if (a.type == VAL_NUMBER) return a.val.number == b.val.number;
-    // if (a.type == VAL_INT) return a.as.integer == b.as.integer;
     if (a.type == VAL_BOOL)   return Fox_AsBool(a) == Fox_AsBool(b);
     return a.val.obj == b.val.obj;
+#endif
 }
 
 bool ValuesEqual(Value a, Value b)
@@ -76,6 +85,7 @@ bool Value::operator==(const Value& other) const
     return ValuesEqual(*this, other);
 }
 
+#if !FOX_NAN_TAGGING
 template <>
 bool Value::as<bool>()
 {
@@ -87,6 +97,8 @@ bool Value::as<bool>()
 template <>
 double Value::as<double>()
 {
+    if (type == VAL_INT)
+        return static_cast<double>(val.integer);
     if (type != VAL_NUMBER)
         throw std::runtime_error("Invalid Type");
     return val.number;
@@ -95,6 +107,8 @@ double Value::as<double>()
 template <>
 float Value::as<float>()
 {
+    if (type == VAL_INT)
+        return static_cast<float>(val.integer);
     if (type != VAL_NUMBER)
         throw std::runtime_error("Invalid Type");
     return static_cast<int>(val.number);
@@ -103,10 +117,13 @@ float Value::as<float>()
 template <>
 int Value::as<int>()
 {
+    if (type == VAL_INT)
+        return val.integer;
     if (type != VAL_NUMBER)
         throw std::runtime_error("Invalid Type");
     return static_cast<int>(val.number);
 }
+#endif
 
 std::string FunctionToString(ObjectFunction* function)
 {
@@ -213,12 +230,13 @@ std::string ObjectToString(Value value, VM* pVm)
 std::string ValueToString(Value value, VM* pVm)
 {
     std::string string = "";
-    switch (value.type)
+    switch (value.GetType())
     {
         case VAL_BOOL: string += (Fox_AsBool(value) ? "true" : "false"); break;
         case VAL_NIL:    string +=  "nil"; break;
+        case VAL_UNDEFINED: string += "undefined"; break;
         case VAL_NUMBER: string +=  std::to_string(Fox_AsNumber(value)); break;
-        // case VAL_INT: string +=  std::to_string(Fox_AsInt(value)); break;
+        case VAL_INT:    string +=  std::to_string(Fox_AsInt(value)); break;
         case VAL_OBJ: string += ObjectToString(value, pVm); break;
     }
     return string;
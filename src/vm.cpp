@@ -5,9 +5,11 @@
 #include <fstream>
 #include <streambuf>
 #include <cstring>
+#include <cmath>
 
 #include "common.h"
 #include "chunk.hpp"
+#include "codecache.hpp"
 #include "debug.h"
 #include "library/library.h"
 #include "foxely.h"
@@ -16,6 +18,7 @@
 #include "object.hpp"
 #include "Table.hpp"
 #include "Utility.hpp"
+#include "jit.hpp"
 
 Value clockNative(VM* pVM, int argCount, Value* args)
 {
@@ -28,6 +31,11 @@ VM::VM(int ac, char** av) : argc(ac), argv(av), m_oParser(this), modules()
     m_bLogTrace = false;
     m_bLogToken = false;
     m_bLogGC = false;
+    m_bLogCache = false;
+    m_bLogProfile = false;
+    m_bJit = true;
+    m_bLazyCompile = false;
+    result = INTERPRET_OK;
     for (int i = 1; i < ac; ++i)
     {
         if (av[i][0] == '-')
@@ -40,14 +48,37 @@ VM::VM(int ac, char** av) : argc(ac), argv(av), m_oParser(this), modules()
 
             if (av[i][1] == 'l' && av[i][2] == 'e')
                 m_bLogTrace = true;
+
+            if (av[i][1] == 'l' && av[i][2] == 'c')
+                m_bLogCache = true;
+
+            if (av[i][1] == 'l' && av[i][2] == 'p')
+                m_bLogProfile = true;
+
+            if (strcmp(av[i], "-jit=off") == 0)
+                m_bJit = false;
+
+            if (strcmp(av[i], "-lazy") == 0)
+                m_bLazyCompile = true;
+
+            if (strcmp(av[i], "-gc=incremental") == 0)
+                gc.SetIncremental(true);
+
+            if (strncmp(av[i], "-gc-threads=", 12) == 0)
+                gc.SetMarkThreads(atoi(av[i] + 12));
+
+            if (strncmp(av[i], "-gc-parallel=", 13) == 0)
+                gc.SetParallelHeap((size_t) atoi(av[i] + 13) * 1024 * 1024);
         }
     }
     gc.add_callback(GC_OnMark, std::bind(&VM::AddToRoots, this));
+    gc.add_callback(GC_OnSweep, std::bind(&Table::RemoveWhite, &strings, std::ref(gc)));
     // ResetStack();
     m_pCurrentFiber = nullptr;
     isInit = false;
     currentModule = nullptr;
     m_pApiStack = nullptr;
+    m_pIsolate = nullptr;
     m_pCurrentFiber = gc.New<ObjectFiber>(nullptr);
     DefineModule("core");
     initString = NewString("init").as<ObjectString>();
@@ -67,13 +98,29 @@ VM::VM(int ac, char** av) : argc(ac), argv(av), m_oParser(this), modules()
 void VM::ResetStack()
 {
     PROFILE_FUNCTION();
-    m_pCurrentFiber->m_pStackTop = m_pCurrentFiber->m_vStack;
+    m_pCurrentFiber->m_pStackTop = m_pCurrentFiber->m_vStack.data();
     m_pCurrentFiber->m_iFrameCount = 0;
 }
 
+void VM::EnsureStack(ObjectFiber* pFiber, size_t iNeeded)
+{
+    PROFILE_FUNCTION();
+    if (iNeeded <= pFiber->m_vStack.size())
+        return;
+
+    // The API slots point into the stack of the current fiber too.
+    bool bMoveApiStack = m_pApiStack != nullptr && pFiber == m_pCurrentFiber;
+    ptrdiff_t iApiStack = bMoveApiStack ? m_pApiStack - pFiber->m_vStack.data() : 0;
+    pFiber->EnsureStack(iNeeded);
+    if (bMoveApiStack)
+        m_pApiStack = pFiber->m_vStack.data() + iApiStack;
+}
+
 void VM::Push(Value oValue)
 {
     PROFILE_FUNCTION();
+    size_t iCount = m_pCurrentFiber->m_pStackTop - m_pCurrentFiber->m_vStack.data();
+    EnsureStack(m_pCurrentFiber, iCount + 1);
     *m_pCurrentFiber->m_pStackTop = oValue;
     m_pCurrentFiber->m_pStackTop++;
 }
@@ -146,8 +193,8 @@ void VM::RuntimeError(const char *format, ...)
         ObjectFunction* function = frame->closure->function;
 
         // -1 because the IP is sitting on the next instruction to be executed.
-        size_t instruction = frame->ip - function->chunk.m_vCode.begin() - 1;
-        fprintf(stderr, "[line %d] in ", function->chunk.m_vLines[instruction]);
+        size_t instruction = function->chunk.Offset(frame->ip) - 1;
+        fprintf(stderr, "[line %d] in ", (*function->chunk.m_pLines)[instruction]);
         if (function->name == nullptr)
             fprintf(stderr, "script\n");
         else
@@ -180,8 +227,8 @@ void VM::PrintError(ObjectFiber* pFiber, const char *format, ...)
         ObjectFunction* function = frame->closure->function;
 
         // -1 because the IP is sitting on the next instruction to be executed.
-        size_t instruction = frame->ip - function->chunk.m_vCode.begin() - 1;
-        fprintf(stderr, "[line %d] in ", function->chunk.m_vLines[instruction]);
+        size_t instruction = function->chunk.Offset(frame->ip) - 1;
+        fprintf(stderr, "[line %d] in ", (*function->chunk.m_pLines)[instruction]);
         if (function->name == nullptr)
             fprintf(stderr, "script\n");
         else
@@ -218,11 +265,39 @@ bool VM::CallFunction(ObjectClosure* pClosure, int iArgCount)
         return false;
     }
 
-    CallFrame *pFrame = &m_pCurrentFiber->m_vFrames[m_pCurrentFiber->m_iFrameCount++];
+    if (!CompileLazy(pClosure->function))
+        return false;
+
+    CallFrame *pFrame = m_pCurrentFiber->PushFrame();
     pFrame->closure = pClosure;
-    pFrame->ip = pClosure->function->chunk.m_vCode.begin();
+    pFrame->ip = pClosure->function->chunk.Start();
 
     pFrame->slots = m_pCurrentFiber->m_pStackTop - iArgCount - 1;
+    // Leave the callee room for its locals and temporaries. This may move the
+    // stack, so the caller has to reload its pointers into it.
+    EnsureStack(m_pCurrentFiber, pFrame->slots - m_pCurrentFiber->m_vStack.data() + pClosure->function->maxSlots);
+    return true;
+}
+
+// Compiles [pFunction] if it was deferred to its first call by -lazy. Must be
+// called before any frame runs it.
+bool VM::CompileLazy(ObjectFunction* pFunction)
+{
+    PROFILE_FUNCTION();
+    if (pFunction->lazy == nullptr)
+        return true;
+
+    // The module variables it declares go in its own module.
+    ObjectModule* pModule = currentModule;
+    currentModule = pFunction->module;
+    bool bCompiled = ::CompileLazy(m_oParser, pFunction);
+    currentModule = pModule;
+
+    if (!bCompiled)
+    {
+        RuntimeError("Could not compile function '%s'.", pFunction->name->string.c_str());
+        return false;
+    }
     return true;
 }
 
@@ -307,6 +382,7 @@ void VM::CloseUpvalues(Value *last)
         ObjectUpvalue* pUpvalue = m_pCurrentFiber->m_vOpenUpvalues;
         pUpvalue->closed = *pUpvalue->location;
         pUpvalue->location = &pUpvalue->closed;
+        WriteBarrier(pUpvalue, pUpvalue->closed);
         m_pCurrentFiber->m_vOpenUpvalues = pUpvalue->next;
     }
 }
@@ -322,7 +398,7 @@ void VM::DefineLib(const std::string &strModule, const std::string &strName, Nat
     {
         Push(Fox_Object(m_oParser.CopyString(strName)));
         Push(Fox_Object(gc.New<ObjectLib>(Fox_AsString(PeekStart(0)))));
-        pModule->m_vVariables.Set(Fox_AsString(PeekStart(0)), PeekStart(1));
+        pModule->SetVariable(Fox_AsString(PeekStart(0)), PeekStart(1));
         ObjectLib* pKlass = Fox_AsLib(Pop());
         Pop();
         Push(Fox_Object(pKlass));
@@ -332,6 +408,7 @@ void VM::DefineLib(const std::string &strModule, const std::string &strName, Nat
             Push(Fox_Object(gc.New<ObjectNative>(it.second)));
 
             pKlass->methods.Set(Fox_AsString(PeekStart(1)), PeekStart(2));
+            InvalidateMethodCaches();
 
             Pop();
             Pop();
@@ -366,8 +443,7 @@ ObjectModule& VM::DefineModule(const std::string& strName)
         {
             // Implicitly import the core module.
             ObjectModule* coreModule = GetModule(NewString("core"));
-            for (int i = 0; i < coreModule->m_vVariables.m_iCount; i++)
-                pModule->m_vVariables.AddAll(coreModule->m_vVariables);
+            pModule->ImportVariables(*coreModule);
         }
     }
     else
@@ -386,17 +462,64 @@ void VM::DefineBuiltIn(Table& methods, NativeMethods& functions)
         Push(Fox_Object(gc.New<ObjectNative>(func)));
 
         methods.Set(Fox_AsString(PeekStart(0)), PeekStart(1));
+        InvalidateMethodCaches();
 
         Pop();
         Pop();
     }
 }
 
-bool VM::InvokeFromClass(ObjectClass* pKlass, ObjectString* pName, int iArgCount)
+// Looks the method [pName] up in [oMethods], going through [pCache] when the
+// call site has one. Returns false if the table doesn't contain [pName].
+inline bool VM::FindMethod(Table& oMethods, ObjectString* pName, MethodCache* pCache, Value& oMethod)
+{
+    if (pCache != nullptr)
+    {
+        const Value* pCached = pCache->Find(&oMethods, m_uMethodEpoch);
+        if (pCached != nullptr)
+        {
+#ifdef DEBUG
+            m_uCacheHits++;
+#endif
+            oMethod = *pCached;
+            return true;
+        }
+#ifdef DEBUG
+        m_uCacheMisses++;
+#endif
+    }
+
+    if (!oMethods.Get(pName, oMethod))
+        return false;
+
+    if (pCache != nullptr)
+        pCache->Update(&oMethods, oMethod, m_uMethodEpoch);
+    return true;
+}
+
+void VM::InvalidateMethodCaches()
+{
+    m_uMethodEpoch++;
+}
+
+// Called by JIT_ENTER() once [pFunction] has been entered FOX_JIT_THRESHOLD
+// times. If it isn't compiled, its counter starts over from the other end so
+// the interpreter doesn't ask again any time soon.
+void VM::CompileHotFunction(ObjectFunction* pFunction)
+{
+    // A traced or profiled run has to go through every instruction.
+    if (m_bJit && !m_bLogTrace && !m_bLogProfile)
+        pFunction->jitCode = JitCompile(pFunction);
+
+    if (pFunction->jitCode == nullptr)
+        pFunction->hotness = INT32_MIN;
+}
+
+bool VM::InvokeFromClass(ObjectClass* pKlass, ObjectString* pName, int iArgCount, MethodCache* pCache)
 {
     PROFILE_FUNCTION();
     Value oMethod;
-    if (!pKlass->methods.Get(pName, oMethod))
+    if (!FindMethod(pKlass->methods, pName, pCache, oMethod))
     {
         RuntimeError("Undefined property '%s'.", pName->string.c_str());
         return false;
@@ -411,11 +534,12 @@ bool VM::InvokeFromClass(ObjectClass* pKlass, ObjectString* pName, int iArgCount
     return CallValue(oMethod, iArgCount);
 }
 
-bool VM::Invoke(ObjectString* pName, int iArgCount)
+bool VM::Invoke(ObjectString* pName, int iArgCount, MethodCache* pCache)
 {
     PROFILE_FUNCTION();
     Value& oReceiver = Peek(iArgCount);
     Value oValue;
+    Table* pMethods;
 
     switch (Fox_AsObject(oReceiver)->type)
     {
@@ -426,69 +550,36 @@ bool VM::Invoke(ObjectString* pName, int iArgCount)
                 m_pCurrentFiber->m_pStackTop[-iArgCount - 1] = oValue;
                 return CallValue(oValue, iArgCount);
             }
-            return InvokeFromClass(pInstance->klass, pName, iArgCount);
+            return InvokeFromClass(pInstance->klass, pName, iArgCount, pCache);
         }
 
         case OBJ_LIB:
         {
             ObjectLib* pInstance = Fox_AsLib(oReceiver);
-            Value method;
-            if (!pInstance->methods.Get(pName, method))
+            if (!FindMethod(pInstance->methods, pName, pCache, oValue))
             {
                 RuntimeError("Undefined property '%s'.", pName->string.c_str());
                 return false;
             }
-            return CallValue(method, iArgCount);
+            return CallValue(oValue, iArgCount);
         }
 
-        case OBJ_ARRAY:
-        {
-            Value oMethod;
-            if (!arrayMethods.Get(pName, oMethod))
-            {
-                RuntimeError("Undefined methods '%s'.", pName->string.c_str());
-                return false;
-            }
-            return CallValue(oMethod, iArgCount);
-        }
-
-        case OBJ_STRING:
-        {
-            Value oMethod;
-            if (!stringMethods.Get(pName, oMethod))
-            {
-                RuntimeError("Undefined methods '%s'.", pName->string.c_str());
-                return false;
-            }
-            return CallValue(oMethod, iArgCount);
-        }
-
-        case OBJ_MAP:
-        {
-            Value oMethod;
-            if (!mapMethods.Get(pName, oMethod))
-            {
-                RuntimeError("Undefined methods '%s'.", pName->string.c_str());
-                return false;
-            }
-            return CallValue(oMethod, iArgCount);
-        }
-
-        case OBJ_FIBER:
-        {
-            Value oMethod;
-            if (!fiberMethods.Get(pName, oMethod))
-            {
-                RuntimeError("Undefined methods '%s'.", pName->string.c_str());
-                return false;
-            }
-            return CallValue(oMethod, iArgCount);
-        }
+        case OBJ_ARRAY:  pMethods = &arrayMethods; break;
+        case OBJ_STRING: pMethods = &stringMethods; break;
+        case OBJ_MAP:    pMethods = &mapMethods; break;
+        case OBJ_FIBER:  pMethods = &fiberMethods; break;
 
         default:
             RuntimeError("Only instances && module have methods.");
             return false;
     }
+
+    if (!FindMethod(*pMethods, pName, pCache, oValue))
+    {
+        RuntimeError("Undefined methods '%s'.", pName->string.c_str());
+        return false;
+    }
+    return CallValue(oValue, iArgCount);
 }
 
 InterpretResult VM::Interpret(const std::string& strModule, const std::string& strSource)
@@ -505,19 +596,86 @@ InterpretResult VM::Interpret(const std::string& strModule, const std::string& s
 
     Push(Fox_Object(pClosure));
     // Initialize the first call frame.
-    CallFrame *pFrame = &m_pCurrentFiber->m_vFrames[m_pCurrentFiber->m_iFrameCount++];
+    CallFrame *pFrame = m_pCurrentFiber->PushFrame();
     pFrame->closure = pClosure;
-    pFrame->ip = pClosure->function->chunk.m_vCode.begin();
+    pFrame->ip = pClosure->function->chunk.Start();
     
     // The first slot always holds the closure.
     pFrame->slots = m_pCurrentFiber->m_pStackTop - 1;
+    EnsureStack(m_pCurrentFiber, pFrame->slots - m_pCurrentFiber->m_vStack.data() + pClosure->function->maxSlots);
     // Pop(); // closure.
     // m_pApiStack = nullptr;
     // CallValue(Fox_Object(pClosure), 0);
 
-    return run(m_pCurrentFiber);
+    InterpretResult oResult = run(m_pCurrentFiber);
+#ifdef DEBUG
+    if (IsLogCache())
+    {
+        printf("-- inline caches: %llu hits, %llu misses --\n",
+            (unsigned long long) m_uCacheHits, (unsigned long long) m_uCacheMisses);
+    }
+    if (IsLogProfile())
+        PrintInstructionProfile();
+#endif
+    return oResult;
 }
 
+#ifdef DEBUG
+// Counts the instruction about to run together with the one or two that ran
+// before it, whatever function they were in.
+void VM::CountInstruction(uint8_t uInstruction)
+{
+    if (m_uPreviousInstructions[1] < OP_TOTAL)
+    {
+        m_vPairCounts[m_uPreviousInstructions[1]][uInstruction]++;
+        if (m_uPreviousInstructions[0] < OP_TOTAL)
+        {
+            uint32_t uTriple = (m_uPreviousInstructions[0] << 16) |
+                (m_uPreviousInstructions[1] << 8) | uInstruction;
+            m_vTripleCounts[uTriple]++;
+        }
+    }
+    m_uPreviousInstructions[0] = m_uPreviousInstructions[1];
+    m_uPreviousInstructions[1] = uInstruction;
+}
+
+// Prints the most frequent instruction pairs and triples seen with -lp, the
+// candidates for superinstructions.
+void VM::PrintInstructionProfile()
+{
+    const size_t uShown = 15;
+    std::vector<std::pair<uint64_t, uint32_t>> vCounts;
+
+    for (int i = 0; i < OP_TOTAL; i++)
+    {
+        for (int j = 0; j < OP_TOTAL; j++)
+        {
+            if (m_vPairCounts[i][j] > 0)
+                vCounts.push_back({ m_vPairCounts[i][j], (uint32_t)((i << 8) | j) });
+        }
+    }
+    std::sort(vCounts.rbegin(), vCounts.rend());
+    printf("-- instruction pairs --\n");
+    for (size_t i = 0; i < vCounts.size() && i < uShown; i++)
+    {
+        printf("%12llu %s %s\n", (unsigned long long) vCounts[i].first,
+            opcodeName((vCounts[i].second >> 8) & 0xff), opcodeName(vCounts[i].second & 0xff));
+    }
+
+    vCounts.clear();
+    for (const auto& oTriple : m_vTripleCounts)
+        vCounts.push_back({ oTriple.second, oTriple.first });
+    std::sort(vCounts.rbegin(), vCounts.rend());
+    printf("-- instruction triples --\n");
+    for (size_t i = 0; i < vCounts.size() && i < uShown; i++)
+    {
+        printf("%12llu %s %s %s\n", (unsigned long long) vCounts[i].first,
+            opcodeName((vCounts[i].second >> 16) & 0xff),
+            opcodeName((vCounts[i].second >> 8) & 0xff), opcodeName(vCounts[i].second & 0xff));
+    }
+}
+#endif
+
 ObjectClosure* VM::CompileSource(const std::string& strModule, const std::string& strSource, bool bIsExpression, bool bPrintErrors)
 {
     PROFILE_FUNCTION();
@@ -540,6 +698,43 @@ Value VM::NewString(const std::string& strString)
     return Fox_Object(m_oParser.TakeString(strString));
 }
 
+// Looks [pName] up in [oTable] through the inline cache of the current
+// instruction. The slot remembered for [pClass] is used if its entry still
+// holds [pName], otherwise this does a regular lookup and remembers where the
+// name was found. Returns nullptr if the table doesn't contain [pName].
+inline Entry* VM::LookupCached(InlineCache& oCache, ObjectClass* pClass, Table& oTable, ObjectString* pName)
+{
+    int iSlot = oCache.Find(pClass);
+    if (iSlot >= 0 && iSlot <= oTable.m_iCapacity && oTable.m_vEntries[iSlot].m_pKey == pName)
+    {
+#ifdef DEBUG
+        m_uCacheHits++;
+#endif
+        return &oTable.m_vEntries[iSlot];
+    }
+
+#ifdef DEBUG
+    m_uCacheMisses++;
+#endif
+    iSlot = oTable.IndexOf(pName);
+    if (iSlot < 0)
+        return nullptr;
+
+    oCache.Update(pClass, iSlot);
+    return &oTable.m_vEntries[iSlot];
+}
+
+// Returns the name of the variable in [iSlot] of [pModule], for error messages.
+static const char* ModuleVariableName(ObjectModule* pModule, int iSlot)
+{
+    for (Entry& oEntry : pModule->m_vVariableNames.m_vEntries)
+    {
+        if (oEntry.m_pKey != nullptr && Fox_AsInt(oEntry.m_oValue) == iSlot)
+            return oEntry.m_pKey->string.c_str();
+    }
+    return "?";
+}
+
 static bool ValueIsNumber(Value oNumber)
 {
     PROFILE_FUNCTION();
@@ -550,941 +745,1619 @@ static bool ValueIsNumber(Value oNumber)
     return false;
 }
 
+// Returns the slot in ObjectClass::operatorTable of the operator [pName], or -1
+// if it is only reachable by name.
+static int OperatorSlotOf(ObjectString* pName)
+{
+    if (pName->string == "+") return OPERATOR_ADD;
+    if (pName->string == "-") return OPERATOR_SUB;
+    if (pName->string == "*") return OPERATOR_MUL;
+    if (pName->string == "/") return OPERATOR_DIV;
+    return -1;
+}
+
+// Converts a number to the 32-bit integer the bitwise operators work on.
+// Doubles are truncated and wrapped around, so an integer that overflowed to
+// a double gets its low 32 bits back.
+static inline int32_t ValueToInt32(Value oNumber)
+{
+    if (Fox_IsInt(oNumber))
+        return oNumber.GetInt();
+
+    double dNumber = Fox_AsNumber(oNumber);
+    if (!std::isfinite(dNumber))
+        return 0;
+    return (int32_t)(uint32_t)(int64_t)std::fmod(std::trunc(dNumber), 4294967296.0);
+}
+
 InterpretResult VM::run(ObjectFiber* pFiber)
 {
     PROFILE_FUNCTION();
+    // A previous error left the fibers in an unknown state, don't resume them.
+    if (result == INTERPRET_RUNTIME_ERROR || result == INTERPRET_ABORT)
+        return result;
+
     m_pCurrentFiber = pFiber;
-    CallFrame *frame = &m_pCurrentFiber->m_vFrames[m_pCurrentFiber->m_iFrameCount - 1];
 
-#define READ_BYTE() (*frame->ip++)
-#define READ_CONSTANT()                                                        \
-    (frame->closure->function->chunk.m_oConstants.m_vValues[READ_BYTE()])
+    // Remember the current call frame, its instruction pointer, its slots, its
+    // constant pool, its inline caches and its module along with the top of
+    // the stack in locals so the compiler can keep them in registers for the
+    // hot instructions. They are the source of truth while we're in the loop:
+    // anything outside of it (calls, the GC, error reporting) reads the fiber
+    // instead, so they must be written back with STORE_FRAME() before handing
+    // control over and reloaded with LOAD_FRAME() once it comes back.
+    CallFrame* frame;
+    uint8_t* ip;
+    Value* slots;
+    Value* constants;
+    InlineCache* caches;
+    MethodCache* methodCaches;
+    ObjectModule* module;
+    Value* stackTop;
+
+#define STORE_FRAME()                                                          \
+    do {                                                                       \
+        frame->ip = ip;                                                        \
+        m_pCurrentFiber->m_pStackTop = stackTop;                               \
+    } while (false)
+
+// The callee may have pushed a frame, popped one, or switched to another
+// fiber, so everything is reloaded from whatever fiber is current now.
+#define LOAD_FRAME()                                                           \
+    do {                                                                       \
+        frame = &m_pCurrentFiber->m_vFrames[m_pCurrentFiber->m_iFrameCount - 1]; \
+        ip = frame->ip;                                                        \
+        slots = frame->slots;                                                  \
+        constants = frame->closure->function->chunk.m_oConstants.m_vValues.data(); \
+        caches = frame->closure->function->chunk.m_vCaches.data();             \
+        methodCaches = frame->closure->function->chunk.m_vMethodCaches.data(); \
+        module = frame->closure->function->module;                             \
+        stackTop = m_pCurrentFiber->m_pStackTop;                               \
+    } while (false)
+
+#define PUSH(value)  (*stackTop++ = (value))
+#define POP()        (*(--stackTop))
+#define PEEK(distance) (stackTop[-1 - (distance)])
+
+#define READ_BYTE() (*ip++)
+#define READ_CONSTANT() (constants[READ_BYTE()])
 #define READ_STRING() Fox_AsString(READ_CONSTANT())
-#define READ_SHORT()                                                           \
-    (frame->ip += 2, (uint16_t)((frame->ip[-2] << 8) | frame->ip[-1]))
+#define READ_SHORT() (ip += 2, (uint16_t)((ip[-2] << 8) | ip[-1]))
+
+// Reports a runtime error from inside the loop. The registers are flushed
+// first so the stack trace points at the right instruction.
+#define RUNTIME_ERROR(...)                                                     \
+    do {                                                                       \
+        STORE_FRAME();                                                         \
+        RuntimeError(__VA_ARGS__);                                             \
+        return INTERPRET_RUNTIME_ERROR;                                        \
+    } while (false)
 
 #define BINARY_OP(ValueType, GetValue, type, op)                                         \
     do {                                                                       \
-        if (!ValueIsNumber(Peek(0)) || !ValueIsNumber(Peek(1))) {              \
-            RuntimeError("Operands must be numbers.");                         \
+        if (!ValueIsNumber(PEEK(0)) || !ValueIsNumber(PEEK(1)))                \
+            RUNTIME_ERROR("Operands must be numbers.");                        \
+        type b = Fox_As##GetValue(POP());                                           \
+        type a = Fox_As##GetValue(POP());                                           \
+        PUSH(Fox_##ValueType(a op b));                                       \
+    } while (false)
+
+// Fast paths for two integer operands. Arithmetic is done on 64 bits so a
+// result that doesn't fit in an integer is promoted to a double instead of
+// wrapping around.
+#define INT_ARITH_OP(op)                                                       \
+    do {                                                                       \
+        int64_t b = POP().GetInt();                                            \
+        int64_t a = PEEK(0).GetInt();                                          \
+        PEEK(0).SetInteger(a op b);                                            \
+    } while (false)
+
+#define INT_COMPARE_OP(op)                                                     \
+    do {                                                                       \
+        int32_t b = POP().GetInt();                                            \
+        int32_t a = PEEK(0).GetInt();                                          \
+        PEEK(0) = Fox_Bool(a op b);                                            \
+    } while (false)
+
+#define BITWISE_OP(op)                                                         \
+    do {                                                                       \
+        if (!Fox_IsNumber(PEEK(0)) || !Fox_IsNumber(PEEK(1)))                  \
+            RUNTIME_ERROR("Operands must be numbers.");                        \
+        int32_t b = ValueToInt32(POP());                                       \
+        int32_t a = ValueToInt32(POP());                                       \
+        PUSH(Fox_Int(a op b));                                                 \
+    } while (false)
+
+#define BOTH_INTS() (Fox_IsInt(PEEK(0)) && Fox_IsInt(PEEK(1)))
+#define BOTH_NUMBERS() (Fox_IsNumber(PEEK(0)) && Fox_IsNumber(PEEK(1)))
+
+// The bodies of the quickened numeric instructions. They only handle two
+// numbers and fall back to the [generic] instruction for anything else.
+#define NUM_ARITH_OP(op, generic)                                              \
+    do {                                                                       \
+        if (BOTH_INTS())                                                       \
+            INT_ARITH_OP(op);                                                  \
+        else if (BOTH_NUMBERS()) {                                             \
+            double b = Fox_AsNumber(POP());                                    \
+            double a = Fox_AsNumber(PEEK(0));                                  \
+            PEEK(0) = Fox_Number(a op b);                                      \
+        }                                                                      \
+        else                                                                   \
+            DEOPTIMIZE(generic);                                               \
+    } while (false)
+
+#define NUM_COMPARE_OP(op, generic)                                            \
+    do {                                                                       \
+        if (BOTH_INTS())                                                       \
+            INT_COMPARE_OP(op);                                                \
+        else if (BOTH_NUMBERS()) {                                             \
+            double b = Fox_AsNumber(POP());                                    \
+            double a = Fox_AsNumber(PEEK(0));                                  \
+            PEEK(0) = Fox_Bool(a op b);                                        \
+        }                                                                      \
+        else                                                                   \
+            DEOPTIMIZE(generic);                                               \
+    } while (false)
+
+// Quickening. Once a generic instruction has run with operands of the types
+// one of its specialized variants expects, it rewrites its opcode in place so
+// the next executions skip the type tests for the other cases. The variant
+// only guards that its operands still have the right types, and if they
+// don't, it turns the instruction back into the generic one and runs that.
+// These only apply to instructions without operands, whose opcode is the byte
+// right before [ip]. A function loaded from the code cache runs the code the
+// VMs share, so it gets its own copy before its first rewrite, either way:
+// OP_INC_LOCAL and OP_DEC_LOCAL come from the compiler and deoptimize in the
+// shared code.
+#define QUICKEN(op)                                                            \
+    do {                                                                       \
+        ip = frame->closure->function->chunk.OwnCode(ip);                      \
+        ip[-1] = (uint8_t) (op);                                               \
+    } while (false)
+
+#define DEOPTIMIZE(op)                                                         \
+    do {                                                                       \
+        ip = frame->closure->function->chunk.OwnCode(ip);                      \
+        ip[-1] = (uint8_t) (op);                                               \
+        ip--;                                                                  \
+        DISPATCH();                                                            \
+    } while (false)
+
+// A native, a getter/setter or an overloaded operator can report an error
+// through [result] without unwinding the run loop, so only the instructions
+// that may call back into the host check it.
+#define CHECK_RESULT()                                                         \
+    do {                                                                       \
+        if (result == INTERPRET_RUNTIME_ERROR || result == INTERPRET_ABORT ||  \
+            result == INTERPRET_SUSPEND)                                       \
+            return result;                                                     \
+    } while (false)
+
+// Calls the overload of the operator in [slot] defined by the class of the
+// instance on the left side.
+#define CALL_OPERATOR(slot, name)                                              \
+    do {                                                                       \
+        Value oMethod = Fox_AsInstance(PEEK(1))->klass->operatorTable[slot];   \
+        if (Fox_IsNil(oMethod))                                                \
+            RUNTIME_ERROR("Undefined operator '%s'.", name);                   \
+        STORE_FRAME();                                                         \
+        if (!CallValue(oMethod, 1))                                            \
             return INTERPRET_RUNTIME_ERROR;                                    \
+        LOAD_FRAME();                                                          \
+        CHECK_RESULT();                                                        \
+    } while (false)
+
+// The body of the arithmetic superinstructions on a local and a constant. The
+// compiler only fuses them when the constant is a number, so the local is
+// either a number too, an instance overloading the operator, or an error.
+#define LOCAL_CONST_ARITH_OP(op, slot, name, error)                            \
+    do {                                                                       \
+        if (BOTH_INTS())                                                       \
+            INT_ARITH_OP(op);                                                  \
+        else if (Fox_IsNumber(PEEK(1))) {                                      \
+            double b = Fox_AsNumber(POP());                                    \
+            double a = Fox_AsNumber(PEEK(0));                                  \
+            PEEK(0) = Fox_Number(a op b);                                      \
         }                                                                      \
-        type b = Fox_As##GetValue(Pop());                                           \
-        type a = Fox_As##GetValue(Pop());                                           \
-        Push(Fox_##ValueType(a op b));                                       \
+        else if (Fox_IsInstance(PEEK(1)))                                      \
+            CALL_OPERATOR(slot, name);                                         \
+        else                                                                   \
+            RUNTIME_ERROR(error);                                              \
     } while (false)
 
-    while (true)
-    {
-        if (result == INTERPRET_RUNTIME_ERROR)
-            return result;
-        if (result == INTERPRET_ABORT)
-            return result;
+// The body of the compare-and-branch instructions: compares [a] and [b] the
+// way OP_LESS and OP_GREATER do, and jumps if the result is [when].
+#define COMPARE_AND_JUMP(a, b, op, when)                                       \
+    do {                                                                       \
+        uint16_t uOffset = READ_SHORT();                                       \
+        bool bResult;                                                          \
+        if (Fox_IsInt(a) && Fox_IsInt(b))                                      \
+            bResult = (a).GetInt() op (b).GetInt();                            \
+        else if (ValueIsNumber(a) && ValueIsNumber(b))                         \
+            bResult = Fox_AsNumber(a) op Fox_AsNumber(b);                      \
+        else                                                                   \
+            RUNTIME_ERROR("Operands must be numbers.");                        \
+        if (bResult == (when))                                                 \
+            ip += uOffset;                                                     \
+    } while (false)
+
+// The body of OP_INC_LOCAL and OP_DEC_LOCAL, which add or subtract a number
+// constant to a local and skip the OP_STORE_LOCAL in their operands. Anything
+// else than a number in the local turns them back into the [generic]
+// superinstruction, which runs with that store after it.
+#define LOCAL_INC_OP(op, generic)                                              \
+    do {                                                                       \
+        Value& oLocal = slots[ip[0]];                                          \
+        Value oConstant = constants[ip[1]];                                    \
+        if (Fox_IsInt(oLocal) && Fox_IsInt(oConstant))                         \
+            oLocal.SetInteger((int64_t)oLocal.GetInt() op oConstant.GetInt()); \
+        else if (Fox_IsNumber(oLocal))                                         \
+            oLocal = Fox_Number(Fox_AsNumber(oLocal) op Fox_AsNumber(oConstant)); \
+        else                                                                   \
+            DEOPTIMIZE(generic);                                               \
+        ip += 4;                                                               \
+    } while (false)
+
+// Runs the machine code of the current function, if it has been compiled,
+// from [ip] to the first instruction it leaves to the interpreter. It is only
+// tried where the interpreter enters a function: after a call, a return or a
+// loop back edge, which is also where the hotness of the function is counted.
+// The calls made by the machine code may move the stack and the frames, and
+// may leave the interpreter in one of the callees, so everything is reloaded
+// from the fiber afterwards.
+#if FOX_JIT
+    #define JIT_ENTER()                                                        \
+        do {                                                                   \
+            ObjectFunction* pJitFunction = frame->closure->function;           \
+            if (pJitFunction->jitCode != nullptr) {                            \
+                Chunk& oJitChunk = pJitFunction->chunk;                        \
+                int iJitExit = pJitFunction->jitCode->Enter(this,              \
+                    oJitChunk.Offset(ip), slots,                               \
+                    module != nullptr ? module->m_vVariables.data() : nullptr, \
+                    stackTop);                                                 \
+                if (iJitExit == JIT_EXIT_ERROR)                                \
+                    return INTERPRET_RUNTIME_ERROR;                            \
+                if (iJitExit != JIT_EXIT_FRAMES) {                             \
+                    m_pCurrentFiber->m_vFrames[m_pCurrentFiber->m_iFrameCount - 1].ip = \
+                        oJitChunk.Start() + iJitExit;                          \
+                    m_pCurrentFiber->m_pStackTop = stackTop;                   \
+                }                                                              \
+                LOAD_FRAME();                                                  \
+                CHECK_RESULT();                                                \
+            }                                                                  \
+            else if (++pJitFunction->hotness == FOX_JIT_THRESHOLD)             \
+                CompileHotFunction(pJitFunction);                              \
+        } while (false)
+#else
+    #define JIT_ENTER() do { } while (false)
+#endif
+
 #ifdef DEBUG
-        if (IsLogTrace()) {
-            printf("          ");
-            for (Value *pSlot = m_pCurrentFiber->m_vStack; pSlot < m_pCurrentFiber->m_pStackTop; ++pSlot) {
-                printf("[ ");
-                PrintValue(*pSlot);
-                printf(" ]");
-            }
-            printf("\n");
-            disassembleInstruction(
-                frame->closure->function->chunk,
-                (int)(frame->ip - frame->closure->function->chunk.m_vCode.begin()));
-        }
+    #define DEBUG_TRACE_INSTRUCTIONS()                                         \
+        do {                                                                   \
+            if (IsLogProfile())                                                \
+                CountInstruction(*ip);                                         \
+            if (IsLogTrace()) {                                                \
+                printf("          ");                                          \
+                for (Value *pSlot = m_pCurrentFiber->m_vStack.data();          \
+                     pSlot < stackTop; ++pSlot) {                              \
+                    printf("[ ");                                              \
+                    PrintValue(*pSlot);                                        \
+                    printf(" ]");                                              \
+                }                                                              \
+                printf("\n");                                                  \
+                disassembleInstruction(                                        \
+                    frame->closure->function->chunk,                           \
+                    frame->closure->function->chunk.Offset(ip));               \
+            }                                                                  \
+        } while (false)
+#else
+    #define DEBUG_TRACE_INSTRUCTIONS() do { } while (false)
 #endif
-        uint8_t instruction = READ_BYTE();
-        switch (instruction)
-        {
-        case OP_NIL:
-            Push(Fox_Nil);
-            break;
-        case OP_TRUE:
-            Push(Fox_Bool(true));
-            break;
-        case OP_FALSE:
-            Push(Fox_Bool(false));
-            break;
-        case OP_POP:
-            Pop();
-            break;
 
-        case OP_GET_UPVALUE:
-        {
-            PROFILE_SCOPE("OP_GET_UPVALUE");
-            uint8_t uSlot = READ_BYTE();
-            Push(*frame->closure->upValues[uSlot]->location);
-            break;
+#if FOX_COMPUTED_GOTO
+
+    static void* dispatchTable[] = {
+        #define OPCODE(name) &&code_##name,
+        #include "opcodes.h"
+        #undef OPCODE
+    };
+
+    #define INTERPRET_LOOP    DISPATCH();
+    #define CASE_CODE(name)   code_##name
+
+    #define DISPATCH()                                                         \
+        do {                                                                   \
+            DEBUG_TRACE_INSTRUCTIONS();                                        \
+            goto *dispatchTable[instruction = READ_BYTE()];                    \
+        } while (false)
+
+#else
+
+    #define INTERPRET_LOOP                                                     \
+        loop:                                                                  \
+            DEBUG_TRACE_INSTRUCTIONS();                                        \
+            switch (instruction = READ_BYTE())
+
+    #define CASE_CODE(name)  case name
+    #define DISPATCH()       goto loop
+
+#endif
+
+    LOAD_FRAME();
+
+    uint8_t instruction;
+    INTERPRET_LOOP
+    {
+    CASE_CODE(OP_NIL):
+        PUSH(Fox_Nil);
+        DISPATCH();
+    CASE_CODE(OP_TRUE):
+        PUSH(Fox_Bool(true));
+        DISPATCH();
+    CASE_CODE(OP_FALSE):
+        PUSH(Fox_Bool(false));
+        DISPATCH();
+    CASE_CODE(OP_POP):
+        stackTop--;
+        DISPATCH();
+
+    CASE_CODE(OP_GET_UPVALUE):
+    {
+        PROFILE_SCOPE("OP_GET_UPVALUE");
+        uint8_t uSlot = READ_BYTE();
+        PUSH(*frame->closure->upValues[uSlot]->location);
+        DISPATCH();
+    }
+
+    CASE_CODE(OP_SET_UPVALUE):
+    {
+        PROFILE_SCOPE("OP_SET_UPVALUE");
+        uint8_t uSlot = READ_BYTE();
+        ObjectUpvalue* pUpvalue = frame->closure->upValues[uSlot];
+        *pUpvalue->location = PEEK(0);
+        WriteBarrier(pUpvalue, PEEK(0));
+        DISPATCH();
+    }
+
+    CASE_CODE(OP_GET_LOCAL):
+    {
+        PROFILE_SCOPE("OP_GET_LOCAL");
+        uint8_t uSlot = READ_BYTE();
+        PUSH(slots[uSlot]);
+        DISPATCH();
+    }
+
+    CASE_CODE(OP_SET_LOCAL):
+    {
+        PROFILE_SCOPE("OP_SET_LOCAL");
+        uint8_t uSlot = READ_BYTE();
+        slots[uSlot] = PEEK(0);
+        DISPATCH();
+    }
+
+    CASE_CODE(OP_STORE_LOCAL):
+    {
+        PROFILE_SCOPE("OP_STORE_LOCAL");
+        uint8_t uSlot = READ_BYTE();
+        slots[uSlot] = POP();
+        DISPATCH();
+    }
+
+    CASE_CODE(OP_GET_MODULE_VAR):
+    {
+        PROFILE_SCOPE("OP_GET_MODULE_VAR");
+        uint16_t uSlot = READ_SHORT();
+        Value oValue = module->m_vVariables[uSlot];
+        if (Fox_IsUndefined(oValue)) {
+            RUNTIME_ERROR("Undefined variable '%s'.", ModuleVariableName(module, uSlot));
+        }
+        PUSH(oValue);
+        DISPATCH();
+    }
+
+    CASE_CODE(OP_DEFINE_MODULE_VAR):
+    {
+        PROFILE_SCOPE("OP_DEFINE_MODULE_VAR");
+        module->m_vVariables[READ_SHORT()] = POP();
+        DISPATCH();
+    }
+
+    CASE_CODE(OP_SET_MODULE_VAR):
+    {
+        PROFILE_SCOPE("OP_SET_MODULE_VAR");
+        uint16_t uSlot = READ_SHORT();
+        if (Fox_IsUndefined(module->m_vVariables[uSlot])) {
+            RUNTIME_ERROR("Undefined variable '%s'.", ModuleVariableName(module, uSlot));
         }
+        module->m_vVariables[uSlot] = PEEK(0);
+        DISPATCH();
+    }
 
-        case OP_SET_UPVALUE:
-        {
-            PROFILE_SCOPE("OP_SET_UPVALUE");
-            uint8_t uSlot = READ_BYTE();
-            *frame->closure->upValues[uSlot]->location = Peek(0);
-            break;
+    CASE_CODE(OP_STORE_MODULE_VAR):
+    {
+        PROFILE_SCOPE("OP_STORE_MODULE_VAR");
+        uint16_t uSlot = READ_SHORT();
+        if (Fox_IsUndefined(module->m_vVariables[uSlot])) {
+            RUNTIME_ERROR("Undefined variable '%s'.", ModuleVariableName(module, uSlot));
         }
+        module->m_vVariables[uSlot] = POP();
+        DISPATCH();
+    }
 
-        case OP_GET_LOCAL:
-        {
-            PROFILE_SCOPE("OP_GET_LOCAL");
-            uint8_t uSlot = READ_BYTE();
-            Push(frame->slots[uSlot]);
-            break;
+    CASE_CODE(OP_GET_LOCAL_PROPERTY):
+        PUSH(slots[READ_BYTE()]);
+        // Falls through to the property access on the local.
+
+    CASE_CODE(OP_GET_PROPERTY):
+    {
+        PROFILE_SCOPE("OP_GET_PROPERTY");
+        ObjectString* pName = READ_STRING();
+        InlineCache& oCache = caches[READ_SHORT()];
+        if (!Fox_IsInstance(PEEK(0))) {
+            RUNTIME_ERROR("Only instances have properties.");
         }
 
-        case OP_SET_LOCAL:
+        ObjectInstance* pInstance = Fox_AsInstance(PEEK(0));
+
+        if (pInstance->user_type != nullptr)
         {
-            PROFILE_SCOPE("OP_SET_LOCAL");
-            uint8_t uSlot = READ_BYTE();
-            frame->slots[uSlot] = Peek(0);
-            break;
+            Entry* pGetter = LookupCached(oCache, pInstance->klass, pInstance->klass->getters, pName);
+            if (pGetter != nullptr) {
+                STORE_FRAME();
+                CallValue(pGetter->m_oValue, 0);
+                LOAD_FRAME();
+                CHECK_RESULT();
+            }
+            DISPATCH();
         }
-
-        case OP_GET_GLOBAL:
+        else
         {
-            PROFILE_SCOPE("OP_GET_GLOBAL");
-            ObjectString* pName = READ_STRING();
-            Value oValue;
-            if (!currentModule->m_vVariables.Get(pName, oValue)) {
-                RuntimeError("Undefined variable '%s'.", pName->string.c_str());
-                return INTERPRET_RUNTIME_ERROR;
+            Entry* pField = LookupCached(oCache, pInstance->klass, pInstance->fields, pName);
+            if (pField != nullptr) {
+                PEEK(0) = pField->m_oValue; // Replaces the instance.
+                DISPATCH();
             }
-            Push(oValue);
-            break;
         }
 
-        case OP_DEFINE_GLOBAL:
-        {
-            PROFILE_SCOPE("OP_DEFINE_GLOBAL");
-            ObjectString* pName = READ_STRING();
-            currentModule->m_vVariables.Set(pName, Peek(0));
-            Pop();
-            break;
+        STORE_FRAME();
+        if (!BindMethod(pInstance->klass, pName)) {
+            return INTERPRET_RUNTIME_ERROR;
         }
+        stackTop = m_pCurrentFiber->m_pStackTop;
+        DISPATCH();
+    }
 
-        case OP_SET_GLOBAL:
+    CASE_CODE(OP_SET_PROPERTY):
+    {
+        PROFILE_SCOPE("OP_SET_PROPERTY");
+        ObjectString* pName = READ_STRING();
+        InlineCache& oCache = caches[READ_SHORT()];
+        if (!Fox_IsInstance(PEEK(1)))
         {
-            PROFILE_SCOPE("OP_SET_GLOBAL");
-            ObjectString* pName = READ_STRING();
-            if (currentModule->m_vVariables.Set(pName, Peek(0))) {
-                currentModule->m_vVariables.Delete(pName);
-                RuntimeError("Undefined variable '%s'.", pName->string.c_str());
-                return INTERPRET_RUNTIME_ERROR;
-            }
-            break;
+            RUNTIME_ERROR("Only instances have fields.");
         }
 
-        case OP_GET_PROPERTY:
+        ObjectInstance* pInstance = Fox_AsInstance(PEEK(1));
+        if (pInstance->user_type != nullptr)
         {
-            PROFILE_SCOPE("OP_GET_PROPERTY");
-            if (!Fox_IsInstance(Peek(0))) {
-                RuntimeError("Only instances have properties.");
-                return INTERPRET_RUNTIME_ERROR;
-            }
-
-            ObjectInstance* pInstance = Fox_AsInstance(Peek(0));
-
-            if (pInstance->user_type != nullptr)
-            {
-                Value oGetterFunc;
-                if (pInstance->klass->getters.Get(READ_STRING(), oGetterFunc)) {
-                    CallValue(oGetterFunc, 0);
-                }
-                break;
-            }
-            else
-            {
-                Value value;
-                if (pInstance->fields.Get(READ_STRING(), value)) {
-                    Pop(); // Instance.
-                    Push(value);
-                    break;
-                }
+            Entry* pSetter = LookupCached(oCache, pInstance->klass, pInstance->klass->setters, pName);
+            if (pSetter != nullptr) {
+                STORE_FRAME();
+                CallValue(pSetter->m_oValue, 1);
+                LOAD_FRAME();
+                CHECK_RESULT();
             }
-
-            if (!BindMethod(pInstance->klass, READ_STRING())) {
-                return INTERPRET_RUNTIME_ERROR;
-            }
-            break;
         }
-
-        case OP_SET_PROPERTY:
+        else
         {
-            PROFILE_SCOPE("OP_SET_PROPERTY");
-            if (!Fox_IsInstance(Peek(1)))
+            Entry* pField = LookupCached(oCache, pInstance->klass, pInstance->fields, pName);
+            if (pField != nullptr)
             {
-                RuntimeError("Only instances have fields.");
-                return INTERPRET_RUNTIME_ERROR;
-            }
-
-            ObjectInstance* pInstance = Fox_AsInstance(Peek(1));
-            if (pInstance->user_type != nullptr)
-            {
-                Value oSetterFunc;
-                if (pInstance->klass->setters.Get(READ_STRING(), oSetterFunc)) {
-                    CallValue(oSetterFunc, 1);
-                }
+                pField->m_oValue = PEEK(0);
+                WriteBarrier(pInstance, PEEK(0));
             }
             else
             {
-                pInstance->fields.Set(READ_STRING(), Peek(0));
-                Value oValue = Pop();
-                Pop();
-                Push(oValue);
+                // A new field, the next access will find it in the cache.
+                pInstance->fields.Set(pName, PEEK(0));
+                oCache.Update(pInstance->klass, pInstance->fields.IndexOf(pName));
             }
-            break;
+            Value oValue = POP();
+            PEEK(0) = oValue;
         }
+        DISPATCH();
+    }
 
-        case OP_EQUAL:
-        {
-            PROFILE_SCOPE("OP_EQUAL");
-            Value b = Pop();
-            Value a = Pop();
-            Push(Fox_Bool(ValuesEqual(a, b)));
-            break;
-        }
+    CASE_CODE(OP_EQUAL):
+    {
+        PROFILE_SCOPE("OP_EQUAL");
+        Value b = POP();
+        Value a = POP();
+        PUSH(Fox_Bool(ValuesEqual(a, b)));
+        DISPATCH();
+    }
 
-        case OP_GREATER:
-        {
-            PROFILE_SCOPE("OP_GREATER");
+    CASE_CODE(OP_GREATER):
+    {
+        PROFILE_SCOPE("OP_GREATER");
+        if (BOTH_INTS())
+            INT_COMPARE_OP(>);
+        else
             BINARY_OP(Bool, Number, double, >);
-            break;
-        }
+        QUICKEN(OP_GREATER_NUM);
+        DISPATCH();
+    }
 
-        case OP_LESS:
-        {
-            PROFILE_SCOPE("OP_LESS");
+    CASE_CODE(OP_GREATER_NUM):
+    {
+        PROFILE_SCOPE("OP_GREATER_NUM");
+        NUM_COMPARE_OP(>, OP_GREATER);
+        DISPATCH();
+    }
+
+    CASE_CODE(OP_LESS):
+    {
+        PROFILE_SCOPE("OP_LESS");
+        if (BOTH_INTS())
+            INT_COMPARE_OP(<);
+        else
             BINARY_OP(Bool, Number, double, <);
-            break;
+        QUICKEN(OP_LESS_NUM);
+        DISPATCH();
+    }
+
+    CASE_CODE(OP_LESS_NUM):
+    {
+        PROFILE_SCOPE("OP_LESS_NUM");
+        NUM_COMPARE_OP(<, OP_LESS);
+        DISPATCH();
+    }
+
+    CASE_CODE(OP_LESS_LOCAL_CONST):
+    {
+        PROFILE_SCOPE("OP_LESS_LOCAL_CONST");
+        PUSH(slots[READ_BYTE()]);
+        PUSH(READ_CONSTANT());
+        if (BOTH_INTS())
+            INT_COMPARE_OP(<);
+        else
+            BINARY_OP(Bool, Number, double, <);
+        DISPATCH();
+    }
+    
+    CASE_CODE(OP_ADD):
+    {
+        PROFILE_SCOPE("OP_ADD");
+        if (BOTH_INTS()) {
+            INT_ARITH_OP(+);
+            QUICKEN(OP_ADD_NUM);
+        } else if (Fox_IsString(PEEK(0)) && Fox_IsString(PEEK(1))) {
+            STORE_FRAME();
+            Concatenate();
+            stackTop = m_pCurrentFiber->m_pStackTop;
+            QUICKEN(OP_ADD_STR);
+        } else if (Fox_IsNumber(PEEK(0)) && Fox_IsNumber(PEEK(1))) {
+            double b = Fox_AsNumber(POP());
+            double a = Fox_AsNumber(POP());
+            PUSH(Fox_Number(a + b));
+            QUICKEN(OP_ADD_NUM);
+        } else if (Fox_IsInstance(PEEK(1))) {
+            CALL_OPERATOR(OPERATOR_ADD, "+");
+        } else {
+            RUNTIME_ERROR("Operands must be two numbers or two strings.");
+        }
+        DISPATCH();
+    }
+
+    CASE_CODE(OP_ADD_NUM):
+    {
+        PROFILE_SCOPE("OP_ADD_NUM");
+        NUM_ARITH_OP(+, OP_ADD);
+        DISPATCH();
+    }
+
+    CASE_CODE(OP_ADD_STR):
+    {
+        PROFILE_SCOPE("OP_ADD_STR");
+        if (!Fox_IsString(PEEK(0)) || !Fox_IsString(PEEK(1)))
+            DEOPTIMIZE(OP_ADD);
+        STORE_FRAME();
+        Concatenate();
+        stackTop = m_pCurrentFiber->m_pStackTop;
+        DISPATCH();
+    }
+
+    CASE_CODE(OP_ADD_LOCAL_CONST):
+    {
+        PROFILE_SCOPE("OP_ADD_LOCAL_CONST");
+        PUSH(slots[READ_BYTE()]);
+        PUSH(READ_CONSTANT());
+        LOCAL_CONST_ARITH_OP(+, OPERATOR_ADD, "+", "Operands must be two numbers or two strings.");
+        DISPATCH();
+    }
+
+    CASE_CODE(OP_SUB):
+    {
+        PROFILE_SCOPE("OP_SUB");
+        if (BOTH_INTS()) {
+            INT_ARITH_OP(-);
+            QUICKEN(OP_SUB_NUM);
         }
-        
-        case OP_ADD:
-        {
-            PROFILE_SCOPE("OP_ADD");
-            if (Fox_IsString(Peek(0)) && Fox_IsString(Peek(1))) {
-                Concatenate();
-            } else if (Fox_IsNumber(Peek(0)) && Fox_IsNumber(Peek(1))) {
-                double b = Fox_AsNumber(Pop());
-                double a = Fox_AsNumber(Pop());
-                Push(Fox_Number(a + b));
-            } else if (Fox_IsInstance(Peek(1))) {
-                ObjectInstance* pInst = Fox_AsInstance(Peek(1));
-                Value oMethod;
-                // If we found the + operator so call it
-                if (pInst->klass->operators.Get(m_oParser.TakeString("+"), oMethod)) {
-                    if (CallValue(oMethod, 1))
-                        frame = &m_pCurrentFiber->m_vFrames[m_pCurrentFiber->m_iFrameCount - 1];
-                }
-            } else {
-                RuntimeError("Operands must be two numbers or two strings.");
-                return INTERPRET_RUNTIME_ERROR;
-            }
-            break;
+        else if (Fox_IsInstance(PEEK(1))) {
+            CALL_OPERATOR(OPERATOR_SUB, "-");
+        }
+        else {
+            BINARY_OP(Number, Number, double, -);
+            QUICKEN(OP_SUB_NUM);
         }
+        DISPATCH();
+    }
 
-        case OP_SUB:
-        {
-            PROFILE_SCOPE("OP_SUB");
-            if (Fox_IsInstance(Peek(1))) {
-                ObjectInstance* pInst = Fox_AsInstance(Peek(1));
-                Value oMethod;
-                // If we found the + operator so call it
-                if (pInst->klass->operators.Get(m_oParser.TakeString("-"), oMethod)) {
-                    CallValue(oMethod, 1);
-                    frame = &m_pCurrentFiber->m_vFrames[m_pCurrentFiber->m_iFrameCount - 1];
-                }
-            }
-            else if (Fox_IsNumber(Peek(0)))
-                BINARY_OP(Number, Number, double, -);
-            // else if (Fox_IsNumber(Peek(0)))
-            //     BINARY_OP(Int, int, -);
-            break;
+    CASE_CODE(OP_SUB_NUM):
+    {
+        PROFILE_SCOPE("OP_SUB_NUM");
+        NUM_ARITH_OP(-, OP_SUB);
+        DISPATCH();
+    }
+
+    CASE_CODE(OP_SUB_LOCAL_CONST):
+    {
+        PROFILE_SCOPE("OP_SUB_LOCAL_CONST");
+        PUSH(slots[READ_BYTE()]);
+        PUSH(READ_CONSTANT());
+        LOCAL_CONST_ARITH_OP(-, OPERATOR_SUB, "-", "Operands must be numbers.");
+        DISPATCH();
+    }
+
+    CASE_CODE(OP_MUL):
+    {
+        PROFILE_SCOPE("OP_MUL");
+        if (BOTH_INTS()) {
+            INT_ARITH_OP(*);
+            QUICKEN(OP_MUL_NUM);
         }
+        else if (Fox_IsInstance(PEEK(1))) {
+            CALL_OPERATOR(OPERATOR_MUL, "*");
+        }
+        else {
+            BINARY_OP(Number, Number, double, *);
+            QUICKEN(OP_MUL_NUM);
+        }
+        DISPATCH();
+    }
 
-        case OP_MUL:
-        {
-            PROFILE_SCOPE("OP_MUL");
-            if (Fox_IsInstance(Peek(1))) {
-                ObjectInstance* pInst = Fox_AsInstance(Peek(1));
-                Value oMethod;
-                // If we found the + operator so call it
-                if (pInst->klass->operators.Get(m_oParser.TakeString("*"), oMethod)) {
-                    CallValue(oMethod, 1);
-                    frame = &m_pCurrentFiber->m_vFrames[m_pCurrentFiber->m_iFrameCount - 1];
-                }
-            }
-            else if (Fox_IsNumber(Peek(0)))
-                BINARY_OP(Number, Number, double, *);
-            // else if (Fox_IsNumber(Peek(0)))
-            //     BINARY_OP(Int, int, *);
-            break;
+    CASE_CODE(OP_MUL_NUM):
+    {
+        PROFILE_SCOPE("OP_MUL_NUM");
+        NUM_ARITH_OP(*, OP_MUL);
+        DISPATCH();
+    }
+
+    CASE_CODE(OP_DIV):
+    {
+        PROFILE_SCOPE("OP_DIV");
+        if (Fox_IsInstance(PEEK(1))) {
+            CALL_OPERATOR(OPERATOR_DIV, "/");
         }
+        // Dividing two integers gives a double, 7 / 2 is 3.5.
+        else
+            BINARY_OP(Number, Number, double,  /);
+        DISPATCH();
+    }
 
-        case OP_DIV:
-        {
-            PROFILE_SCOPE("OP_DIV");
-            if (Fox_IsInstance(Peek(1))) {
-                ObjectInstance* pInst = Fox_AsInstance(Peek(1));
-                Value oMethod;
-                // If we found the + operator so call it
-                if (pInst->klass->operators.Get(m_oParser.TakeString("/"), oMethod)) {
-                    CallValue(oMethod, 1);
-                    frame = &m_pCurrentFiber->m_vFrames[m_pCurrentFiber->m_iFrameCount - 1];
-                }
+    CASE_CODE(OP_BIT_AND):
+    {
+        PROFILE_SCOPE("OP_BIT_AND");
+        BITWISE_OP(&);
+        DISPATCH();
+    }
+
+    CASE_CODE(OP_BIT_OR):
+    {
+        PROFILE_SCOPE("OP_BIT_OR");
+        BITWISE_OP(|);
+        DISPATCH();
+    }
+
+    CASE_CODE(OP_BIT_XOR):
+    {
+        PROFILE_SCOPE("OP_BIT_XOR");
+        BITWISE_OP(^);
+        DISPATCH();
+    }
+
+    CASE_CODE(OP_BIT_NOT):
+    {
+        PROFILE_SCOPE("OP_BIT_NOT");
+        if (!Fox_IsNumber(PEEK(0)))
+            RUNTIME_ERROR("Operand must be a number.");
+        PEEK(0) = Fox_Int(~ValueToInt32(PEEK(0)));
+        DISPATCH();
+    }
+
+    CASE_CODE(OP_SHIFT_LEFT):
+    {
+        PROFILE_SCOPE("OP_SHIFT_LEFT");
+        if (!Fox_IsNumber(PEEK(0)) || !Fox_IsNumber(PEEK(1)))
+            RUNTIME_ERROR("Operands must be numbers.");
+        // Only the low five bits of the count are used, bits shifted out of
+        // the top are lost.
+        uint32_t uCount = (uint32_t)ValueToInt32(POP()) & 31;
+        uint32_t uValue = (uint32_t)ValueToInt32(POP());
+        PUSH(Fox_Int((int32_t)(uValue << uCount)));
+        DISPATCH();
+    }
+
+    CASE_CODE(OP_SHIFT_RIGHT):
+    {
+        PROFILE_SCOPE("OP_SHIFT_RIGHT");
+        if (!Fox_IsNumber(PEEK(0)) || !Fox_IsNumber(PEEK(1)))
+            RUNTIME_ERROR("Operands must be numbers.");
+        // Arithmetic shift, the sign is kept.
+        uint32_t uCount = (uint32_t)ValueToInt32(POP()) & 31;
+        int32_t iValue = ValueToInt32(POP());
+        PUSH(Fox_Int(iValue >> uCount));
+        DISPATCH();
+    }
+
+    CASE_CODE(OP_IS):
+    {
+    // 'is' don't work with int type, modifie it
+        PROFILE_SCOPE("OP_IS");
+        if (Fox_IsInstance(PEEK(1))) {
+            if (Fox_IsClass(PEEK(0))) {
+                ObjectClass* oClassType = Fox_AsClass(POP());
+                ObjectInstance* pInst = Fox_AsInstance(POP());
+                PUSH(Fox_Bool(pInst->klass->name == oClassType->name));
+            } else {
+                RUNTIME_ERROR("Expected class type.");
             }
-            else if (Fox_IsNumber(Peek(0)))
-                BINARY_OP(Number, Number, double,  /);
-            // else if (Fox_IsNumber(Peek(0)))
-            //     BINARY_OP(Int, int, /);
-            break;
+        } else {
+            RUNTIME_ERROR("Expected an instance before the keyword 'is'.");
         }
+        DISPATCH();
+    }
+
+    CASE_CODE(OP_NOT):
+    {
+        PROFILE_SCOPE("OP_NOT");
+        PEEK(0) = Fox_Bool(IsFalsey(PEEK(0)));
+        DISPATCH();
+    }
     
-        case OP_IS:
-        {
-        // 'is' don't work with int type, modifie it
-            PROFILE_SCOPE("OP_IS");
-            if (Fox_IsInstance(Peek(1))) {
-                if (Fox_IsClass(Peek(0))) {
-                    ObjectClass* oClassType = Fox_AsClass(Pop());
-                    ObjectInstance* pInst = Fox_AsInstance(Pop());
-                    Push(Fox_Bool(pInst->klass->name == oClassType->name));
-                } else
-                    RuntimeError("Expected class type.");
-            } else
-                RuntimeError("Expected an instance before the keyword 'is'.");
-            break;
+    CASE_CODE(OP_NEGATE):
+    {
+        PROFILE_SCOPE("OP_NEGATE");
+        if (Fox_IsInt(PEEK(0)) && PEEK(0).GetInt() != INT32_MIN) {
+            PEEK(0).SetInt(-PEEK(0).GetInt());
+            DISPATCH();
+        }
+
+        if (!Fox_IsNumber(PEEK(0))) {
+            RUNTIME_ERROR("Operand must be a number.");
         }
 
-        case OP_NOT:
+        PEEK(0) = Fox_Number(-Fox_AsNumber(PEEK(0)));
+        DISPATCH();
+    }
+
+    CASE_CODE(OP_PRINT):
+    {
+        PROFILE_SCOPE("OP_PRINT");
+        int iArgCount = READ_BYTE();
+        int iTempArgCount = iArgCount;
+        int iPercentCount = 0;
+        Value string = PEEK(--iTempArgCount);
+        
+        for (int i = 0; Fox_AsString(string)->string[i]; i++)
         {
-            PROFILE_SCOPE("OP_NOT");
-            Push(Fox_Bool(IsFalsey(Pop())));
-            break;
+            if (Fox_AsString(string)->string[i] == '%' && Fox_AsString(string)->string[i + 1] == '%')
+                i++;
+            else if (Fox_AsString(string)->string[i] == '%')
+                iPercentCount++;
         }
         
-        case OP_NEGATE:
+        if (iTempArgCount != iPercentCount)
         {
-            PROFILE_SCOPE("OP_NEGATE");
-            if (!Fox_IsNumber(Peek(0))) {
-                RuntimeError("Operand must be a number.");
-                return INTERPRET_RUNTIME_ERROR;
-            }
-
-            Push(Fox_Number(-Fox_AsNumber(Pop())));
-            break;
+            RUNTIME_ERROR("Expected %d arguments but got %d in print call.", iPercentCount, iTempArgCount);
         }
-
-        case OP_PRINT:
+        
+        for (int i = 0; Fox_AsString(string)->string[i]; i++)
         {
-            PROFILE_SCOPE("OP_PRINT");
-            int iArgCount = READ_BYTE();
-            int iTempArgCount = iArgCount;
-            int iPercentCount = 0;
-            Value string = Peek(--iTempArgCount);
-            
-            for (int i = 0; Fox_AsString(string)->string[i]; i++)
-            {
-                if (Fox_AsString(string)->string[i] == '%' && Fox_AsString(string)->string[i + 1] == '%')
-                    i++;
-                else if (Fox_AsString(string)->string[i] == '%')
-                    iPercentCount++;
-            }
-            
-            if (iTempArgCount != iPercentCount)
-            {
-                RuntimeError("Expected %d arguments but got %d in print call.", iPercentCount, iTempArgCount);
-                break;
-            }
-            
-            for (int i = 0; Fox_AsString(string)->string[i]; i++)
-            {
-                if (Fox_AsString(string)->string[i] != '%') {
-                    std::cout << Fox_AsString(string)->string[i];
-                } else if (Fox_AsString(string)->string[i] == '%' && Fox_AsString(string)->string[i + 1] == '%') {
-                    std::cout << "%";
-                    i++;
-                } else {
-                    PrintValue(Peek(--iTempArgCount), this);
-                }
+            if (Fox_AsString(string)->string[i] != '%') {
+                std::cout << Fox_AsString(string)->string[i];
+            } else if (Fox_AsString(string)->string[i] == '%' && Fox_AsString(string)->string[i + 1] == '%') {
+                std::cout << "%";
+                i++;
+            } else {
+                PrintValue(PEEK(--iTempArgCount), this);
             }
-            m_pCurrentFiber->m_pStackTop -= iArgCount;
-            break;
         }
+        stackTop -= iArgCount;
+        DISPATCH();
+    }
 
-        case OP_PRINT_REPL:
-        {
-            PROFILE_SCOPE("OP_PRINT_REPL");
-            PrintValue(Peek(0), this);
-            std::cout << std::endl;
-            break;
-        }
+    CASE_CODE(OP_PRINT_REPL):
+    {
+        PROFILE_SCOPE("OP_PRINT_REPL");
+        PrintValue(PEEK(0), this);
+        std::cout << std::endl;
+        DISPATCH();
+    }
 
-        case OP_JUMP:
-        {
-            PROFILE_SCOPE("OP_JUMP");
-            uint16_t uOffset = READ_SHORT();
-            frame->ip += uOffset;
-            break;
-        }
+    CASE_CODE(OP_JUMP):
+    {
+        PROFILE_SCOPE("OP_JUMP");
+        uint16_t uOffset = READ_SHORT();
+        ip += uOffset;
+        DISPATCH();
+    }
 
-        case OP_JUMP_IF_FALSE:
-        {
-            PROFILE_SCOPE("OP_JUMP_IF_FALSE");
-            uint16_t uOffset = READ_SHORT();
-            if (IsFalsey(Peek(0)))
-                frame->ip += uOffset;
-            break;
-        }
+    CASE_CODE(OP_JUMP_IF_FALSE):
+    {
+        PROFILE_SCOPE("OP_JUMP_IF_FALSE");
+        uint16_t uOffset = READ_SHORT();
+        if (IsFalsey(PEEK(0)))
+            ip += uOffset;
+        DISPATCH();
+    }
 
-        case OP_LOOP:
-        {
-            PROFILE_SCOPE("OP_LOOP");
-            uint16_t uOffset = READ_SHORT();
-            frame->ip -= uOffset;
-            break;
-        }
+    CASE_CODE(OP_LOOP):
+    {
+        PROFILE_SCOPE("OP_LOOP");
+        uint16_t uOffset = READ_SHORT();
+        ip -= uOffset;
+        JIT_ENTER();
+        DISPATCH();
+    }
 
-        case OP_CALL:
-        {
-            PROFILE_SCOPE("OP_CALL");
-            int iArgCount = READ_BYTE();
-            if (!CallValue(Peek(iArgCount), iArgCount))
+    CASE_CODE(OP_JUMP_IF_NOT_LESS):
+    {
+        PROFILE_SCOPE("OP_JUMP_IF_NOT_LESS");
+        Value b = POP();
+        Value a = POP();
+        COMPARE_AND_JUMP(a, b, <, false);
+        DISPATCH();
+    }
+
+    CASE_CODE(OP_JUMP_IF_NOT_GREATER):
+    {
+        PROFILE_SCOPE("OP_JUMP_IF_NOT_GREATER");
+        Value b = POP();
+        Value a = POP();
+        COMPARE_AND_JUMP(a, b, >, false);
+        DISPATCH();
+    }
+
+    CASE_CODE(OP_JUMP_IF_LESS):
+    {
+        PROFILE_SCOPE("OP_JUMP_IF_LESS");
+        Value b = POP();
+        Value a = POP();
+        COMPARE_AND_JUMP(a, b, <, true);
+        DISPATCH();
+    }
+
+    CASE_CODE(OP_JUMP_IF_GREATER):
+    {
+        PROFILE_SCOPE("OP_JUMP_IF_GREATER");
+        Value b = POP();
+        Value a = POP();
+        COMPARE_AND_JUMP(a, b, >, true);
+        DISPATCH();
+    }
+
+    CASE_CODE(OP_JUMP_IF_NOT_LESS_LOCAL):
+    {
+        PROFILE_SCOPE("OP_JUMP_IF_NOT_LESS_LOCAL");
+        Value a = slots[READ_BYTE()];
+        Value b = slots[READ_BYTE()];
+        COMPARE_AND_JUMP(a, b, <, false);
+        DISPATCH();
+    }
+
+    CASE_CODE(OP_JUMP_IF_NOT_LESS_LOCAL_CONST):
+    {
+        PROFILE_SCOPE("OP_JUMP_IF_NOT_LESS_LOCAL_CONST");
+        Value a = slots[READ_BYTE()];
+        Value b = READ_CONSTANT();
+        COMPARE_AND_JUMP(a, b, <, false);
+        DISPATCH();
+    }
+
+    CASE_CODE(OP_INC_LOCAL):
+    {
+        PROFILE_SCOPE("OP_INC_LOCAL");
+        LOCAL_INC_OP(+, OP_ADD_LOCAL_CONST);
+        DISPATCH();
+    }
+
+    CASE_CODE(OP_DEC_LOCAL):
+    {
+        PROFILE_SCOPE("OP_DEC_LOCAL");
+        LOCAL_INC_OP(-, OP_SUB_LOCAL_CONST);
+        DISPATCH();
+    }
+
+    CASE_CODE(OP_CALL):
+    {
+        PROFILE_SCOPE("OP_CALL");
+        int iArgCount = READ_BYTE();
+        STORE_FRAME();
+        if (!CallValue(PEEK(iArgCount), iArgCount))
+            return INTERPRET_RUNTIME_ERROR;
+        LOAD_FRAME();
+        CHECK_RESULT();
+        JIT_ENTER();
+        DISPATCH();
+    }
+
+    CASE_CODE(OP_TAIL_CALL):
+    {
+        PROFILE_SCOPE("OP_TAIL_CALL");
+        int iArgCount = READ_BYTE();
+        Value oCallee = PEEK(iArgCount);
+        ObjectClosure* pClosure = nullptr;
+        if (Fox_IsClosure(oCallee))
+            pClosure = Fox_AsClosure(oCallee);
+        else if (Fox_IsBoundMethod(oCallee))
+        {
+            pClosure = Fox_AsBoundMethod(oCallee)->method;
+            PEEK(iArgCount) = Fox_AsBoundMethod(oCallee)->receiver;
+        }
+
+        // A wrong number of arguments is reported by the regular call, while
+        // the caller is still on the stack trace. The first call of a lazy
+        // function also goes through it, to compile it.
+        if (pClosure == nullptr || iArgCount < pClosure->function->iMinArity ||
+            iArgCount > pClosure->function->iMaxArity || pClosure->function->lazy != nullptr)
+        {
+            STORE_FRAME();
+            if (!CallValue(oCallee, iArgCount))
                 return INTERPRET_RUNTIME_ERROR;
-            frame = &m_pCurrentFiber->m_vFrames[m_pCurrentFiber->m_iFrameCount - 1];
-            break;
+            LOAD_FRAME();
+            CHECK_RESULT();
+            JIT_ENTER();
+            DISPATCH();
+        }
+
+        // The callee and its arguments replace the frame of the caller, whose
+        // upvalues are closed first since their slots are overwritten.
+        CloseUpvalues(slots);
+        Value* pArgs = stackTop - iArgCount - 1;
+        for (int i = 0; i <= iArgCount; i++)
+            slots[i] = pArgs[i];
+        stackTop = slots + iArgCount + 1;
+        frame->closure = pClosure;
+        frame->ip = pClosure->function->chunk.Start();
+        m_pCurrentFiber->m_pStackTop = stackTop;
+        // The callee may need more room than the caller did.
+        EnsureStack(m_pCurrentFiber, slots - m_pCurrentFiber->m_vStack.data() + pClosure->function->maxSlots);
+        LOAD_FRAME();
+        JIT_ENTER();
+        DISPATCH();
+    }
+
+    CASE_CODE(OP_CLASS):
+    {
+        PROFILE_SCOPE("OP_CLASS");
+        STORE_FRAME();
+        PUSH(Fox_Object(gc.New<ObjectClass>(READ_STRING())));
+        DISPATCH();
+    }
+    
+    CASE_CODE(OP_INHERIT):
+    {
+        PROFILE_SCOPE("OP_INHERIT");
+        Value oSuperclass = PEEK(1);
+
+        if (!Fox_IsClass(oSuperclass)) {
+            RUNTIME_ERROR("Superclass must be a class.");
+        }
+
+        ObjectClass* pSubclass = Fox_AsClass(PEEK(0));
+
+        pSubclass->methods.AddAll(Fox_AsClass(oSuperclass)->methods);
+        pSubclass->operators.AddAll(Fox_AsClass(oSuperclass)->operators);
+        for (int i = 0; i < OPERATOR_COUNT; i++)
+            pSubclass->operatorTable[i] = Fox_AsClass(oSuperclass)->operatorTable[i];
+        InvalidateMethodCaches();
+        pSubclass->superClass = Fox_AsClass(oSuperclass);
+        pSubclass->derivedCount = Fox_AsClass(oSuperclass)->derivedCount + 1;
+        stackTop--; // Subclass.
+        DISPATCH();
+    }
+
+    CASE_CODE(OP_METHOD):
+    {
+        PROFILE_SCOPE("OP_METHOD");
+        STORE_FRAME();
+        DefineMethod(READ_STRING());
+        stackTop = m_pCurrentFiber->m_pStackTop;
+        DISPATCH();
+    }
+    
+    CASE_CODE(OP_OPERATOR):
+    {
+        PROFILE_SCOPE("OP_OPERATOR");
+        STORE_FRAME();
+        DefineOperator(READ_STRING());
+        stackTop = m_pCurrentFiber->m_pStackTop;
+        DISPATCH();
+    }
+
+    CASE_CODE(OP_INVOKE):
+    {
+        PROFILE_SCOPE("OP_INVOKE");
+        ObjectString* pMethod = READ_STRING();
+        int iArgCount = READ_BYTE();
+        MethodCache& oCache = methodCaches[READ_SHORT()];
+        STORE_FRAME();
+        if (!Invoke(pMethod, iArgCount, &oCache)) {
+            return INTERPRET_RUNTIME_ERROR;
+        }
+        LOAD_FRAME();
+        CHECK_RESULT();
+        JIT_ENTER();
+        DISPATCH();
+    }
+
+    CASE_CODE(OP_SUPER_INVOKE):
+    {
+        PROFILE_SCOPE("OP_SUPER_INVOKE");
+        ObjectString* pMethod = READ_STRING();
+        int iArgCount = READ_BYTE();
+        MethodCache& oCache = methodCaches[READ_SHORT()];
+        ObjectClass* pSuperclass = Fox_AsClass(POP());
+        STORE_FRAME();
+        if (!InvokeFromClass(pSuperclass, pMethod, iArgCount, &oCache)) {
+            return INTERPRET_RUNTIME_ERROR;
+        }
+        LOAD_FRAME();
+        CHECK_RESULT();
+        JIT_ENTER();
+        DISPATCH();
+    }
+
+    CASE_CODE(OP_CLOSURE):
+    {
+        PROFILE_SCOPE("OP_CLOSURE");
+        ObjectFunction* pFunction = Fox_AsFunction(READ_CONSTANT());
+        STORE_FRAME();
+        ObjectClosure* pClosure = gc.New<ObjectClosure>(this, pFunction);
+        PUSH(Fox_Object(pClosure));
+        // Capturing an upvalue allocates, keep the closure reachable.
+        STORE_FRAME();
+
+        for (int i = 0; i < pClosure->upvalueCount; i++) {
+            uint8_t uIsLocal = READ_BYTE();
+            uint8_t uIndex = READ_BYTE();
+            if (uIsLocal)
+                pClosure->upValues[i] = CaptureUpvalue(slots + uIndex);
+            else
+                pClosure->upValues[i] = frame->closure->upValues[uIndex];
+            // Capturing may have promoted the closure.
+            pClosure->WriteBarrier(pClosure->upValues[i]);
         }
+        DISPATCH();
+    }
+
+    CASE_CODE(OP_CLOSE_UPVALUE):
+    {
+        PROFILE_SCOPE("OP_CLOSE_UPVALUE");
+        CloseUpvalues(stackTop - 1);
+        stackTop--;
+        DISPATCH();
+    }
+
+    CASE_CODE(OP_GET_SUPER):
+    {
+        PROFILE_SCOPE("OP_GET_SUPER");
+        ObjectString* pName = READ_STRING();
+        ObjectClass* pSuperclass = Fox_AsClass(POP());
+        STORE_FRAME();
+        if (!BindMethod(pSuperclass, pName)) {
+            return INTERPRET_RUNTIME_ERROR;
+        }
+        stackTop = m_pCurrentFiber->m_pStackTop;
+        DISPATCH();
+    }
+
+    CASE_CODE(OP_IMPORT):
+    {
+        PROFILE_SCOPE("OP_IMPORT");
+        STORE_FRAME();
+        Value oModule = ImportModule(Fox_Object(READ_STRING()));
+        PUSH(oModule);
+        CHECK_RESULT();
 
-        case OP_CLASS:
+        if (Fox_IsClosure(PEEK(0)))
         {
-            PROFILE_SCOPE("OP_CLASS");
-            Push(Fox_Object(gc.New<ObjectClass>(READ_STRING())));
-            break;
+            STORE_FRAME();
+            CallFunction(Fox_AsClosure(PEEK(0)), 0);
+            LOAD_FRAME();
         }
-        
-        case OP_INHERIT:
+        else if (!Fox_IsNil(PEEK(0)))
         {
-            PROFILE_SCOPE("OP_INHERIT");
-            Value oSuperclass = Peek(1);
-
-            if (!Fox_IsClass(oSuperclass)) {
-                RuntimeError("Superclass must be a class.");
-                return INTERPRET_RUNTIME_ERROR;
-            }
+            // The module has already been loaded. Remember it so we can import
+            // variables from it if needed.
+            module->ImportVariables(*Fox_AsModule(PEEK(0)));
+            // currentModule = Fox_AsModule(POP());
+        }
+        // Either way one value is left for the OP_POP that follows, the result
+        // of the module's body if it just ran.
+        DISPATCH();
+    }
 
-            ObjectClass* pSubclass = Fox_AsClass(Peek(0));
+    CASE_CODE(OP_RETURN_LOCAL):
+        PUSH(slots[READ_BYTE()]);
+        // Falls through to return the local.
 
-            pSubclass->methods.AddAll(Fox_AsClass(oSuperclass)->methods);
-            pSubclass->superClass = Fox_AsClass(oSuperclass);
-            pSubclass->derivedCount = Fox_AsClass(oSuperclass)->derivedCount + 1;
-            Pop(); // Subclass.
-            break;
-        }
+    CASE_CODE(OP_RETURN):
+    {
+        PROFILE_SCOPE("OP_RETURN");
+        Value oResult = POP();
+        // Close any upvalues still in scope.
+        CloseUpvalues(slots);
+        m_pCurrentFiber->m_iFrameCount--;
+        // If the fiber is complete, end it.
+        if (m_pCurrentFiber->m_iFrameCount <= 0)
+        {
+            if (m_pCurrentFiber->m_pCaller == nullptr)
+            {
+                // Store the final result value at the beginning of the stack so the
+                // C API can get it.
+                m_pCurrentFiber->m_iFrameCount = 0;
+                m_pCurrentFiber->m_vStack[0] = oResult;
+                m_pCurrentFiber->m_pStackTop = m_pCurrentFiber->m_vStack.data() + 1;
+                return INTERPRET_OK;
+            }
+            
+            // POP();
+            m_pCurrentFiber->m_pStackTop = stackTop;
+            ObjectFiber* pResumingFiber = m_pCurrentFiber->m_pCaller;
+            m_pCurrentFiber->m_pCaller = nullptr;
+            pFiber = pResumingFiber;
+            m_pCurrentFiber = pResumingFiber;
+        
+            // Store the result in the resuming fiber.
+            m_pCurrentFiber->m_pStackTop[-1] = oResult;
 
-        case OP_METHOD:
-        {
-            PROFILE_SCOPE("OP_METHOD");
-            DefineMethod(READ_STRING());
-            break;
+            // m_pCurrentFiber->m_pStackTop = slots;
+            // PUSH(oResult);
         }
-        
-        case OP_OPERATOR:
+        else
         {
-            PROFILE_SCOPE("OP_OPERATOR");
-            DefineOperator(READ_STRING());
-            break;
-        }
+            // POP();
+            // Store the result of the block in the first slot, which is where the
+            // caller expects it.
+            // m_pCurrentFiber->m_vStack[0] = oResult;
 
-        case OP_INVOKE:
-        {
-            PROFILE_SCOPE("OP_INVOKE");
-            ObjectString* pMethod = READ_STRING();
-            int iArgCount = READ_BYTE();
-            if (!Invoke(pMethod, iArgCount)) {
-                return INTERPRET_RUNTIME_ERROR;
-            }
-            frame = &m_pCurrentFiber->m_vFrames[m_pCurrentFiber->m_iFrameCount - 1];
-            break;
+            stackTop = slots;
+            PUSH(oResult);
+            m_pCurrentFiber->m_pStackTop = stackTop;
+
+            // Discard the stack slots for the call frame (leaving one slot for the
+            // result).
+            // m_pCurrentFiber->m_pStackTop = m_pCurrentFiber->m_vStack + 1;
         }
 
-        case OP_SUPER_INVOKE:
-        {
-            PROFILE_SCOPE("OP_SUPER_INVOKE");
-            ObjectString* pMethod = READ_STRING();
-            int iArgCount = READ_BYTE();
-            ObjectClass* pSuperclass = Fox_AsClass(Pop());
-            if (!InvokeFromClass(pSuperclass, pMethod, iArgCount)) {
-                return INTERPRET_RUNTIME_ERROR;
+        LOAD_FRAME();
+        JIT_ENTER();
+        DISPATCH();
+    }
+
+    CASE_CODE(OP_END):
+    {
+        PROFILE_SCOPE("OP_END");
+        STORE_FRAME();
+        return INTERPRET_OK;
+    }
+
+    CASE_CODE(OP_END_MODULE):
+    {
+        PROFILE_SCOPE("OP_END_MODULE");
+        // A module that is imported for the first time runs on top of the code
+        // that imported it. Now that its variables are defined, hand them to
+        // the importing module and go back to it.
+        if (m_pCurrentFiber->m_iFrameCount > 1)
+        {
+            ObjectModule* pImporter = frame[-1].closure->function->module;
+            if (pImporter != nullptr && pImporter != module)
+            {
+                pImporter->ImportVariables(*module);
+                currentModule = pImporter;
             }
-            frame = &m_pCurrentFiber->m_vFrames[m_pCurrentFiber->m_iFrameCount - 1];
-            break;
         }
+        // PUSH(Fox_Nil);
+        DISPATCH();
+    }
+
+    CASE_CODE(OP_CONST):
+    {
+        PROFILE_SCOPE("OP_CONST");
+        Value oConstant = READ_CONSTANT();
+        PUSH(oConstant);
+        DISPATCH();
+    }
+
+    CASE_CODE(OP_SUBSCRIPT):
+    {
+        PROFILE_SCOPE("OP_SUBSCRIPT");
+        Value oIndexValue = PEEK(0);
+        Value oSubscriptValue = PEEK(1);
 
-        case OP_CLOSURE:
+        // Fast path for an in-bounds integer index into an array. Everything
+        // else, including negative indexes, goes through the generic code.
+        if (Fox_IsInt(oIndexValue) && Fox_IsArray(oSubscriptValue))
         {
-            PROFILE_SCOPE("OP_CLOSURE");
-            ObjectFunction* pFunction = Fox_AsFunction(READ_CONSTANT());
-            ObjectClosure* pClosure = gc.New<ObjectClosure>(this, pFunction);
-            Push(Fox_Object(pClosure));
-
-            for (int i = 0; i < pClosure->upvalueCount; i++) {
-                uint8_t uIsLocal = READ_BYTE();
-                uint8_t uIndex = READ_BYTE();
-                if (uIsLocal)
-                    pClosure->upValues[i] = CaptureUpvalue(frame->slots + uIndex);
-                else
-                    pClosure->upValues[i] = frame->closure->upValues[uIndex];
+            std::vector<Value>& vValues = Fox_AsArray(oSubscriptValue)->m_vValues;
+            int32_t iIndex = oIndexValue.GetInt();
+            if (iIndex >= 0 && (size_t) iIndex < vValues.size())
+            {
+                stackTop--;
+                PEEK(0) = vValues[iIndex];
+                DISPATCH();
             }
-            break;
         }
 
-        case OP_CLOSE_UPVALUE:
+        if (!Fox_IsObject(oSubscriptValue))
         {
-            PROFILE_SCOPE("OP_CLOSE_UPVALUE");
-            CloseUpvalues(m_pCurrentFiber->m_pStackTop - 1);
-            Pop();
-            break;
+            RUNTIME_ERROR("Can only subscript on pArrays, strings or maps.");
         }
 
-        case OP_GET_SUPER:
+        switch (Fox_ObjectType(oSubscriptValue))
         {
-            PROFILE_SCOPE("OP_GET_SUPER");
-            ObjectString* pName = READ_STRING();
-            ObjectClass* pSuperclass = Fox_AsClass(Pop());
-            if (!BindMethod(pSuperclass, pName)) {
-                return INTERPRET_RUNTIME_ERROR;
-            }
-            break;
-        }
+            case OBJ_ARRAY:
+            {
+                if (!Fox_IsNumber(oIndexValue) && !Fox_IsNumber(oIndexValue))
+                {
+                    RUNTIME_ERROR("Array index must be a number.");
+                }
 
-        case OP_IMPORT:
-        {
-            PROFILE_SCOPE("OP_IMPORT");
-            Push(ImportModule(Fox_Object(READ_STRING())));
+                ObjectArray* ppArray = Fox_AsArray(oSubscriptValue);
+                int iIndex = Fox_AsNumber(oIndexValue);
 
-            if (Fox_IsClosure(Peek(0)))
-            {
-                CallFunction(Fox_AsClosure(Peek(0)), 0);
-                frame = &m_pCurrentFiber->m_vFrames[m_pCurrentFiber->m_iFrameCount - 1];
-            }
-            else if (!Fox_IsNil(Peek(0)))
-            {
-                // The module has already been loaded. Remember it so we can import
-                // variables from it if needed.
-                currentModule->m_vVariables.AddAll(Fox_AsModule(Pop())->m_vVariables);
-                // currentModule = Fox_AsModule(Pop());
+                // Allow negative indexes
+                if (iIndex < 0)
+                    iIndex = ppArray->m_vValues.size() + iIndex;
+
+                if (iIndex >= 0 && (size_t) iIndex < ppArray->m_vValues.size())
+                {
+                    stackTop--;
+                    stackTop--;
+                    PUSH(ppArray->m_vValues[iIndex]);
+                    break;
+                }
+
+                RUNTIME_ERROR("pArray index out of bounds.");
             }
-            break;
-        }
 
-        case OP_RETURN:
-        {
-            PROFILE_SCOPE("OP_RETURN");
-            Value oResult = Pop();
-            // Close any upvalues still in scope.
-            CloseUpvalues(frame->slots);
-            m_pCurrentFiber->m_iFrameCount--;
-            // If the fiber is complete, end it.
-            if (m_pCurrentFiber->m_iFrameCount <= 0)
+            case OBJ_STRING:
             {
-                if (m_pCurrentFiber->m_pCaller == nullptr)
+                if (!Fox_IsNumber(oIndexValue) && !Fox_IsNumber(oIndexValue))
                 {
-                    // Store the final result value at the beginning of the stack so the
-                    // C API can get it.
-                    Pop();
-                    m_pCurrentFiber->m_iFrameCount = 0;
-                    m_pCurrentFiber->m_vStack[0] = oResult;
-                    m_pCurrentFiber->m_pStackTop = m_pCurrentFiber->m_vStack + 1;
-                    return INTERPRET_OK;
+                    RUNTIME_ERROR("String index must be a number.");
                 }
                 
-                // Pop();
-                ObjectFiber* pResumingFiber = m_pCurrentFiber->m_pCaller;
-                m_pCurrentFiber->m_pCaller = nullptr;
-                pFiber = pResumingFiber;
-                m_pCurrentFiber = pResumingFiber;
-            
-                // Store the result in the resuming fiber.
-                m_pCurrentFiber->m_pStackTop[-1] = oResult;
+                ObjectString* pString = Fox_AsString(oSubscriptValue);
+                int iIndex = Fox_AsNumber(oIndexValue);
+
+                // Allow negative indexes
+                if (iIndex < 0)
+                    iIndex = pString->string.size() + iIndex;
+
+                if (iIndex >= 0 && (size_t) iIndex < pString->string.size()) {
+                    STORE_FRAME();
+                    Value oChar = Fox_Object(m_oParser.CopyString(std::string(1, pString->string[iIndex])));
+                    stackTop--;
+                    stackTop--;
+                    PUSH(oChar);
+                    break;
+                }
 
-                // m_pCurrentFiber->m_pStackTop = frame->slots;
-                // Push(oResult);
+                RUNTIME_ERROR("String index out of bounds.");
             }
-            else
-            {
-                // Pop();
-                // Store the result of the block in the first slot, which is where the
-                // caller expects it.
-                // m_pCurrentFiber->m_vStack[0] = oResult;
 
-                m_pCurrentFiber->m_pStackTop = frame->slots;
-                Push(oResult);
-
-                // Discard the stack slots for the call frame (leaving one slot for the
-                // result).
-                // m_pCurrentFiber->m_pStackTop = m_pCurrentFiber->m_vStack + 1;
+            case OBJ_MAP: {
+                ObjectMap* pMap = Fox_AsMap(oSubscriptValue);
+                Value oValue;
+                stackTop--;
+                stackTop--;
+                if (pMap->m_vValues.Get(oIndexValue, oValue))
+                    PUSH(oValue);
+                else
+                    PUSH(Fox_Nil);
+                break;
             }
 
-            frame = &m_pCurrentFiber->m_vFrames[m_pCurrentFiber->m_iFrameCount - 1];
-            break;
-        }
-
-        case OP_END:
-        {
-            PROFILE_SCOPE("OP_END");
-            return INTERPRET_OK;
+            default:
+            {
+                RUNTIME_ERROR("Can only subscript on pArrays, strings or dictionaries.");
+            }
         }
+        DISPATCH();
+    }
 
-        case OP_END_MODULE:
-        {
-            PROFILE_SCOPE("OP_END_MODULE");
-            currentModule = m_pCurrentFiber->m_vFrames[m_pCurrentFiber->m_iFrameCount - 1].closure->function->module;
-            // Push(Fox_Nil);
-            break;
-        }
+    CASE_CODE(OP_SUBSCRIPT_ASSIGN):
+    {
+        PROFILE_SCOPE("OP_SUBSCRIPT_ASSIGN");
+        Value oValue = PEEK(0);
+        Value oIndexValue = PEEK(1);
+        Value oSubscriptValue = PEEK(2);
 
-        case OP_CONST:
+        if (!Fox_IsObject(oSubscriptValue))
         {
-            PROFILE_SCOPE("OP_CONST");
-            Value oConstant = READ_CONSTANT();
-            Push(oConstant);
-            break;
+            RUNTIME_ERROR("Can only subscript on Arrays, strings or maps.");
         }
 
-        case OP_SUBSCRIPT:
+        switch (Fox_ObjectType(oSubscriptValue))
         {
-            PROFILE_SCOPE("OP_SUBSCRIPT");
-            Value oIndexValue = Peek(0);
-            Value oSubscriptValue = Peek(1);
-
-            if (!Fox_IsObject(oSubscriptValue))
-            {
-                RuntimeError("Can only subscript on pArrays, strings or maps.");
-                return INTERPRET_RUNTIME_ERROR;
-            }
-
-            switch (oSubscriptValue.type)
+            case OBJ_ARRAY:
             {
-                case OBJ_ARRAY:
+                if (!Fox_IsNumber(oIndexValue) && !Fox_IsNumber(oIndexValue))
                 {
-                    if (!Fox_IsNumber(oIndexValue) && !Fox_IsNumber(oIndexValue))
-                    {
-                        RuntimeError("Array index must be a number.");
-                        return INTERPRET_RUNTIME_ERROR;
-                    }
-
-                    ObjectArray* ppArray = Fox_AsArray(oSubscriptValue);
-                    int iIndex = Fox_AsNumber(oIndexValue);
-
-                    // Allow negative indexes
-                    if (iIndex < 0)
-                        iIndex = ppArray->m_vValues.size() + iIndex;
-
-                    if (iIndex >= 0 && iIndex < ppArray->m_vValues.size())
-                    {
-                        Pop();
-                        Pop();
-                        Push(ppArray->m_vValues[iIndex]);
-                        break;
-                    }
-
-                    RuntimeError("pArray index out of bounds.");
-                    return INTERPRET_RUNTIME_ERROR;
+                    RUNTIME_ERROR("pArray index must be a number.");
                 }
 
-                case OBJ_STRING:
-                {
-                    if (!Fox_IsNumber(oIndexValue) && !Fox_IsNumber(oIndexValue))
-                    {
-                        RuntimeError("String index must be a number.");
-                        return INTERPRET_RUNTIME_ERROR;
-                    }
-                    
-                    ObjectString* pString = Fox_AsString(oSubscriptValue);
-                    int iIndex = Fox_AsNumber(oIndexValue);
-
-                    // Allow negative indexes
-                    if (iIndex < 0)
-                        iIndex = pString->string.size() + iIndex;
-
-                    if (iIndex >= 0 && iIndex < pString->string.size()) {
-                        Pop();
-                        Pop();
-                        Push(Fox_Object(m_oParser.CopyString(std::string(1, pString->string[iIndex]))));
-                        break;
-                    }
-
-                    RuntimeError("String index out of bounds.");
-                    return INTERPRET_RUNTIME_ERROR;
-                }
+                ObjectArray* pArray = Fox_AsArray(oSubscriptValue);
+                int iIndex = Fox_AsNumber(oIndexValue);
 
-                case OBJ_MAP: {
-                    ObjectMap* pMap = Fox_AsMap(oSubscriptValue);
-                    Value oValue;
-                    Pop();
-                    Pop();
-                    if (pMap->m_vValues.Get(oIndexValue, oValue))
-                        Push(oValue);
-                    else
-                        Push(Fox_Nil);
-                    break;
-                }
+                // Allow negative indexes
+                if (iIndex < 0)
+                    iIndex = pArray->m_vValues.size() + iIndex;
 
-                default:
+                if (iIndex >= 0 && (size_t) iIndex < pArray->m_vValues.size())
                 {
-                    RuntimeError("Can only subscript on pArrays, strings or dictionaries.");
-                    return INTERPRET_RUNTIME_ERROR;
+                    stackTop--;
+                    stackTop--;
+                    stackTop--;
+                    pArray->m_vValues[iIndex] = oValue;
+                    WriteBarrier(pArray, oValue);
+                    break;
                 }
-            }
-            break;
-        }
-
-        case OP_SUBSCRIPT_ASSIGN:
-        {
-            PROFILE_SCOPE("OP_SUBSCRIPT_ASSIGN");
-            Value oValue = Peek(0);
-            Value oIndexValue = Peek(1);
-            Value oSubscriptValue = Peek(2);
 
-            if (!Fox_IsObject(oSubscriptValue))
-            {
-                RuntimeError("Can only subscript on Arrays, strings or maps.");
-                return INTERPRET_RUNTIME_ERROR;
+                RUNTIME_ERROR("Array index out of bounds.");
             }
 
-            switch (oSubscriptValue.type)
+            case OBJ_STRING:
             {
-                case OBJ_ARRAY:
+                if (!Fox_IsNumber(oIndexValue) && !Fox_IsNumber(oIndexValue))
                 {
-                    if (!Fox_IsNumber(oIndexValue) && !Fox_IsNumber(oIndexValue))
-                    {
-                        RuntimeError("pArray index must be a number.");
-                        return INTERPRET_RUNTIME_ERROR;
-                    }
-
-                    ObjectArray* pArray = Fox_AsArray(oSubscriptValue);
-                    int iIndex = Fox_AsNumber(oIndexValue);
-
-                    // Allow negative indexes
-                    if (iIndex < 0)
-                        iIndex = pArray->m_vValues.size() + iIndex;
-
-                    if (iIndex >= 0 && iIndex < pArray->m_vValues.size())
-                    {
-                        Pop();
-                        Pop();
-                        Pop();
-                        pArray->m_vValues[iIndex] = oValue;
-                        break;
-                    }
-
-                    RuntimeError("Array index out of bounds.");
-                    return INTERPRET_RUNTIME_ERROR;
+                    RUNTIME_ERROR("String index must be a number.");
                 }
 
-                case OBJ_STRING:
+                if (!Fox_IsString(oValue))
                 {
-                    if (!Fox_IsNumber(oIndexValue) && !Fox_IsNumber(oIndexValue))
-                    {
-                        RuntimeError("String index must be a number.");
-                        return INTERPRET_RUNTIME_ERROR;
-                    }
-
-                    if (!Fox_IsString(oValue))
-                    {
-                        RuntimeError("The value to set must be a string.");
-                        return INTERPRET_RUNTIME_ERROR;
-                    }
-
-                    ObjectString* pString = Fox_AsString(oSubscriptValue);
-                    int iIndex = Fox_AsNumber(oIndexValue);
-                    ObjectString* pValueString = Fox_AsString(oValue);
-
-                    // Allow negative indexes
-                    if (iIndex < 0)
-                        iIndex = pString->string.size() + iIndex;
+                    RUNTIME_ERROR("The value to set must be a string.");
+                }
 
-                    if (iIndex >= 0 && iIndex < pString->string.size()) {
-                        Pop();
-                        Pop();
-                        pString->string[iIndex] = pValueString->string[0];
-                        break;
-                    }
+                ObjectString* pString = Fox_AsString(oSubscriptValue);
+                int iIndex = Fox_AsNumber(oIndexValue);
+                ObjectString* pValueString = Fox_AsString(oValue);
 
-                    RuntimeError("String index out of bounds.");
-                    return INTERPRET_RUNTIME_ERROR;
-                }
+                // Allow negative indexes
+                if (iIndex < 0)
+                    iIndex = pString->string.size() + iIndex;
 
-                case OBJ_MAP: {
-                    ObjectMap* pMap = Fox_AsMap(oSubscriptValue);
-                    Pop();
-                    Pop();
-                    Pop();
-                    pMap->m_vValues.Set(oIndexValue, oValue);
+                if (iIndex >= 0 && (size_t) iIndex < pString->string.size()) {
+                    stackTop--;
+                    stackTop--;
+                    pString->string[iIndex] = pValueString->string[0];
                     break;
                 }
 
-                default:
-                {
-                    RuntimeError("Can only subscript on Arrays, strings or dictionaries.");
-                    return INTERPRET_RUNTIME_ERROR;
-                }
+                RUNTIME_ERROR("String index out of bounds.");
             }
-            break;
-        }
-
-        case OP_SLICE:
-        {
-            PROFILE_SCOPE("OP_SLICE");
-            Value sliceEndIndex = Peek(0);
-            Value sliceStartIndex = Peek(1);
-            Value objectValue = Peek(2);
 
-            if (!Fox_IsObject(objectValue)) {
-                RuntimeError("Can only slice on pArrays and strings.");
+            case OBJ_MAP: {
+                ObjectMap* pMap = Fox_AsMap(oSubscriptValue);
+                stackTop--;
+                stackTop--;
+                stackTop--;
+                pMap->m_vValues.Set(oIndexValue, oValue);
+                break;
             }
 
-            if ((!Fox_IsNumber(sliceStartIndex) && !Fox_IsNil(sliceStartIndex)) || (!Fox_IsNumber(sliceEndIndex) && !Fox_IsNil(sliceEndIndex))) {
-                RuntimeError("Slice index must be a number.");
+            default:
+            {
+                RUNTIME_ERROR("Can only subscript on Arrays, strings or dictionaries.");
             }
+        }
+        DISPATCH();
+    }
+
+    CASE_CODE(OP_SLICE):
+    {
+        PROFILE_SCOPE("OP_SLICE");
+        Value sliceEndIndex = PEEK(0);
+        Value sliceStartIndex = PEEK(1);
+        Value objectValue = PEEK(2);
 
-            int indexStart;
-            int indexEnd;
-            Value returnVal;
+        if (!Fox_IsObject(objectValue)) {
+            RUNTIME_ERROR("Can only slice on pArrays and strings.");
+        }
 
-            if (Fox_IsNil(sliceStartIndex)) {
-                indexStart = 0;
-            } else {
-                indexStart = Fox_AsNumber(sliceStartIndex);
+        if ((!Fox_IsNumber(sliceStartIndex) && !Fox_IsNil(sliceStartIndex)) || (!Fox_IsNumber(sliceEndIndex) && !Fox_IsNil(sliceEndIndex))) {
+            RUNTIME_ERROR("Slice index must be a number.");
+        }
 
-                if (indexStart < 0) {
-                    indexStart = 0;
-                }
+        int indexStart;
+        int indexEnd;
+        Value returnVal;
+
+        if (Fox_IsNil(sliceStartIndex)) {
+            indexStart = 0;
+        } else {
+            indexStart = Fox_AsNumber(sliceStartIndex);
+
+            if (indexStart < 0) {
+                indexStart = 0;
             }
+        }
 
-            switch (objectValue.type)
+        // Both cases allocate the result.
+        STORE_FRAME();
+        switch (Fox_ObjectType(objectValue))
+        {
+            case OBJ_ARRAY:
             {
-                case OBJ_ARRAY:
-                {
-                    ObjectArray* pNewArray = gc.New<ObjectArray>();
-                    Push(Fox_Object(pNewArray));
-                    ObjectArray* pArray = Fox_AsArray(objectValue);
+                ObjectArray* pNewArray = gc.New<ObjectArray>();
+                PUSH(Fox_Object(pNewArray));
+                ObjectArray* pArray = Fox_AsArray(objectValue);
 
-                    if (Fox_IsNil(sliceEndIndex)) {
+                if (Fox_IsNil(sliceEndIndex)) {
+                    indexEnd = pArray->m_vValues.size();
+                } else {
+                    indexEnd = Fox_AsNumber(sliceEndIndex);
+                    if ((size_t) indexEnd > pArray->m_vValues.size())
                         indexEnd = pArray->m_vValues.size();
-                    } else {
-                        indexEnd = Fox_AsNumber(sliceEndIndex);
-                        if (indexEnd > pArray->m_vValues.size())
-                            indexEnd = pArray->m_vValues.size();
-                    }
-
-                    for (int i = indexStart; i < indexEnd; i++)
-                        pNewArray->m_vValues.push_back(pArray->m_vValues[i]);
+                }
 
-                    Pop();
-                    returnVal = Fox_Object(pNewArray);
-                    break;
+                for (int i = indexStart; i < indexEnd; i++) {
+                    pNewArray->m_vValues.push_back(pArray->m_vValues[i]);
+                    WriteBarrier(pNewArray, pArray->m_vValues[i]);
                 }
 
-                case OBJ_STRING:
-                {
-                    ObjectString* pString = Fox_AsString(objectValue);
+                stackTop--;
+                returnVal = Fox_Object(pNewArray);
+                break;
+            }
 
-                    if (Fox_IsNil(sliceEndIndex)) {
-                        indexEnd = pString->string.size();
-                    } else {
-                        indexEnd = Fox_AsNumber(sliceEndIndex);
+            case OBJ_STRING:
+            {
+                ObjectString* pString = Fox_AsString(objectValue);
 
-                        if (indexEnd > pString->string.size()) {
-                            indexEnd = pString->string.size();
-                        }
-                    }
+                if (Fox_IsNil(sliceEndIndex)) {
+                    indexEnd = pString->string.size();
+                } else {
+                    indexEnd = Fox_AsNumber(sliceEndIndex);
 
-                    // Ensure the start index is below the end index
-                    if (indexStart > indexEnd) {
-                        returnVal = Fox_Object(m_oParser.CopyString(""));
-                    } else {
-                        returnVal = Fox_Object(m_oParser.CopyString(pString->string.substr(indexStart, indexEnd - indexStart)));
+                    if ((size_t) indexEnd > pString->string.size()) {
+                        indexEnd = pString->string.size();
                     }
-                    break;
                 }
 
-                default: {
-                    RuntimeError("Can only slice on pArrays and strings.");
+                // Ensure the start index is below the end index
+                if (indexStart > indexEnd) {
+                    returnVal = Fox_Object(m_oParser.CopyString(""));
+                } else {
+                    returnVal = Fox_Object(m_oParser.CopyString(pString->string.substr(indexStart, indexEnd - indexStart)));
                 }
+                break;
             }
 
-            Pop();
-            Pop();
-            Pop();
-
-            Push(returnVal);
-            break;
-        }
-
-        case OP_ARRAY:
-        {
-            PROFILE_SCOPE("OP_ARRAY");
-            Push(Fox_Object(gc.New<ObjectArray>()));
-            break;
+            default: {
+                RUNTIME_ERROR("Can only slice on pArrays and strings.");
+            }
         }
 
-        case OP_MAP:
-        {
-            PROFILE_SCOPE("OP_MAP");
-            Push(Fox_Object(gc.New<ObjectMap>()));
-            break;
-        }
+        stackTop--;
+        stackTop--;
+        stackTop--;
 
-        case OP_ADD_LIST:
-        {
-            PROFILE_SCOPE("OP_ADD_LIST");
-            int iArgCount = READ_BYTE();
-            Value opArrayValue = Peek(iArgCount);
+        PUSH(returnVal);
+        DISPATCH();
+    }
 
-            ObjectArray* pArray = Fox_AsArray(opArrayValue);
+    CASE_CODE(OP_ARRAY):
+    {
+        PROFILE_SCOPE("OP_ARRAY");
+        STORE_FRAME();
+        PUSH(Fox_Object(gc.New<ObjectArray>()));
+        DISPATCH();
+    }
 
-            for (int i = iArgCount - 1; i >= 0; i--)
-                pArray->m_vValues.push_back(Peek(i));
+    CASE_CODE(OP_MAP):
+    {
+        PROFILE_SCOPE("OP_MAP");
+        STORE_FRAME();
+        PUSH(Fox_Object(gc.New<ObjectMap>()));
+        DISPATCH();
+    }
 
-            m_pCurrentFiber->m_pStackTop -= iArgCount;
+    CASE_CODE(OP_ADD_LIST):
+    {
+        PROFILE_SCOPE("OP_ADD_LIST");
+        int iArgCount = READ_BYTE();
+        Value opArrayValue = PEEK(iArgCount);
 
-            Pop();
+        ObjectArray* pArray = Fox_AsArray(opArrayValue);
 
-            Push(Fox_Object(pArray));
-            break;
+        // The elements may have been allocated after the array, and promoted
+        // it, so this is a store like any other.
+        for (int i = iArgCount - 1; i >= 0; i--) {
+            pArray->m_vValues.push_back(PEEK(i));
+            WriteBarrier(pArray, PEEK(i));
         }
 
-        case OP_ADD_MAP:
-        {
-            PROFILE_SCOPE("OP_ADD_MAP");
-            int iArgCount = READ_BYTE();
-            iArgCount *= 2;
-            Value oMapValue = Peek(iArgCount);
+        stackTop -= iArgCount;
 
-            ObjectMap* pMap = Fox_AsMap(oMapValue);
+        stackTop--;
 
-            for (int i = iArgCount - 1; i >= 0; i -= 2)
-            {
-                pMap->m_vValues.Set(Peek(i), Peek(i - 1));
-            }
+        PUSH(Fox_Object(pArray));
+        DISPATCH();
+    }
 
-            m_pCurrentFiber->m_pStackTop -= iArgCount;
+    CASE_CODE(OP_ADD_MAP):
+    {
+        PROFILE_SCOPE("OP_ADD_MAP");
+        int iArgCount = READ_BYTE();
+        iArgCount *= 2;
+        Value oMapValue = PEEK(iArgCount);
 
-            Pop();
+        ObjectMap* pMap = Fox_AsMap(oMapValue);
 
-            Push(Fox_Object(pMap));
-            break;
-        }
+        for (int i = iArgCount - 1; i >= 0; i -= 2)
+        {
+            pMap->m_vValues.Set(PEEK(i), PEEK(i - 1));
         }
+
+        stackTop -= iArgCount;
+
+        stackTop--;
+
+        PUSH(Fox_Object(pMap));
+        DISPATCH();
+    }
     }
 
+    // We should only exit this function from an explicit return from OP_RETURN
+    // or a runtime error.
+    FOX_ASSERT(false, "Unreachable bytecode instruction.");
+    return INTERPRET_RUNTIME_ERROR;
+
+#undef STORE_FRAME
+#undef LOAD_FRAME
+#undef PUSH
+#undef POP
+#undef PEEK
+#undef RUNTIME_ERROR
 #undef READ_BYTE
 #undef READ_SHORT
 #undef READ_CONSTANT
 #undef READ_STRING
 #undef BINARY_OP
+#undef INT_ARITH_OP
+#undef INT_COMPARE_OP
+#undef BITWISE_OP
+#undef BOTH_INTS
+#undef BOTH_NUMBERS
+#undef NUM_ARITH_OP
+#undef NUM_COMPARE_OP
+#undef QUICKEN
+#undef DEOPTIMIZE
+#undef CHECK_RESULT
+#undef CALL_OPERATOR
+#undef LOCAL_CONST_ARITH_OP
+#undef COMPARE_AND_JUMP
+#undef LOCAL_INC_OP
+#undef JIT_ENTER
+#undef DEBUG_TRACE_INSTRUCTIONS
+#undef INTERPRET_LOOP
+#undef CASE_CODE
+#undef DISPATCH
 }
 
 void VM::Concatenate()
@@ -1503,14 +2376,12 @@ void VM::Concatenate()
 // Garabage Collector Functions
 void VM::AddToRoots()
 {
-    for (Value *slot = m_pCurrentFiber->m_vStack; slot < m_pCurrentFiber->m_pStackTop; slot++)
-        AddValueToRoot(*slot);
-
-    for (int i = 0; i < m_pCurrentFiber->m_iFrameCount; i++)
-        AddObjectToRoot(m_pCurrentFiber->m_vFrames[i].closure);
+    // The collection may free a class and let a new one take its address, so
+    // methods cached before it can't be trusted anymore.
+    InvalidateMethodCaches();
 
-    for (ObjectUpvalue *upvalue = m_pCurrentFiber->m_vOpenUpvalues; upvalue != NULL; upvalue = upvalue->next)
-        AddObjectToRoot(upvalue);
+    // The current fiber traces its own stack, frames and open upvalues.
+    AddObjectToRoot(m_pCurrentFiber);
 
     for (auto& handle : m_vHandles)
     {
@@ -1519,15 +2390,18 @@ void VM::AddToRoots()
     
     AddTableToRoot(modules);
     AddTableToRoot(arrayMethods);
+    AddTableToRoot(stringMethods);
+    AddTableToRoot(mapMethods);
+    AddTableToRoot(fiberMethods);
+    AddTableToRoot(builtConvMethods);
     AddCompilerToRoots();
     AddObjectToRoot(initString);
+    AddObjectToRoot(stringString);
+    AddObjectToRoot(currentModule);
 }
 
 void VM::AddTableToRoot(Table &table) {
-    for (auto& entry : table.m_vEntries) {
-        AddObjectToRoot(entry.m_pKey);
-        AddValueToRoot(entry.m_oValue);
-    }
+    table.MarkTable(gc);
 }
 
 void VM::AddValueToRoot(Value value) {
@@ -1537,7 +2411,7 @@ void VM::AddValueToRoot(Value value) {
 }
 
 void VM::AddObjectToRoot(Object *object) {
-    if (object == NULL)
+    if (object == NULL || !gc.AddRoot(object))
         return;
 #ifdef DEBUG
 	if (IsLogGC()) {
@@ -1546,10 +2420,6 @@ void VM::AddObjectToRoot(Object *object) {
         printf("\n");
     }
 #endif
-    gc.AddRoot(object);
-
-    BlackenObject(object);
-    strings.RemoveWhite();
 }
 
 void VM::AddCompilerToRoots()
@@ -1561,104 +2431,9 @@ void VM::AddCompilerToRoots()
     }
 }
 
-void VM::AddArrayToRoot(ValueArray *array)
-{
-    for (int i = 0; i < array->m_vValues.size(); i++)
-        AddValueToRoot(array->m_vValues[i]);
-}
-
-void VM::BlackenObject(Object *object)
+void Handle::markChildren(GC& gc)
 {
-#ifdef DEBUG
-	if (IsLogGC()) {
-        printf("%p blacken ", (void *)object);
-        PrintValue(Fox_Object(object));
-        printf("\n");
-    }
-#endif
-    switch (object->type) {
-    case OBJ_INSTANCE:
-    {
-        ObjectInstance *instance = (ObjectInstance *)object;
-        AddObjectToRoot((Object *)instance->klass);
-        AddTableToRoot(instance->fields);
-        
-        break;
-    }
-    case OBJ_BOUND_METHOD: {
-        ObjectBoundMethod *bound = (ObjectBoundMethod *)object;
-        AddValueToRoot(bound->receiver);
-        AddObjectToRoot((Object *)bound->method);
-        break;
-    }
-    case OBJ_CLASS: {
-        ObjectClass *klass = (ObjectClass *)object;
-        AddObjectToRoot((Object *)klass->name);
-        AddTableToRoot(klass->methods);
-        AddTableToRoot(klass->setters);
-        AddTableToRoot(klass->getters);
-        break;
-    }
-    case OBJ_CLOSURE: {
-        ObjectClosure *closure = (ObjectClosure *)object;
-        AddObjectToRoot((Object *)closure->function);
-        for (int i = 0; i < closure->upvalueCount; i++) {
-            AddObjectToRoot((Object *)closure->upValues[i]);
-        }
-        break;
-    }
-    case OBJ_FUNCTION: {
-        ObjectFunction *function = (ObjectFunction *)object;
-        AddObjectToRoot((Object *)function->name);
-        AddArrayToRoot(&function->chunk.m_oConstants);
-        break;
-    }
-    case OBJ_UPVALUE:
-        AddValueToRoot(((ObjectUpvalue *)object)->closed);
-        break;
-    case OBJ_ARRAY:
-    {
-        ObjectArray* pArray = (ObjectArray *) object;
-        for (auto& oValue : pArray->m_vValues)
-            AddValueToRoot(oValue);
-        break;
-    }
-
-    case OBJ_MAP:
-    {
-        ObjectMap* pMap = (ObjectMap *) object;
-        for (auto& oValue : pMap->m_vValues.m_vEntries)
-        {
-            AddValueToRoot(oValue.m_oKey);
-            AddValueToRoot(oValue.m_oValue);
-        }
-        break;
-    }
-    case OBJ_MODULE:
-    {
-        ObjectModule* pModule = (ObjectModule *) object;
-        AddObjectToRoot(pModule->m_strName);
-        AddTableToRoot(pModule->m_vVariables);
-        break;
-    }
-
-    case OBJ_HANDLE:
-    {
-        Handle* pHandle = (Handle *) object;
-        AddValueToRoot(pHandle->value);
-        break;
-    }
-    case OBJ_LIB:
-    {
-        ObjectLib* pLib = (ObjectLib *) object;
-        AddTableToRoot(pLib->methods);
-        AddObjectToRoot(pLib->name);
-        break;
-    }
-    case OBJ_NATIVE:
-    case OBJ_STRING:
-        break;
-    }
+    MarkValue(gc, value);
 }
 
 void VM::DefineMethod(ObjectString* name)
@@ -1667,6 +2442,7 @@ void VM::DefineMethod(ObjectString* name)
     Value method = Peek(0);
     ObjectClass* klass = Fox_AsClass(Peek(1));
     klass->methods.Set(name, method);
+    InvalidateMethodCaches();
     Pop();
 }
 
@@ -1676,6 +2452,10 @@ void VM::DefineOperator(ObjectString* name)
     Value method = Peek(0);
     ObjectClass* klass = Fox_AsClass(Peek(1));
     klass->operators.Set(name, method);
+
+    int iSlot = OperatorSlotOf(name);
+    if (iSlot != -1)
+        klass->operatorTable[iSlot] = method;
     Pop();
 }
 
@@ -1698,7 +2478,7 @@ Value VM::FindVariable(ObjectModule* module, const char* name)
 {
     PROFILE_FUNCTION();
     Value oValue;
-    if (module->m_vVariables.Get(m_oParser.CopyString(name), oValue))
+    if (module->GetVariable(m_oParser.CopyString(name), oValue))
         return oValue;
     return Fox_Nil;
 }
@@ -1735,7 +2515,7 @@ void VM::DefineVariable(const char* strModule, const char* strName, Value oValue
 
     if (pModule != nullptr)
     {
-        pModule->m_vVariables.Set(Fox_AsString(NewString(strName)), oValue);
+        pModule->SetVariable(Fox_AsString(NewString(strName)), oValue);
     }
 }
 
@@ -1751,7 +2531,7 @@ ObjectModule* VM::GetModule(Value name)
     return nullptr;
 }
 
-ObjectClosure* VM::CompileInModule(Value name, const std::string& source, bool isExpression, bool printErrors)
+ObjectClosure* VM::CompileInModule(Value name, const std::string& source, bool isExpression, bool printErrors, const std::string& cachePath)
 {
     PROFILE_FUNCTION();
     // See if the module has already been loaded.
@@ -1773,20 +2553,44 @@ ObjectClosure* VM::CompileInModule(Value name, const std::string& source, bool i
 
         // Implicitly import the core module.
         ObjectModule* coreModule = GetModule(NewString("core"));
-        for (int i = 0; i < coreModule->m_vVariables.m_iCount; i++)
-        {
-            module->m_vVariables.AddAll(coreModule->m_vVariables);
-        }
+        module->ImportVariables(*coreModule);
     }
 
     currentModule = module;
 
-    Chunk chunk;
-    ObjectFunction* fn = Compile(m_oParser, source, &chunk);
-    if (fn == nullptr)
+    // Another VM, or a previous run for the .foxc file, may have compiled the
+    // same module already.
+    std::string strLayout = CodeCache::Layout(*module, IsLazyCompile());
+    std::string strKey = CodeCache::Key(*module, IsLazyCompile(), source);
+    ref<const CachedModule> pCached = CodeCache::Get().Find(strKey);
+    if (pCached == nullptr && !cachePath.empty())
     {
-        // TODO: Should we still store the module even if it didn't compile?
-        return nullptr;
+        pCached = CodeCache::Read(cachePath, strLayout, source);
+        if (pCached != nullptr)
+            CodeCache::Get().Add(strKey, pCached);
+    }
+
+    ObjectFunction* fn = nullptr;
+    if (pCached != nullptr)
+        fn = CodeCache::Load(this, module, *pCached);
+    else
+    {
+        size_t iFirstVariable = module->m_vVariables.size();
+        Chunk chunk;
+        fn = Compile(m_oParser, source, &chunk);
+        if (fn == nullptr)
+        {
+            // TODO: Should we still store the module even if it didn't compile?
+            return nullptr;
+        }
+
+        pCached = CodeCache::Save(*module, iFirstVariable, fn);
+        if (pCached != nullptr)
+        {
+            CodeCache::Get().Add(strKey, pCached);
+            if (!cachePath.empty())
+                CodeCache::Write(cachePath, strLayout, source, *pCached);
+        }
     }
 
     // Functions are always wrapped in closures.
@@ -1821,7 +2625,8 @@ Value VM::ImportModule(Value name)
         return Fox_Nil;
     }
     
-    ObjectClosure* moduleClosure = CompileInModule(name, strContent.c_str(), false, true);
+    // The compiled module is kept next to its source, see CodeCache::Read().
+    ObjectClosure* moduleClosure = CompileInModule(name, strContent.c_str(), false, true, nameString->string + "c");
     
     // Modules loaded by the host are expected to be dynamically allocated with
     // ownership given to the VM, which will free it. The built in optional
@@ -1848,7 +2653,7 @@ Value VM::GetModuleVariable(ObjectModule* module, Value variableName)
     Value oModule;
 
     // It's a runtime error if the imported variable does not exist.
-    if (module->m_vVariables.Get(Fox_AsString(variableName), oModule))
+    if (module->GetVariable(Fox_AsString(variableName), oModule))
         return oModule;
     
     RuntimeError("Could not find a variable named '%s' in module '%s'.", Fox_AsCString(variableName), module->m_strName->string.c_str());
@@ -1870,7 +2675,7 @@ InterpretResult VM::Call(Handle* pMethod)
     m_pApiStack = nullptr;
     CallFunction(closure, closure->function->arity);
     InterpretResult result = run(m_pCurrentFiber);
-    m_pApiStack = m_pCurrentFiber->m_vStack;
+    m_pApiStack = m_pCurrentFiber->m_vStack.data();
     return result;
 }
 
@@ -1954,6 +2759,8 @@ Handle* VM::MakeCallHandle(const char* signature)
     fn->chunk.WriteChunk((uint8_t)OP_CALL, 0);
     fn->chunk.WriteChunk((uint8_t)numParams, 0);
     fn->chunk.WriteChunk((uint8_t)OP_RETURN, 0);
+    // The stub, the receiver and the arguments.
+    fn->maxSlots = fn->chunk.MaxStack(numParams + 2);
     fn->name = Fox_AsString(NewString(signature));
     return value;
 }
@@ -1979,6 +2786,8 @@ int VM::GetSlotCount()
 void VM::EnsureSlots(int numSlots)
 {
     PROFILE_FUNCTION();
+    size_t iCount = m_pCurrentFiber->m_pStackTop - m_pCurrentFiber->m_vStack.data();
+    EnsureStack(m_pCurrentFiber, iCount + numSlots);
     for (int i = 0; i < numSlots; i++)
         Push(Fox_Nil);
 
@@ -2144,6 +2953,7 @@ void VM::SetListElement(int iSlot, int index, int elementSlot)
     FOX_ASSERT(index <= pArray->m_vValues.size(), "Index out of bounds.\n");
 
     pArray->m_vValues[index] = m_pApiStack[elementSlot];
+    WriteBarrier(pArray, m_pApiStack[elementSlot]);
 }
 
 bool VM::IsLogToken() const
@@ -2164,6 +2974,24 @@ bool VM::IsLogTrace() const
     return m_bLogTrace;
 }
 
+bool VM::IsLogCache() const
+{
+    PROFILE_FUNCTION();
+    return m_bLogCache;
+}
+
+bool VM::IsLogProfile() const
+{
+    PROFILE_FUNCTION();
+    return m_bLogProfile;
+}
+
+bool VM::IsLazyCompile() const
+{
+    PROFILE_FUNCTION();
+    return m_bLazyCompile;
+}
+
 // template <>
 // std::string VM::arg<std::string>(int ac, Value* av, const int i)
 // {
@@ -0,0 +1,129 @@
+#!/bin/sh
+# Runs the tests with the interpreter given as argument, examples/fox by
+# default, and exits with 1 if one of them fails.
+#
+# A test file must only print the "Test ... OK" lines of its assert(), any
+# other line, like a runtime error, fails it. So does a crash, which may
+# print nothing. Some files are also run with the flags of the feature they
+# test.
+
+FOX=${1:-examples/fox}
+FOX=$(cd "$(dirname "$FOX")" && pwd)/$(basename "$FOX")
+FAILED=0
+
+# The tests import their modules from tests/import.
+cd "$(dirname "$0")" || exit 1
+
+# written <file>: the previous run must have written the .foxc <file>.
+written()
+{
+    if [ -s "$1" ]; then
+        echo "passed: $1 written"
+    else
+        echo "FAILED: $1 not written"
+        FAILED=1
+    fi
+}
+
+# rewritten <file> <copy>: the previous run must have written <file> back the
+# way it was when <copy> was made.
+rewritten()
+{
+    if cmp -s "$1" "$2"; then
+        echo "passed: $1 rewritten"
+    else
+        echo "FAILED: $1 not rewritten"
+        FAILED=1
+    fi
+}
+
+# damage <file> <n>: flips the bits of the <n>th byte from the end of <file>.
+damage()
+{
+    OFFSET=$(($(wc -c < "$1") - $2))
+    BYTE=$(od -A n -t u1 -j $OFFSET -N 1 "$1")
+    printf "\\$(printf '%03o' $((255 - BYTE)))" | dd of="$1" bs=1 seek=$OFFSET conv=notrunc 2> /dev/null
+}
+
+# run <file> [flags...]
+run()
+{
+    FILE=$1
+    shift
+    OUTPUT=$("$FOX" "$FILE" "$@" 2>&1)
+    STATUS=$?
+    if [ $STATUS -ne 0 ] || echo "$OUTPUT" | grep -v "^Test .*OK" | grep -q .; then
+        echo "FAILED: $FILE $*"
+        echo "$OUTPUT" | grep -v "^Test .*OK"
+        [ $STATUS -ne 0 ] && echo "exit status $STATUS"
+        FAILED=1
+    else
+        echo "passed: $FILE $*"
+    fi
+}
+
+# trace <file> <expected> [flags...]: the file fails on purpose, and the
+# functions of its stack trace must be <expected>, one per line.
+trace()
+{
+    FILE=$1
+    EXPECTED=$2
+    shift 2
+    OUTPUT=$("$FOX" "$FILE" "$@" 2>&1 | sed -n 's/^\[line [0-9]*\] in //p')
+    if [ "$OUTPUT" != "$EXPECTED" ]; then
+        echo "FAILED: $FILE $*"
+        echo "$OUTPUT"
+        FAILED=1
+    else
+        echo "passed: $FILE $*"
+    fi
+}
+
+run unit.fox
+run unit.fox -lazy
+run unit.fox -jit=off
+run gc.fox
+run gc.fox -gc=incremental
+run gc.fox -gc-parallel=1 -gc-threads=4
+run lazy.fox -lazy
+run worker.fox
+run frame.fox
+run frame.fox -lazy
+trace trace.fox "$(printf 'fail()\n+()\nscript')"
+trace trace.fox "$(printf 'fail()\n+()\nscript')" -lazy
+trace operands.fox "$(printf 'subtract()\nscript')"
+
+# The first run compiles the module cache.fox imports and writes its .foxc
+# file, the second loads it from there, and -lazy must compile it again.
+rm -f import/*.foxc
+run cache.fox
+run cache.fox
+run cache.fox -lazy
+
+# A .foxc file is only used for the source it was compiled from: the module
+# stale.fox imports is edited, so is the file, then it is cut short, damaged
+# and replaced with garbage. Every run must compile the module again and
+# write the file back. The last byte of the file is in the string version()
+# returns, which only the checksum of the file tells apart.
+echo 'version :: func () { return "one"; }' > import/edited.fox
+rm -f import/edited.foxc
+run stale.fox -expect=one
+written import/edited.foxc
+run stale.fox -expect=one
+echo 'version :: func () { return "two"; }' > import/edited.fox
+run stale.fox -expect=two
+head -c 40 import/edited.foxc > import/edited.tmp
+mv import/edited.tmp import/edited.foxc
+run stale.fox -expect=two
+written import/edited.foxc
+cp import/edited.foxc import/edited.good
+for BYTE in 1 60 120; do
+    damage import/edited.foxc $BYTE
+    run stale.fox -expect=two
+    rewritten import/edited.foxc import/edited.good
+done
+echo 'FOXC garbage' > import/edited.foxc
+run stale.fox -expect=two
+rm -f import/edited.fox import/edited.foxc import/edited.good
+
+exit $FAILED